@@ -0,0 +1,874 @@
+/* async.c */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "async.h"
+
+#include <string.h>
+
+#if !defined(_WIN32) && !defined(MONGO_ENV_STANDARD)
+#define MONGO_ASYNC_SUPPORTED
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#ifdef __linux
+#include <sys/epoll.h>
+#define MONGO_ASYNC_EPOLL
+#endif
+#endif
+
+#define MONGO_ASYNC_IN 1
+#define MONGO_ASYNC_OUT 2
+#define MONGO_ASYNC_BUF_SIZE ( 16 * 1024 )
+#define MONGO_ASYNC_MAX_EVENTS 64
+#define MONGO_ASYNC_QUERY_FAILURE 2 /* OP_REPLY QueryFailure flag */
+
+/* How a reply decides the status handed to the callback. */
+enum mongo_async_kind {
+    MONGO_ASYNC_WRITE,      /* No reply; done once written. */
+    MONGO_ASYNC_QUERY,      /* Fails on QueryFailure. */
+    MONGO_ASYNC_GLE,        /* Fails if getlasterror reports an error. */
+    MONGO_ASYNC_COMMAND     /* Fails unless the command returned ok. */
+};
+
+static const int ZERO = 0;
+
+/*********************************************************************
+Platform
+**********************************************************************/
+
+#ifdef MONGO_ASYNC_SUPPORTED
+
+static int mongo_async_set_blocking( mongo *conn, int blocking ) {
+    int flags = fcntl( conn->sock, F_GETFL, 0 );
+
+    if( flags == -1 )
+        return MONGO_ERROR;
+    if( blocking )
+        flags &= ~O_NONBLOCK;
+    else
+        flags |= O_NONBLOCK;
+
+    return fcntl( conn->sock, F_SETFL, flags ) == -1 ? MONGO_ERROR : MONGO_OK;
+}
+
+static int mongo_async_would_block( void ) {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+#ifdef MONGO_ASYNC_EPOLL
+static int mongo_async_watch( mongo_async_conn *ac, int events ) {
+    struct epoll_event ev;
+    int op = ac->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+    if( events == ac->events )
+        return MONGO_OK;
+
+    memset( &ev, 0, sizeof( ev ) );
+    ev.data.ptr = ac;
+    if( events & MONGO_ASYNC_IN )
+        ev.events |= EPOLLIN;
+    if( events & MONGO_ASYNC_OUT )
+        ev.events |= EPOLLOUT;
+
+    if( ! events )
+        op = EPOLL_CTL_DEL;
+    if( epoll_ctl( ac->loop->fd, op, ac->conn->sock, &ev ) == -1 )
+        return MONGO_ERROR;
+
+    ac->events = events;
+    return MONGO_OK;
+}
+#else
+static int mongo_async_watch( mongo_async_conn *ac, int events ) {
+    ac->events = events;
+    return MONGO_OK;
+}
+#endif
+
+#endif /* MONGO_ASYNC_SUPPORTED */
+
+/*********************************************************************
+Requests
+**********************************************************************/
+
+static mongo_async_request *mongo_async_request_new( mongo_async *loop ) {
+    mongo_async_request *req = loop->free_requests;
+
+    if( req )
+        loop->free_requests = req->next;
+    else
+        req = ( mongo_async_request * )bson_malloc( sizeof( mongo_async_request ) );
+
+    return req;
+}
+
+/* Hand a finished request to its callback. The request is recycled
+ * first so the callback is free to queue new work. */
+static void mongo_async_complete( mongo_async_conn *ac, mongo_async_request *req,
+                                  int status, const mongo_reply *reply ) {
+    mongo_async *loop = ac->loop;
+    mongo_async_callback cb = req->cb;
+    void *arg = req->arg;
+
+    req->next = loop->free_requests;
+    loop->free_requests = req;
+    loop->pending--;
+
+    if( cb )
+        cb( ac->conn, status, reply, arg );
+}
+
+/* Fail everything in flight on a connection whose socket has failed.
+ * The caller has already recorded the error on the connection. */
+static int mongo_async_fail( mongo_async_conn *ac ) {
+    mongo_async_request *req;
+    int done = 0;
+
+#ifdef MONGO_ASYNC_SUPPORTED
+    if( ac->events )
+        mongo_async_watch( ac, 0 );
+#endif
+    ac->failed = 1;
+    ac->out_start = ac->out_end = 0;
+    ac->conn->read_buf_start = ac->conn->read_buf_end = 0;
+
+    while( ( req = ac->sending ) ) {
+        ac->sending = req->next;
+        mongo_async_complete( ac, req, MONGO_ERROR, NULL );
+        done++;
+    }
+    ac->sending_tail = NULL;
+
+    while( ( req = ac->waiting ) ) {
+        ac->waiting = req->next;
+        mongo_async_complete( ac, req, MONGO_ERROR, NULL );
+        done++;
+    }
+    ac->waiting_tail = NULL;
+
+    return done;
+}
+
+/*********************************************************************
+Message building
+**********************************************************************/
+
+/* Make room for a len byte message at the end of the output buffer. */
+static char *mongo_async_reserve( mongo_async_conn *ac, int len ) {
+    char *data;
+
+    if( ac->out_start == ac->out_end )
+        ac->out_start = ac->out_end = 0;
+
+    if( ac->out_end + len > ac->out_size ) {
+        if( ac->out_start ) {
+            memmove( ac->out, ac->out + ac->out_start, ac->out_end - ac->out_start );
+            ac->out_end -= ac->out_start;
+            ac->out_start = 0;
+        }
+        if( ac->out_end + len > ac->out_size ) {
+            int size = ac->out_size ? ac->out_size : MONGO_ASYNC_BUF_SIZE;
+            while( size < ac->out_end + len )
+                size *= 2;
+            ac->out = ( char * )bson_realloc( ac->out, size );
+            ac->out_size = size;
+        }
+    }
+
+    data = ac->out + ac->out_end;
+    ac->out_end += len;
+    ac->queued += len;
+    return data;
+}
+
+static char *mongo_async_append( char *start, const void *data, size_t len ) {
+    memcpy( start, data, len );
+    return start + len;
+}
+
+static char *mongo_async_append32( char *start, const void *data ) {
+    bson_little_endian32( start, data );
+    return start + 4;
+}
+
+static char *mongo_async_append64( char *start, const void *data ) {
+    bson_little_endian64( start, data );
+    return start + 8;
+}
+
+/* Reserve a message and write its header. The new request id is
+ * stored in *id. */
+static char *mongo_async_message( mongo_async_conn *ac, int len, int op, int *id ) {
+    char *data = mongo_async_reserve( ac, len );
+
+    *id = ac->next_id;
+    ac->next_id = ac->next_id == INT32_MAX ? 1 : ac->next_id + 1;
+
+    data = mongo_async_append32( data, &len );
+    data = mongo_async_append32( data, id );
+    data = mongo_async_append32( data, &ZERO );
+    return mongo_async_append32( data, &op );
+}
+
+/* Queue an OP_QUERY on ns_len bytes of ns followed by suffix. */
+static int mongo_async_query( mongo_async_conn *ac, const char *ns, int ns_len,
+                              const char *suffix, int options, int skip, int limit,
+                              const bson *query, const bson *fields ) {
+    int suffix_len = ( int )strlen( suffix );
+    int id;
+    char *data;
+
+    data = mongo_async_message( ac, 16 + 4 + ns_len + suffix_len + 1 + 4 + 4
+                                + bson_size( query ) + ( fields ? bson_size( fields ) : 0 ),
+                                MONGO_OP_QUERY, &id );
+    data = mongo_async_append32( data, &options );
+    data = mongo_async_append( data, ns, ns_len );
+    data = mongo_async_append( data, suffix, suffix_len + 1 );
+    data = mongo_async_append32( data, &skip );
+    data = mongo_async_append32( data, &limit );
+    data = mongo_async_append( data, query->data, bson_size( query ) );
+    if( fields )
+        mongo_async_append( data, fields->data, bson_size( fields ) );
+
+    return id;
+}
+
+static void mongo_async_expect( mongo_async_conn *ac, int id, int kind,
+                                mongo_async_callback cb, void *arg ) {
+    mongo_async_request *req = mongo_async_request_new( ac->loop );
+
+    req->id = id;
+    req->kind = kind;
+    req->end = ac->queued;
+    req->cb = cb;
+    req->arg = arg;
+    req->next = NULL;
+
+    if( kind == MONGO_ASYNC_WRITE ) {
+        if( ac->sending_tail )
+            ac->sending_tail->next = req;
+        else
+            ac->sending = req;
+        ac->sending_tail = req;
+    }
+    else {
+        if( ac->waiting_tail )
+            ac->waiting_tail->next = req;
+        else
+            ac->waiting = req;
+        ac->waiting_tail = req;
+    }
+
+    ac->loop->pending++;
+}
+
+static int mongo_async_check( mongo_async_conn *ac ) {
+    if( ac->failed ) {
+        ac->conn->err = MONGO_IO_ERROR;
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
+static int mongo_async_bson_valid( mongo *conn, const bson *b ) {
+    if( ! b->finished ) {
+        conn->err = MONGO_BSON_NOT_FINISHED;
+        return MONGO_ERROR;
+    }
+    if( bson_size( b ) > conn->max_bson_size ) {
+        conn->err = MONGO_BSON_TOO_LARGE;
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
+static int mongo_async_write_concern( mongo *conn, mongo_write_concern *custom_write_concern,
+                                      mongo_write_concern **write_concern ) {
+    *write_concern = custom_write_concern ? custom_write_concern : conn->write_concern;
+
+    if( *write_concern && ( *write_concern )->w < 1 )
+        *write_concern = NULL;
+
+    if( *write_concern && ! ( *write_concern )->cmd ) {
+        __mongo_set_error( conn, MONGO_WRITE_CONCERN_INVALID,
+                           "Must call mongo_write_concern_finish() before using *write_concern.", 0 );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/* Follow a queued write with its getlasterror, or wait for the write
+ * to hit the socket when there is no write concern. */
+static void mongo_async_write_done( mongo_async_conn *ac, const char *ns,
+                                    mongo_write_concern *write_concern,
+                                    mongo_async_callback cb, void *arg ) {
+    int id;
+
+    if( write_concern ) {
+        id = mongo_async_query( ac, ns, ( int )( strchr( ns, '.' ) - ns ), ".$cmd",
+                                0, 0, 1, write_concern->cmd, NULL );
+        mongo_async_expect( ac, id, MONGO_ASYNC_GLE, cb, arg );
+    }
+    else
+        mongo_async_expect( ac, 0, MONGO_ASYNC_WRITE, cb, arg );
+}
+
+/*********************************************************************
+I/O
+**********************************************************************/
+
+#ifdef MONGO_ASYNC_SUPPORTED
+
+/* Write as much queued output as the socket takes, then complete the
+ * unacknowledged writes that are now fully sent. */
+static int mongo_async_flush( mongo_async_conn *ac ) {
+    mongo_async_request *req;
+    ssize_t sent;
+    int done = 0;
+#ifdef __APPLE__
+    int flags = 0;
+#else
+    int flags = MSG_NOSIGNAL;
+#endif
+
+    while( ac->out_start < ac->out_end ) {
+        sent = send( ac->conn->sock, ac->out + ac->out_start,
+                     ac->out_end - ac->out_start, flags );
+        if( sent == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( mongo_async_would_block( ) )
+                break;
+            __mongo_set_error( ac->conn, MONGO_IO_ERROR, strerror( errno ), errno );
+            return mongo_async_fail( ac );
+        }
+        ac->out_start += ( int )sent;
+        ac->written += sent;
+    }
+
+    while( ( req = ac->sending ) && req->end <= ac->written ) {
+        ac->sending = req->next;
+        if( ! ac->sending )
+            ac->sending_tail = NULL;
+        mongo_async_complete( ac, req, MONGO_OK, NULL );
+        done++;
+    }
+
+    return done;
+}
+
+static mongo_async_request *mongo_async_take( mongo_async_conn *ac, int id ) {
+    mongo_async_request *req, *prev = NULL;
+
+    for( req = ac->waiting; req; prev = req, req = req->next ) {
+        if( req->id == id ) {
+            if( prev )
+                prev->next = req->next;
+            else
+                ac->waiting = req->next;
+            if( ac->waiting_tail == req )
+                ac->waiting_tail = prev;
+            return req;
+        }
+    }
+
+    return NULL;
+}
+
+static int mongo_async_status( mongo *conn, int kind, const mongo_reply *reply ) {
+    bson_iterator it[1];
+    bson response[1];
+
+    if( reply->fields.flag & MONGO_ASYNC_QUERY_FAILURE ) {
+        if( reply->fields.num > 0 ) {
+            bson_init_finished_data( response, ( char * )&reply->objs, 0 );
+            mongo_parse_last_error( conn, response );
+        }
+        __mongo_set_error( conn, MONGO_COMMAND_FAILED,
+                           "Query failed. See conn->lasterrstr for details.", 0 );
+        return MONGO_ERROR;
+    }
+
+    if( kind == MONGO_ASYNC_QUERY )
+        return MONGO_OK;
+
+    if( reply->fields.num < 1 ) {
+        __mongo_set_error( conn, MONGO_READ_SIZE_ERROR, "Empty reply.", 0 );
+        return MONGO_ERROR;
+    }
+
+    bson_init_finished_data( response, ( char * )&reply->objs, 0 );
+
+    if( kind == MONGO_ASYNC_COMMAND ) {
+        if( ! bson_find( it, response, "ok" ) || ! bson_iterator_bool( it ) ) {
+            conn->err = MONGO_COMMAND_FAILED;
+            return MONGO_ERROR;
+        }
+        return MONGO_OK;
+    }
+
+    return mongo_parse_last_error( conn, response );
+}
+
+/* Hand every complete reply in the read buffer to its request. Replies
+ * are converted to native byte order where they lie. */
+static int mongo_async_dispatch( mongo_async_conn *ac ) {
+    mongo *conn = ac->conn;
+    mongo_async_request *req;
+    mongo_reply *reply;
+    int len, done = 0;
+    int32_t i32;
+    int64_t i64;
+
+    while( conn->read_buf_end - conn->read_buf_start >= 16 ) {
+        reply = ( mongo_reply * )( conn->read_buf + conn->read_buf_start );
+        bson_little_endian32( &len, &reply->head.len );
+
+        if( len < ( int )( sizeof( mongo_header ) + sizeof( mongo_reply_fields ) ) ||
+                len > 64 * 1024 * 1024 ) {
+            conn->err = MONGO_READ_SIZE_ERROR;
+            done += mongo_async_fail( ac );
+            break;
+        }
+
+        if( conn->read_buf_end - conn->read_buf_start < len ) {
+            if( len > conn->read_buf_size - conn->read_buf_start ) {
+                memmove( conn->read_buf, conn->read_buf + conn->read_buf_start,
+                         conn->read_buf_end - conn->read_buf_start );
+                conn->read_buf_end -= conn->read_buf_start;
+                conn->read_buf_start = 0;
+                if( len > conn->read_buf_size ) {
+                    conn->read_buf = ( char * )bson_realloc( conn->read_buf, len );
+                    conn->read_buf_size = len;
+                }
+            }
+            break;
+        }
+
+        conn->read_buf_start += len;
+
+        reply->head.len = len;
+        bson_little_endian32( &i32, &reply->head.id );
+        reply->head.id = i32;
+        bson_little_endian32( &i32, &reply->head.responseTo );
+        reply->head.responseTo = i32;
+        bson_little_endian32( &i32, &reply->head.op );
+        reply->head.op = i32;
+        bson_little_endian32( &i32, &reply->fields.flag );
+        reply->fields.flag = i32;
+        bson_little_endian64( &i64, &reply->fields.cursorID );
+        reply->fields.cursorID = i64;
+        bson_little_endian32( &i32, &reply->fields.start );
+        reply->fields.start = i32;
+        bson_little_endian32( &i32, &reply->fields.num );
+        reply->fields.num = i32;
+
+        /* A reply nobody is waiting for is dropped. */
+        if( ( req = mongo_async_take( ac, reply->head.responseTo ) ) ) {
+            mongo_async_complete( ac, req, mongo_async_status( conn, req->kind, reply ), reply );
+            done++;
+        }
+    }
+
+    if( conn->read_buf_start == conn->read_buf_end )
+        conn->read_buf_start = conn->read_buf_end = 0;
+
+    return done;
+}
+
+static int mongo_async_read( mongo_async_conn *ac ) {
+    mongo *conn = ac->conn;
+    ssize_t got;
+    int space, done = 0;
+
+    while( ! ac->failed ) {
+        if( conn->read_buf_end == conn->read_buf_size ) {
+            if( conn->read_buf_start ) {
+                memmove( conn->read_buf, conn->read_buf + conn->read_buf_start,
+                         conn->read_buf_end - conn->read_buf_start );
+                conn->read_buf_end -= conn->read_buf_start;
+                conn->read_buf_start = 0;
+            }
+            else {
+                conn->read_buf_size = conn->read_buf_size ? conn->read_buf_size * 2 : MONGO_ASYNC_BUF_SIZE;
+                conn->read_buf = ( char * )bson_realloc( conn->read_buf, conn->read_buf_size );
+            }
+        }
+
+        space = conn->read_buf_size - conn->read_buf_end;
+        got = recv( conn->sock, conn->read_buf + conn->read_buf_end, space, 0 );
+        if( got == -1 ) {
+            if( errno == EINTR )
+                continue;
+            if( mongo_async_would_block( ) )
+                break;
+            __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+            return done + mongo_async_fail( ac );
+        }
+        if( got == 0 ) {
+            __mongo_set_error( conn, MONGO_IO_ERROR, "Connection closed by server.", 0 );
+            return done + mongo_async_fail( ac );
+        }
+
+        conn->read_buf_end += ( int )got;
+        done += mongo_async_dispatch( ac );
+
+        if( got < space )
+            break;
+    }
+
+    return done;
+}
+
+static int mongo_async_ready( mongo_async_conn *ac, int readable, int writable ) {
+    int done = 0;
+
+    if( readable && ! ac->failed )
+        done += mongo_async_read( ac );
+    if( writable && ! ac->failed )
+        done += mongo_async_flush( ac );
+
+    return done;
+}
+
+#ifdef MONGO_ASYNC_EPOLL
+static int mongo_async_wait( mongo_async *loop, int timeout_ms ) {
+    struct epoll_event events[MONGO_ASYNC_MAX_EVENTS];
+    int i, n, done = 0;
+
+    n = epoll_wait( loop->fd, events, MONGO_ASYNC_MAX_EVENTS, timeout_ms );
+    if( n == -1 )
+        return errno == EINTR ? 0 : MONGO_ERROR;
+
+    for( i = 0; i < n; i++ )
+        done += mongo_async_ready( ( mongo_async_conn * )events[i].data.ptr,
+                                   events[i].events & ( EPOLLIN | EPOLLERR | EPOLLHUP ),
+                                   events[i].events & EPOLLOUT );
+
+    return done;
+}
+#else
+static int mongo_async_wait( mongo_async *loop, int timeout_ms ) {
+    struct pollfd *fds;
+    mongo_async_conn *ac;
+    int i, n = 0, done = 0;
+
+    for( ac = loop->conns; ac; ac = ac->next )
+        n++;
+    if( n > loop->poll_fds_size ) {
+        loop->poll_fds = bson_realloc( loop->poll_fds, n * sizeof( struct pollfd ) );
+        loop->poll_fds_size = n;
+    }
+    fds = ( struct pollfd * )loop->poll_fds;
+
+    for( i = 0, ac = loop->conns; ac; ac = ac->next, i++ ) {
+        fds[i].fd = ac->failed ? -1 : ac->conn->sock;
+        fds[i].events = 0;
+        fds[i].revents = 0;
+        if( ac->events & MONGO_ASYNC_IN )
+            fds[i].events |= POLLIN;
+        if( ac->events & MONGO_ASYNC_OUT )
+            fds[i].events |= POLLOUT;
+    }
+
+    if( poll( fds, n, timeout_ms ) == -1 )
+        return errno == EINTR ? 0 : MONGO_ERROR;
+
+    for( i = 0, ac = loop->conns; ac; ac = ac->next, i++ ) {
+        if( fds[i].revents )
+            done += mongo_async_ready( ac, fds[i].revents & ( POLLIN | POLLERR | POLLHUP ),
+                                       fds[i].revents & POLLOUT );
+    }
+
+    return done;
+}
+#endif
+
+#endif /* MONGO_ASYNC_SUPPORTED */
+
+/*********************************************************************
+Loop API
+**********************************************************************/
+
+MONGO_EXPORT int mongo_async_init( mongo_async *loop ) {
+    memset( loop, 0, sizeof( mongo_async ) );
+    loop->fd = -1;
+
+#ifdef MONGO_ASYNC_SUPPORTED
+#ifdef MONGO_ASYNC_EPOLL
+    if( ( loop->fd = epoll_create( MONGO_ASYNC_MAX_EVENTS ) ) == -1 )
+        return MONGO_ERROR;
+#endif
+    return MONGO_OK;
+#else
+    return MONGO_ERROR;
+#endif
+}
+
+MONGO_EXPORT void mongo_async_destroy( mongo_async *loop ) {
+    mongo_async_request *req;
+
+    while( loop->conns )
+        mongo_async_detach( loop->conns );
+
+    while( ( req = loop->free_requests ) ) {
+        loop->free_requests = req->next;
+        bson_free( req );
+    }
+
+    bson_free( loop->poll_fds );
+    loop->poll_fds = NULL;
+
+#ifdef MONGO_ASYNC_SUPPORTED
+    if( loop->fd != -1 )
+        close( loop->fd );
+#endif
+    loop->fd = -1;
+}
+
+MONGO_EXPORT mongo_async_conn *mongo_async_attach( mongo_async *loop, mongo *conn ) {
+#ifdef MONGO_ASYNC_SUPPORTED
+    mongo_async_conn *ac;
+
+    if( ! conn->connected ) {
+        conn->err = MONGO_IO_ERROR;
+        return NULL;
+    }
+
+    if( mongo_async_set_blocking( conn, 0 ) != MONGO_OK ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        return NULL;
+    }
+
+    ac = ( mongo_async_conn * )bson_malloc( sizeof( mongo_async_conn ) );
+    memset( ac, 0, sizeof( mongo_async_conn ) );
+    ac->conn = conn;
+    ac->loop = loop;
+    ac->next_id = 1;
+
+    if( mongo_async_watch( ac, MONGO_ASYNC_IN ) != MONGO_OK ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        mongo_async_set_blocking( conn, 1 );
+        bson_free( ac );
+        return NULL;
+    }
+
+    conn->read_buf_start = conn->read_buf_end = 0;
+
+    ac->next = loop->conns;
+    loop->conns = ac;
+    return ac;
+#else
+    conn->err = MONGO_IO_ERROR;
+    return NULL;
+#endif
+}
+
+MONGO_EXPORT void mongo_async_detach( mongo_async_conn *ac ) {
+    mongo_async *loop = ac->loop;
+    mongo_async_conn **link;
+
+    if( ac->sending || ac->waiting ) {
+        __mongo_set_error( ac->conn, MONGO_IO_ERROR, "Detached with requests in flight.", 0 );
+        mongo_async_fail( ac );
+    }
+
+#ifdef MONGO_ASYNC_SUPPORTED
+    if( ac->events )
+        mongo_async_watch( ac, 0 );
+    mongo_async_set_blocking( ac->conn, 1 );
+#endif
+
+    for( link = &loop->conns; *link; link = &( *link )->next ) {
+        if( *link == ac ) {
+            *link = ac->next;
+            break;
+        }
+    }
+
+    bson_free( ac->out );
+    bson_free( ac );
+}
+
+MONGO_EXPORT int mongo_async_poll( mongo_async *loop, int timeout_ms ) {
+#ifdef MONGO_ASYNC_SUPPORTED
+    mongo_async_conn *ac;
+    int res, done = 0;
+
+    for( ac = loop->conns; ac; ac = ac->next ) {
+        if( ! ac->failed && ac->out_start < ac->out_end )
+            done += mongo_async_flush( ac );
+    }
+
+    for( ac = loop->conns; ac; ac = ac->next ) {
+        if( ! ac->failed )
+            mongo_async_watch( ac, MONGO_ASYNC_IN |
+                               ( ac->out_start < ac->out_end ? MONGO_ASYNC_OUT : 0 ) );
+    }
+
+    if( ! loop->pending )
+        return done;
+
+    res = mongo_async_wait( loop, done ? 0 : timeout_ms );
+    if( res == MONGO_ERROR )
+        return done ? done : MONGO_ERROR;
+
+    return done + res;
+#else
+    return MONGO_ERROR;
+#endif
+}
+
+MONGO_EXPORT int mongo_async_pending( mongo_async *loop ) {
+    return loop->pending;
+}
+
+/*********************************************************************
+Requests API
+**********************************************************************/
+
+MONGO_EXPORT int mongo_async_insert( mongo_async_conn *ac, const char *ns, const bson *data,
+                                     mongo_write_concern *custom_write_concern,
+                                     mongo_async_callback cb, void *arg ) {
+    mongo *conn = ac->conn;
+    mongo_write_concern *write_concern = NULL;
+    int sl = ( int )strlen( ns ) + 1;
+    int id;
+    char *msg;
+
+    if( mongo_async_check( ac ) != MONGO_OK ||
+            mongo_validate_ns( conn, ns ) != MONGO_OK ||
+            mongo_async_bson_valid( conn, data ) != MONGO_OK ||
+            mongo_async_write_concern( conn, custom_write_concern, &write_concern ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    msg = mongo_async_message( ac, 16 + 4 + sl + bson_size( data ), MONGO_OP_INSERT, &id );
+    msg = mongo_async_append32( msg, &ZERO );
+    msg = mongo_async_append( msg, ns, sl );
+    mongo_async_append( msg, data->data, bson_size( data ) );
+
+    mongo_async_write_done( ac, ns, write_concern, cb, arg );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_async_update( mongo_async_conn *ac, const char *ns, const bson *cond,
+                                     const bson *op, int flags,
+                                     mongo_write_concern *custom_write_concern,
+                                     mongo_async_callback cb, void *arg ) {
+    mongo *conn = ac->conn;
+    mongo_write_concern *write_concern = NULL;
+    int sl = ( int )strlen( ns ) + 1;
+    int id;
+    char *msg;
+
+    if( mongo_async_check( ac ) != MONGO_OK ||
+            mongo_validate_ns( conn, ns ) != MONGO_OK ||
+            mongo_async_bson_valid( conn, cond ) != MONGO_OK ||
+            mongo_async_bson_valid( conn, op ) != MONGO_OK ||
+            mongo_async_write_concern( conn, custom_write_concern, &write_concern ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    msg = mongo_async_message( ac, 16 + 4 + sl + 4 + bson_size( cond ) + bson_size( op ),
+                               MONGO_OP_UPDATE, &id );
+    msg = mongo_async_append32( msg, &ZERO );
+    msg = mongo_async_append( msg, ns, sl );
+    msg = mongo_async_append32( msg, &flags );
+    msg = mongo_async_append( msg, cond->data, bson_size( cond ) );
+    mongo_async_append( msg, op->data, bson_size( op ) );
+
+    mongo_async_write_done( ac, ns, write_concern, cb, arg );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_async_remove( mongo_async_conn *ac, const char *ns, const bson *cond,
+                                     mongo_write_concern *custom_write_concern,
+                                     mongo_async_callback cb, void *arg ) {
+    mongo *conn = ac->conn;
+    mongo_write_concern *write_concern = NULL;
+    int sl = ( int )strlen( ns ) + 1;
+    int id;
+    char *msg;
+
+    if( mongo_async_check( ac ) != MONGO_OK ||
+            mongo_validate_ns( conn, ns ) != MONGO_OK ||
+            mongo_async_bson_valid( conn, cond ) != MONGO_OK ||
+            mongo_async_write_concern( conn, custom_write_concern, &write_concern ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    msg = mongo_async_message( ac, 16 + 4 + sl + 4 + bson_size( cond ), MONGO_OP_DELETE, &id );
+    msg = mongo_async_append32( msg, &ZERO );
+    msg = mongo_async_append( msg, ns, sl );
+    msg = mongo_async_append32( msg, &ZERO );
+    mongo_async_append( msg, cond->data, bson_size( cond ) );
+
+    mongo_async_write_done( ac, ns, write_concern, cb, arg );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_async_find( mongo_async_conn *ac, const char *ns, const bson *query,
+                                   const bson *fields, int limit, int skip, int options,
+                                   mongo_async_callback cb, void *arg ) {
+    int id;
+
+    if( ! query )
+        query = bson_shared_empty( );
+
+    if( mongo_async_check( ac ) != MONGO_OK ||
+            mongo_async_bson_valid( ac->conn, query ) != MONGO_OK ||
+            ( fields && mongo_async_bson_valid( ac->conn, fields ) != MONGO_OK ) )
+        return MONGO_ERROR;
+
+    id = mongo_async_query( ac, ns, ( int )strlen( ns ), "", options, skip, limit, query, fields );
+    mongo_async_expect( ac, id, MONGO_ASYNC_QUERY, cb, arg );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_async_get_more( mongo_async_conn *ac, const char *ns, int64_t cursor_id,
+                                       int limit, mongo_async_callback cb, void *arg ) {
+    int sl = ( int )strlen( ns ) + 1;
+    int id;
+    char *msg;
+
+    if( mongo_async_check( ac ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    msg = mongo_async_message( ac, 16 + 4 + sl + 4 + 8, MONGO_OP_GET_MORE, &id );
+    msg = mongo_async_append32( msg, &ZERO );
+    msg = mongo_async_append( msg, ns, sl );
+    msg = mongo_async_append32( msg, &limit );
+    mongo_async_append64( msg, &cursor_id );
+
+    mongo_async_expect( ac, id, MONGO_ASYNC_QUERY, cb, arg );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_async_command( mongo_async_conn *ac, const char *db, const bson *command,
+                                      mongo_async_callback cb, void *arg ) {
+    int id;
+
+    if( mongo_async_check( ac ) != MONGO_OK ||
+            mongo_async_bson_valid( ac->conn, command ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    id = mongo_async_query( ac, db, ( int )strlen( db ), ".$cmd", 0, 0, 1, command, NULL );
+    mongo_async_expect( ac, id, MONGO_ASYNC_COMMAND, cb, arg );
+    return MONGO_OK;
+}
@@ -0,0 +1,239 @@
+/** @file async.h
+ *
+ *  @brief Non-blocking, event-loop driven requests.
+ *
+ * */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "mongo.h"
+
+#ifndef MONGO_ASYNC_H_
+#define MONGO_ASYNC_H_
+
+MONGO_EXTERN_C_START
+
+/**
+ * Called once for every completed request.
+ *
+ * @param conn the connection the request was sent on.
+ * @param status MONGO_OK, or MONGO_ERROR if the request failed. A failed
+ *     query or getlasterror still passes its reply.
+ * @param reply the server's reply, or NULL for unacknowledged writes and
+ *     I/O failures. It is only valid for the duration of the callback.
+ * @param arg the pointer given when the request was queued.
+ */
+typedef void ( *mongo_async_callback )( mongo *conn, int status,
+                                        const mongo_reply *reply, void *arg );
+
+typedef struct mongo_async_request {
+    int id;             /**< Request id a reply must answer, or 0 for none. */
+    int kind;           /**< How the reply decides the request's status. */
+    int64_t end;        /**< Output offset at which the request is fully sent. */
+    mongo_async_callback cb;
+    void *arg;
+    struct mongo_async_request *next;
+} mongo_async_request;
+
+typedef struct mongo_async_conn {
+    mongo *conn;              /**< Connection is *not* owned by the loop. */
+    struct mongo_async *loop;
+    int next_id;              /**< Next request id on this connection. */
+    int events;               /**< Events currently watched for. */
+    int failed;               /**< Set once the socket has failed. */
+    char *out;                /**< Queued, unsent bytes. */
+    int out_start;
+    int out_end;
+    int out_size;
+    int64_t queued;           /**< Total bytes ever queued. */
+    int64_t written;          /**< Total bytes ever written. */
+    mongo_async_request *sending;     /**< Unacknowledged writes, in order. */
+    mongo_async_request *sending_tail;
+    mongo_async_request *waiting;     /**< Requests awaiting a reply, in order. */
+    mongo_async_request *waiting_tail;
+    struct mongo_async_conn *next;
+} mongo_async_conn;
+
+typedef struct mongo_async {
+    int fd;                   /**< epoll descriptor, or -1 when using poll( ). */
+    int pending;              /**< Requests not yet completed. */
+    mongo_async_conn *conns;
+    mongo_async_request *free_requests;
+    void *poll_fds;           /**< Scratch array for poll( ). */
+    int poll_fds_size;
+} mongo_async;
+
+/**
+ * Initialize an event loop. Uses epoll on Linux and poll( ) on
+ * other POSIX systems. Not available in the win32 or standard
+ * environments.
+ *
+ * @param loop
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_async_init( mongo_async *loop );
+
+/**
+ * Detach every connection, failing any requests still in flight,
+ * and release the loop's resources.
+ *
+ * @param loop
+ */
+MONGO_EXPORT void mongo_async_destroy( mongo_async *loop );
+
+/**
+ * Drive a connected mongo object from the loop. Its socket is made
+ * non-blocking, so the blocking API must not be used on the connection
+ * until it is detached again.
+ *
+ * @param loop
+ * @param conn a connected mongo object.
+ *
+ * @return a handle for queueing requests, or NULL on failure.
+ */
+MONGO_EXPORT mongo_async_conn *mongo_async_attach( mongo_async *loop, mongo *conn );
+
+/**
+ * Stop driving a connection and return its socket to blocking mode.
+ * Requests still in flight fail. Must not be called from a callback.
+ *
+ * @param ac
+ */
+MONGO_EXPORT void mongo_async_detach( mongo_async_conn *ac );
+
+/**
+ * Queue an insert. With a write concern, the callback receives the
+ * getlasterror reply; without one it runs once the insert is written.
+ *
+ * @param ac
+ * @param ns the namespace.
+ * @param data the bson data.
+ * @param custom_write_concern a write concern, or NULL for the
+ *     connection's default.
+ * @param cb
+ * @param arg
+ *
+ * @return MONGO_OK if the request was queued, MONGO_ERROR otherwise.
+ */
+MONGO_EXPORT int mongo_async_insert( mongo_async_conn *ac, const char *ns, const bson *data,
+                                     mongo_write_concern *custom_write_concern,
+                                     mongo_async_callback cb, void *arg );
+
+/**
+ * Queue an update. Completion works as for mongo_async_insert( ).
+ *
+ * @param ac
+ * @param ns the namespace.
+ * @param cond the bson update query.
+ * @param op the bson update data.
+ * @param flags flags for the update.
+ * @param custom_write_concern a write concern, or NULL for the default.
+ * @param cb
+ * @param arg
+ *
+ * @return MONGO_OK if the request was queued, MONGO_ERROR otherwise.
+ */
+MONGO_EXPORT int mongo_async_update( mongo_async_conn *ac, const char *ns, const bson *cond,
+                                     const bson *op, int flags,
+                                     mongo_write_concern *custom_write_concern,
+                                     mongo_async_callback cb, void *arg );
+
+/**
+ * Queue a remove. Completion works as for mongo_async_insert( ).
+ *
+ * @param ac
+ * @param ns the namespace.
+ * @param cond the bson query.
+ * @param custom_write_concern a write concern, or NULL for the default.
+ * @param cb
+ * @param arg
+ *
+ * @return MONGO_OK if the request was queued, MONGO_ERROR otherwise.
+ */
+MONGO_EXPORT int mongo_async_remove( mongo_async_conn *ac, const char *ns, const bson *cond,
+                                     mongo_write_concern *custom_write_concern,
+                                     mongo_async_callback cb, void *arg );
+
+/**
+ * Queue a query. The callback receives the first batch; use
+ * mongo_async_get_more( ) with its cursor id for the rest.
+ *
+ * @param ac
+ * @param ns the namespace.
+ * @param query the bson query.
+ * @param fields a bson document of fields to be returned, or NULL.
+ * @param limit the number of documents to return.
+ * @param skip the number of documents to skip.
+ * @param options a bitfield of mongo_cursor_opts.
+ * @param cb
+ * @param arg
+ *
+ * @return MONGO_OK if the request was queued, MONGO_ERROR otherwise.
+ */
+MONGO_EXPORT int mongo_async_find( mongo_async_conn *ac, const char *ns, const bson *query,
+                                   const bson *fields, int limit, int skip, int options,
+                                   mongo_async_callback cb, void *arg );
+
+/**
+ * Queue a getmore for an open cursor.
+ *
+ * @param ac
+ * @param ns the namespace the cursor was opened on.
+ * @param cursor_id the cursor id from a previous reply.
+ * @param limit the number of documents to return, or 0 for the default.
+ * @param cb
+ * @param arg
+ *
+ * @return MONGO_OK if the request was queued, MONGO_ERROR otherwise.
+ */
+MONGO_EXPORT int mongo_async_get_more( mongo_async_conn *ac, const char *ns, int64_t cursor_id,
+                                       int limit, mongo_async_callback cb, void *arg );
+
+/**
+ * Queue a database command.
+ *
+ * @param ac
+ * @param db the database name.
+ * @param command the bson command.
+ * @param cb
+ * @param arg
+ *
+ * @return MONGO_OK if the request was queued, MONGO_ERROR otherwise.
+ */
+MONGO_EXPORT int mongo_async_command( mongo_async_conn *ac, const char *db, const bson *command,
+                                      mongo_async_callback cb, void *arg );
+
+/**
+ * Write queued requests, wait up to timeout_ms for replies and run the
+ * callbacks of everything that completed.
+ *
+ * @param loop
+ * @param timeout_ms milliseconds to wait, 0 to not wait, or -1 to wait
+ *     until something completes.
+ *
+ * @return the number of requests completed, or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_async_poll( mongo_async *loop, int timeout_ms );
+
+/**
+ * @return the number of requests queued on the loop and not yet completed.
+ */
+MONGO_EXPORT int mongo_async_pending( mongo_async *loop );
+
+MONGO_EXTERN_C_END
+
+#endif
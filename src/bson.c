@@ -19,6 +19,7 @@
   #define _CRT_SECURE_NO_WARNINGS
 #endif
 
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -63,7 +64,8 @@ static int ( *oid_inc_func )( void )  = NULL;
    ------------------------------ */
 
 MONGO_EXPORT void bson_init_zero(bson* b) {
-    memset(b, 0, sizeof(bson) - sizeof(b->stack));
+    memset(b, 0, offsetof(bson, stack));
+    b->trustKeys = 0;
 }
 
 MONGO_EXPORT bson* bson_alloc( void ) {
@@ -324,6 +326,358 @@ MONGO_EXPORT bson_type bson_find( bson_iterator *it, const bson *obj, const char
     return bson_iterator_type( it );
 }
 
+/* FNV-1a over a key. */
+static unsigned int bson_index_hash( const char *key ) {
+    unsigned int h = 2166136261u;
+
+    while( *key ) {
+        h ^= ( unsigned char )*key++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* Find name's slot, or the empty slot where it belongs. */
+static bson_index_slot *bson_index_slot_for( const bson_index *index, unsigned int hash,
+                                             const char *name ) {
+    int mask = index->size - 1;
+    int i = ( int )( hash & ( unsigned int )mask );
+    bson_index_slot *slot;
+
+    for( ;; ) {
+        slot = &index->slots[i];
+        if( ! slot->offset )
+            return slot;
+        if( slot->hash == hash && strcmp( index->data + slot->offset + 1, name ) == 0 )
+            return slot;
+        i = ( i + 1 ) & mask;
+    }
+}
+
+static void bson_index_grow( bson_index *index ) {
+    bson_index_slot *old = index->slots;
+    int old_size = index->size, i;
+
+    index->size = old_size ? old_size * 2 : 16;
+    index->slots = ( bson_index_slot * )bson_malloc( index->size * sizeof( bson_index_slot ) );
+    memset( index->slots, 0, index->size * sizeof( bson_index_slot ) );
+
+    for( i = 0; i < old_size; i++ ) {
+        if( old[i].offset )
+            *bson_index_slot_for( index, old[i].hash, index->data + old[i].offset + 1 ) = old[i];
+    }
+    bson_free( old );
+}
+
+MONGO_EXPORT int bson_index_init( bson_index *index, const bson *b ) {
+    bson_iterator it[1];
+    bson_index_slot *slot;
+    unsigned int hash;
+    const char *key;
+
+    memset( index, 0, sizeof( bson_index ) );
+    if( ! b->finished )
+        return BSON_ERROR;
+
+    index->data = b->data;
+    bson_index_grow( index );
+
+    bson_iterator_init( it, b );
+    while( bson_iterator_next( it ) ) {
+        /* Keep the load at a half or less. */
+        if( 2 * ( index->count + 1 ) > index->size )
+            bson_index_grow( index );
+
+        key = bson_iterator_key( it );
+        hash = bson_index_hash( key );
+        slot = bson_index_slot_for( index, hash, key );
+        if( slot->offset )
+            continue; /* bson_find( ) stops at the first. */
+        slot->hash = hash;
+        slot->offset = ( int )( it->cur - index->data );
+        index->count++;
+    }
+
+    return BSON_OK;
+}
+
+MONGO_EXPORT bson_type bson_index_find( bson_iterator *it, const bson_index *index,
+                                        const char *name ) {
+    bson_index_slot *slot;
+    int size;
+
+    it->first = 0;
+
+    /* An index whose init failed, or that was destroyed, has no table
+     * or object; leave the iterator on a lone EOO instead. */
+    if( ! index->slots ) {
+        it->cur = "";
+        return BSON_EOO;
+    }
+
+    slot = bson_index_slot_for( index, bson_index_hash( name ), name );
+    if( slot->offset )
+        it->cur = index->data + slot->offset;
+    else {
+        /* Not found leaves the iterator at the end, as bson_find( ) does. */
+        bson_little_endian32( &size, index->data );
+        it->cur = index->data + size - 1;
+    }
+    return bson_iterator_type( it );
+}
+
+MONGO_EXPORT void bson_index_destroy( bson_index *index ) {
+    bson_free( index->slots );
+    memset( index, 0, sizeof( bson_index ) );
+}
+
+/* bson_find_many( ) compiles this many keys or fewer on the stack. */
+#define BSON_MATCHER_STACK_KEYS 16
+
+/* Find key's slot, or the empty slot where it belongs. */
+static bson_index_slot *bson_matcher_slot_for( const bson_matcher *matcher, unsigned int hash,
+                                               const char *key ) {
+    int mask = matcher->size - 1;
+    int i = ( int )( hash & ( unsigned int )mask );
+    bson_index_slot *slot;
+
+    for( ;; ) {
+        slot = &matcher->slots[i];
+        if( ! slot->offset )
+            return slot;
+        if( slot->hash == hash && strcmp( matcher->keys[slot->offset - 1], key ) == 0 )
+            return slot;
+        i = ( i + 1 ) & mask;
+    }
+}
+
+/* Slots for n keys at a load of a half or less. */
+static int bson_matcher_size( int n ) {
+    int size = 4;
+
+    while( size < 2 * n )
+        size *= 2;
+    return size;
+}
+
+/* Fill in a matcher over caller-provided tables. */
+static void bson_matcher_build( bson_matcher *matcher, const char **keys, int n,
+                                bson_index_slot *slots, int size, int *first ) {
+    bson_index_slot *slot;
+    unsigned int hash;
+    int i;
+
+    matcher->keys = keys;
+    matcher->count = n;
+    matcher->distinct = 0;
+    matcher->slots = slots;
+    matcher->size = size;
+    matcher->first = first;
+    memset( slots, 0, size * sizeof( bson_index_slot ) );
+
+    for( i = 0; i < n; i++ ) {
+        hash = bson_index_hash( keys[i] );
+        slot = bson_matcher_slot_for( matcher, hash, keys[i] );
+        if( ! slot->offset ) {
+            slot->hash = hash;
+            slot->offset = i + 1;
+            matcher->distinct++;
+        }
+        first[i] = slot->offset - 1;
+    }
+}
+
+MONGO_EXPORT void bson_matcher_init( bson_matcher *matcher, const char **keys, int n ) {
+    int size = bson_matcher_size( n );
+
+    bson_matcher_build( matcher, keys, n,
+                        ( bson_index_slot * )bson_malloc( size * sizeof( bson_index_slot ) ), size,
+                        ( int * )bson_malloc( ( n ? n : 1 ) * sizeof( int ) ) );
+}
+
+MONGO_EXPORT int bson_matcher_find( const bson_matcher *matcher, const bson *b,
+                                    bson_iterator *out ) {
+    bson_iterator it[1];
+    bson_index_slot *slot;
+    const char *end = b->data + bson_size( b ) - 1;
+    int i, pending = matcher->distinct, found = 0;
+
+    for( i = 0; i < matcher->count; i++ ) {
+        out[i].cur = NULL;
+        out[i].first = 0;
+    }
+
+    /* Stop as soon as every key has been seen. */
+    bson_iterator_init( it, b );
+    while( pending && bson_iterator_next( it ) ) {
+        const char *key = bson_iterator_key( it );
+        slot = bson_matcher_slot_for( matcher, bson_index_hash( key ), key );
+        if( slot->offset && ! out[slot->offset - 1].cur ) {
+            out[slot->offset - 1].cur = it->cur;
+            pending--;
+        }
+    }
+
+    for( i = 0; i < matcher->count; i++ ) {
+        if( matcher->first[i] != i )
+            out[i].cur = out[matcher->first[i]].cur;
+        if( out[i].cur )
+            found++;
+        else
+            out[i].cur = end;
+    }
+
+    return found;
+}
+
+MONGO_EXPORT void bson_matcher_destroy( bson_matcher *matcher ) {
+    bson_free( matcher->slots );
+    bson_free( matcher->first );
+    memset( matcher, 0, sizeof( bson_matcher ) );
+}
+
+MONGO_EXPORT int bson_find_many( const bson *b, const char **keys, int n, bson_iterator *out ) {
+    bson_matcher matcher[1];
+    bson_index_slot slots[2 * BSON_MATCHER_STACK_KEYS];
+    int first[BSON_MATCHER_STACK_KEYS];
+    int found;
+
+    if( n > BSON_MATCHER_STACK_KEYS ) {
+        bson_matcher_init( matcher, keys, n );
+        found = bson_matcher_find( matcher, b, out );
+        bson_matcher_destroy( matcher );
+        return found;
+    }
+
+    bson_matcher_build( matcher, keys, n, slots, bson_matcher_size( n ), first );
+    return bson_matcher_find( matcher, b, out );
+}
+
+/* A path component as an array index, or -1 if it is not a canonical
+ * non-negative integer. */
+static int bson_path_index( const char *name, int len ) {
+    int index = 0, i;
+
+    if( len < 1 || len > 9 || ( len > 1 && name[0] == '0' ) )
+        return -1;
+    for( i = 0; i < len; i++ ) {
+        if( name[i] < '0' || name[i] > '9' )
+            return -1;
+        index = index * 10 + ( name[i] - '0' );
+    }
+    return index;
+}
+
+/* Advance it, at the start of the object or array at level, to one
+ * path component. Array elements are counted rather than compared. On
+ * failure it is left at the end of level. */
+static bson_type bson_path_step( bson_iterator *it, const char *level, bson_type container,
+                                 const char *name, int len, int index ) {
+    const char *key;
+    int size;
+
+    if( container != BSON_ARRAY )
+        index = -1;
+
+    while( bson_iterator_next( it ) ) {
+        if( index >= 0 ) {
+            if( index-- == 0 )
+                return bson_iterator_type( it );
+        }
+        else {
+            key = bson_iterator_key( it );
+            if( strncmp( key, name, len ) == 0 && key[len] == '\0' )
+                return bson_iterator_type( it );
+        }
+    }
+
+    bson_little_endian32( &size, level );
+    it->cur = level + size - 1;
+    return BSON_EOO;
+}
+
+/* Descend into the object or array at it. Returns false, leaving it at
+ * the end of level, if it holds neither. */
+static int bson_path_descend( bson_iterator *it, const char **level, bson_type type ) {
+    int size;
+
+    if( type != BSON_OBJECT && type != BSON_ARRAY ) {
+        bson_little_endian32( &size, *level );
+        it->cur = *level + size - 1;
+        it->first = 0;
+        return 0;
+    }
+    *level = bson_iterator_value( it );
+    bson_iterator_from_buffer( it, *level );
+    return 1;
+}
+
+MONGO_EXPORT bson_type bson_find_path( bson_iterator *it, const bson *obj, const char *path ) {
+    const char *level = obj->data, *dot;
+    bson_type type = BSON_OBJECT;
+    int len;
+
+    bson_iterator_init( it, obj );
+    for( ;; ) {
+        dot = strchr( path, '.' );
+        len = dot ? ( int )( dot - path ) : ( int )strlen( path );
+        type = bson_path_step( it, level, type, path, len, bson_path_index( path, len ) );
+        if( ! dot || ! type )
+            return type;
+        if( ! bson_path_descend( it, &level, type ) )
+            return BSON_EOO;
+        path = dot + 1;
+    }
+}
+
+MONGO_EXPORT void bson_path_init( bson_path *path, const char *dotted ) {
+    size_t size = strlen( dotted ) + 1;
+    const char *p;
+    char *copy;
+    int i;
+
+    path->count = 1;
+    for( p = dotted; *p; p++ ) {
+        if( *p == '.' )
+            path->count++;
+    }
+
+    path->parts = ( bson_path_part * )bson_malloc( path->count * sizeof( bson_path_part ) + size );
+    copy = ( char * )( path->parts + path->count );
+    memcpy( copy, dotted, size );
+
+    for( i = 0; i < path->count; i++ ) {
+        p = strchr( copy, '.' );
+        path->parts[i].name = copy;
+        path->parts[i].len = p ? ( int )( p - copy ) : ( int )strlen( copy );
+        path->parts[i].index = bson_path_index( copy, path->parts[i].len );
+        copy += path->parts[i].len + 1;
+    }
+}
+
+MONGO_EXPORT bson_type bson_path_find( bson_iterator *it, const bson *obj, const bson_path *path ) {
+    const char *level = obj->data;
+    bson_type type = BSON_OBJECT;
+    int i;
+
+    bson_iterator_init( it, obj );
+    for( i = 0; i < path->count; i++ ) {
+        if( i && ! bson_path_descend( it, &level, type ) )
+            return BSON_EOO;
+        type = bson_path_step( it, level, type, path->parts[i].name, path->parts[i].len,
+                               path->parts[i].index );
+        if( ! type )
+            return BSON_EOO;
+    }
+    return type;
+}
+
+MONGO_EXPORT void bson_path_destroy( bson_path *path ) {
+    bson_free( path->parts );
+    path->parts = NULL;
+    path->count = 0;
+}
+
 MONGO_EXPORT bson_bool_t bson_iterator_more( const bson_iterator *i ) {
     return *( i->cur );
 }
@@ -773,8 +1127,28 @@ MONGO_EXPORT void bson_destroy( bson *b ) {
     }
 }
 
-static int bson_append_estart( bson *b, int type, const char *name, const size_t dataSize ) {
-    const size_t len = strlen( name ) + 1;
+/* key->err for a plain name, validated as it is appended. */
+#define BSON_KEY_UNCHECKED -1
+
+static void bson_key_unchecked( bson_key *key, const char *name ) {
+    key->name = name;
+    key->len = ( int )strlen( name );
+    key->err = BSON_KEY_UNCHECKED;
+}
+
+MONGO_EXPORT int bson_key_init( bson_key *key, const char *name ) {
+    key->name = name;
+    key->len = ( int )strlen( name );
+    key->err = 0;
+    return bson_check_field_name_err( &key->err, name, key->len );
+}
+
+MONGO_EXPORT void bson_set_trusted_keys( bson *b, bson_bool_t trusted ) {
+    b->trustKeys = trusted;
+}
+
+static int bson_append_estart_key( bson *b, int type, const bson_key *key, const size_t dataSize ) {
+    const size_t len = key->len + 1;
 
     if ( b->finished ) {
         b->err |= BSON_ALREADY_FINISHED;
@@ -785,54 +1159,100 @@ static int bson_append_estart( bson *b, int type, const char *name, const size_t
         return BSON_ERROR;
     }
 
-    if( bson_check_field_name( b, ( const char * )name, len - 1 ) == BSON_ERROR ) {
+    /* A bson_key was validated when it was made; replay its result. */
+    if ( key->err != BSON_KEY_UNCHECKED ) {
+        b->err |= key->err;
+        if ( key->err & BSON_NOT_UTF8 ) {
+            bson_builder_error( b );
+            return BSON_ERROR;
+        }
+    }
+    else if( ! b->trustKeys &&
+             bson_check_field_name( b, key->name, len - 1 ) == BSON_ERROR ) {
         bson_builder_error( b );
         return BSON_ERROR;
     }
 
     bson_append_byte( b, ( char )type );
-    bson_append( b, name, len );
+    bson_append( b, key->name, len );
     return BSON_OK;
 }
 
+static int bson_append_estart( bson *b, int type, const char *name, const size_t dataSize ) {
+    bson_key key[1];
+
+    bson_key_unchecked( key, name );
+    return bson_append_estart_key( b, type, key, dataSize );
+}
+
 /* ----------------------------
    BUILDING TYPES
    ------------------------------ */
 
-MONGO_EXPORT int bson_append_int( bson *b, const char *name, const int i ) {
-    if ( bson_append_estart( b, BSON_INT, name, 4 ) == BSON_ERROR )
+MONGO_EXPORT int bson_append_int_key( bson *b, const bson_key *key, const int i ) {
+    if ( bson_append_estart_key( b, BSON_INT, key, 4 ) == BSON_ERROR )
         return BSON_ERROR;
     bson_append32( b , &i );
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_long( bson *b, const char *name, const int64_t i ) {
-    if ( bson_append_estart( b , BSON_LONG, name, 8 ) == BSON_ERROR )
+MONGO_EXPORT int bson_append_int( bson *b, const char *name, const int i ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_int_key( b, key, i );
+}
+
+MONGO_EXPORT int bson_append_long_key( bson *b, const bson_key *key, const int64_t i ) {
+    if ( bson_append_estart_key( b , BSON_LONG, key, 8 ) == BSON_ERROR )
         return BSON_ERROR;
     bson_append64( b , &i );
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_double( bson *b, const char *name, const double d ) {
-    if ( bson_append_estart( b, BSON_DOUBLE, name, 8 ) == BSON_ERROR )
+MONGO_EXPORT int bson_append_long( bson *b, const char *name, const int64_t i ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_long_key( b, key, i );
+}
+
+MONGO_EXPORT int bson_append_double_key( bson *b, const bson_key *key, const double d ) {
+    if ( bson_append_estart_key( b, BSON_DOUBLE, key, 8 ) == BSON_ERROR )
         return BSON_ERROR;
     bson_append64( b , &d );
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_bool( bson *b, const char *name, const bson_bool_t i ) {
-    if ( bson_append_estart( b, BSON_BOOL, name, 1 ) == BSON_ERROR )
+MONGO_EXPORT int bson_append_double( bson *b, const char *name, const double d ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_double_key( b, key, d );
+}
+
+MONGO_EXPORT int bson_append_bool_key( bson *b, const bson_key *key, const bson_bool_t i ) {
+    if ( bson_append_estart_key( b, BSON_BOOL, key, 1 ) == BSON_ERROR )
         return BSON_ERROR;
     bson_append_byte( b , i != 0 );
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_null( bson *b, const char *name ) {
-    if ( bson_append_estart( b , BSON_NULL, name, 0 ) == BSON_ERROR )
+MONGO_EXPORT int bson_append_bool( bson *b, const char *name, const bson_bool_t i ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_bool_key( b, key, i );
+}
+
+MONGO_EXPORT int bson_append_null_key( bson *b, const bson_key *key ) {
+    if ( bson_append_estart_key( b , BSON_NULL, key, 0 ) == BSON_ERROR )
         return BSON_ERROR;
     return BSON_OK;
 }
 
+MONGO_EXPORT int bson_append_null( bson *b, const char *name ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_null_key( b, key );
+}
+
 MONGO_EXPORT int bson_append_undefined( bson *b, const char *name ) {
     if ( bson_append_estart( b, BSON_UNDEFINED, name, 0 ) == BSON_ERROR )
         return BSON_ERROR;
@@ -851,8 +1271,8 @@ MONGO_EXPORT int bson_append_minkey( bson *b, const char *name ) {
     return BSON_OK;
 }
 
-static int bson_append_string_base( bson *b, const char *name,
-                                    const char *value, size_t len, bson_type type ) {
+static int bson_append_string_base_key( bson *b, const bson_key *key,
+                                        const char *value, size_t len, bson_type type ) {
 
     size_t sl = len + 1;
     if ( sl > INT32_MAX ) {
@@ -862,7 +1282,7 @@ static int bson_append_string_base( bson *b, const char *name,
     }
     if ( bson_check_string( b, ( const char * )value, sl - 1 ) == BSON_ERROR )
         return BSON_ERROR;
-    if ( bson_append_estart( b, type, name, 4 + sl ) == BSON_ERROR ) {
+    if ( bson_append_estart_key( b, type, key, 4 + sl ) == BSON_ERROR ) {
         return BSON_ERROR;
     }
     bson_append32_as_int( b , ( int )sl );
@@ -871,6 +1291,22 @@ static int bson_append_string_base( bson *b, const char *name,
     return BSON_OK;
 }
 
+static int bson_append_string_base( bson *b, const char *name,
+                                    const char *value, size_t len, bson_type type ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_string_base_key( b, key, value, len, type );
+}
+
+MONGO_EXPORT int bson_append_string_key( bson *b, const bson_key *key, const char *value ) {
+    return bson_append_string_base_key( b, key, value, strlen ( value ), BSON_STRING );
+}
+
+MONGO_EXPORT int bson_append_string_n_key( bson *b, const bson_key *key, const char *value,
+                                           size_t len ) {
+    return bson_append_string_base_key( b, key, value, len, BSON_STRING );
+}
+
 MONGO_EXPORT int bson_append_string( bson *b, const char *name, const char *value ) {
     return bson_append_string_base( b, name, value, strlen ( value ), BSON_STRING );
 }
@@ -919,10 +1355,11 @@ MONGO_EXPORT int bson_append_code_w_scope( bson *b, const char *name, const char
     return bson_append_code_w_scope_n( b, name, code, strlen ( code ), scope );
 }
 
-MONGO_EXPORT int bson_append_binary( bson *b, const char *name, char type, const char *str, size_t len ) {
+MONGO_EXPORT int bson_append_binary_key( bson *b, const bson_key *key, char type,
+                                         const char *str, size_t len ) {
     if ( type == BSON_BIN_BINARY_OLD ) {
         size_t subtwolen = len + 4;
-        if ( bson_append_estart( b, BSON_BINDATA, name, 4+1+4+len ) == BSON_ERROR )
+        if ( bson_append_estart_key( b, BSON_BINDATA, key, 4+1+4+len ) == BSON_ERROR )
             return BSON_ERROR;
         bson_append32_as_int( b, ( int )subtwolen );
         bson_append_byte( b, type );
@@ -930,7 +1367,7 @@ MONGO_EXPORT int bson_append_binary( bson *b, const char *name, char type, const
         bson_append( b, str, len );
     }
     else {
-        if ( bson_append_estart( b, BSON_BINDATA, name, 4+1+len ) == BSON_ERROR )
+        if ( bson_append_estart_key( b, BSON_BINDATA, key, 4+1+len ) == BSON_ERROR )
             return BSON_ERROR;
         bson_append32_as_int( b, ( int )len );
         bson_append_byte( b, type );
@@ -939,13 +1376,25 @@ MONGO_EXPORT int bson_append_binary( bson *b, const char *name, char type, const
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_oid( bson *b, const char *name, const bson_oid_t *oid ) {
-    if ( bson_append_estart( b, BSON_OID, name, 12 ) == BSON_ERROR )
+MONGO_EXPORT int bson_append_binary( bson *b, const char *name, char type, const char *str, size_t len ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_binary_key( b, key, type, str, len );
+}
+
+MONGO_EXPORT int bson_append_oid_key( bson *b, const bson_key *key, const bson_oid_t *oid ) {
+    if ( bson_append_estart_key( b, BSON_OID, key, 12 ) == BSON_ERROR )
         return BSON_ERROR;
     bson_append( b , oid , 12 );
     return BSON_OK;
 }
 
+MONGO_EXPORT int bson_append_oid( bson *b, const char *name, const bson_oid_t *oid ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_oid_key( b, key, oid );
+}
+
 MONGO_EXPORT int bson_append_new_oid( bson *b, const char *name ) {
     bson_oid_t oid;
     bson_oid_gen( &oid );
@@ -964,14 +1413,20 @@ MONGO_EXPORT int bson_append_regex( bson *b, const char *name, const char *patte
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_bson( bson *b, const char *name, const bson *bson ) {
+MONGO_EXPORT int bson_append_bson_key( bson *b, const bson_key *key, const bson *bson ) {
     if ( !bson ) return BSON_ERROR;
-    if ( bson_append_estart( b, BSON_OBJECT, name, bson_size( bson ) ) == BSON_ERROR )
+    if ( bson_append_estart_key( b, BSON_OBJECT, key, bson_size( bson ) ) == BSON_ERROR )
         return BSON_ERROR;
     bson_append( b , bson->data , bson_size( bson ) );
     return BSON_OK;
 }
 
+MONGO_EXPORT int bson_append_bson( bson *b, const char *name, const bson *bson ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_bson_key( b, key, bson );
+}
+
 MONGO_EXPORT int bson_append_element( bson *b, const char *name_or_null, const bson_iterator *elem ) {
     bson_iterator next = *elem;
     size_t size;
@@ -1010,30 +1465,48 @@ MONGO_EXPORT int bson_append_timestamp2( bson *b, const char *name, int time, in
     return BSON_OK;
 }
 
-MONGO_EXPORT int bson_append_date( bson *b, const char *name, bson_date_t millis ) {
-    if ( bson_append_estart( b, BSON_DATE, name, 8 ) == BSON_ERROR ) return BSON_ERROR;
+MONGO_EXPORT int bson_append_date_key( bson *b, const bson_key *key, bson_date_t millis ) {
+    if ( bson_append_estart_key( b, BSON_DATE, key, 8 ) == BSON_ERROR ) return BSON_ERROR;
     bson_append64( b , &millis );
     return BSON_OK;
 }
 
+MONGO_EXPORT int bson_append_date( bson *b, const char *name, bson_date_t millis ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_date_key( b, key, millis );
+}
+
 MONGO_EXPORT int bson_append_time_t( bson *b, const char *name, time_t secs ) {
     return bson_append_date( b, name, ( bson_date_t )secs * 1000 );
 }
 
-MONGO_EXPORT int bson_append_start_object( bson *b, const char *name ) {
-    if ( bson_append_estart( b, BSON_OBJECT, name, 5 ) == BSON_ERROR ) return BSON_ERROR;
+static int bson_append_start_nested( bson *b, int type, const bson_key *key ) {
+    if ( bson_append_estart_key( b, type, key, 5 ) == BSON_ERROR ) return BSON_ERROR;
     if ( b->stackPos >= b->stackSize && _bson_append_grow_stack( b ) == BSON_ERROR ) return BSON_ERROR;
     b->stackPtr[ b->stackPos++ ] = _bson_position(b);
     bson_append32( b , &zero );
     return BSON_OK;
 }
 
+MONGO_EXPORT int bson_append_start_object_key( bson *b, const bson_key *key ) {
+    return bson_append_start_nested( b, BSON_OBJECT, key );
+}
+
+MONGO_EXPORT int bson_append_start_object( bson *b, const char *name ) {
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_start_nested( b, BSON_OBJECT, key );
+}
+
+MONGO_EXPORT int bson_append_start_array_key( bson *b, const bson_key *key ) {
+    return bson_append_start_nested( b, BSON_ARRAY, key );
+}
+
 MONGO_EXPORT int bson_append_start_array( bson *b, const char *name ) {
-    if ( bson_append_estart( b, BSON_ARRAY, name, 5 ) == BSON_ERROR ) return BSON_ERROR;
-    if ( b->stackPos >= b->stackSize && _bson_append_grow_stack( b ) == BSON_ERROR ) return BSON_ERROR;
-    b->stackPtr[ b->stackPos++ ] = _bson_position(b);
-    bson_append32( b , &zero );
-    return BSON_OK;
+    bson_key key[1];
+    bson_key_unchecked( key, name );
+    return bson_append_start_nested( b, BSON_ARRAY, key );
 }
 
 MONGO_EXPORT int bson_append_finish_object( bson *b ) {
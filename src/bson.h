@@ -146,7 +146,11 @@ typedef struct {
     int stackPos;         /**< Index of current stack position. */
     size_t* stackPtr;     /**< Pointer to the current stack */
     size_t stack[32];     /**< A stack used to keep track of nested BSON elements.
-                               Must be at end of bson struct so _bson_zero does not clear. */
+                               Must follow the fields above so bson_init_zero does not clear it. */
+    bson_bool_t trustKeys; /**< Whether appended keys skip validation; see bson_set_trusted_keys().
+                                After stack, so bson_init_zero clears it by hand. This still
+                                grows sizeof( bson ) and every struct embedding one: not ABI
+                                compatible with builds that predate it. */
 } bson;
 
 #pragma pack(1)
@@ -163,6 +167,49 @@ typedef struct {
     int t; /* time in seconds */
 } bson_timestamp_t;
 
+/* A key validated once, for appending many times. */
+typedef struct {
+    const char *name;     /**< The key, which is *not* owned. */
+    int len;              /**< strlen( name ). */
+    int err;              /**< The bson_validity_t bits the key sets when appended. */
+} bson_key;
+
+/* A bson_key for a string literal the caller vouches for: valid UTF-8,
+ * no '.' and no leading '$'. Usable as a static initializer. */
+#define BSON_KEY_LITERAL( s ) { ( s ), sizeof( s ) - 1, 0 }
+
+typedef struct {
+    unsigned int hash;   /**< Hash of the element's key. */
+    int offset;          /**< Offset of the element in the object, or 0 for an empty slot. */
+} bson_index_slot;
+
+typedef struct {
+    const char *data;    /**< The indexed object's data, which is *not* owned. */
+    bson_index_slot *slots; /**< Open-addressed table of the object's top-level keys. */
+    int size;            /**< Number of slots, a power of two. */
+    int count;           /**< Number of distinct keys. */
+} bson_index;
+
+typedef struct {
+    const char **keys;   /**< The keys to find, which are *not* owned. */
+    int count;           /**< Number of keys. */
+    int distinct;        /**< Number of different keys. */
+    bson_index_slot *slots; /**< Table of keys by hash; offset is the key's position + 1. */
+    int size;            /**< Number of slots, a power of two. */
+    int *first;          /**< For each key, the position of its first occurrence in keys. */
+} bson_matcher;
+
+typedef struct {
+    const char *name;    /**< Not NUL-terminated. */
+    int len;             /**< Length of name. */
+    int index;           /**< name as an array index, or -1 if it is not one. */
+} bson_path_part;
+
+typedef struct {
+    bson_path_part *parts; /**< One per dotted component, in a single owned block. */
+    int count;           /**< Number of components. */
+} bson_path;
+
 /* ----------------------------
    READING
    ------------------------------ */
@@ -288,6 +335,121 @@ MONGO_EXPORT void bson_print_raw( const char *bson , int depth );
  */
 MONGO_EXPORT bson_type bson_find( bson_iterator *it, const bson *obj, const char *name );
 
+/**
+ * Index the top-level keys of a finished BSON object in one pass, so
+ * that fields can be found with bson_index_find( ) without scanning.
+ * Worth it when many fields are read from a wide object. The object
+ * must not change or be freed while the index is in use.
+ *
+ * @param index the index to initialize.
+ * @param b a finished BSON object.
+ *
+ * @return BSON_OK, or BSON_ERROR if b is not finished.
+ */
+MONGO_EXPORT int bson_index_init( bson_index *index, const bson *b );
+
+/**
+ * Advance a bson_iterator to the named field, as bson_find( ) does,
+ * through an index. When a key is repeated the first is found.
+ *
+ * @param it the bson_iterator to use.
+ * @param index an index from bson_index_init( ).
+ * @param name the name of the field to find.
+ *
+ * @return the type of the found object or BSON_EOO if it is not found,
+ *     including when bson_index_init( ) failed or the index has been
+ *     destroyed.
+ */
+MONGO_EXPORT bson_type bson_index_find( bson_iterator *it, const bson_index *index,
+                                        const char *name );
+
+/**
+ * Free an index's memory.
+ *
+ * @param index
+ */
+MONGO_EXPORT void bson_index_destroy( bson_index *index );
+
+/**
+ * Find several fields in one pass over an object. Each iterator in out
+ * is left as bson_find( ) would leave it for the corresponding key:
+ * at the field, or at the end of the object if there is none. For
+ * the same keys over many objects, compile a bson_matcher instead.
+ *
+ * @param b a finished BSON object.
+ * @param keys the names of the fields to find.
+ * @param n the number of keys.
+ * @param out n iterators to position.
+ *
+ * @return the number of keys found.
+ */
+MONGO_EXPORT int bson_find_many( const bson *b, const char **keys, int n, bson_iterator *out );
+
+/**
+ * Compile a set of keys for bson_matcher_find( ).
+ *
+ * @param matcher the matcher to initialize.
+ * @param keys the names of the fields to find, which must outlive
+ *     the matcher. Repeats are allowed.
+ * @param n the number of keys.
+ */
+MONGO_EXPORT void bson_matcher_init( bson_matcher *matcher, const char **keys, int n );
+
+/**
+ * bson_find_many( ) with a compiled set of keys.
+ *
+ * @param matcher a matcher from bson_matcher_init( ).
+ * @param b a finished BSON object.
+ * @param out one iterator per key to position.
+ *
+ * @return the number of keys found.
+ */
+MONGO_EXPORT int bson_matcher_find( const bson_matcher *matcher, const bson *b,
+                                    bson_iterator *out );
+
+/**
+ * Free a matcher's memory.
+ *
+ * @param matcher
+ */
+MONGO_EXPORT void bson_matcher_destroy( bson_matcher *matcher );
+
+/**
+ * Advance a bson_iterator to a field inside nested objects and arrays
+ * named by a dotted path such as "a.b.c" or "items.0.price". Numeric
+ * components index arrays by position. Nothing is allocated or copied.
+ *
+ * @param it the bson_iterator to use. It is left at the field, ready
+ *     to iterate its siblings.
+ * @param obj the BSON object to search.
+ * @param path the dotted path.
+ *
+ * @return the type of the found object or BSON_EOO if it is not found.
+ */
+MONGO_EXPORT bson_type bson_find_path( bson_iterator *it, const bson *obj, const char *path );
+
+/**
+ * Split a dotted path once, for use with bson_path_find( ).
+ *
+ * @param path the path to initialize.
+ * @param dotted the dotted path, which is copied.
+ */
+MONGO_EXPORT void bson_path_init( bson_path *path, const char *dotted );
+
+/**
+ * bson_find_path( ) with a path from bson_path_init( ).
+ *
+ * @return the type of the found object or BSON_EOO if it is not found.
+ */
+MONGO_EXPORT bson_type bson_path_find( bson_iterator *it, const bson *obj, const bson_path *path );
+
+/**
+ * Free a path's memory.
+ *
+ * @param path
+ */
+MONGO_EXPORT void bson_path_destroy( bson_path *path );
+
 
 MONGO_EXPORT bson_iterator* bson_iterator_alloc( void );
 MONGO_EXPORT void bson_iterator_dealloc(bson_iterator*);
@@ -1085,6 +1247,50 @@ MONGO_EXPORT int bson_append_finish_object( bson *b );
  */
 MONGO_EXPORT int bson_append_finish_array( bson *b );
 
+/**
+ * Skip key validation for names appended to a bson. Validation costs a
+ * UTF-8 scan per append, which is wasted on keys the program itself
+ * spells. Keys from outside the program should still be validated.
+ *
+ * @param b the bson to append to.
+ * @param trusted true to skip validation; false, the default, to
+ *     validate every key.
+ */
+MONGO_EXPORT void bson_set_trusted_keys( bson *b, bson_bool_t trusted );
+
+/**
+ * Validate a key once, for use with the bson_append_*_key( ) functions,
+ * which neither measure nor re-validate it.
+ *
+ * @param key the key to initialize.
+ * @param name the key's name, which must outlive the key.
+ *
+ * @return BSON_OK, or BSON_ERROR if name is not valid UTF-8; appending
+ *     the key then fails as appending name would. key->err is set either way.
+ */
+MONGO_EXPORT int bson_key_init( bson_key *key, const char *name );
+
+/**
+ * Versions of the appends above that take a bson_key for the name.
+ *
+ * @return BSON_OK or BSON_ERROR.
+ */
+MONGO_EXPORT int bson_append_int_key( bson *b, const bson_key *key, const int i );
+MONGO_EXPORT int bson_append_long_key( bson *b, const bson_key *key, const int64_t i );
+MONGO_EXPORT int bson_append_double_key( bson *b, const bson_key *key, const double d );
+MONGO_EXPORT int bson_append_bool_key( bson *b, const bson_key *key, const bson_bool_t v );
+MONGO_EXPORT int bson_append_null_key( bson *b, const bson_key *key );
+MONGO_EXPORT int bson_append_string_key( bson *b, const bson_key *key, const char *str );
+MONGO_EXPORT int bson_append_string_n_key( bson *b, const bson_key *key, const char *str,
+                                           size_t len );
+MONGO_EXPORT int bson_append_oid_key( bson *b, const bson_key *key, const bson_oid_t *oid );
+MONGO_EXPORT int bson_append_date_key( bson *b, const bson_key *key, bson_date_t millis );
+MONGO_EXPORT int bson_append_binary_key( bson *b, const bson_key *key, char type,
+                                         const char *str, size_t len );
+MONGO_EXPORT int bson_append_bson_key( bson *b, const bson_key *key, const bson *bson );
+MONGO_EXPORT int bson_append_start_object_key( bson *b, const bson_key *key );
+MONGO_EXPORT int bson_append_start_array_key( bson *b, const bson_key *key );
+
 void bson_numstr( char *str, int i );
 
 void bson_incnumstr( char *str );
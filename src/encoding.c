@@ -40,6 +40,13 @@
 #include "bson.h"
 #include "encoding.h"
 
+#include <string.h>
+
+#if defined( __SSE2__ ) || defined( _M_X64 ) || ( defined( _M_IX86_FP ) && _M_IX86_FP >= 2 )
+#include <emmintrin.h>
+#define BSON_VALIDATE_SSE2
+#endif
+
 /*
  * Index into the table below with the first byte of a UTF-8 sequence to
  * get the number of trailing bytes that are supposed to follow it.
@@ -119,31 +126,78 @@ static int bson_string_is_db_ref( const unsigned char *string, const size_t leng
     return result;
 }
 
-static int bson_validate_string( bson *b, const unsigned char *string,
+/* Strings are checked this many bytes at a time while they are ASCII. */
+#define BSON_VALIDATE_BLOCK 16
+
+/* Return true if a block is all ASCII, and so valid UTF-8 that starts
+ * and ends on character boundaries. Sets *dot if it holds a '.'. */
+static int bson_validate_ascii_block( const unsigned char *block, int *dot ) {
+#ifdef BSON_VALIDATE_SSE2
+    __m128i v = _mm_loadu_si128( ( const __m128i * )block );
+
+    if( _mm_movemask_epi8( v ) )
+        return 0;
+    if( _mm_movemask_epi8( _mm_cmpeq_epi8( v, _mm_set1_epi8( '.' ) ) ) )
+        *dot = 1;
+    return 1;
+#else
+    unsigned int w[BSON_VALIDATE_BLOCK / 4], x;
+    int i;
+
+    memcpy( w, block, BSON_VALIDATE_BLOCK );
+    if( ( w[0] | w[1] | w[2] | w[3] ) & 0x80808080u )
+        return 0;
+    /* A byte of w ^ "...." is zero where w has a dot. */
+    for( i = 0; i < BSON_VALIDATE_BLOCK / 4; i++ ) {
+        x = w[i] ^ 0x2E2E2E2Eu;
+        if( ( x - 0x01010101u ) & ~x & 0x80808080u )
+            *dot = 1;
+    }
+    return 1;
+#endif
+}
+
+static int bson_validate_string( int *err, const unsigned char *string,
                                  const size_t length, const char check_utf8, const char check_dot,
                                  const char check_dollar ) {
 
     size_t position = 0;
+    size_t scalar_end = 0;
     int sequence_length = 1;
+    int dot = 0;
 
     if( check_dollar && string[0] == '$' ) {
         if( !bson_string_is_db_ref( string, length ) )
-            b->err |= BSON_FIELD_INIT_DOLLAR;
+            *err |= BSON_FIELD_INIT_DOLLAR;
     }
 
     while ( position < length ) {
+        /* Take ASCII a block at a time. A block with other bytes is
+         * walked a character at a time below, and so are the last few
+         * bytes. Either way position stays on a character boundary. */
+        if ( check_utf8 && position >= scalar_end ) {
+            if ( position + BSON_VALIDATE_BLOCK <= length &&
+                    bson_validate_ascii_block( string + position, &dot ) ) {
+                if ( check_dot && dot )
+                    *err |= BSON_FIELD_HAS_DOT;
+                position += BSON_VALIDATE_BLOCK;
+                continue;
+            }
+            scalar_end = position + BSON_VALIDATE_BLOCK;
+        }
+
         if ( check_dot && *( string + position ) == '.' ) {
-            b->err |= BSON_FIELD_HAS_DOT;
+            *err |= BSON_FIELD_HAS_DOT;
         }
 
         if ( check_utf8 ) {
             sequence_length = trailingBytesForUTF8[*( string + position )] + 1;
             if ( ( position + sequence_length ) > length ) {
-                b->err |= BSON_NOT_UTF8;
+                *err |= BSON_NOT_UTF8;
                 return BSON_ERROR;
             }
             if ( !isLegalUTF8( string + position, sequence_length ) ) {
-                b->err |= BSON_NOT_UTF8;
+                *err |= BSON_NOT_UTF8;
                 return BSON_ERROR;
             }
         }
@@ -157,11 +211,17 @@ static int bson_validate_string( bson *b, const unsigned char *string,
 int bson_check_string( bson *b, const char *string,
                        const size_t length ) {
 
-    return bson_validate_string( b, ( const unsigned char * )string, length, 1, 0, 0 );
+    return bson_validate_string( &b->err, ( const unsigned char * )string, length, 1, 0, 0 );
 }
 
 int bson_check_field_name( bson *b, const char *string,
                            const size_t length ) {
 
-    return bson_validate_string( b, ( const unsigned char * )string, length, 1, 1, 1 );
+    return bson_check_field_name_err( &b->err, string, length );
+}
+
+int bson_check_field_name_err( int *err, const char *string,
+                               const size_t length ) {
+
+    return bson_validate_string( err, ( const unsigned char * )string, length, 1, 1, 1 );
 }
@@ -37,6 +37,18 @@ MONGO_EXTERN_C_START
 int bson_check_field_name( bson *b, const char *string,
                            const size_t length );
 
+/**
+ * bson_check_field_name( ) for a name not yet bound to a bson object.
+ *
+ * @param err the bit field to set, as b->err would be.
+ * @param string The field name as char*.
+ * @param length The length of the field name.
+ *
+ * @return BSON_OK if valid UTF8 and BSON_ERROR if not.
+ */
+int bson_check_field_name_err( int *err, const char *string,
+                               const size_t length );
+
 /**
  * Check that a string is valid UTF8. Sets the buffer bit field appropriately.
  *
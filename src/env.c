@@ -38,6 +38,10 @@ int mongo_env_close_socket( SOCKET socket ) {
     return closesocket( socket );
 }
 
+int mongo_env_shutdown_socket( SOCKET socket ) {
+    return shutdown( socket, SD_BOTH );
+}
+
 int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     const char *cbuf = (const char*)buf;
     int flags = 0;
@@ -56,6 +60,18 @@ int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+/* No scatter/gather here; write each buffer in turn. */
+int mongo_env_writev_socket( mongo *conn, mongo_iovec *iov, int iovcnt ) {
+    int i;
+
+    for ( i = 0; i < iovcnt; i++ ) {
+        if ( mongo_env_write_socket( conn, iov[i].base, iov[i].len ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     char *cbuf = (char*)buf;
 
@@ -72,7 +88,18 @@ int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     return MONGO_OK;
 }
 
-int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
+int mongo_env_recv_socket( mongo *conn, void *buf, size_t len, size_t *received ) {
+    int got = recv( conn->sock, (char*)buf, (int)len, 0 );
+    if ( got == 0 || got == SOCKET_ERROR ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, NULL, WSAGetLastError() );
+        return MONGO_ERROR;
+    }
+    *received = got;
+
+    return MONGO_OK;
+}
+
+int mongo_env_set_socket_recv_timeout( mongo *conn, int millis ) {
     if ( setsockopt( conn->sock, SOL_SOCKET, SO_RCVTIMEO, (const char *)&millis,
                      sizeof( millis ) ) == -1 ) {
         __mongo_set_error( conn, MONGO_IO_ERROR, "setsockopt SO_RCVTIMEO failed.",
@@ -80,6 +107,13 @@ int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
         return MONGO_ERROR;
     }
 
+    return MONGO_OK;
+}
+
+int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
+    if ( mongo_env_set_socket_recv_timeout( conn, millis ) != MONGO_OK )
+        return MONGO_ERROR;
+
     if ( setsockopt( conn->sock, SOL_SOCKET, SO_SNDTIMEO, (const char *)&millis,
                      sizeof( millis ) ) == -1 ) {
         __mongo_set_error( conn, MONGO_IO_ERROR, "setsockopt SO_SNDTIMEO failed.",
@@ -90,14 +124,195 @@ int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
     return MONGO_OK;
 }
 
-int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
+/* Put the addresses in the order they are tried: alternating between
+ * address families, starting with the resolver's first choice. */
+static struct addrinfo **mongo_env_order_addresses( struct addrinfo *ai_list, int *count ) {
+    struct addrinfo *ai_ptr;
+    struct addrinfo **addrs, **sorted;
+    int n = 0, first = 0, other, i, j, k;
+
+    for ( ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next )
+        n++;
+
+    /* The first family from the front of sorted, the rest from the back. */
+    sorted = ( struct addrinfo ** )bson_malloc( n * sizeof( struct addrinfo * ) );
+    other = n;
+    for ( ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
+        if ( ai_ptr->ai_family == ai_list->ai_family )
+            sorted[first++] = ai_ptr;
+        else
+            sorted[--other] = ai_ptr;
+    }
+
+    addrs = ( struct addrinfo ** )bson_malloc( n * sizeof( struct addrinfo * ) );
+    for ( i = 0, j = n - 1, k = 0; k < n; ) {
+        if ( i < first )
+            addrs[k++] = sorted[i++];
+        if ( j >= first )
+            addrs[k++] = sorted[j--];
+    }
+
+    bson_free( sorted );
+    *count = n;
+    return addrs;
+}
+
+/* A connect in progress, kept on conn->connecting, raced across the
+ * host's addresses as env_posix does. */
+typedef struct {
+    struct addrinfo *ai_list;
+    struct addrinfo **addrs;
+    int count;              /* Addresses in addrs. */
+    int next;               /* The next address to try. */
+    int live;               /* Attempts in socks. */
+    SOCKET *socks;
+    int64_t *started;
+    int64_t last_start;
+} mongo_env_connect_state;
+
+static void mongo_env_connect_state_free( mongo_env_connect_state *cs ) {
+    int i;
+
+    for ( i = 0; i < cs->live; i++ )
+        mongo_env_close_socket( cs->socks[i] );
+
+    bson_free( cs->started );
+    bson_free( cs->socks );
+    bson_free( cs->addrs );
+    freeaddrinfo( cs->ai_list );
+    bson_free( cs );
+}
+
+/* Milliseconds until the next attempt is due or the oldest gives up,
+ * or -1 if neither will happen. */
+static int mongo_env_connect_wait( mongo *conn, mongo_env_connect_state *cs, int64_t now ) {
+    int wait = -1, i;
+
+    if ( cs->next < cs->count ) {
+        wait = ( int )( cs->last_start + MONGO_ENV_CONNECT_STAGGER_MS - now );
+        if ( wait < 0 )
+            wait = 0;
+    }
+    if ( cs->live > 0 && conn->conn_timeout_ms > 0 ) {
+        i = ( int )( cs->started[0] + conn->conn_timeout_ms - now );
+        if ( i < 0 )
+            i = 0;
+        if ( wait < 0 || i < wait )
+            wait = i;
+    }
+
+    return wait;
+}
+
+static void mongo_env_connect_drop( mongo_env_connect_state *cs, int i ) {
+    /* Keep the attempts in the order they started. */
+    memmove( cs->socks + i, cs->socks + i + 1, ( cs->live - i - 1 ) * sizeof( SOCKET ) );
+    memmove( cs->started + i, cs->started + i + 1, ( cs->live - i - 1 ) * sizeof( int64_t ) );
+    cs->live--;
+}
+
+/* Run the attempts for up to millis, or until one connects or all
+ * have failed if millis is negative. Returns the winning socket, or
+ * INVALID_SOCKET; if cs->live is then 0, every address failed. A
+ * failed connect shows up in the exception set. */
+static SOCKET mongo_env_connect_run( mongo *conn, mongo_env_connect_state *cs, int millis ) {
+    u_long nonblocking = 1;
+    int64_t now, deadline;
+    int status, wait, error, len, i;
+    fd_set writefds, exceptfds;
+    struct timeval tv;
+    SOCKET sock;
+
+    deadline = mongo_env_time_ms( ) + millis;
+
+    for ( ;; ) {
+        now = mongo_env_time_ms( );
+
+        if ( cs->next < cs->count &&
+                ( cs->live == 0 || now - cs->last_start >= MONGO_ENV_CONNECT_STAGGER_MS ) ) {
+            struct addrinfo *ai_ptr = cs->addrs[cs->next++];
+
+            sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+            if ( sock == INVALID_SOCKET ) {
+                __mongo_set_error( conn, MONGO_SOCKET_ERROR, "socket() failed",
+                                   WSAGetLastError() );
+                continue;
+            }
+
+            ioctlsocket( sock, FIONBIO, &nonblocking );
+            status = connect( sock, ai_ptr->ai_addr, ( int )ai_ptr->ai_addrlen );
+            if ( status == 0 )
+                return sock;
+            if ( WSAGetLastError() != WSAEWOULDBLOCK ) {
+                __mongo_set_error( conn, MONGO_SOCKET_ERROR, "connect() failed",
+                                   WSAGetLastError() );
+                mongo_env_close_socket( sock );
+                continue;
+            }
+
+            cs->socks[cs->live] = sock;
+            cs->started[cs->live++] = cs->last_start = now;
+            continue;
+        }
+
+        if ( cs->live == 0 )
+            return INVALID_SOCKET;
+
+        wait = mongo_env_connect_wait( conn, cs, now );
+        if ( millis >= 0 && ( wait < 0 || deadline - now < wait ) )
+            wait = deadline > now ? ( int )( deadline - now ) : 0;
+
+        FD_ZERO( &writefds );
+        FD_ZERO( &exceptfds );
+        for ( i = 0; i < cs->live; i++ ) {
+            FD_SET( cs->socks[i], &writefds );
+            FD_SET( cs->socks[i], &exceptfds );
+        }
+        tv.tv_sec = wait / 1000;
+        tv.tv_usec = ( wait % 1000 ) * 1000;
+        if ( select( 0, NULL, &writefds, &exceptfds, wait < 0 ? NULL : &tv ) == SOCKET_ERROR ) {
+            /* Nothing can be waited on; give every attempt up. */
+            for ( i = 0; i < cs->live; i++ )
+                mongo_env_close_socket( cs->socks[i] );
+            cs->live = 0;
+            cs->next = cs->count;
+            return INVALID_SOCKET;
+        }
+
+        now = mongo_env_time_ms( );
+        for ( i = 0; i < cs->live; ) {
+            error = 0;
+            len = sizeof( error );
+            if ( FD_ISSET( cs->socks[i], &writefds ) &&
+                    getsockopt( cs->socks[i], SOL_SOCKET, SO_ERROR, ( char * )&error, &len ) == 0 && error == 0 ) {
+                sock = cs->socks[i];
+                mongo_env_connect_drop( cs, i );
+                return sock;
+            }
+
+            if ( FD_ISSET( cs->socks[i], &writefds ) || FD_ISSET( cs->socks[i], &exceptfds ) ||
+                    ( conn->conn_timeout_ms > 0 && now - cs->started[i] >= conn->conn_timeout_ms ) ) {
+                mongo_env_close_socket( cs->socks[i] );
+                mongo_env_connect_drop( cs, i );
+            }
+            else
+                i++;
+        }
+
+        if ( millis >= 0 && now >= deadline && cs->live > 0 )
+            return INVALID_SOCKET;
+    }
+}
+
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port ) {
     char port_str[NI_MAXSERV];
     char errstr[MONGO_ERR_LEN];
     int status;
 
     struct addrinfo ai_hints;
     struct addrinfo *ai_list = NULL;
-    struct addrinfo *ai_ptr = NULL;
+    mongo_env_connect_state *cs;
+    SOCKET sock;
 
     conn->sock = 0;
     conn->connected = 0;
@@ -116,50 +331,174 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
         return MONGO_ERROR;
     }
 
-    for ( ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
-        conn->sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype,
-                             ai_ptr->ai_protocol );
+    cs = ( mongo_env_connect_state * )bson_malloc( sizeof( mongo_env_connect_state ) );
+    memset( cs, 0, sizeof( mongo_env_connect_state ) );
+    cs->ai_list = ai_list;
+    cs->addrs = mongo_env_order_addresses( ai_list, &cs->count );
+    cs->socks = ( SOCKET * )bson_malloc( cs->count * sizeof( SOCKET ) );
+    cs->started = ( int64_t * )bson_malloc( cs->count * sizeof( int64_t ) );
 
-        if ( conn->sock == INVALID_SOCKET ) {
-            __mongo_set_error( conn, MONGO_SOCKET_ERROR, "socket() failed",
-                               WSAGetLastError() );
-            conn->sock = 0;
-            continue;
+    sock = mongo_env_connect_run( conn, cs, 0 );
+    if ( sock == INVALID_SOCKET && cs->live == 0 ) {
+        mongo_env_connect_state_free( cs );
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+
+    if ( sock != INVALID_SOCKET ) {
+        mongo_env_connect_state_free( cs );
+        conn->sock = sock;
+    }
+    else {
+        conn->connecting = cs;
+        conn->sock = cs->socks[0];
+    }
+
+    mongo_clear_errors( conn );
+    return MONGO_OK;
+}
+
+int mongo_env_socket_connect_finish( mongo *conn ) {
+    mongo_env_connect_state *cs = ( mongo_env_connect_state * )conn->connecting;
+    u_long nonblocking = 0;
+    int error = 0, flag = 1;
+    int len = sizeof( error );
+    SOCKET sock;
+
+    if ( cs ) {
+        sock = mongo_env_connect_run( conn, cs, 0 );
+        if ( sock == INVALID_SOCKET && cs->live > 0 ) {
+            /* Still connecting, perhaps to the next address. */
+            conn->sock = cs->socks[0];
+            return MONGO_OK;
         }
 
-        status = connect( conn->sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen );
-        if ( status != 0 ) {
-            __mongo_set_error( conn, MONGO_SOCKET_ERROR, "connect() failed",
-                               WSAGetLastError() );
-            mongo_env_close_socket( conn->sock );
-            conn->sock = 0;
-            continue;
+        mongo_env_connect_state_free( cs );
+        conn->connecting = NULL;
+        conn->sock = 0;
+        if ( sock == INVALID_SOCKET ) {
+            conn->err = MONGO_CONN_FAIL;
+            return MONGO_ERROR;
         }
+        conn->sock = sock;
+    }
+    else if ( getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, ( char * )&error, &len ) != 0 || error != 0 ) {
+        __mongo_set_error( conn, MONGO_SOCKET_ERROR, "connect() failed", error );
+        mongo_env_close_socket( conn->sock );
+        conn->sock = 0;
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
 
-        if ( ai_ptr->ai_protocol == IPPROTO_TCP ) {
-            int flag = 1;
+    ioctlsocket( conn->sock, FIONBIO, &nonblocking );
+    setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY,
+                ( const char * ) &flag, sizeof( flag ) );
+    if ( conn->op_timeout_ms > 0 )
+        mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
 
-            setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY,
-                        ( const char * ) &flag, sizeof( flag ) );
+    conn->connected = 1;
+    conn->read_buf_start = conn->read_buf_end = 0;
 
-            if ( conn->op_timeout_ms > 0 )
-                mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
-        }
+    return MONGO_OK;
+}
 
-        conn->connected = 1;
-        break;
+void mongo_env_socket_connect_cancel( mongo *conn ) {
+    if ( conn->connecting ) {
+        mongo_env_connect_state_free( ( mongo_env_connect_state * )conn->connecting );
+        conn->connecting = NULL;
     }
+    else if ( conn->sock && ! conn->connected )
+        mongo_env_close_socket( conn->sock );
 
-    freeaddrinfo( ai_list );
+    if ( ! conn->connected )
+        conn->sock = 0;
+}
 
-    if ( ! conn->connected ) {
-        conn->err = MONGO_CONN_FAIL;
+int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
+    mongo_env_connect_state *cs;
+    SOCKET sock;
+
+    if ( mongo_env_socket_connect_start( conn, host, port ) != MONGO_OK )
         return MONGO_ERROR;
+
+    cs = ( mongo_env_connect_state * )conn->connecting;
+    if ( cs ) {
+        sock = mongo_env_connect_run( conn, cs, -1 );
+        mongo_env_connect_state_free( cs );
+        conn->connecting = NULL;
+        conn->sock = 0;
+        if ( sock == INVALID_SOCKET ) {
+            conn->err = MONGO_CONN_FAIL;
+            return MONGO_ERROR;
+        }
+        conn->sock = sock;
     }
-    else {
-        mongo_clear_errors( conn );
-        return MONGO_OK;
+
+    if ( mongo_env_socket_connect_finish( conn ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    mongo_clear_errors( conn );
+    return MONGO_OK;
+}
+
+/* A failed connect shows up in the exception set rather than the
+ * write set. A connection still connecting is polled on every attempt
+ * it has running, and is also ready when its next attempt is due or
+ * its oldest times out. */
+int mongo_env_poll_sockets( mongo **conns, int *ready, int count, int millis ) {
+    mongo_env_connect_state *cs;
+    fd_set readfds, writefds, exceptfds;
+    struct timeval tv;
+    int64_t now;
+    int i, j, res, wait;
+
+    FD_ZERO( &readfds );
+    FD_ZERO( &writefds );
+    FD_ZERO( &exceptfds );
+    now = mongo_env_time_ms( );
+    for ( i = 0; i < count; i++ ) {
+        cs = ( mongo_env_connect_state * )conns[i]->connecting;
+        if ( cs ) {
+            for ( j = 0; j < cs->live; j++ ) {
+                FD_SET( cs->socks[j], &writefds );
+                FD_SET( cs->socks[j], &exceptfds );
+            }
+            wait = mongo_env_connect_wait( conns[i], cs, now );
+            if ( wait >= 0 && wait < millis )
+                millis = wait;
+        }
+        else if ( conns[i]->connected )
+            FD_SET( conns[i]->sock, &readfds );
+        else {
+            FD_SET( conns[i]->sock, &writefds );
+            FD_SET( conns[i]->sock, &exceptfds );
+        }
+    }
+
+    tv.tv_sec = millis / 1000;
+    tv.tv_usec = ( millis % 1000 ) * 1000;
+
+    res = select( 0, &readfds, &writefds, &exceptfds, &tv );
+    if ( res == SOCKET_ERROR )
+        return -1;
+
+    now = mongo_env_time_ms( );
+    for ( i = res = 0; i < count; i++ ) {
+        cs = ( mongo_env_connect_state * )conns[i]->connecting;
+        if ( cs ) {
+            ready[i] = mongo_env_connect_wait( conns[i], cs, now ) == 0;
+            for ( j = 0; j < cs->live; j++ )
+                if ( FD_ISSET( cs->socks[j], &writefds ) || FD_ISSET( cs->socks[j], &exceptfds ) )
+                    ready[i] = 1;
+        }
+        else
+            ready[i] = FD_ISSET( conns[i]->sock, &readfds ) ||
+                       FD_ISSET( conns[i]->sock, &writefds ) ||
+                       FD_ISSET( conns[i]->sock, &exceptfds );
+        res += ready[i];
     }
+
+    return res;
 }
 
 MONGO_EXPORT int mongo_env_sock_init( void ) {
@@ -178,6 +517,128 @@ MONGO_EXPORT int mongo_env_sock_init( void ) {
     return retval;
 }
 
+int mongo_env_atomic_cas( volatile int *ptr, int oldval, int newval ) {
+    return InterlockedCompareExchange( ( volatile LONG * )ptr, newval, oldval ) == oldval;
+}
+
+int mongo_env_atomic_add( volatile int *ptr, int delta ) {
+    return InterlockedExchangeAdd( ( volatile LONG * )ptr, delta ) + delta;
+}
+
+void *mongo_env_atomic_cas_ptr( void *volatile *ptr, void *oldval, void *newval ) {
+    return InterlockedCompareExchangePointer( ptr, newval, oldval );
+}
+
+void *mongo_env_atomic_swap_ptr( void *volatile *ptr, void *newval ) {
+    return InterlockedExchangePointer( ptr, newval );
+}
+
+void mongo_env_yield( void ) {
+    Sleep( 0 );
+}
+
+void mongo_env_sleep_ms( int millis ) {
+    Sleep( millis );
+}
+
+int64_t mongo_env_time_ms( void ) {
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter( &count );
+    QueryPerformanceFrequency( &freq );
+    return ( int64_t )( count.QuadPart / ( freq.QuadPart / 1000 ) );
+}
+
+int64_t mongo_env_time_us( void ) {
+    LARGE_INTEGER count, freq;
+
+    QueryPerformanceCounter( &count );
+    QueryPerformanceFrequency( &freq );
+    return ( int64_t )( count.QuadPart / freq.QuadPart * 1000000 +
+                        count.QuadPart % freq.QuadPart * 1000000 / freq.QuadPart );
+}
+
+typedef struct {
+    HANDLE handle;
+    mongo_env_thread_func fn;
+    void *arg;
+} mongo_env_thread;
+
+static DWORD WINAPI mongo_env_thread_start( LPVOID arg ) {
+    mongo_env_thread *t = ( mongo_env_thread * )arg;
+    t->fn( t->arg );
+    return 0;
+}
+
+int mongo_env_thread_create( void **thread, mongo_env_thread_func fn, void *arg ) {
+    mongo_env_thread *t = ( mongo_env_thread * )bson_malloc( sizeof( mongo_env_thread ) );
+
+    t->fn = fn;
+    t->arg = arg;
+    t->handle = CreateThread( NULL, 0, mongo_env_thread_start, t, 0, NULL );
+    if( t->handle == NULL ) {
+        bson_free( t );
+        return MONGO_ERROR;
+    }
+
+    *thread = t;
+    return MONGO_OK;
+}
+
+void mongo_env_thread_join( void *thread ) {
+    mongo_env_thread *t = ( mongo_env_thread * )thread;
+
+    WaitForSingleObject( t->handle, INFINITE );
+    CloseHandle( t->handle );
+    bson_free( t );
+}
+
+int mongo_env_mutex_create( void **mutex ) {
+    CRITICAL_SECTION *m = ( CRITICAL_SECTION * )bson_malloc( sizeof( CRITICAL_SECTION ) );
+
+    InitializeCriticalSection( m );
+    *mutex = m;
+    return MONGO_OK;
+}
+
+void mongo_env_mutex_lock( void *mutex ) {
+    EnterCriticalSection( ( CRITICAL_SECTION * )mutex );
+}
+
+void mongo_env_mutex_unlock( void *mutex ) {
+    LeaveCriticalSection( ( CRITICAL_SECTION * )mutex );
+}
+
+void mongo_env_mutex_destroy( void *mutex ) {
+    DeleteCriticalSection( ( CRITICAL_SECTION * )mutex );
+    bson_free( mutex );
+}
+
+int mongo_env_cond_create( void **cond ) {
+    CONDITION_VARIABLE *c = ( CONDITION_VARIABLE * )bson_malloc( sizeof( CONDITION_VARIABLE ) );
+
+    InitializeConditionVariable( c );
+    *cond = c;
+    return MONGO_OK;
+}
+
+void mongo_env_cond_wait( void *cond, void *mutex ) {
+    SleepConditionVariableCS( ( CONDITION_VARIABLE * )cond, ( CRITICAL_SECTION * )mutex, INFINITE );
+}
+
+void mongo_env_cond_timedwait( void *cond, void *mutex, int millis ) {
+    SleepConditionVariableCS( ( CONDITION_VARIABLE * )cond, ( CRITICAL_SECTION * )mutex,
+                              millis > 0 ? ( DWORD )millis : 0 );
+}
+
+void mongo_env_cond_broadcast( void *cond ) {
+    WakeAllConditionVariable( ( CONDITION_VARIABLE * )cond );
+}
+
+void mongo_env_cond_destroy( void *cond ) {
+    bson_free( cond );
+}
+
 
 #elif !defined(MONGO_ENV_STANDARD) && (defined(__APPLE__) || defined(__linux) || defined(__unix) || defined(__posix))
 
@@ -206,21 +667,33 @@ MONGO_EXPORT int mongo_env_sock_init( void ) {
 #include <arpa/inet.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
 #include <unistd.h>
 
 #ifndef NI_MAXSERV
 # define NI_MAXSERV 32
 #endif
 
+/* Buffers handed to a single sendmsg(); well under any IOV_MAX. */
+#define MONGO_ENV_IOV_MAX 64
+
 int mongo_env_close_socket( SOCKET socket ) {
     return close( socket );
 }
 
+int mongo_env_shutdown_socket( SOCKET socket ) {
+    return shutdown( socket, SHUT_RDWR );
+}
+
 int mongo_env_sock_init( void ) {
     return 0;
 }
@@ -248,6 +721,51 @@ int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_writev_socket( mongo *conn, mongo_iovec *iov, int iovcnt ) {
+    struct iovec vec[MONGO_ENV_IOV_MAX];
+    struct msghdr msg;
+    ssize_t sent;
+    int i, n;
+#ifdef __APPLE__
+    int flags = 0;
+#else
+    int flags = MSG_NOSIGNAL;
+#endif
+
+    while ( iovcnt ) {
+        n = iovcnt < MONGO_ENV_IOV_MAX ? iovcnt : MONGO_ENV_IOV_MAX;
+        for ( i = 0; i < n; i++ ) {
+            vec[i].iov_base = ( void * )iov[i].base;
+            vec[i].iov_len = iov[i].len;
+        }
+
+        memset( &msg, 0, sizeof( msg ) );
+        msg.msg_iov = vec;
+        msg.msg_iovlen = n;
+
+        sent = sendmsg( conn->sock, &msg, flags );
+        if ( sent == -1 ) {
+            if (errno == EPIPE)
+                conn->connected = 0;
+            __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+            return MONGO_ERROR;
+        }
+
+        /* Skip what was written; a short write leaves us mid-buffer. */
+        while ( iovcnt && ( size_t )sent >= iov->len ) {
+            sent -= iov->len;
+            iov++;
+            iovcnt--;
+        }
+        if ( sent ) {
+            iov->base = ( const char * )iov->base + sent;
+            iov->len -= sent;
+        }
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     char *cbuf = buf;
     while ( len ) {
@@ -263,7 +781,18 @@ int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     return MONGO_OK;
 }
 
-int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
+int mongo_env_recv_socket( mongo *conn, void *buf, size_t len, size_t *received ) {
+    ssize_t got = recv( conn->sock, buf, len, 0 );
+    if ( got == 0 || got == -1 ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, strerror( errno ), errno );
+        return MONGO_ERROR;
+    }
+    *received = got;
+
+    return MONGO_OK;
+}
+
+int mongo_env_set_socket_recv_timeout( mongo *conn, int millis ) {
     struct timeval tv;
     tv.tv_sec = millis / 1000;
     tv.tv_usec = ( millis % 1000 ) * 1000;
@@ -274,6 +803,17 @@ int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
         return MONGO_ERROR;
     }
 
+    return MONGO_OK;
+}
+
+int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
+    struct timeval tv;
+    tv.tv_sec = millis / 1000;
+    tv.tv_usec = ( millis % 1000 ) * 1000;
+
+    if ( mongo_env_set_socket_recv_timeout( conn, millis ) != MONGO_OK )
+        return MONGO_ERROR;
+
     if ( setsockopt( conn->sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof( tv ) ) == -1 ) {
         __mongo_set_error( conn, MONGO_IO_ERROR, "setsockopt SO_SNDTIMEO failed.", errno );
         return MONGO_ERROR;
@@ -307,17 +847,191 @@ static int mongo_env_unix_socket_connect( mongo *conn, const char *sock_path ) {
     }
 
     conn->connected = 1;
+    conn->read_buf_start = conn->read_buf_end = 0;
 
     return MONGO_OK;
 }
 
-int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
+/* Put the addresses in the order they are tried: alternating between
+ * address families, starting with the resolver's first choice. */
+static struct addrinfo **mongo_env_order_addresses( struct addrinfo *ai_list, int *count ) {
+    struct addrinfo *ai_ptr;
+    struct addrinfo **addrs, **sorted;
+    int n = 0, first = 0, other, i, j, k;
+
+    for ( ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next )
+        n++;
+
+    /* The first family from the front of sorted, the rest from the back. */
+    sorted = ( struct addrinfo ** )bson_malloc( n * sizeof( struct addrinfo * ) );
+    other = n;
+    for ( ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
+        if ( ai_ptr->ai_family == ai_list->ai_family )
+            sorted[first++] = ai_ptr;
+        else
+            sorted[--other] = ai_ptr;
+    }
+
+    addrs = ( struct addrinfo ** )bson_malloc( n * sizeof( struct addrinfo * ) );
+    for ( i = 0, j = n - 1, k = 0; k < n; ) {
+        if ( i < first )
+            addrs[k++] = sorted[i++];
+        if ( j >= first )
+            addrs[k++] = sorted[j--];
+    }
+
+    bson_free( sorted );
+    *count = n;
+    return addrs;
+}
+
+/* A connect in progress, kept on conn->connecting: every address the
+ * host resolved to, and the attempts running now, oldest first.
+ *
+ * Connects race every address. Each attempt gets a head start of
+ * MONGO_ENV_CONNECT_STAGGER_MS before the next begins, or none if it
+ * fails outright, and is abandoned after conn->conn_timeout_ms. The
+ * first to connect wins. */
+typedef struct {
+    struct addrinfo *ai_list;
+    struct addrinfo **addrs;
+    int count;              /* Addresses in addrs. */
+    int next;               /* The next address to try. */
+    int live;               /* Attempts in fds. */
+    struct pollfd *fds;
+    int64_t *started;
+    int64_t last_start;
+} mongo_env_connect_state;
+
+static void mongo_env_connect_state_free( mongo_env_connect_state *cs ) {
+    int i;
+
+    for ( i = 0; i < cs->live; i++ )
+        mongo_env_close_socket( cs->fds[i].fd );
+
+    bson_free( cs->started );
+    bson_free( cs->fds );
+    bson_free( cs->addrs );
+    freeaddrinfo( cs->ai_list );
+    bson_free( cs );
+}
+
+/* Milliseconds until the next attempt is due or the oldest gives up,
+ * or -1 if neither will happen. */
+static int mongo_env_connect_wait( mongo *conn, mongo_env_connect_state *cs, int64_t now ) {
+    int wait = -1, i;
+
+    if ( cs->next < cs->count ) {
+        wait = ( int )( cs->last_start + MONGO_ENV_CONNECT_STAGGER_MS - now );
+        if ( wait < 0 )
+            wait = 0;
+    }
+    if ( cs->live > 0 && conn->conn_timeout_ms > 0 ) {
+        i = ( int )( cs->started[0] + conn->conn_timeout_ms - now );
+        if ( i < 0 )
+            i = 0;
+        if ( wait < 0 || i < wait )
+            wait = i;
+    }
+
+    return wait;
+}
+
+static void mongo_env_connect_drop( mongo_env_connect_state *cs, int i ) {
+    /* Keep the attempts in the order they started. */
+    memmove( cs->fds + i, cs->fds + i + 1, ( cs->live - i - 1 ) * sizeof( struct pollfd ) );
+    memmove( cs->started + i, cs->started + i + 1, ( cs->live - i - 1 ) * sizeof( int64_t ) );
+    cs->live--;
+}
+
+/* Run the attempts for up to millis, or until one connects or all
+ * have failed if millis is negative. Returns the winning socket, or
+ * INVALID_SOCKET; if cs->live is then 0, every address failed. */
+static SOCKET mongo_env_connect_run( mongo *conn, mongo_env_connect_state *cs, int millis ) {
+    int64_t now, deadline;
+    int status, wait, error, i;
+    socklen_t len;
+    SOCKET sock;
+
+    deadline = mongo_env_time_ms( ) + millis;
+
+    for ( ;; ) {
+        now = mongo_env_time_ms( );
+
+        if ( cs->next < cs->count &&
+                ( cs->live == 0 || now - cs->last_start >= MONGO_ENV_CONNECT_STAGGER_MS ) ) {
+            struct addrinfo *ai_ptr = cs->addrs[cs->next++];
+
+            sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
+            if ( sock == INVALID_SOCKET )
+                continue;
+
+            fcntl( sock, F_SETFL, fcntl( sock, F_GETFL, 0 ) | O_NONBLOCK );
+            status = connect( sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen );
+            if ( status == 0 )
+                return sock;
+            if ( errno != EINPROGRESS ) {
+                mongo_env_close_socket( sock );
+                continue;
+            }
+
+            cs->fds[cs->live].fd = sock;
+            cs->fds[cs->live].events = POLLOUT;
+            cs->started[cs->live++] = cs->last_start = now;
+            continue;
+        }
+
+        if ( cs->live == 0 )
+            return INVALID_SOCKET;
+
+        wait = mongo_env_connect_wait( conn, cs, now );
+        if ( millis >= 0 && ( wait < 0 || deadline - now < wait ) )
+            wait = deadline > now ? ( int )( deadline - now ) : 0;
+
+        for ( i = 0; i < cs->live; i++ )
+            cs->fds[i].revents = 0;
+        if ( poll( cs->fds, cs->live, wait ) < 0 && errno != EINTR ) {
+            /* Nothing can be waited on; give every attempt up. */
+            for ( i = 0; i < cs->live; i++ )
+                mongo_env_close_socket( cs->fds[i].fd );
+            cs->live = 0;
+            cs->next = cs->count;
+            return INVALID_SOCKET;
+        }
+
+        now = mongo_env_time_ms( );
+        for ( i = 0; i < cs->live; ) {
+            error = 0;
+            len = sizeof( error );
+            if ( cs->fds[i].revents &&
+                    getsockopt( cs->fds[i].fd, SOL_SOCKET, SO_ERROR, &error, &len ) == 0 && error == 0 ) {
+                sock = cs->fds[i].fd;
+                mongo_env_connect_drop( cs, i );
+                return sock;
+            }
+
+            if ( cs->fds[i].revents ||
+                    ( conn->conn_timeout_ms > 0 && now - cs->started[i] >= conn->conn_timeout_ms ) ) {
+                mongo_env_close_socket( cs->fds[i].fd );
+                mongo_env_connect_drop( cs, i );
+            }
+            else
+                i++;
+        }
+
+        if ( millis >= 0 && now >= deadline && cs->live > 0 )
+            return INVALID_SOCKET;
+    }
+}
+
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port ) {
     char port_str[NI_MAXSERV];
     int status;
 
     struct addrinfo ai_hints;
     struct addrinfo *ai_list = NULL;
-    struct addrinfo *ai_ptr = NULL;
+    mongo_env_connect_state *cs;
+    SOCKET sock;
 
     if ( port < 0 ) {
         return mongo_env_unix_socket_connect( conn, host );
@@ -325,7 +1039,6 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
 
     conn->sock = 0;
     conn->connected = 0;
-    sprintf(port_str,"%d",port);
 
     bson_sprintf( port_str, "%d", port );
 
@@ -343,49 +1056,331 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
         return MONGO_ERROR;
     }
 
-    for ( ai_ptr = ai_list; ai_ptr != NULL; ai_ptr = ai_ptr->ai_next ) {
-        conn->sock = socket( ai_ptr->ai_family, ai_ptr->ai_socktype, ai_ptr->ai_protocol );
-        if ( conn->sock == INVALID_SOCKET ) {
-            continue;
+    cs = ( mongo_env_connect_state * )bson_malloc( sizeof( mongo_env_connect_state ) );
+    memset( cs, 0, sizeof( mongo_env_connect_state ) );
+    cs->ai_list = ai_list;
+    cs->addrs = mongo_env_order_addresses( ai_list, &cs->count );
+    cs->fds = ( struct pollfd * )bson_malloc( cs->count * sizeof( struct pollfd ) );
+    cs->started = ( int64_t * )bson_malloc( cs->count * sizeof( int64_t ) );
+
+    sock = mongo_env_connect_run( conn, cs, 0 );
+    if ( sock == INVALID_SOCKET && cs->live == 0 ) {
+        mongo_env_connect_state_free( cs );
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+
+    if ( sock != INVALID_SOCKET ) {
+        mongo_env_connect_state_free( cs );
+        conn->sock = sock;
+    }
+    else {
+        conn->connecting = cs;
+        conn->sock = cs->fds[0].fd;
+    }
+
+    return MONGO_OK;
+}
+
+int mongo_env_socket_connect_finish( mongo *conn ) {
+    mongo_env_connect_state *cs = ( mongo_env_connect_state * )conn->connecting;
+    int error = 0, flag = 1;
+    socklen_t len = sizeof( error );
+    SOCKET sock;
+
+    if ( cs ) {
+        sock = mongo_env_connect_run( conn, cs, 0 );
+        if ( sock == INVALID_SOCKET && cs->live > 0 ) {
+            /* Still connecting, perhaps to the next address. */
+            conn->sock = cs->fds[0].fd;
+            return MONGO_OK;
         }
-        
-        status = connect( conn->sock, ai_ptr->ai_addr, ai_ptr->ai_addrlen );
-        if ( status != 0 ) {
-            mongo_env_close_socket( conn->sock );
-            conn->sock = 0;
-            continue;
+
+        mongo_env_connect_state_free( cs );
+        conn->connecting = NULL;
+        conn->sock = 0;
+        if ( sock == INVALID_SOCKET ) {
+            conn->err = MONGO_CONN_FAIL;
+            return MONGO_ERROR;
         }
+        conn->sock = sock;
+    }
+    else if ( getsockopt( conn->sock, SOL_SOCKET, SO_ERROR, &error, &len ) != 0 || error != 0 ) {
+        mongo_env_close_socket( conn->sock );
+        conn->sock = 0;
+        conn->err = MONGO_CONN_FAIL;
+        return MONGO_ERROR;
+    }
+
+    fcntl( conn->sock, F_SETFL, fcntl( conn->sock, F_GETFL, 0 ) & ~O_NONBLOCK );
 #if __APPLE__
-        {
-            int flag = 1;
-            setsockopt( conn->sock, SOL_SOCKET, SO_NOSIGPIPE,
-                       ( void * ) &flag, sizeof( flag ) );
-        }
+    setsockopt( conn->sock, SOL_SOCKET, SO_NOSIGPIPE, ( void * ) &flag, sizeof( flag ) );
 #endif
+    setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY, ( void * ) &flag, sizeof( flag ) );
+    if ( conn->op_timeout_ms > 0 )
+        mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
 
-        if ( ai_ptr->ai_protocol == IPPROTO_TCP ) {
-            int flag = 1;
+    conn->connected = 1;
+    conn->read_buf_start = conn->read_buf_end = 0;
+
+    return MONGO_OK;
+}
+
+void mongo_env_socket_connect_cancel( mongo *conn ) {
+    if ( conn->connecting ) {
+        mongo_env_connect_state_free( ( mongo_env_connect_state * )conn->connecting );
+        conn->connecting = NULL;
+    }
+    else if ( conn->sock && ! conn->connected )
+        mongo_env_close_socket( conn->sock );
 
-            setsockopt( conn->sock, IPPROTO_TCP, TCP_NODELAY,
-                        ( void * ) &flag, sizeof( flag ) );
-            if ( conn->op_timeout_ms > 0 )
-                mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
+    if ( ! conn->connected )
+        conn->sock = 0;
+}
+
+int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
+    mongo_env_connect_state *cs;
+    SOCKET sock;
+
+    if ( mongo_env_socket_connect_start( conn, host, port ) != MONGO_OK )
+        return MONGO_ERROR;
+    if ( conn->connected )
+        return MONGO_OK;
+
+    cs = ( mongo_env_connect_state * )conn->connecting;
+    if ( cs ) {
+        sock = mongo_env_connect_run( conn, cs, -1 );
+        mongo_env_connect_state_free( cs );
+        conn->connecting = NULL;
+        conn->sock = 0;
+        if ( sock == INVALID_SOCKET ) {
+            conn->err = MONGO_CONN_FAIL;
+            return MONGO_ERROR;
         }
+        conn->sock = sock;
+    }
 
-        conn->connected = 1;
-        break;
+    return mongo_env_socket_connect_finish( conn );
+}
+
+/* A connection still connecting is polled on every attempt it has
+ * running, and is also ready when its next attempt is due or its
+ * oldest times out, so that mongo_env_socket_connect_finish( ) can
+ * move it along. */
+int mongo_env_poll_sockets( mongo **conns, int *ready, int count, int millis ) {
+    mongo_env_connect_state *cs;
+    struct pollfd *fds;
+    int64_t now;
+    int i, j, n, res, wait;
+
+    now = mongo_env_time_ms( );
+    for ( i = n = 0; i < count; i++ ) {
+        cs = ( mongo_env_connect_state * )conns[i]->connecting;
+        n += cs ? cs->live : 1;
+        if ( cs ) {
+            wait = mongo_env_connect_wait( conns[i], cs, now );
+            if ( wait >= 0 && ( millis < 0 || wait < millis ) )
+                millis = wait;
+        }
     }
 
-    freeaddrinfo( ai_list );
+    fds = ( struct pollfd * )bson_malloc( ( n ? n : 1 ) * sizeof( struct pollfd ) );
+    for ( i = n = 0; i < count; i++ ) {
+        cs = ( mongo_env_connect_state * )conns[i]->connecting;
+        if ( cs ) {
+            for ( j = 0; j < cs->live; j++ ) {
+                fds[n].fd = cs->fds[j].fd;
+                fds[n].events = POLLOUT;
+                fds[n++].revents = 0;
+            }
+            continue;
+        }
+        fds[n].fd = conns[i]->sock;
+        fds[n].events = conns[i]->connected ? POLLIN : POLLOUT;
+        fds[n++].revents = 0;
+    }
 
-    if ( ! conn->connected ) {
-        conn->err = MONGO_CONN_FAIL;
+    res = poll( fds, n, millis );
+    if ( res < 0 && errno != EINTR ) {
+        bson_free( fds );
+        return -1;
+    }
+
+    now = mongo_env_time_ms( );
+    for ( i = n = res = 0; i < count; i++ ) {
+        cs = ( mongo_env_connect_state * )conns[i]->connecting;
+        ready[i] = 0;
+        for ( j = 0; j < ( cs ? cs->live : 1 ); j++ )
+            if ( fds[n++].revents != 0 )
+                ready[i] = 1;
+        if ( cs && mongo_env_connect_wait( conns[i], cs, now ) == 0 )
+            ready[i] = 1;
+        res += ready[i];
+    }
+
+    bson_free( fds );
+    return res;
+}
+
+int mongo_env_atomic_cas( volatile int *ptr, int oldval, int newval ) {
+    return __sync_bool_compare_and_swap( ptr, oldval, newval );
+}
+
+int mongo_env_atomic_add( volatile int *ptr, int delta ) {
+    return __sync_add_and_fetch( ptr, delta );
+}
+
+void *mongo_env_atomic_cas_ptr( void *volatile *ptr, void *oldval, void *newval ) {
+    return __sync_val_compare_and_swap( ptr, oldval, newval );
+}
+
+/* __sync_lock_test_and_set( ) is only an acquire barrier, which is
+ * all a consumer taking ownership of *ptr needs. */
+void *mongo_env_atomic_swap_ptr( void *volatile *ptr, void *newval ) {
+    return __sync_lock_test_and_set( ptr, newval );
+}
+
+void mongo_env_yield( void ) {
+    sched_yield( );
+}
+
+void mongo_env_sleep_ms( int millis ) {
+    struct timespec ts;
+
+    ts.tv_sec = millis / 1000;
+    ts.tv_nsec = ( long )( millis % 1000 ) * 1000000;
+    while( nanosleep( &ts, &ts ) == -1 && errno == EINTR )
+        ;
+}
+
+int64_t mongo_env_time_ms( void ) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0 )
+        return ( int64_t )ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday( &tv, NULL );
+        return ( int64_t )tv.tv_sec * 1000 + tv.tv_usec / 1000;
+    }
+}
+
+int64_t mongo_env_time_us( void ) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+
+    if( clock_gettime( CLOCK_MONOTONIC, &ts ) == 0 )
+        return ( int64_t )ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#endif
+    {
+        struct timeval tv;
+        gettimeofday( &tv, NULL );
+        return ( int64_t )tv.tv_sec * 1000000 + tv.tv_usec;
+    }
+}
+
+typedef struct {
+    pthread_t handle;
+    mongo_env_thread_func fn;
+    void *arg;
+} mongo_env_thread;
+
+static void *mongo_env_thread_start( void *arg ) {
+    mongo_env_thread *t = ( mongo_env_thread * )arg;
+    t->fn( t->arg );
+    return NULL;
+}
+
+int mongo_env_thread_create( void **thread, mongo_env_thread_func fn, void *arg ) {
+    mongo_env_thread *t = ( mongo_env_thread * )bson_malloc( sizeof( mongo_env_thread ) );
+
+    t->fn = fn;
+    t->arg = arg;
+    if( pthread_create( &t->handle, NULL, mongo_env_thread_start, t ) != 0 ) {
+        bson_free( t );
+        return MONGO_ERROR;
+    }
+
+    *thread = t;
+    return MONGO_OK;
+}
+
+void mongo_env_thread_join( void *thread ) {
+    mongo_env_thread *t = ( mongo_env_thread * )thread;
+
+    pthread_join( t->handle, NULL );
+    bson_free( t );
+}
+
+int mongo_env_mutex_create( void **mutex ) {
+    pthread_mutex_t *m = ( pthread_mutex_t * )bson_malloc( sizeof( pthread_mutex_t ) );
+
+    if( pthread_mutex_init( m, NULL ) != 0 ) {
+        bson_free( m );
+        return MONGO_ERROR;
+    }
+
+    *mutex = m;
+    return MONGO_OK;
+}
+
+void mongo_env_mutex_lock( void *mutex ) {
+    pthread_mutex_lock( ( pthread_mutex_t * )mutex );
+}
+
+void mongo_env_mutex_unlock( void *mutex ) {
+    pthread_mutex_unlock( ( pthread_mutex_t * )mutex );
+}
+
+void mongo_env_mutex_destroy( void *mutex ) {
+    pthread_mutex_destroy( ( pthread_mutex_t * )mutex );
+    bson_free( mutex );
+}
+
+int mongo_env_cond_create( void **cond ) {
+    pthread_cond_t *c = ( pthread_cond_t * )bson_malloc( sizeof( pthread_cond_t ) );
+
+    if( pthread_cond_init( c, NULL ) != 0 ) {
+        bson_free( c );
         return MONGO_ERROR;
     }
 
+    *cond = c;
     return MONGO_OK;
 }
 
+void mongo_env_cond_wait( void *cond, void *mutex ) {
+    pthread_cond_wait( ( pthread_cond_t * )cond, ( pthread_mutex_t * )mutex );
+}
+
+void mongo_env_cond_timedwait( void *cond, void *mutex, int millis ) {
+    struct timespec ts;
+    struct timeval tv;
+
+    /* pthread_cond_timedwait( ) takes an absolute wall clock time. */
+    if( millis < 0 )
+        millis = 0;
+    gettimeofday( &tv, NULL );
+    ts.tv_sec = tv.tv_sec + millis / 1000;
+    ts.tv_nsec = ( long )tv.tv_usec * 1000 + ( long )( millis % 1000 ) * 1000000;
+    if( ts.tv_nsec >= 1000000000 ) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait( ( pthread_cond_t * )cond, ( pthread_mutex_t * )mutex, &ts );
+}
+
+void mongo_env_cond_broadcast( void *cond ) {
+    pthread_cond_broadcast( ( pthread_cond_t * )cond );
+}
+
+void mongo_env_cond_destroy( void *cond ) {
+    pthread_cond_destroy( ( pthread_cond_t * )cond );
+    bson_free( cond );
+}
+
 #else
 /* env_standard.c */
 
@@ -408,6 +1403,7 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
 #include "env.h"
 #include <errno.h>
 #include <string.h>
+#include <time.h>
 
 #ifdef _WIN32
 #ifdef _MSC_VER
@@ -441,6 +1437,14 @@ int mongo_env_close_socket( SOCKET socket ) {
 #endif
 }
 
+int mongo_env_shutdown_socket( SOCKET socket ) {
+#ifdef _WIN32
+    return shutdown( socket, SD_BOTH );
+#else
+    return shutdown( socket, SHUT_RDWR );
+#endif
+}
+
 int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     const char *cbuf = buf;
 #ifdef _WIN32
@@ -468,6 +1472,18 @@ int mongo_env_write_socket( mongo *conn, const void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+/* No scatter/gather here; write each buffer in turn. */
+int mongo_env_writev_socket( mongo *conn, mongo_iovec *iov, int iovcnt ) {
+    int i;
+
+    for ( i = 0; i < iovcnt; i++ ) {
+        if ( mongo_env_write_socket( conn, iov[i].base, iov[i].len ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     char *cbuf = buf;
     while ( len ) {
@@ -483,11 +1499,27 @@ int mongo_env_read_socket( mongo *conn, void *buf, size_t len ) {
     return MONGO_OK;
 }
 
+int mongo_env_recv_socket( mongo *conn, void *buf, size_t len, size_t *received ) {
+    int got = recv( conn->sock, buf, len, 0 );
+    if ( got == 0 || got == -1 ) {
+        conn->err = MONGO_IO_ERROR;
+        return MONGO_ERROR;
+    }
+    *received = got;
+
+    return MONGO_OK;
+}
+
 /* This is a no-op in the generic implementation. */
 int mongo_env_set_socket_op_timeout( mongo *conn, int millis ) {
     return MONGO_OK;
 }
 
+/* Likewise. */
+int mongo_env_set_socket_recv_timeout( mongo *conn, int millis ) {
+    return MONGO_OK;
+}
+
 int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
     struct sockaddr_in sa;
     socklen_t addressSize;
@@ -519,10 +1551,34 @@ int mongo_env_socket_connect( mongo *conn, const char *host, int port ) {
         mongo_env_set_socket_op_timeout( conn, conn->op_timeout_ms );
 
     conn->connected = 1;
+    conn->read_buf_start = conn->read_buf_end = 0;
 
     return MONGO_OK;
 }
 
+/* Connects are not left in progress in the generic implementation. */
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port ) {
+    return mongo_env_socket_connect( conn, host, port );
+}
+
+int mongo_env_socket_connect_finish( mongo *conn ) {
+    return MONGO_OK;
+}
+
+void mongo_env_socket_connect_cancel( mongo *conn ) {
+}
+
+/* Without a way to wait on several sockets, report them all ready
+ * and let the caller block on each in turn. */
+int mongo_env_poll_sockets( mongo **conns, int *ready, int count, int millis ) {
+    int i;
+
+    for ( i = 0; i < count; i++ )
+        ready[i] = 1;
+
+    return count;
+}
+
 MONGO_EXPORT int mongo_env_sock_init( void ) {
 
 #if defined(_WIN32)
@@ -556,4 +1612,93 @@ MONGO_EXPORT int mongo_env_sock_init( void ) {
     return retval;
 }
 
+
+/* Without a platform to ask, fall back to the compiler's builtins;
+ * other compilers get plain, unsynchronized operations. */
+int mongo_env_atomic_cas( volatile int *ptr, int oldval, int newval ) {
+#ifdef __GNUC__
+    return __sync_bool_compare_and_swap( ptr, oldval, newval );
+#else
+    if( *ptr != oldval )
+        return 0;
+    *ptr = newval;
+    return 1;
+#endif
+}
+
+int mongo_env_atomic_add( volatile int *ptr, int delta ) {
+#ifdef __GNUC__
+    return __sync_add_and_fetch( ptr, delta );
+#else
+    return *ptr += delta;
+#endif
+}
+
+void *mongo_env_atomic_cas_ptr( void *volatile *ptr, void *oldval, void *newval ) {
+    void *old = *ptr;
+
+    if( old == oldval )
+        *ptr = newval;
+    return old;
+}
+
+void *mongo_env_atomic_swap_ptr( void *volatile *ptr, void *newval ) {
+    void *old = *ptr;
+    *ptr = newval;
+    return old;
+}
+
+/* This is a no-op in the generic implementation. */
+void mongo_env_yield( void ) {
+}
+
+/* There are no threads to wait for in the generic implementation. */
+void mongo_env_sleep_ms( int millis ) {
+}
+
+int64_t mongo_env_time_ms( void ) {
+    return ( int64_t )time( NULL ) * 1000;
+}
+
+int64_t mongo_env_time_us( void ) {
+    return ( int64_t )time( NULL ) * 1000000;
+}
+
+/* There are no threads in the generic implementation. */
+int mongo_env_thread_create( void **thread, mongo_env_thread_func fn, void *arg ) {
+    return MONGO_ERROR;
+}
+
+void mongo_env_thread_join( void *thread ) {
+}
+
+int mongo_env_mutex_create( void **mutex ) {
+    return MONGO_ERROR;
+}
+
+void mongo_env_mutex_lock( void *mutex ) {
+}
+
+void mongo_env_mutex_unlock( void *mutex ) {
+}
+
+void mongo_env_mutex_destroy( void *mutex ) {
+}
+
+int mongo_env_cond_create( void **cond ) {
+    return MONGO_ERROR;
+}
+
+void mongo_env_cond_wait( void *cond, void *mutex ) {
+}
+
+void mongo_env_cond_timedwait( void *cond, void *mutex, int millis ) {
+}
+
+void mongo_env_cond_broadcast( void *cond ) {
+}
+
+void mongo_env_cond_destroy( void *cond ) {
+}
+
 #endif
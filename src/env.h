@@ -27,17 +27,122 @@ MONGO_EXTERN_C_START
   #define INVALID_SOCKET (-1) 
 #endif
 
+/* One buffer of a scatter/gather write. */
+typedef struct {
+    const void *base;
+    size_t len;
+} mongo_iovec;
+
 /* This is a no-op in the generic implementation. */
 int mongo_env_set_socket_op_timeout( mongo *conn, int millis );
+/* As mongo_env_set_socket_op_timeout( ), for reads only; 0 clears it. */
+int mongo_env_set_socket_recv_timeout( mongo *conn, int millis );
 int mongo_env_read_socket( mongo *conn, void *buf, size_t len );
+
+/* Read whatever is available, up to len bytes, with a single recv().
+ * Blocks only until at least one byte arrives. */
+int mongo_env_recv_socket( mongo *conn, void *buf, size_t len, size_t *received );
 int mongo_env_write_socket( mongo *conn, const void *buf, size_t len );
+
+/* Write iovcnt buffers in order without coalescing them first.
+ * The entries of iov are consumed (modified) as data is sent. */
+int mongo_env_writev_socket( mongo *conn, mongo_iovec *iov, int iovcnt );
+
+/* How long a connect attempt to one address runs before the next
+ * address is tried alongside it. */
+#define MONGO_ENV_CONNECT_STAGGER_MS 50
+
+/* Connect to host, trying its addresses as described in env.c and
+ * giving up on each after conn->conn_timeout_ms, if set. */
 int mongo_env_socket_connect( mongo *conn, const char *host, int port );
 
+/* Start connecting without waiting for the connection to be made,
+ * racing the host's addresses as mongo_env_socket_connect( ) does.
+ * conn->sock is set and conn->connected stays 0 until
+ * mongo_env_socket_connect_finish( ) succeeds. Where connects cannot
+ * be left in progress this connects before returning. */
+int mongo_env_socket_connect_start( mongo *conn, const char *host, int port );
+
+/* Move a connect from mongo_env_socket_connect_start( ) along once
+ * mongo_env_poll_sockets( ) reports it ready. Returns MONGO_OK with
+ * conn->connected still 0 while later addresses are being tried, and
+ * MONGO_ERROR once every address has failed. */
+int mongo_env_socket_connect_finish( mongo *conn );
+
+/* Abandon a connect from mongo_env_socket_connect_start( ) that has
+ * not finished, closing every attempt still running. */
+void mongo_env_socket_connect_cancel( mongo *conn );
+
+/* Wait up to millis for any of count connections to become ready:
+ * writable while still connecting, readable once connected. Sets
+ * ready[i] for each one that is. Returns the number ready, 0 on
+ * timeout, or -1 on error. */
+int mongo_env_poll_sockets( mongo **conns, int *ready, int count, int millis );
+
 /* Initialize socket services */
 MONGO_EXPORT int mongo_env_sock_init( void );
 
 /* Close a socket */
 MONGO_EXPORT int mongo_env_close_socket( SOCKET socket );
 
+/* Shut down both directions of a socket without closing it, waking
+ * any thread blocked reading from it. */
+int mongo_env_shutdown_socket( SOCKET socket );
+
+/* Atomically set *ptr to newval if it still holds oldval.
+ * Returns non-zero if the swap happened. */
+int mongo_env_atomic_cas( volatile int *ptr, int oldval, int newval );
+
+/* Atomically add delta to *ptr and return the new value. */
+int mongo_env_atomic_add( volatile int *ptr, int delta );
+
+/* Atomically set *ptr to newval if it still holds oldval. Unlike
+ * mongo_env_atomic_cas( ), returns what *ptr held, so the swap
+ * happened if that is oldval. */
+void *mongo_env_atomic_cas_ptr( void *volatile *ptr, void *oldval, void *newval );
+
+/* Atomically set *ptr to newval and return what it held. */
+void *mongo_env_atomic_swap_ptr( void *volatile *ptr, void *newval );
+
+/* Give up the rest of this thread's time slice. */
+void mongo_env_yield( void );
+
+/* Sleep for about millis milliseconds. */
+void mongo_env_sleep_ms( int millis );
+
+/* Milliseconds from an arbitrary, steadily increasing clock. */
+int64_t mongo_env_time_ms( void );
+
+/* As mongo_env_time_ms( ), in microseconds. */
+int64_t mongo_env_time_us( void );
+
+typedef void ( *mongo_env_thread_func )( void *arg );
+
+/* Run fn( arg ) on a new thread. Returns MONGO_ERROR if no thread could
+ * be started, including where threads are unavailable; the caller
+ * should then run fn itself. */
+int mongo_env_thread_create( void **thread, mongo_env_thread_func fn, void *arg );
+
+/* Wait for a thread from mongo_env_thread_create( ) to finish. */
+void mongo_env_thread_join( void *thread );
+
+/* Mutexes and condition variables. Creation fails where threads are
+ * unavailable. */
+int mongo_env_mutex_create( void **mutex );
+void mongo_env_mutex_lock( void *mutex );
+void mongo_env_mutex_unlock( void *mutex );
+void mongo_env_mutex_destroy( void *mutex );
+
+int mongo_env_cond_create( void **cond );
+
+/* Release mutex, wait for a broadcast, and take mutex again. Wakeups
+ * may be spurious. */
+void mongo_env_cond_wait( void *cond, void *mutex );
+
+/* As mongo_env_cond_wait( ), but give up after about millis milliseconds. */
+void mongo_env_cond_timedwait( void *cond, void *mutex, int millis );
+void mongo_env_cond_broadcast( void *cond );
+void mongo_env_cond_destroy( void *cond );
+
 MONGO_EXTERN_C_END
 #endif
@@ -695,20 +695,20 @@ MONGO_EXPORT void gridfile_get_metadata( const gridfile *gfile, bson *out, bson_
 /* ++++++++++++++++++++++++++++++++ */
 
 MONGO_EXPORT int gridfile_get_numchunks( const gridfile *gfile ) {
-    bson_iterator it[1];
+    static const char *keys[] = { "length", "chunkSize" };
+    bson_iterator it[2];
     gridfs_offset length;
     gridfs_offset chunkSize;
     double numchunks;
 
-    bson_find(it, gfile->meta, "length");
+    bson_find_many(gfile->meta, keys, 2, it);
 
-    if (bson_iterator_type(it) == BSON_INT)
-        length = (gridfs_offset)bson_iterator_int(it);
+    if (bson_iterator_type(&it[0]) == BSON_INT)
+        length = (gridfs_offset)bson_iterator_int(&it[0]);
     else
-        length = (gridfs_offset)bson_iterator_long(it);
+        length = (gridfs_offset)bson_iterator_long(&it[0]);
  
-    bson_find(it, gfile->meta, "chunkSize");
-    chunkSize = bson_iterator_int(it);
+    chunkSize = bson_iterator_int(&it[1]);
     numchunks = ((double)length / (double)chunkSize);
     return (numchunks - (int)numchunks > 0) ? (int)(numchunks + 1): (int)(numchunks);
 }
@@ -26,6 +26,7 @@
 #include "mongo.h"
 #include "md5.h"
 #include "env.h"
+#include "queue.h"
 
 #include <string.h>
 #include <assert.h>
@@ -54,6 +55,11 @@ MONGO_EXPORT int mongo_get_op_timeout(mongo* conn) {
 }
 
 
+MONGO_EXPORT int mongo_get_connect_timeout(mongo* conn) {
+    return conn->conn_timeout_ms;
+}
+
+
 static const char* _get_host_port(mongo_host_port* hp) {    
     char *_hp = (char*) bson_malloc(sizeof(hp->host)+12);
     bson_sprintf(_hp, "%s:%d", hp->host, hp->port);
@@ -151,6 +157,31 @@ MONGO_EXPORT void mongo_clear_errors( mongo *conn ) {
     conn->lasterrstr[0] = 0;
 }
 
+/* An error held on to while the connection is used for something else. */
+typedef struct {
+    mongo_error_t err;
+    int errcode;
+    char errstr[MONGO_ERR_LEN];
+    int lasterrcode;
+    char lasterrstr[MONGO_ERR_LEN];
+} mongo_saved_error;
+
+static void mongo_save_error( mongo *conn, mongo_saved_error *saved ) {
+    saved->err = conn->err;
+    saved->errcode = conn->errcode;
+    saved->lasterrcode = conn->lasterrcode;
+    memcpy( saved->errstr, conn->errstr, MONGO_ERR_LEN );
+    memcpy( saved->lasterrstr, conn->lasterrstr, MONGO_ERR_LEN );
+}
+
+static void mongo_restore_error( mongo *conn, mongo_saved_error *saved ) {
+    conn->err = saved->err;
+    conn->errcode = saved->errcode;
+    conn->lasterrcode = saved->lasterrcode;
+    memcpy( conn->errstr, saved->errstr, MONGO_ERR_LEN );
+    memcpy( conn->lasterrstr, saved->lasterrstr, MONGO_ERR_LEN );
+}
+
 /* Note: this function returns a char* which must be freed. */
 static char *mongo_ns_to_cmd_db( const char *ns ) {
     char *current = NULL;
@@ -271,19 +302,40 @@ MONGO_EXPORT int mongo_validate_ns( mongo *conn, const char *ns ) {
     return MONGO_OK;
 }
 
-static void mongo_set_last_error( mongo *conn, bson_iterator *it, bson *obj ) {
+static void mongo_copy_last_error( bson_iterator *it, bson *obj,
+                                   int *lasterrcode, char *lasterrstr ) {
     bson_iterator iter[1];
     int result_len = bson_iterator_string_len( it );
     const char *result_string = bson_iterator_string( it );
     int len = result_len < MONGO_ERR_LEN ? result_len : MONGO_ERR_LEN;
-    memcpy( conn->lasterrstr, result_string, len );
+    memcpy( lasterrstr, result_string, len );
+    lasterrstr[MONGO_ERR_LEN - 1] = '\0';
     iter[0] = *it;  // no side effects on the passed iter
     if( bson_find( iter, obj, "code" ) != BSON_NULL )
-        conn->lasterrcode = bson_iterator_int( iter );
+        *lasterrcode = bson_iterator_int( iter );
+}
+
+static void mongo_set_last_error( mongo *conn, bson_iterator *it, bson *obj ) {
+    mongo_copy_last_error( it, obj, &conn->lasterrcode, conn->lasterrstr );
 }
 
 static const int ZERO = 0;
 static const int ONE = 1;
+
+/* Request ids come from one process-wide counter so that connections
+ * shared between threads never hand out the same id twice. */
+static volatile int mongo_request_id;
+
+MONGO_EXPORT int mongo_next_request_id( void ) {
+    int id;
+
+    do {
+        id = mongo_env_atomic_add( &mongo_request_id, 1 ) & INT32_MAX;
+    } while( ! id );
+
+    return id;
+}
+
 static mongo_message *mongo_message_create( size_t len , int id , int responseTo , int op ) {
     mongo_message *mm;
 
@@ -292,7 +344,7 @@ static mongo_message *mongo_message_create( size_t len , int id , int responseTo
     }
     mm = ( mongo_message * )bson_malloc( len );
     if ( !id )
-        id = rand();
+        id = mongo_next_request_id( );
 
     /* native endian (converted on send) */
     mm->head.len = ( int )len;
@@ -303,47 +355,320 @@ static mongo_message *mongo_message_create( size_t len , int id , int responseTo
     return mm;
 }
 
+static int mongo_cursor_land_prefetch( mongo_cursor *cursor );
+static void mongo_cursor_batch_arrived( mongo_cursor *cursor, int64_t waited_since );
+static int mongo_replica_set_member_land( mongo_replica_set_member *member );
+
+MONGO_EXPORT int mongo_header_init( mongo_header *head, size_t len, int id, int responseTo, int op ) {
+    int ilen;
+
+    if( len >= INT32_MAX )
+        return MONGO_ERROR;
+    if ( !id )
+        id = mongo_next_request_id( );
+
+    ilen = ( int )len;
+    bson_little_endian32( &head->len, &ilen );
+    bson_little_endian32( &head->id, &id );
+    bson_little_endian32( &head->responseTo, &responseTo );
+    bson_little_endian32( &head->op, &op );
+    return MONGO_OK;
+}
+
+/* Scatter/gather message writer. Segments point into caller-owned
+ * memory (headers, namespaces, bson->data), which must stay valid
+ * until mongo_gather_flush( ). Nothing is copied. */
+#define MONGO_GATHER_MAX 64
+
+typedef struct {
+    mongo *conn;
+    int count;
+    int res;
+    mongo_iovec iov[1 + MONGO_GATHER_MAX]; /* iov[0] is kept for pending cursor kills. */
+} mongo_gather;
+
+/* Cursor kills wait in conn->kill_cursors as an OP_KILL_CURSORS
+ * message with room for kill_cursor_size ids. */
+#define MONGO_KILL_CURSORS_HEADER ( 16 /* header */ + 4 /* ZERO */ + 4 /* numCursors */ )
+
+/* Fill in the pending kill message's header and count; return its length. */
+static int mongo_kill_cursors_stamp( mongo *conn ) {
+    int len = MONGO_KILL_CURSORS_HEADER + 8 * conn->kill_cursor_count;
+
+    mongo_header_init( ( mongo_header * )conn->kill_cursors, len, 0, 0, MONGO_OP_KILL_CURSORS );
+    memset( conn->kill_cursors + 16, 0, 4 );
+    bson_little_endian32( conn->kill_cursors + 20, &conn->kill_cursor_count );
+    return len;
+}
+
+static void mongo_gather_init( mongo_gather *g, mongo *conn ) {
+    g->conn = conn;
+    g->count = 0;
+    g->res = MONGO_OK;
+}
+
+static int mongo_gather_flush( mongo_gather *g ) {
+    mongo *conn = g->conn;
+
+    /* A message can't go out while a read-ahead reply is unread. If
+     * that reply is lost, so is the message. */
+    if( conn->prefetching && mongo_cursor_land_prefetch( conn->prefetching ) != MONGO_OK )
+        g->res = MONGO_ERROR;
+    /* Likewise a ping's reply. */
+    if( conn->pinged && mongo_replica_set_member_land( conn->pinged ) != MONGO_OK )
+        g->res = MONGO_ERROR;
+
+    if( g->res == MONGO_OK && g->count ) {
+        /* Pending cursor kills ride in front of the message. */
+        if( conn->kill_cursor_count ) {
+            g->iov[0].base = conn->kill_cursors;
+            g->iov[0].len = mongo_kill_cursors_stamp( conn );
+            g->res = mongo_env_writev_socket( conn, g->iov, g->count + 1 );
+            conn->kill_cursor_count = 0;
+        }
+        else
+            g->res = mongo_env_writev_socket( conn, g->iov + 1, g->count );
+    }
+    g->count = 0;
+    return g->res;
+}
+
+/* Queue a segment, writing out what we have once the vector is full. */
+static void mongo_gather_add( mongo_gather *g, const void *data, size_t len ) {
+    if( g->count == MONGO_GATHER_MAX )
+        mongo_gather_flush( g );
+    g->iov[1 + g->count].base = data;
+    g->iov[1 + g->count].len = len;
+    g->count++;
+}
+
 /* Always calls bson_free(mm) */
 static int mongo_message_send( mongo *conn, mongo_message *mm ) {
     mongo_header head; /* little endian */
+    mongo_gather g[1];
     int res;
+
     bson_little_endian32( &head.len, &mm->head.len );
     bson_little_endian32( &head.id, &mm->head.id );
     bson_little_endian32( &head.responseTo, &mm->head.responseTo );
     bson_little_endian32( &head.op, &mm->head.op );
 
-    res = mongo_env_write_socket( conn, &head, sizeof( head ) );
-    if( res != MONGO_OK ) {
-        bson_free( mm );
-        return res;
+    mongo_gather_init( g, conn );
+    mongo_gather_add( g, &head, sizeof( head ) );
+    mongo_gather_add( g, &mm->data, mm->head.len - sizeof( head ) );
+    res = mongo_gather_flush( g );
+
+    bson_free( mm );
+    return res;
+}
+
+MONGO_EXPORT int mongo_kill_cursors_flush( mongo *conn ) {
+    int len;
+
+    if( ! conn->kill_cursor_count )
+        return MONGO_OK;
+
+    len = mongo_kill_cursors_stamp( conn );
+    conn->kill_cursor_count = 0;
+    if( ! conn->connected )
+        return MONGO_ERROR;
+    return mongo_env_write_socket( conn, conn->kill_cursors, len );
+}
+
+/* Send the queued kills if the oldest has waited long enough. */
+static int mongo_kill_cursors_check( mongo *conn ) {
+    if( ! conn->kill_cursor_count || conn->kill_cursors_delay_ms <= 0 ||
+            mongo_env_time_ms( ) - conn->kill_cursors_since < conn->kill_cursors_delay_ms )
+        return MONGO_OK;
+
+    return mongo_kill_cursors_flush( conn );
+}
+
+/* Queue a cursor kill, sending the batch once it is full or its oldest
+ * kill has waited long enough. */
+static int mongo_kill_cursor_later( mongo *conn, int64_t cursor_id ) {
+    if( conn->kill_cursor_count == conn->kill_cursor_size ) {
+        conn->kill_cursor_size = conn->kill_cursor_size ? conn->kill_cursor_size * 2 : 16;
+        conn->kill_cursors = ( char * )bson_realloc( conn->kill_cursors,
+                             MONGO_KILL_CURSORS_HEADER + 8 * conn->kill_cursor_size );
     }
+    bson_little_endian64( conn->kill_cursors + MONGO_KILL_CURSORS_HEADER +
+                          8 * conn->kill_cursor_count, &cursor_id );
 
-    res = mongo_env_write_socket( conn, &mm->data, mm->head.len - sizeof( head ) );
-    if( res != MONGO_OK ) {
-        bson_free( mm );
-        return res;
+    if( conn->kill_cursor_count++ == 0 )
+        conn->kill_cursors_since = conn->kill_cursors_delay_ms > 0 ? mongo_env_time_ms( ) : 0;
+
+    if( conn->kill_cursor_count >= conn->kill_cursors_max )
+        return mongo_kill_cursors_flush( conn );
+
+    return mongo_kill_cursors_check( conn );
+}
+
+/* Replies carry a hidden header with their capacity, and a link used
+ * while they sit in the connection's pool. */
+typedef union {
+    struct {
+        size_t size;
+        void *next;
+    } b;
+    int64_t align;
+    double align_double;
+} mongo_reply_block;
+
+#define MONGO_REPLY_OVERHEAD ( sizeof( mongo_reply ) - sizeof( char ) )
+#define MONGO_REPLY_POOL_MIN ( 4 * 1024 )
+#define MONGO_REPLY_POOL_DEPTH 2
+#define MONGO_READ_BUF_SIZE ( 16 * 1024 )
+
+/* Return the pool size class for a reply of size bytes, or -1 if the
+ * reply is too large to be pooled. */
+static int mongo_reply_class( size_t size ) {
+    size_t class_size = MONGO_REPLY_POOL_MIN;
+    int i;
+
+    for( i = 0; i < MONGO_REPLY_POOL_CLASSES; i++ ) {
+        if( size <= class_size )
+            return i;
+        class_size <<= 1;
+    }
+
+    return -1;
+}
+
+/* Return a reply to its size class, or free it if that class is full
+ * or conn is NULL. */
+MONGO_EXPORT void mongo_reply_release( mongo *conn, mongo_reply *reply ) {
+    mongo_reply_block *block;
+    mongo_reply *pooled;
+    int cls, depth = 0;
+
+    if( ! reply )
+        return;
+
+    block = ( mongo_reply_block * )reply - 1;
+    cls = mongo_reply_class( block->b.size );
+
+    if( conn && cls >= 0 && block->b.size == ( size_t )MONGO_REPLY_POOL_MIN << cls ) {
+        for( pooled = conn->reply_pool[cls]; pooled && depth < MONGO_REPLY_POOL_DEPTH; depth++ )
+            pooled = ( mongo_reply * )( ( mongo_reply_block * )pooled - 1 )->b.next;
+
+        if( depth < MONGO_REPLY_POOL_DEPTH ) {
+            block->b.next = conn->reply_pool[cls];
+            conn->reply_pool[cls] = reply;
+            return;
+        }
+    }
+
+    bson_free( block );
+}
+
+/* Get a reply with room for body_len bytes of documents. spare, if not
+ * NULL, is a reply the caller is done with; it is reused when it is
+ * large enough and returned to the pool otherwise. */
+static mongo_reply *mongo_reply_alloc( mongo *conn, size_t body_len, mongo_reply *spare ) {
+    mongo_reply_block *block;
+    size_t size = MONGO_REPLY_OVERHEAD + body_len;
+    int cls;
+
+    if( spare ) {
+        if( ( ( mongo_reply_block * )spare - 1 )->b.size >= size )
+            return spare;
+        mongo_reply_release( conn, spare );
+    }
+
+    cls = mongo_reply_class( size );
+    if( cls < 0 ) {
+        block = ( mongo_reply_block * )bson_malloc( sizeof( mongo_reply_block ) + size );
+        block->b.size = size;
+    }
+    else if( conn->reply_pool[cls] ) {
+        block = ( mongo_reply_block * )conn->reply_pool[cls] - 1;
+        conn->reply_pool[cls] = ( mongo_reply * )block->b.next;
+    }
+    else {
+        size = ( size_t )MONGO_REPLY_POOL_MIN << cls;
+        block = ( mongo_reply_block * )bson_malloc( sizeof( mongo_reply_block ) + size );
+        block->b.size = size;
+    }
+
+    return ( mongo_reply * )( block + 1 );
+}
+
+static void mongo_reply_pool_destroy( mongo *conn ) {
+    mongo_reply_block *block;
+    int i;
+
+    for( i = 0; i < MONGO_REPLY_POOL_CLASSES; i++ ) {
+        while( conn->reply_pool[i] ) {
+            block = ( mongo_reply_block * )conn->reply_pool[i] - 1;
+            conn->reply_pool[i] = ( mongo_reply * )block->b.next;
+            bson_free( block );
+        }
+    }
+}
+
+/* Make sure at least len unparsed bytes are buffered, receiving as much
+ * as the socket has ready each time we have to go to the network. */
+static int mongo_read_buffer_fill( mongo *conn, int len ) {
+    size_t received;
+    int have;
+
+    if( ! conn->read_buf ) {
+        conn->read_buf = ( char * )bson_malloc( MONGO_READ_BUF_SIZE );
+        conn->read_buf_size = MONGO_READ_BUF_SIZE;
+        conn->read_buf_start = conn->read_buf_end = 0;
+    }
+
+    while( ( have = conn->read_buf_end - conn->read_buf_start ) < len ) {
+        if( conn->read_buf_start + len > conn->read_buf_size ) {
+            memmove( conn->read_buf, conn->read_buf + conn->read_buf_start, have );
+            conn->read_buf_start = 0;
+            conn->read_buf_end = have;
+        }
+
+        if( mongo_env_recv_socket( conn, conn->read_buf + conn->read_buf_end,
+                                   conn->read_buf_size - conn->read_buf_end,
+                                   &received ) != MONGO_OK ) {
+            conn->read_buf_start = conn->read_buf_end = 0;
+            return MONGO_ERROR;
+        }
+        conn->read_buf_end += ( int )received;
     }
 
-    bson_free( mm );
     return MONGO_OK;
 }
 
-static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
+/* Read the next reply. If *reply is not NULL it is a finished reply
+ * whose buffer may be reused; *reply is NULL whenever this fails. */
+MONGO_EXPORT int mongo_read_response( mongo *conn, mongo_reply **reply ) {
     mongo_header head; /* header from network */
     mongo_reply_fields fields; /* header from network */
     mongo_reply *out;  /* native endian */
+    mongo_reply *spare = *reply;
     unsigned int len;
+    size_t body_len, buffered;
     int res;
 
-    if ( ( res = mongo_env_read_socket( conn, &head, sizeof( head ) ) ) != MONGO_OK ||
-         ( res = mongo_env_read_socket( conn, &fields, sizeof( fields ) ) ) != MONGO_OK ) {
+    *reply = NULL;
+
+    if( ( res = mongo_read_buffer_fill( conn, sizeof( head ) + sizeof( fields ) ) ) != MONGO_OK ) {
+        mongo_reply_release( conn, spare );
         return res;
     }
 
+    memcpy( &head, conn->read_buf + conn->read_buf_start, sizeof( head ) );
+    memcpy( &fields, conn->read_buf + conn->read_buf_start + sizeof( head ), sizeof( fields ) );
+
     bson_little_endian32( &len, &head.len );
 
-    if ( len < sizeof( head )+sizeof( fields ) || len > 64*1024*1024 )
+    if ( len < sizeof( head )+sizeof( fields ) || len > 64*1024*1024 ) {
+        conn->read_buf_start = conn->read_buf_end = 0;
+        mongo_reply_release( conn, spare );
         return MONGO_READ_SIZE_ERROR;  /* most likely corruption */
+    }
+
+    conn->read_buf_start += sizeof( head ) + sizeof( fields );
+    body_len = len - 16 - 20; /* was len-sizeof( head )-sizeof( fields ) */
 
     /*
      * mongo_reply matches the wire for observed environments (MacOS, Linux, Windows VC), but
@@ -352,7 +677,7 @@ static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
      * assert( sizeof(mongo_reply) - sizeof(char) - 16 - 20 + len >= len );
      * printf( "sizeof(mongo_reply) - sizeof(char) - 16 - 20 = %ld\n", sizeof(mongo_reply) - sizeof(char) - 16 - 20 );
      */
-    out = ( mongo_reply * )bson_malloc( sizeof(mongo_reply) - sizeof(char) + len - 16 - 20 );
+    out = mongo_reply_alloc( conn, body_len, spare );
 
     out->head.len = len;
     bson_little_endian32( &out->head.id, &head.id );
@@ -364,10 +689,23 @@ static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
     bson_little_endian32( &out->fields.start, &fields.start );
     bson_little_endian32( &out->fields.num, &fields.num );
 
-    res = mongo_env_read_socket( conn, &out->objs, len - 16 - 20 ); /* was len-sizeof( head )-sizeof( fields ) */
-    if( res != MONGO_OK ) {
-        bson_free( out );
-        return res;
+    /* Take what is already buffered; read the rest of a large batch
+     * straight into the reply rather than through the buffer. */
+    buffered = conn->read_buf_end - conn->read_buf_start;
+    if( buffered > body_len )
+        buffered = body_len;
+    memcpy( &out->objs, conn->read_buf + conn->read_buf_start, buffered );
+    conn->read_buf_start += ( int )buffered;
+
+    if( conn->read_buf_start == conn->read_buf_end )
+        conn->read_buf_start = conn->read_buf_end = 0;
+
+    if( buffered < body_len ) {
+        res = mongo_env_read_socket( conn, &out->objs + buffered, body_len - buffered );
+        if( res != MONGO_OK ) {
+            mongo_reply_release( conn, out );
+            return res;
+        }
     }
 
     *reply = out;
@@ -376,23 +714,34 @@ static int mongo_read_response( mongo *conn, mongo_reply **reply ) {
 }
 
 
-static char *mongo_data_append( char *start , const void *data , size_t len ) {
+MONGO_EXPORT char *mongo_data_append( char *start , const void *data , size_t len ) {
     memcpy( start , data , len );
     return start + len;
 }
 
-static char *mongo_data_append32( char *start , const void *data ) {
+MONGO_EXPORT char *mongo_data_append32( char *start , const void *data ) {
     bson_little_endian32( start , data );
     return start + 4;
 }
 
-static char *mongo_data_append64( char *start , const void *data ) {
+MONGO_EXPORT char *mongo_data_append64( char *start , const void *data ) {
     bson_little_endian64( start , data );
     return start + 8;
 }
 
 /* Connection API */
 
+/* Servers that predate maxMessageSizeBytes take messages of twice the
+ * largest object. */
+static void mongo_set_max_msg_size( mongo *conn, const bson *is_master ) {
+    bson_iterator it;
+
+    if( bson_find( &it, is_master, "maxMessageSizeBytes" ) )
+        conn->max_msg_size = bson_iterator_int( &it );
+    else
+        conn->max_msg_size = 2 * conn->max_bson_size;
+}
+
 static int mongo_check_is_master( mongo *conn ) {
     bson out;
     bson_iterator it;
@@ -407,6 +756,7 @@ static int mongo_check_is_master( mongo *conn ) {
     if( bson_find( &it, &out, "maxBsonObjectSize" ) )
         max_bson_size = bson_iterator_int( &it );
     conn->max_bson_size = max_bson_size;
+    mongo_set_max_msg_size( conn, &out );
 
     bson_destroy( &out );
 
@@ -432,6 +782,11 @@ static mongo_write_concern WC1 = { 1, 0, 0, 0, 0, &WC1_cmd }; /* w = 1 */
 MONGO_EXPORT void mongo_init( mongo *conn ) {
     memset( conn, 0, sizeof( mongo ) );
     conn->max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+    conn->max_msg_size = 2 * MONGO_DEFAULT_MAX_BSON_SIZE;
+    conn->local_threshold_ms = MONGO_DEFAULT_LOCAL_THRESHOLD_MS;
+    conn->conn_timeout_ms = MONGO_DEFAULT_CONNECT_TIMEOUT_MS;
+    conn->kill_cursors_max = MONGO_DEFAULT_KILL_CURSORS_MAX;
+    conn->kill_cursors_delay_ms = MONGO_DEFAULT_KILL_CURSORS_DELAY_MS;
     mongo_set_write_concern( conn, &WC1 );
 }
 
@@ -461,6 +816,7 @@ MONGO_EXPORT void mongo_replica_set_init( mongo *conn, const char *name ) {
     mongo_init( conn );
 
     conn->replica_set = (mongo_replica_set*)bson_malloc( sizeof( mongo_replica_set ) );
+    memset( conn->replica_set, 0, sizeof( mongo_replica_set ) );
     conn->replica_set->primary_connected = 0;
     conn->replica_set->seeds = NULL;
     conn->replica_set->hosts = NULL;
@@ -477,8 +833,15 @@ MONGO_EXPORT void mongo_replset_init( mongo *conn, const char *name ) {
     mongo_replica_set_init( conn, name );
 }
 
+/* Append a node to the list unless it is already there. */
 static void mongo_replica_set_add_node( mongo_host_port **list, const char *host, int port ) {
-    mongo_host_port *host_port = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
+    mongo_host_port *host_port;
+
+    for( host_port = *list; host_port != NULL; host_port = host_port->next )
+        if( host_port->port == port && strcmp( host_port->host, host ) == 0 )
+            return;
+
+    host_port = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
     host_port->port = port;
     host_port->next = NULL;
     snprintf( host_port->host, MAXHOSTNAMELEN, "%s", host);
@@ -540,147 +903,528 @@ void mongo_parse_host( const char *host_string, mongo_host_port *host_port ) {
         host_port->port = MONGO_DEFAULT_PORT;
 }
 
-static void mongo_replica_set_check_seed( mongo *conn ) {
+/* Replica set members are probed with ismaster all at once, each on a
+ * connection of its own. Discovery probes every seed and known host
+ * and keeps the first primary to answer. Pings probe the members kept
+ * for reads, timing each round trip. Hosts named in a reply are added
+ * and probed in the same round.
+ *
+ * Once there are members, a ping round runs alongside reads: each read
+ * moves it along without waiting. A member's connection stays usable
+ * while its ismaster is out; the reply is read before anything else is
+ * sent on it. Members with a read-ahead or exhaust reply of their own
+ * outstanding sit a round out. */
+
+#define MONGO_REPLICA_SET_DISCOVERY_MS 10000
+#define MONGO_REPLICA_SET_PING_MS 10000
+
+enum mongo_replica_set_member_state {
+    MONGO_MEMBER_CONNECTING,
+    MONGO_MEMBER_WAITING,   /* ismaster sent. */
+    MONGO_MEMBER_DONE
+};
+
+typedef struct {
+    mongo *conn;
+    mongo_replica_set_member **members;
+    int count;
+    int size;
+    int discovering;        /* Stop at the first primary. */
+    int bad_set_name;       /* Some host belongs to another set. */
+} mongo_replica_set_round;
+
+static int mongo_replica_set_member_send( mongo_replica_set_member *member ) {
+    static const char ns[] = "admin.$cmd";
+    static const int MINUS_ONE = -1;
+    mongo_message *mm;
+    char *data;
+    bson cmd[1];
+    int res;
+
+    bson_init( cmd );
+    bson_append_int( cmd, "ismaster", 1 );
+    bson_finish( cmd );
+
+    mm = mongo_message_create( 16 + 4 + sizeof( ns ) + 4 + 4 + bson_size( cmd ),
+                               0, 0, MONGO_OP_QUERY );
+    data = &mm->data;
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append( data, ns, sizeof( ns ) );
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append32( data, &MINUS_ONE );
+    mongo_data_append( data, cmd->data, bson_size( cmd ) );
+    bson_destroy( cmd );
+
+    member->sent = mongo_env_time_ms( );
+    res = mongo_message_send( &member->conn, mm );
+    member->state = res == MONGO_OK ? MONGO_MEMBER_WAITING : MONGO_MEMBER_DONE;
+    if( res == MONGO_OK )
+        member->conn.pinged = member;
+    return res;
+}
+
+/* Fold the round trip of the ismaster just answered into the member's
+ * average, weighting each new one by a fifth. */
+static void mongo_replica_set_member_time( mongo_replica_set_member *member ) {
+    int rtt = ( int )( mongo_env_time_ms( ) - member->sent );
+
+    member->rtt_ms = member->rtt_ms < 0 ? rtt : ( member->rtt_ms * 4 + rtt ) / 5;
+}
+
+/* Read a member's ismaster reply before its connection is used for
+ * something else. Only the round trip is taken from it; the member's
+ * role stays as the last full reply left it. */
+static int mongo_replica_set_member_land( mongo_replica_set_member *member ) {
+    mongo_reply *reply = NULL;
+    int res;
+
+    member->conn.pinged = NULL;
+    member->state = MONGO_MEMBER_DONE;
+
+    if( ( res = mongo_read_response( &member->conn, &reply ) ) != MONGO_OK ) {
+        if( res == MONGO_READ_SIZE_ERROR )
+            __mongo_set_error( &member->conn, MONGO_READ_SIZE_ERROR, "Invalid ismaster reply.", 0 );
+        return MONGO_ERROR;
+    }
+
+    mongo_replica_set_member_time( member );
+    mongo_reply_release( &member->conn, reply );
+    return MONGO_OK;
+}
+
+static void mongo_replica_set_member_close( mongo_replica_set_member *member ) {
+    if( member->conn.connected )
+        mongo_disconnect( &member->conn );
+    else
+        mongo_env_socket_connect_cancel( &member->conn );
+    member->conn.sock = 0;
+    member->conn.connected = 0;
+    member->ismaster = 0;
+    member->secondary = 0;
+}
+
+/* Start a member's round: connect it if need be, then send ismaster. */
+static void mongo_replica_set_member_start( mongo_replica_set_member *member ) {
+    if( member->conn.connected )
+        mongo_replica_set_member_send( member );
+    else if( mongo_env_socket_connect_start( &member->conn, member->host, member->port ) != MONGO_OK )
+        member->state = MONGO_MEMBER_DONE;
+    else if( member->conn.connected )
+        mongo_replica_set_member_send( member );
+    else
+        member->state = MONGO_MEMBER_CONNECTING;
+}
+
+static void mongo_replica_set_member_add( mongo_replica_set_round *r,
+                                          const char *host, int port ) {
+    mongo_replica_set_member *member;
+    int i;
+
+    for( i = 0; i < r->count; i++ )
+        if( r->members[i]->port == port && strcmp( r->members[i]->host, host ) == 0 )
+            return;
+
+    if( r->count == r->size ) {
+        r->size = r->size ? r->size * 2 : 8;
+        r->members = ( mongo_replica_set_member ** )bson_realloc( r->members,
+                     r->size * sizeof( mongo_replica_set_member * ) );
+    }
+
+    member = ( mongo_replica_set_member * )bson_malloc( sizeof( mongo_replica_set_member ) );
+    memset( member, 0, sizeof( mongo_replica_set_member ) );
+    mongo_init( &member->conn );
+    member->conn.op_timeout_ms = r->conn->op_timeout_ms;
+    member->conn.conn_timeout_ms = r->conn->conn_timeout_ms;
+    member->conn.primary = ( mongo_host_port * )bson_malloc( sizeof( mongo_host_port ) );
+    snprintf( member->conn.primary->host, MAXHOSTNAMELEN, "%s", host );
+    member->conn.primary->port = port;
+    member->conn.primary->next = NULL;
+    snprintf( member->host, MAXHOSTNAMELEN, "%s", host );
+    member->port = port;
+    member->rtt_ms = -1;
+    r->members[r->count++] = member;
+
+    mongo_replica_set_member_start( member );
+}
+
+/* The ismaster fields read from each member, in one pass. */
+static const char *mongo_ismaster_keys[] = {
+    "setName", "ismaster", "secondary", "hosts", "maxBsonObjectSize"
+};
+enum {
+    MONGO_ISMASTER_SET_NAME,
+    MONGO_ISMASTER_ISMASTER,
+    MONGO_ISMASTER_SECONDARY,
+    MONGO_ISMASTER_HOSTS,
+    MONGO_ISMASTER_MAX_BSON_SIZE,
+    MONGO_ISMASTER_KEYS
+};
+
+/* Read a member's ismaster reply. Returns true if it came from the
+ * primary of this set. */
+static int mongo_replica_set_member_read( mongo_replica_set_round *r,
+                                          mongo_replica_set_member *member ) {
+    mongo_replica_set *replica_set = r->conn->replica_set;
+    mongo_reply *reply = NULL;
+    mongo_host_port host_port;
     bson out[1];
-    const char *data;
-    bson_iterator it[1];
+    bson_iterator fields[MONGO_ISMASTER_KEYS];
+    bson_iterator *it;
     bson_iterator it_sub[1];
-    const char *host_string;
-    mongo_host_port *host_port = NULL;
+    int is_member = 0;
 
-    if( mongo_simple_int_command( conn, "admin", "ismaster", 1, out ) == MONGO_OK ) {
+    member->state = MONGO_MEMBER_DONE;
+    member->conn.pinged = NULL;
+    member->ismaster = 0;
+    member->secondary = 0;
 
-        if( bson_find( it, out, "hosts" ) ) {
-            data = bson_iterator_value( it );
-            bson_iterator_from_buffer( it_sub, data );
+    if( mongo_read_response( &member->conn, &reply ) != MONGO_OK ) {
+        mongo_replica_set_member_close( member );
+        return 0;
+    }
 
-            /* Iterate over host list, adding each host to the
-             * connection's host list. */
-            while( bson_iterator_next( it_sub ) ) {
-                host_string = bson_iterator_string( it_sub );
+    if( reply->fields.num < 1 ) {
+        mongo_reply_release( &member->conn, reply );
+        mongo_replica_set_member_close( member );
+        return 0;
+    }
 
-                host_port = (mongo_host_port*)bson_malloc( sizeof( mongo_host_port ) );
+    mongo_replica_set_member_time( member );
 
-                if( host_port ) {
-                    mongo_parse_host( host_string, host_port );
-                    mongo_replica_set_add_node( &conn->replica_set->hosts,
-                                                host_port->host, host_port->port );
+    bson_init_finished_data( out, &reply->objs, 0 );
+    bson_find_many( out, mongo_ismaster_keys, MONGO_ISMASTER_KEYS, fields );
 
-                    bson_free( host_port );
-                    host_port = NULL;
-                }
-            }
+    /* A standalone server has no set name, and is no primary of ours. */
+    it = &fields[MONGO_ISMASTER_SET_NAME];
+    if( bson_iterator_type( it ) ) {
+        if( strcmp( bson_iterator_string( it ), replica_set->name ) == 0 )
+            is_member = 1;
+        else
+            r->bad_set_name = 1;
+    }
+
+    it = &fields[MONGO_ISMASTER_ISMASTER];
+    if( is_member && bson_iterator_type( it ) )
+        member->ismaster = bson_iterator_bool( it );
+    it = &fields[MONGO_ISMASTER_SECONDARY];
+    if( is_member && bson_iterator_type( it ) )
+        member->secondary = bson_iterator_bool( it );
+
+    /* Discovery need not probe the other hosts once it has the primary. */
+    it = &fields[MONGO_ISMASTER_HOSTS];
+    if( is_member && bson_iterator_type( it ) ) {
+        bson_iterator_subiterator( it, it_sub );
+        while( bson_iterator_next( it_sub ) ) {
+            mongo_parse_host( bson_iterator_string( it_sub ), &host_port );
+            mongo_replica_set_add_node( &replica_set->hosts, host_port.host, host_port.port );
+            if( ! ( r->discovering && member->ismaster ) )
+                mongo_replica_set_member_add( r, host_port.host, host_port.port );
         }
     }
 
-    bson_destroy(out);
-    mongo_env_close_socket( conn->sock );
-    conn->sock = 0;
-    conn->connected = 0;
+    if( member->ismaster ) {
+        member->conn.max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+        it = &fields[MONGO_ISMASTER_MAX_BSON_SIZE];
+        if( bson_iterator_type( it ) )
+            member->conn.max_bson_size = bson_iterator_int( it );
+        mongo_set_max_msg_size( &member->conn, out );
+    }
+
+    mongo_reply_release( &member->conn, reply );
+    return member->ismaster;
 }
 
-/* Find out whether the current connected node is master, and
- * verify that the node's replica set name matched the provided name
- */
-static int mongo_replica_set_check_host( mongo *conn ) {
+/* Wait up to millis for started members to become ready and move each
+ * ready one along its round. Sets *pending to the number still going.
+ * When discovering, stops at and returns the first primary. */
+static mongo_replica_set_member *mongo_replica_set_poll_round( mongo_replica_set_round *r,
+        int millis, int *pending ) {
+    mongo_replica_set_member *primary = NULL;
+    mongo_replica_set_member **members;
+    mongo **conns;
+    int *ready;
+    int i, count;
 
-    bson out[1];
-    bson_iterator it[1];
-    bson_bool_t ismaster = 0;
-    const char *set_name;
-    int max_bson_size = MONGO_DEFAULT_MAX_BSON_SIZE;
+    /* Members added during this pass are polled in the next. */
+    members = ( mongo_replica_set_member ** )bson_malloc( r->count * sizeof( mongo_replica_set_member * ) );
+    conns = ( mongo ** )bson_malloc( r->count * sizeof( mongo * ) );
+    ready = ( int * )bson_malloc( r->count * sizeof( int ) );
+
+    for( i = count = 0; i < r->count; i++ ) {
+        if( r->members[i]->state != MONGO_MEMBER_DONE ) {
+            members[count] = r->members[i];
+            conns[count++] = &r->members[i]->conn;
+        }
+    }
 
-    if ( mongo_simple_int_command( conn, "admin", "ismaster", 1, out ) == MONGO_OK ) {
-        if( bson_find( it, out, "ismaster" ) )
-            ismaster = bson_iterator_bool( it );
+    if( count > 0 && mongo_env_poll_sockets( conns, ready, count, millis ) < 0 )
+        count = 0;
 
-        if( bson_find( it, out, "maxBsonObjectSize" ) )
-            max_bson_size = bson_iterator_int( it );
-        conn->max_bson_size = max_bson_size;
+    for( i = 0; i < count && ! primary; i++ ) {
+        if( ! ready[i] || members[i]->state == MONGO_MEMBER_DONE )
+            continue;
 
-        if( bson_find( it, out, "setName" ) ) {
-            set_name = bson_iterator_string( it );
-            if( strcmp( set_name, conn->replica_set->name ) != 0 ) {
-                bson_destroy( out );
-                conn->err = MONGO_CONN_BAD_SET_NAME;
-                return MONGO_ERROR;
-            }
+        if( members[i]->state == MONGO_MEMBER_CONNECTING ) {
+            /* Until connected, finishing may only move on to the next address. */
+            if( mongo_env_socket_connect_finish( &members[i]->conn ) != MONGO_OK )
+                members[i]->state = MONGO_MEMBER_DONE;
+            else if( members[i]->conn.connected )
+                mongo_replica_set_member_send( members[i] );
         }
+        else if( mongo_replica_set_member_read( r, members[i] ) && r->discovering )
+            primary = members[i];
     }
 
-    bson_destroy( out );
+    *pending = 0;
+    if( count > 0 )
+        for( i = 0; i < r->count; i++ )
+            if( r->members[i]->state != MONGO_MEMBER_DONE )
+                ( *pending )++;
+
+    bson_free( members );
+    bson_free( conns );
+    bson_free( ready );
+
+    return primary;
+}
 
-    if( ismaster ) {
-        conn->replica_set->primary_connected = 1;
+/* Close the members that have not answered. */
+static void mongo_replica_set_end_round( mongo_replica_set_round *r ) {
+    int i;
+
+    for( i = 0; i < r->count; i++ ) {
+        if( r->members[i]->state != MONGO_MEMBER_DONE ) {
+            mongo_replica_set_member_close( r->members[i] );
+            r->members[i]->state = MONGO_MEMBER_DONE;
+        }
     }
-    else {
-        mongo_env_close_socket( conn->sock );
+}
+
+/* Drive every started member through its round until all have
+ * answered or the deadline passes. Members still waiting then are
+ * closed. When discovering, stops at and returns the first primary. */
+static mongo_replica_set_member *mongo_replica_set_run_round( mongo_replica_set_round *r,
+        int64_t deadline ) {
+    mongo_replica_set_member *primary = NULL;
+    int timeout, pending = 1;
+
+    while( ! primary && pending ) {
+        timeout = ( int )( deadline - mongo_env_time_ms( ) );
+        if( timeout <= 0 )
+            break;
+        primary = mongo_replica_set_poll_round( r, timeout, &pending );
     }
 
-    return MONGO_OK;
+    mongo_replica_set_end_round( r );
+    return primary;
 }
 
-MONGO_EXPORT int mongo_replica_set_client( mongo *conn ) {
+/* Move a connected member's socket over to the client. */
+static void mongo_replica_set_adopt( mongo *conn, mongo_replica_set_member *member ) {
+    conn->sock = member->conn.sock;
+    conn->connected = 1;
+    conn->read_buf_start = conn->read_buf_end = 0;
+    conn->max_bson_size = member->conn.max_bson_size;
+    conn->max_msg_size = member->conn.max_msg_size;
+    conn->replica_set->primary_connected = 1;
 
-    int res = 0;
+    snprintf( conn->primary->host, MAXHOSTNAMELEN, "%s", member->host );
+    conn->primary->port = member->port;
+
+    member->conn.sock = 0;
+    member->conn.connected = 0;
+}
+
+static void mongo_replica_set_free_members( mongo_replica_set_member **members, int count ) {
+    int i;
+
+    for( i = 0; i < count; i++ ) {
+        mongo_replica_set_member_close( members[i] );
+        mongo_destroy( &members[i]->conn );
+        bson_free( members[i] );
+    }
+    bson_free( members );
+}
+
+MONGO_EXPORT int mongo_replica_set_client( mongo *conn ) {
+    mongo_replica_set_round r[1];
+    mongo_replica_set_member *primary;
     mongo_host_port *node;
+    int timeout;
 
     conn->sock = 0;
     conn->connected = 0;
 
-    /* First iterate over the seed nodes to get the canonical list of hosts
-     * from the replica set. Break out once we have a host list.
-     */
-    node = conn->replica_set->seeds;
-    while( node != NULL ) {
-        res = mongo_env_socket_connect( conn, ( const char * )&node->host, node->port );
-        if( res == MONGO_OK ) {
-            mongo_replica_set_check_seed( conn );
-            if( conn->replica_set->hosts )
-                break;
-        }
-        node = node->next;
+    memset( r, 0, sizeof( r ) );
+    r->conn = conn;
+    r->discovering = 1;
+
+    /* Hosts learned by an earlier discovery are probed with the seeds. */
+    for( node = conn->replica_set->seeds; node != NULL; node = node->next )
+        mongo_replica_set_member_add( r, node->host, node->port );
+    for( node = conn->replica_set->hosts; node != NULL; node = node->next )
+        mongo_replica_set_member_add( r, node->host, node->port );
+
+    timeout = conn->conn_timeout_ms > 0 ? conn->conn_timeout_ms : MONGO_REPLICA_SET_DISCOVERY_MS;
+    primary = mongo_replica_set_run_round( r, mongo_env_time_ms( ) + timeout );
+
+    /* A host answering for another set means the seed list is wrong,
+     * even if this set's primary was found too. Only hosts heard from
+     * before the primary are checked: the round stops there. */
+    if( r->bad_set_name ) {
+        primary = NULL;
+        __mongo_set_error( conn, MONGO_CONN_BAD_SET_NAME,
+                           "A seed belongs to another replica set.", 0 );
+    }
+    else if( primary )
+        mongo_replica_set_adopt( conn, primary );
+    else
+        conn->err = MONGO_CONN_NO_PRIMARY;
+
+    mongo_replica_set_free_members( r->members, r->count );
+
+    return primary ? MONGO_OK : MONGO_ERROR;
+}
+
+static void mongo_replica_set_round_load( mongo_replica_set_round *r, mongo *conn ) {
+    memset( r, 0, sizeof( mongo_replica_set_round ) );
+    r->conn = conn;
+    r->members = conn->replica_set->members;
+    r->count = conn->replica_set->member_count;
+    r->size = conn->replica_set->member_size;
+}
+
+static void mongo_replica_set_round_save( mongo_replica_set_round *r, mongo *conn ) {
+    conn->replica_set->members = r->members;
+    conn->replica_set->member_count = r->count;
+    conn->replica_set->member_size = r->size;
+}
+
+/* Start pinging the members kept for reads, connecting any that are
+ * down and adding any hosts the set has gained. */
+static void mongo_replica_set_ping_start( mongo *conn ) {
+    mongo_replica_set *replica_set = conn->replica_set;
+    mongo_replica_set_member *member;
+    mongo_replica_set_round r[1];
+    mongo_host_port *node;
+    int i, timeout;
+
+    mongo_replica_set_round_load( r, conn );
+
+    for( i = 0; i < r->count; i++ ) {
+        member = r->members[i];
+        if( ! member->conn.prefetching && ! member->conn.streaming )
+            mongo_replica_set_member_start( member );
     }
+    for( node = replica_set->hosts; node != NULL; node = node->next )
+        mongo_replica_set_member_add( r, node->host, node->port );
 
-    /* Iterate over the host list, checking for the primary node. */
-    if( !conn->replica_set->hosts ) {
-        conn->err = MONGO_CONN_NO_PRIMARY;
-        return MONGO_ERROR;
+    mongo_replica_set_round_save( r, conn );
+
+    timeout = conn->conn_timeout_ms > 0 ? conn->conn_timeout_ms : MONGO_REPLICA_SET_DISCOVERY_MS;
+    replica_set->ping_deadline = mongo_env_time_ms( ) + timeout;
+}
+
+/* Move the ping round along, waiting up to millis, and end it once
+ * every member has answered or its deadline has passed. */
+static void mongo_replica_set_ping_step( mongo *conn, int millis ) {
+    mongo_replica_set *replica_set = conn->replica_set;
+    mongo_replica_set_round r[1];
+    int64_t now;
+    int pending;
+
+    mongo_replica_set_round_load( r, conn );
+    mongo_replica_set_poll_round( r, millis, &pending );
+
+    now = mongo_env_time_ms( );
+    if( pending == 0 || now >= replica_set->ping_deadline ) {
+        mongo_replica_set_end_round( r );
+        replica_set->ping_deadline = 0;
+        replica_set->last_ping = now;
     }
-    else {
-        node = conn->replica_set->hosts;
 
-        while( node != NULL ) {
-            res = mongo_env_socket_connect( conn, ( const char * )&node->host, node->port );
+    mongo_replica_set_round_save( r, conn );
+}
+
+/* Ping the members and wait for the round to end. */
+static void mongo_replica_set_ping( mongo *conn ) {
+    mongo_replica_set *replica_set = conn->replica_set;
+    int timeout;
 
-            if( res == MONGO_OK ) {
-                if( mongo_replica_set_check_host( conn ) != MONGO_OK )
-                    return MONGO_ERROR;
+    if( ! replica_set->ping_deadline )
+        mongo_replica_set_ping_start( conn );
 
-                /* Primary found, so return. */
-                else if( conn->replica_set->primary_connected ) {
-                    bson_free( conn->primary );
-                    conn->primary = bson_malloc( sizeof( mongo_host_port ) );
-                    snprintf( conn->primary->host, MAXHOSTNAMELEN, "%s", node->host );
-                    conn->primary->port = node->port;
-                    return MONGO_OK;
-                }
+    while( replica_set->ping_deadline ) {
+        timeout = ( int )( replica_set->ping_deadline - mongo_env_time_ms( ) );
+        mongo_replica_set_ping_step( conn, timeout > 0 ? timeout : 0 );
+    }
+}
 
-                /* No primary, so close the connection. */
-                else {
-                    mongo_env_close_socket( conn->sock );
-                    conn->sock = 0;
-                    conn->connected = 0;
-                }
-            }
+/* The connection a read with this preference should go to: the
+ * client's own for the primary, otherwise a member's. Among eligible
+ * members, one within the local threshold of the nearest is picked at
+ * random. */
+static mongo *mongo_read_connection( mongo *conn, int read_pref ) {
+    mongo_replica_set *replica_set = conn->replica_set;
+    mongo_replica_set_member *member;
+    mongo_replica_set_member **eligible;
+    mongo *target = NULL;
+    int i, count = 0, nearest = -1;
+
+    if( ! replica_set || read_pref == MONGO_READ_PRIMARY )
+        return conn;
+    if( read_pref == MONGO_READ_PRIMARY_PREFERRED && conn->connected )
+        return conn;
 
-            node = node->next;
+    /* Reads wait on a ping only when there are no members to read from. */
+    if( replica_set->member_count == 0 )
+        mongo_replica_set_ping( conn );
+    else {
+        if( ! replica_set->ping_deadline &&
+                mongo_env_time_ms( ) - replica_set->last_ping >= MONGO_REPLICA_SET_PING_MS )
+            mongo_replica_set_ping_start( conn );
+        if( replica_set->ping_deadline )
+            mongo_replica_set_ping_step( conn, 0 );
+    }
+
+    for( i = 0; i < replica_set->member_count; i++ ) {
+        member = replica_set->members[i];
+        if( ! member->conn.connected ||
+                ! ( member->secondary || ( read_pref == MONGO_READ_NEAREST && member->ismaster ) ) )
+            continue;
+        if( nearest < 0 || member->rtt_ms < nearest )
+            nearest = member->rtt_ms;
+    }
+
+    if( nearest >= 0 ) {
+        eligible = ( mongo_replica_set_member ** )bson_malloc(
+                       replica_set->member_count * sizeof( mongo_replica_set_member * ) );
+        for( i = 0; i < replica_set->member_count; i++ ) {
+            member = replica_set->members[i];
+            if( member->conn.connected &&
+                    ( member->secondary || ( read_pref == MONGO_READ_NEAREST && member->ismaster ) ) &&
+                    member->rtt_ms <= nearest + conn->local_threshold_ms )
+                eligible[count++] = member;
         }
+        target = &eligible[rand( ) % count]->conn;
+        bson_free( eligible );
     }
+    else if( read_pref == MONGO_READ_SECONDARY_PREFERRED && conn->connected )
+        target = conn;
 
+    if( ! target )
+        __mongo_set_error( conn, MONGO_READ_NO_MEMBER,
+                           "No replica set member matches the read preference.", 0 );
 
-    conn->err = MONGO_CONN_NO_PRIMARY;
-    return MONGO_ERROR;
+    return target;
+}
+
+MONGO_EXPORT void mongo_set_read_preference( mongo *conn, int read_pref ) {
+    conn->read_pref = read_pref;
+}
+
+MONGO_EXPORT void mongo_set_local_threshold( mongo *conn, int millis ) {
+    conn->local_threshold_ms = millis;
 }
 
 MONGO_EXPORT int mongo_replset_connect( mongo *conn ) {
@@ -699,14 +1443,21 @@ MONGO_EXPORT int mongo_set_op_timeout( mongo *conn, int millis ) {
     return MONGO_OK;
 }
 
-MONGO_EXPORT int mongo_reconnect( mongo *conn ) {
-    int res;
+MONGO_EXPORT void mongo_set_kill_cursors_batch( mongo *conn, int max, int millis ) {
+    conn->kill_cursors_max = max;
+    conn->kill_cursors_delay_ms = millis;
+}
+
+MONGO_EXPORT void mongo_set_connect_timeout( mongo *conn, int millis ) {
+    conn->conn_timeout_ms = millis;
+}
+
+MONGO_EXPORT int mongo_reconnect( mongo *conn ) {
+    int res;
     mongo_disconnect( conn );
 
     if( conn->replica_set ) {
         conn->replica_set->primary_connected = 0;
-        mongo_replica_set_free_list( &conn->replica_set->hosts );
-        conn->replica_set->hosts = NULL;
         res = mongo_replica_set_client( conn );
         return res;
     }
@@ -722,25 +1473,50 @@ MONGO_EXPORT int mongo_check_connection( mongo *conn ) {
 }
 
 MONGO_EXPORT void mongo_disconnect( mongo *conn ) {
+    mongo_saved_error saved;
+
     if( ! conn->connected )
         return;
 
-    if( conn->replica_set ) {
+    /* The set's hosts are kept for the next discovery. */
+    if( conn->replica_set )
         conn->replica_set->primary_connected = 0;
-        mongo_replica_set_free_list( &conn->replica_set->hosts );
-        conn->replica_set->hosts = NULL;
+
+    /* Queued kills go out while the connection is still there, without
+     * hiding whatever error led to the disconnect. */
+    if( conn->kill_cursor_count ) {
+        mongo_save_error( conn, &saved );
+        mongo_kill_cursors_flush( conn );
+        mongo_restore_error( conn, &saved );
     }
 
     mongo_env_close_socket( conn->sock );
 
     conn->sock = 0;
     conn->connected = 0;
+    conn->read_buf_start = conn->read_buf_end = 0;
+
+    /* Its read-ahead reply went with the socket. */
+    if( conn->prefetching ) {
+        conn->prefetching->flags &= ~MONGO_CURSOR_PREFETCHING;
+        conn->prefetching = NULL;
+    }
+
+    /* So did any exhaust stream or ping reply. */
+    conn->streaming = NULL;
+    if( conn->pinged ) {
+        conn->pinged->state = MONGO_MEMBER_DONE;
+        conn->pinged = NULL;
+    }
 }
 
 MONGO_EXPORT void mongo_destroy( mongo *conn ) {
+    mongo_write_queue_stop( conn );
     mongo_disconnect( conn );
 
     if( conn->replica_set ) {
+        mongo_replica_set_free_members( conn->replica_set->members,
+                                        conn->replica_set->member_count );
         mongo_replica_set_free_list( &conn->replica_set->seeds );
         mongo_replica_set_free_list( &conn->replica_set->hosts );
         bson_free( conn->replica_set->name );
@@ -750,6 +1526,15 @@ MONGO_EXPORT void mongo_destroy( mongo *conn ) {
 
     bson_free( conn->primary );
 
+    bson_free( conn->read_buf );
+    conn->read_buf = NULL;
+    conn->read_buf_size = 0;
+    mongo_reply_pool_destroy( conn );
+
+    bson_free( conn->kill_cursors );
+    conn->kill_cursors = NULL;
+    conn->kill_cursor_size = 0;
+
     mongo_clear_errors( conn );
 }
 
@@ -805,27 +1590,99 @@ static int mongo_cursor_bson_valid( mongo_cursor *cursor, const bson *bson ) {
     return MONGO_OK;
 }
 
+MONGO_EXPORT int mongo_parse_last_error_into( bson *response, int *lasterrcode,
+        char *lasterrstr ) {
+    bson_iterator it[1];
+
+    if( bson_find( it, response, "$err" ) == BSON_STRING ||
+        bson_find( it, response, "err" ) == BSON_STRING ) {
+        mongo_copy_last_error( it, response, lasterrcode, lasterrstr );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_parse_last_error( mongo *conn, bson *response ) {
+    if( mongo_parse_last_error_into( response, &conn->lasterrcode,
+                                     conn->lasterrstr ) == MONGO_OK )
+        return MONGO_OK;
+
+    __mongo_set_error( conn, MONGO_WRITE_ERROR,
+                       "See conn->lasterrstr for details.", 0 );
+    return MONGO_ERROR;
+}
+
 static int mongo_check_last_error( mongo *conn, const char *ns,
                                    mongo_write_concern *write_concern ) {
     bson response[1];
-    bson_iterator it[1];
     int res = 0;
     char *cmd_ns = mongo_ns_to_cmd_db( ns );
 
     res = mongo_find_one( conn, cmd_ns, write_concern->cmd, bson_shared_empty( ), response );
     bson_free( cmd_ns );
 
-    if (res == MONGO_OK &&
-        (bson_find( it, response, "$err" ) == BSON_STRING ||
-         bson_find( it, response, "err" ) == BSON_STRING)) {
+    if( res == MONGO_OK )
+        res = mongo_parse_last_error( conn, response );
+
+    bson_destroy( response );
+    return res;
+}
+
+/* The fixed part of a getlasterror OP_QUERY, built on the stack: header,
+ * flags, "<db>.$cmd", skip and limit. The command document that follows
+ * is write_concern->cmd, serialized once by mongo_write_concern_finish( ). */
+#define MONGO_GLE_DB_MAX 128
+
+typedef struct {
+    mongo_header head;
+    char body[4 + MONGO_GLE_DB_MAX + 6 + 4 + 4];
+    int len;
+} mongo_gle_query;
+
+static int mongo_gle_query_init( mongo_gle_query *q, const char *ns, const bson *cmd ) {
+    char *data = q->body;
+    size_t db_len = strchr( ns, '.' ) - ns;
+
+    if( db_len >= MONGO_GLE_DB_MAX )
+        return MONGO_ERROR;
+
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append( data, ns, db_len );
+    data = mongo_data_append( data, ".$cmd", 6 );
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append32( data, &ONE );
+    q->len = ( int )( data - q->body );
+
+    return mongo_header_init( &q->head, 16 + q->len + bson_size( cmd )
+                              + bson_size( bson_shared_empty( ) ), 0, 0, MONGO_OP_QUERY );
+}
+
+/* Read the getlasterror reply, inspecting the document where it lies
+ * in the reply buffer. */
+static int mongo_read_last_error( mongo *conn ) {
+    mongo_reply *reply = NULL;
+    bson response[1];
+    int res;
 
-        __mongo_set_error( conn, MONGO_WRITE_ERROR,
-                           "See conn->lasterrstr for details.", 0 );
-        mongo_set_last_error( conn, it, response );
+    mongo_clear_errors( conn );
+
+    if( mongo_read_response( conn, &reply ) != MONGO_OK ) {
+        if( conn->err == MONGO_CONN_SUCCESS )
+            __mongo_set_error( conn, MONGO_READ_SIZE_ERROR, "Invalid getlasterror reply.", 0 );
+        return MONGO_ERROR;
+    }
+
+    if( reply->fields.num < 1 ) {
+        __mongo_set_error( conn, MONGO_READ_SIZE_ERROR, "Empty getlasterror reply.", 0 );
         res = MONGO_ERROR;
     }
+    else {
+        bson_init_finished_data( response, &reply->objs, 0 );
+        res = mongo_parse_last_error( conn, response );
+    }
 
-    bson_destroy( response );
+    mongo_reply_release( conn, reply );
     return res;
 }
 
@@ -856,28 +1713,47 @@ static int mongo_choose_write_concern( mongo *conn,
 CRUD API
 **********************************************************************/
 
-static int mongo_message_send_and_check_write_concern( mongo *conn, const char *ns, mongo_message *mm, mongo_write_concern *write_concern ) {
-   if( write_concern ) {
-        if( mongo_message_send( conn, mm ) == MONGO_ERROR ) {
-            return MONGO_ERROR;
-        }
+/* Queue a getlasterror query right behind a write. */
+static void mongo_gather_add_last_error( mongo_gather *g, mongo_gle_query *gle,
+        mongo_write_concern *write_concern ) {
+    mongo_gather_add( g, &gle->head, sizeof( gle->head ) );
+    mongo_gather_add( g, gle->body, gle->len );
+    mongo_gather_add( g, write_concern->cmd->data, bson_size( write_concern->cmd ) );
+    mongo_gather_add( g, bson_shared_empty( )->data, bson_size( bson_shared_empty( ) ) );
+}
 
+/* Send the queued write. With a write concern, its getlasterror query
+ * goes out in the same writev and the reply is read right after. */
+static int mongo_gather_send_and_check_write_concern( mongo *conn, const char *ns, mongo_gather *g, mongo_write_concern *write_concern ) {
+    mongo_gle_query gle;
+
+    if( ! write_concern )
+        return mongo_gather_flush( g );
+
+    if( mongo_gle_query_init( &gle, ns, write_concern->cmd ) != MONGO_OK ) {
+        if( mongo_gather_flush( g ) != MONGO_OK )
+            return MONGO_ERROR;
         return mongo_check_last_error( conn, ns, write_concern );
     }
-    else {
-        return mongo_message_send( conn, mm );
-    }
+
+    mongo_gather_add_last_error( g, &gle, write_concern );
+
+    if( mongo_gather_flush( g ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_read_last_error( conn );
 }
 
-MONGO_EXPORT int mongo_insert( mongo *conn, const char *ns,
-                               const bson *bson, mongo_write_concern *custom_write_concern ) {
+/* The CRUD entry points below take ns with its length, sl, including
+ * the NUL, and trust that it was validated: by the public wrappers on
+ * each call, or once by mongo_collection_init( ). */
 
-    char *data;
-    mongo_message *mm;
-    mongo_write_concern *write_concern = NULL;
+static int mongo_insert_ns( mongo *conn, const char *ns, size_t sl,
+                            const bson *bson, mongo_write_concern *custom_write_concern ) {
 
-    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
-        return MONGO_ERROR;
+    mongo_header head;
+    mongo_gather g[1];
+    mongo_write_concern *write_concern = NULL;
 
     if( mongo_bson_valid( conn, bson, 1 ) != MONGO_OK ) {
         return MONGO_ERROR;
@@ -888,80 +1764,210 @@ MONGO_EXPORT int mongo_insert( mongo *conn, const char *ns,
         return MONGO_ERROR;
     }
 
-    mm = mongo_message_create( 16 /* header */
-                               + 4 /* ZERO */
-                               + strlen( ns )
-                               + 1 + bson_size( bson )
-                               , 0, 0, MONGO_OP_INSERT );
-    if( mm == NULL ) {
+    if( mongo_header_init( &head, 16 /* header */
+                           + 4 /* ZERO */
+                           + sl
+                           + bson_size( bson )
+                           , 0, 0, MONGO_OP_INSERT ) != MONGO_OK ) {
         conn->err = MONGO_BSON_TOO_LARGE;
         return MONGO_ERROR;
     }
 
-    data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
-    mongo_data_append( data, bson->data, bson_size( bson ) );
+    mongo_gather_init( g, conn );
+    mongo_gather_add( g, &head, sizeof( head ) );
+    mongo_gather_add( g, &ZERO, 4 );
+    mongo_gather_add( g, ns, sl );
+    mongo_gather_add( g, bson->data, bson_size( bson ) );
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    return mongo_gather_send_and_check_write_concern( conn, ns, g, write_concern );
 }
 
-MONGO_EXPORT int mongo_insert_batch( mongo *conn, const char *ns,
-                                     const bson **bsons, int count, mongo_write_concern *custom_write_concern,
-                                     int flags ) {
+MONGO_EXPORT int mongo_insert( mongo *conn, const char *ns,
+                               const bson *bson, mongo_write_concern *custom_write_concern ) {
+    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
 
-    mongo_message *mm;
-    mongo_write_concern *write_concern = NULL;
+    return mongo_insert_ns( conn, ns, strlen( ns ) + 1, bson, custom_write_concern );
+}
+
+/* Find where the message starting at document start ends: as many
+ * documents as fit in the server's maximum message size. */
+static int mongo_insert_batch_split( mongo *conn, const bson **bsons, int start, int count,
+                                     size_t overhead, size_t *size ) {
     int i;
-    char *data;
-    size_t overhead =  16 + 4 + strlen( ns ) + 1;
-    size_t size = overhead;
 
-    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
-        return MONGO_ERROR;
+    *size = overhead + bson_size( bsons[start] );
+    for( i = start + 1; i < count; i++ ) {
+        if( *size + bson_size( bsons[i] ) > ( size_t )conn->max_msg_size )
+            break;
+        *size += bson_size( bsons[i] );
+    }
+    return i;
+}
+
+/* The index of the first document of message n. */
+static int mongo_insert_batch_message_start( mongo *conn, const bson **bsons, int count,
+                                             size_t overhead, int n ) {
+    int start = 0;
+    size_t size;
+
+    while( n-- > 0 )
+        start = mongo_insert_batch_split( conn, bsons, start, count, overhead, &size );
+    return start;
+}
+
+static int mongo_insert_batch_ns( mongo *conn, const char *ns, size_t sl,
+                                  const bson **bsons, int count,
+                                  mongo_write_concern *custom_write_concern, int flags ) {
+
+    mongo_header head;
+    mongo_gather g[1];
+    mongo_gle_query gle;
+    mongo_write_concern *write_concern = NULL;
+    mongo_write_concern between[1];
+    mongo_write_concern *ack;
+    mongo_saved_error first_error;
+    int i, start, first;
+    int insert_flags;
+    int pipeline = 0, acks = 0, messages = 0, failed = 0;
+    int continue_on_error = ( flags & MONGO_CONTINUE_ON_ERROR ) != 0;
+    size_t overhead =  16 + 4 + sl;
+    size_t size;
+
+    conn->batch_errors = 0;
+    conn->batch_error_index = -1;
 
     for( i=0; i<count; i++ ) {
-        size += bson_size( bsons[i] );
         if( mongo_bson_valid( conn, bsons[i], 1 ) != MONGO_OK )
             return MONGO_ERROR;
     }
 
-    if( ( size - overhead ) > (size_t)conn->max_bson_size ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
-        return MONGO_ERROR;
-    }
-
     if( mongo_choose_write_concern( conn, custom_write_concern,
                                     &write_concern ) == MONGO_ERROR ) {
         return MONGO_ERROR;
     }
 
-    mm = mongo_message_create( size , 0 , 0 , MONGO_OP_INSERT );
-    if( mm == NULL ) {
-        conn->err = MONGO_BSON_TOO_LARGE;
+    /* Continuing on error, every sub-batch and its getlasterror go out
+     * back to back and the replies are read at the end. Otherwise each
+     * sub-batch is acknowledged before the next is sent, so that none
+     * goes in after one fails; without a write concern, a plain
+     * getlasterror does that between sub-batches. */
+    if( write_concern && continue_on_error )
+        pipeline = mongo_gle_query_init( &gle, ns, write_concern->cmd ) == MONGO_OK;
+    mongo_write_concern_init( between );
+    memset( &first_error, 0, sizeof( first_error ) );
+
+    if( continue_on_error )
+        bson_little_endian32( &insert_flags, &ONE );
+    else
+        bson_little_endian32( &insert_flags, &ZERO );
+
+    /* Split the documents into as many messages as the server's
+     * maximum message size requires. */
+    for( start = 0; start < count; start = i, messages++ ) {
+        first = start;
+        i = mongo_insert_batch_split( conn, bsons, start, count, overhead, &size );
+
+        if( mongo_header_init( &head, size , 0 , 0 , MONGO_OP_INSERT ) != MONGO_OK ) {
+            conn->err = MONGO_BSON_TOO_LARGE;
+            failed = 1;
+            break;
+        }
+
+        mongo_gather_init( g, conn );
+        mongo_gather_add( g, &head, sizeof( head ) );
+        mongo_gather_add( g, &insert_flags, 4 );
+        mongo_gather_add( g, ns, sl );
+
+        for( ; start < i; start++ ) {
+            mongo_gather_add( g, bsons[start]->data, bson_size( bsons[start] ) );
+        }
+
+        if( pipeline ) {
+            mongo_gather_add_last_error( g, &gle, write_concern );
+            if( mongo_gather_flush( g ) != MONGO_OK ) {
+                failed = 1;
+                break;
+            }
+            acks++;
+            continue;
+        }
+
+        ack = write_concern;
+        if( ! ack && ! continue_on_error && i < count ) {
+            if( ! between->cmd && mongo_write_concern_finish( between ) != MONGO_OK ) {
+                conn->err = MONGO_WRITE_CONCERN_INVALID;
+                failed = 1;
+                break;
+            }
+            ack = between;
+        }
+
+        if( mongo_gather_send_and_check_write_concern( conn, ns, g, ack ) != MONGO_OK ) {
+            if( conn->err != MONGO_WRITE_ERROR ) {
+                failed = 1;
+                break;
+            }
+            if( conn->batch_errors++ == 0 ) {
+                mongo_save_error( conn, &first_error );
+                conn->batch_error_index = first;
+            }
+            if( ! continue_on_error )
+                break;
+        }
+    }
+    mongo_write_concern_destroy( between );
+
+    if( failed ) {
+        /* Acknowledgements already asked for can't be told apart from
+         * the replies to whatever is sent next. */
+        if( acks )
+            mongo_disconnect( conn );
         return MONGO_ERROR;
     }
 
-    data = &mm->data;
-    if( flags & MONGO_CONTINUE_ON_ERROR )
-        data = mongo_data_append32( data, &ONE );
-    else
-        data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
+    /* Read every acknowledgement, counting the failures and reporting
+     * the first. */
+    for( messages = 0; messages < acks; messages++ ) {
+        if( mongo_read_last_error( conn ) == MONGO_OK )
+            continue;
+        if( conn->err != MONGO_WRITE_ERROR ) {
+            if( messages < acks - 1 )
+                mongo_disconnect( conn );
+            return MONGO_ERROR;
+        }
+        if( conn->batch_errors++ == 0 ) {
+            mongo_save_error( conn, &first_error );
+            conn->batch_error_index = mongo_insert_batch_message_start( conn, bsons, count,
+                                      overhead, messages );
+        }
+    }
 
-    for( i=0; i<count; i++ ) {
-        data = mongo_data_append( data, bsons[i]->data, bson_size( bsons[i] ) );
+    if( conn->batch_errors ) {
+        mongo_restore_error( conn, &first_error );
+        return MONGO_ERROR;
     }
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    return MONGO_OK;
 }
 
-MONGO_EXPORT int mongo_update( mongo *conn, const char *ns, const bson *cond,
-                               const bson *op, int flags, mongo_write_concern *custom_write_concern ) {
+MONGO_EXPORT int mongo_insert_batch( mongo *conn, const char *ns,
+                                     const bson **bsons, int count, mongo_write_concern *custom_write_concern,
+                                     int flags ) {
+    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
 
-    char *data;
-    mongo_message *mm;
+    return mongo_insert_batch_ns( conn, ns, strlen( ns ) + 1, bsons, count,
+                                  custom_write_concern, flags );
+}
+
+static int mongo_update_ns( mongo *conn, const char *ns, size_t sl, const bson *cond,
+                            const bson *op, int flags, mongo_write_concern *custom_write_concern ) {
+
+    mongo_header head;
+    mongo_gather g[1];
     mongo_write_concern *write_concern = NULL;
+    int update_flags;
 
     /* Make sure that the op BSON is valid UTF-8.
      * TODO: decide whether to check cond as well.
@@ -975,33 +1981,40 @@ MONGO_EXPORT int mongo_update( mongo *conn, const char *ns, const bson *cond,
         return MONGO_ERROR;
     }
 
-    mm = mongo_message_create( 16 /* header */
-                               + 4  /* ZERO */
-                               + strlen( ns ) + 1
-                               + 4  /* flags */
-                               + bson_size( cond )
-                               + bson_size( op )
-                               , 0 , 0 , MONGO_OP_UPDATE );
-    if( mm == NULL ) {
+    if( mongo_header_init( &head, 16 /* header */
+                           + 4  /* ZERO */
+                           + sl
+                           + 4  /* flags */
+                           + bson_size( cond )
+                           + bson_size( op )
+                           , 0 , 0 , MONGO_OP_UPDATE ) != MONGO_OK ) {
         conn->err = MONGO_BSON_TOO_LARGE;
         return MONGO_ERROR;
     }
 
-    data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
-    data = mongo_data_append32( data, &flags );
-    data = mongo_data_append( data, cond->data, bson_size( cond ) );
-    mongo_data_append( data, op->data, bson_size( op ) );
+    bson_little_endian32( &update_flags, &flags );
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    mongo_gather_init( g, conn );
+    mongo_gather_add( g, &head, sizeof( head ) );
+    mongo_gather_add( g, &ZERO, 4 );
+    mongo_gather_add( g, ns, sl );
+    mongo_gather_add( g, &update_flags, 4 );
+    mongo_gather_add( g, cond->data, bson_size( cond ) );
+    mongo_gather_add( g, op->data, bson_size( op ) );
+
+    return mongo_gather_send_and_check_write_concern( conn, ns, g, write_concern );
 }
 
-MONGO_EXPORT int mongo_remove( mongo *conn, const char *ns, const bson *cond,
-                               mongo_write_concern *custom_write_concern ) {
+MONGO_EXPORT int mongo_update( mongo *conn, const char *ns, const bson *cond,
+                               const bson *op, int flags, mongo_write_concern *custom_write_concern ) {
+    return mongo_update_ns( conn, ns, strlen( ns ) + 1, cond, op, flags, custom_write_concern );
+}
 
-    char *data;
-    mongo_message *mm;
+static int mongo_remove_ns( mongo *conn, const char *ns, size_t sl, const bson *cond,
+                            mongo_write_concern *custom_write_concern ) {
+
+    mongo_header head;
+    mongo_gather g[1];
     mongo_write_concern *write_concern = NULL;
 
     /* Make sure that the BSON is valid UTF-8.
@@ -1016,24 +2029,29 @@ MONGO_EXPORT int mongo_remove( mongo *conn, const char *ns, const bson *cond,
         return MONGO_ERROR;
     }
 
-    mm = mongo_message_create( 16  /* header */
-                               + 4  /* ZERO */
-                               + strlen( ns ) + 1
-                               + 4  /* ZERO */
-                               + bson_size( cond )
-                               , 0 , 0 , MONGO_OP_DELETE );
-    if( mm == NULL ) {
+    if( mongo_header_init( &head, 16  /* header */
+                           + 4  /* ZERO */
+                           + sl
+                           + 4  /* ZERO */
+                           + bson_size( cond )
+                           , 0 , 0 , MONGO_OP_DELETE ) != MONGO_OK ) {
         conn->err = MONGO_BSON_TOO_LARGE;
         return MONGO_ERROR;
     }
 
-    data = &mm->data;
-    data = mongo_data_append32( data, &ZERO );
-    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
-    data = mongo_data_append32( data, &ZERO );
-    mongo_data_append( data, cond->data, bson_size( cond ) );
+    mongo_gather_init( g, conn );
+    mongo_gather_add( g, &head, sizeof( head ) );
+    mongo_gather_add( g, &ZERO, 4 );
+    mongo_gather_add( g, ns, sl );
+    mongo_gather_add( g, &ZERO, 4 );
+    mongo_gather_add( g, cond->data, bson_size( cond ) );
 
-    return mongo_message_send_and_check_write_concern( conn, ns, mm, write_concern ); 
+    return mongo_gather_send_and_check_write_concern( conn, ns, g, write_concern );
+}
+
+MONGO_EXPORT int mongo_remove( mongo *conn, const char *ns, const bson *cond,
+                               mongo_write_concern *custom_write_concern ) {
+    return mongo_remove_ns( conn, ns, strlen( ns ) + 1, cond, custom_write_concern );
 }
 
 
@@ -1159,174 +2177,1054 @@ MONGO_EXPORT void mongo_write_concern_set_mode( mongo_write_concern *write_conce
     write_concern->mode = mode;
 }
 
-static int mongo_cursor_op_query( mongo_cursor *cursor ) {
-    int res;
-    char *data;
-    mongo_message *mm;
-    bson temp;
-    bson_iterator it;
+/*********************************************************************
+Bulk Write API
+**********************************************************************/
 
-    /* Clear any errors. */
-    mongo_clear_errors( cursor->conn );
+/* Unordered bulks read acknowledgements after this many operations, so
+ * that unread replies never fill the socket buffers while we write. */
+#define MONGO_BULK_WINDOW 256
 
-    /* Set up default values for query and fields, if necessary. */
-    if( ! cursor->query )
-        cursor->query = bson_shared_empty( );
-    else if( mongo_cursor_bson_valid( cursor, cursor->query ) != MONGO_OK )
-        return MONGO_ERROR;
+MONGO_EXPORT int mongo_bulk_init( mongo_bulk *bulk, mongo *conn,
+                                  mongo_write_concern *custom_write_concern, int ordered ) {
+    memset( bulk, 0, sizeof( mongo_bulk ) );
+    bulk->conn = conn;
+    bulk->ordered = ordered;
 
-    if( ! cursor->fields )
-        cursor->fields = bson_shared_empty( );
-    else if( mongo_cursor_bson_valid( cursor, cursor->fields ) != MONGO_OK )
-        return MONGO_ERROR;
+    return mongo_choose_write_concern( conn, custom_write_concern, &bulk->write_concern );
+}
 
-    mm = mongo_message_create( 16 + /* header */
-                               4 + /*  options */
-                               strlen( cursor->ns ) + 1 + /* ns */
-                               4 + 4 + /* skip,return */
-                               bson_size( cursor->query ) +
-                               bson_size( cursor->fields ) ,
-                               0 , 0 , MONGO_OP_QUERY );
-    if( mm == NULL ) {
-        return MONGO_ERROR;
+static char *mongo_bulk_reserve( mongo_bulk *bulk, size_t len ) {
+    char *data;
+
+    if( bulk->len + len > bulk->size ) {
+        size_t size = bulk->size ? bulk->size : 4096;
+        while( size < bulk->len + len )
+            size *= 2;
+        bulk->buf = ( char * )bson_realloc( bulk->buf, size );
+        bulk->size = size;
     }
 
-    data = &mm->data;
-    data = mongo_data_append32( data , &cursor->options );
-    data = mongo_data_append( data , cursor->ns , strlen( cursor->ns ) + 1 );
-    data = mongo_data_append32( data , &cursor->skip );
-    data = mongo_data_append32( data , &cursor->limit );
-    data = mongo_data_append( data , cursor->query->data , bson_size( cursor->query ) );
-    if ( cursor->fields )
-        data = mongo_data_append( data , cursor->fields->data , bson_size( cursor->fields ) );
+    data = bulk->buf + bulk->len;
+    bulk->len += len;
+    return data;
+}
 
-    bson_fatal_msg( ( data == ( ( char * )mm ) + mm->head.len ), "query building fail!" );
+/* Serialize one message from its parts, followed by its getlasterror. */
+static int mongo_bulk_add( mongo_bulk *bulk, int opcode, const char *ns,
+                           const mongo_iovec *parts, int count ) {
+    mongo_header head;
+    mongo_gle_query gle;
+    mongo_bulk_op *op;
+    const bson *cmd = NULL;
+    size_t len = sizeof( head );
+    char *data;
+    int i;
 
-    res = mongo_message_send( cursor->conn , mm );
-    if( res != MONGO_OK ) {
-        return MONGO_ERROR;
-    }
+    for( i = 0; i < count; i++ )
+        len += parts[i].len;
 
-    res = mongo_read_response( cursor->conn, ( mongo_reply ** )&( cursor->reply ) );
-    if( res != MONGO_OK ) {
+    if( mongo_header_init( &head, len, 0, 0, opcode ) != MONGO_OK ) {
+        bulk->conn->err = MONGO_BSON_TOO_LARGE;
         return MONGO_ERROR;
     }
 
-    if( cursor->reply->fields.num == 1 ) {
-        bson_init_finished_data( &temp, &cursor->reply->objs, 0 );
-        if( bson_find( &it, &temp, "$err" ) ) {
-            mongo_set_last_error( cursor->conn, &it, &temp );
-            cursor->err = MONGO_CURSOR_QUERY_FAIL;
+    if( bulk->write_concern ) {
+        cmd = bulk->write_concern->cmd;
+        if( mongo_gle_query_init( &gle, ns, cmd ) != MONGO_OK ) {
+            __mongo_set_error( bulk->conn, MONGO_NS_INVALID, "Database name is too long.", 0 );
             return MONGO_ERROR;
         }
     }
 
-    cursor->seen += cursor->reply->fields.num;
-    cursor->flags |= MONGO_CURSOR_QUERY_SENT;
+    if( bulk->count == bulk->ops_size ) {
+        bulk->ops_size = bulk->ops_size ? bulk->ops_size * 2 : 64;
+        bulk->ops = ( mongo_bulk_op * )bson_realloc( bulk->ops,
+                    bulk->ops_size * sizeof( mongo_bulk_op ) );
+    }
+    op = &bulk->ops[bulk->count++];
+    memset( op, 0, sizeof( mongo_bulk_op ) );
+    op->opcode = opcode;
+    op->start = bulk->len;
+
+    data = mongo_bulk_reserve( bulk, len );
+    data = mongo_data_append( data, &head, sizeof( head ) );
+    for( i = 0; i < count; i++ )
+        data = mongo_data_append( data, parts[i].base, parts[i].len );
+
+    if( cmd ) {
+        data = mongo_bulk_reserve( bulk, sizeof( gle.head ) + gle.len + bson_size( cmd )
+                                   + bson_size( bson_shared_empty( ) ) );
+        data = mongo_data_append( data, &gle.head, sizeof( gle.head ) );
+        data = mongo_data_append( data, gle.body, gle.len );
+        data = mongo_data_append( data, cmd->data, bson_size( cmd ) );
+        mongo_data_append( data, bson_shared_empty( )->data, bson_size( bson_shared_empty( ) ) );
+    }
+
     return MONGO_OK;
 }
 
-static int mongo_cursor_get_more( mongo_cursor *cursor ) {
-    int res;
+MONGO_EXPORT int mongo_bulk_insert( mongo_bulk *bulk, const char *ns, const bson *data ) {
+    mongo_iovec parts[3];
 
-    if( cursor->limit > 0 && cursor->seen >= cursor->limit ) {
-        cursor->err = MONGO_CURSOR_EXHAUSTED;
-        return MONGO_ERROR;
-    }
-    else if( ! cursor->reply ) {
-        cursor->err = MONGO_CURSOR_INVALID;
+    if( mongo_validate_ns( bulk->conn, ns ) != MONGO_OK )
         return MONGO_ERROR;
-    }
-    else if( ! cursor->reply->fields.cursorID ) {
-        cursor->err = MONGO_CURSOR_EXHAUSTED;
+
+    if( mongo_bson_valid( bulk->conn, data, 1 ) != MONGO_OK )
         return MONGO_ERROR;
-    }
-    else {
-        char *data;
-        size_t sl = strlen( cursor->ns )+1;
-        int limit = 0;
-        mongo_message *mm;
-
-        if( cursor->limit > 0 )
-            limit = cursor->limit - cursor->seen;
-
-        mm = mongo_message_create( 16 /*header*/
-                                   +4 /*ZERO*/
-                                   +sl
-                                   +4 /*numToReturn*/
-                                   +8 /*cursorID*/
-                                   , 0, 0, MONGO_OP_GET_MORE );
-        if( mm == NULL ) {
-            return MONGO_ERROR;
-        }
 
-        data = &mm->data;
-        data = mongo_data_append32( data, &ZERO );
-        data = mongo_data_append( data, cursor->ns, sl );
-        data = mongo_data_append32( data, &limit );
-        mongo_data_append64( data, &cursor->reply->fields.cursorID );
+    parts[0].base = &ZERO;
+    parts[0].len = 4;
+    parts[1].base = ns;
+    parts[1].len = strlen( ns ) + 1;
+    parts[2].base = data->data;
+    parts[2].len = bson_size( data );
 
-        bson_free( cursor->reply );
-        res = mongo_message_send( cursor->conn, mm );
-        if( res != MONGO_OK ) {
-            mongo_cursor_destroy( cursor );
-            return MONGO_ERROR;
-        }
+    return mongo_bulk_add( bulk, MONGO_OP_INSERT, ns, parts, 3 );
+}
 
-        res = mongo_read_response( cursor->conn, &( cursor->reply ) );
-        if( res != MONGO_OK )
-            return MONGO_ERROR;
+MONGO_EXPORT int mongo_bulk_update( mongo_bulk *bulk, const char *ns, const bson *cond,
+                                    const bson *op, int flags ) {
+    mongo_iovec parts[5];
+    int update_flags;
+
+    if( mongo_validate_ns( bulk->conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_bson_valid( bulk->conn, op, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    bson_little_endian32( &update_flags, &flags );
+
+    parts[0].base = &ZERO;
+    parts[0].len = 4;
+    parts[1].base = ns;
+    parts[1].len = strlen( ns ) + 1;
+    parts[2].base = &update_flags;
+    parts[2].len = 4;
+    parts[3].base = cond->data;
+    parts[3].len = bson_size( cond );
+    parts[4].base = op->data;
+    parts[4].len = bson_size( op );
+
+    return mongo_bulk_add( bulk, MONGO_OP_UPDATE, ns, parts, 5 );
+}
+
+MONGO_EXPORT int mongo_bulk_remove( mongo_bulk *bulk, const char *ns, const bson *cond ) {
+    mongo_iovec parts[4];
+
+    if( mongo_validate_ns( bulk->conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_bson_valid( bulk->conn, cond, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    parts[0].base = &ZERO;
+    parts[0].len = 4;
+    parts[1].base = ns;
+    parts[1].len = strlen( ns ) + 1;
+    parts[2].base = &ZERO;
+    parts[2].len = 4;
+    parts[3].base = cond->data;
+    parts[3].len = bson_size( cond );
+
+    return mongo_bulk_add( bulk, MONGO_OP_DELETE, ns, parts, 4 );
+}
+
+/* Read one operation's getlasterror reply into its result. */
+static int mongo_bulk_read_ack( mongo *conn, mongo_bulk_op *op ) {
+    mongo_reply *reply = NULL;
+    bson response[1];
+    bson_iterator it[1];
+
+    if( mongo_read_response( conn, &reply ) != MONGO_OK ) {
+        if( conn->err == MONGO_CONN_SUCCESS )
+            __mongo_set_error( conn, MONGO_READ_SIZE_ERROR, "Invalid getlasterror reply.", 0 );
+        return MONGO_ERROR;
+    }
+
+    op->status = MONGO_BULK_DONE;
+
+    if( reply->fields.num > 0 ) {
+        bson_init_finished_data( response, &reply->objs, 0 );
+
+        if( bson_find( it, response, "n" ) )
+            op->n = bson_iterator_int( it );
+
+        if( mongo_parse_last_error( conn, response ) != MONGO_OK ) {
+            op->status = MONGO_BULK_FAILED;
+            op->code = conn->lasterrcode;
+            op->errmsg = ( char * )bson_malloc( strlen( conn->lasterrstr ) + 1 );
+            strcpy( op->errmsg, conn->lasterrstr );
+        }
+    }
+
+    mongo_reply_release( conn, reply );
+    return MONGO_OK;
+}
+
+/* Send operations from *next up to end on conn and record how each one
+ * went, advancing *next past everything executed. An ordered bulk stops
+ * after its first failure. Returns MONGO_ERROR only on network errors,
+ * after closing conn: replies to the rest of the window may still be
+ * on their way and would be taken for the answers to later requests.
+ *
+ * With a write concern, an ordered bulk sends one operation at a time.
+ * Legacy writes run whether or not the one before them failed, so any
+ * operation sent ahead of an acknowledgement could run after a failure.
+ * An unordered one keeps a getlasterror per operation, since
+ * getlasterror only describes the latest error on the connection. */
+static int mongo_bulk_run( mongo_bulk *bulk, mongo *conn, int *next, int end ) {
+    mongo_gather g[1];
+    size_t from, to;
+    int i, j, stop, window;
+
+    if( ! conn->connected && *next < end ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, "Not connected.", 0 );
+        return MONGO_ERROR;
+    }
+
+    if( ! bulk->write_concern )
+        window = end - *next;
+    else if( bulk->ordered )
+        window = 1;
+    else
+        window = MONGO_BULK_WINDOW;
+
+    while( *next < end ) {
+        stop = end - *next > window ? *next + window : end;
+
+        /* Operations a parallel execution already ran are skipped; each
+         * run of unsent ones goes out as one segment. */
+        mongo_gather_init( g, conn );
+        for( i = *next; i < stop; i = j ) {
+            for( ; i < stop && bulk->ops[i].status != MONGO_BULK_UNSENT; i++ )
+                ;
+            for( j = i; j < stop && bulk->ops[j].status == MONGO_BULK_UNSENT; j++ )
+                ;
+            if( i == j )
+                break;
+            from = bulk->ops[i].start;
+            to = j < bulk->count ? bulk->ops[j].start : bulk->len;
+            mongo_gather_add( g, bulk->buf + from, to - from );
+        }
+        if( mongo_gather_flush( g ) != MONGO_OK ) {
+            mongo_disconnect( conn );
+            return MONGO_ERROR;
+        }
+
+        for( i = *next; i < stop; i++ ) {
+            if( bulk->ops[i].status != MONGO_BULK_UNSENT )
+                continue;
+            if( ! bulk->write_concern )
+                bulk->ops[i].status = MONGO_BULK_DONE;
+            else if( mongo_bulk_read_ack( conn, &bulk->ops[i] ) != MONGO_OK ) {
+                *next = i;
+                mongo_disconnect( conn );
+                return MONGO_ERROR;
+            }
+        }
+
+        *next = stop;
+        if( bulk->ordered && bulk->ops[stop - 1].status == MONGO_BULK_FAILED )
+            break;
+    }
+
+    return MONGO_OK;
+}
+
+/* Report the first failure among operations start to end - 1 on conn. */
+static int mongo_bulk_report( mongo_bulk *bulk, mongo *conn, int start, int end ) {
+    mongo_bulk_op *op;
+
+    for( ; start < end; start++ ) {
+        op = &bulk->ops[start];
+        if( op->status == MONGO_BULK_FAILED ) {
+            __mongo_set_error( conn, MONGO_WRITE_ERROR,
+                               "See conn->lasterrstr for details.", 0 );
+            conn->lasterrcode = op->code;
+            strncpy( conn->lasterrstr, op->errmsg, MONGO_ERR_LEN );
+            conn->lasterrstr[MONGO_ERR_LEN - 1] = '\0';
+            return MONGO_ERROR;
+        }
+    }
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_bulk_execute( mongo_bulk *bulk ) {
+    int start = bulk->next;
+
+    mongo_clear_errors( bulk->conn );
+
+    if( mongo_bulk_run( bulk, bulk->conn, &bulk->next, bulk->count ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_bulk_report( bulk, bulk->conn, start, bulk->next );
+}
+
+typedef struct {
+    mongo_bulk *bulk;
+    mongo *conn;
+    int next;
+    int end;
+    int res;
+    void *thread;
+} mongo_bulk_worker;
+
+static void mongo_bulk_worker_run( void *arg ) {
+    mongo_bulk_worker *w = ( mongo_bulk_worker * )arg;
+
+    mongo_clear_errors( w->conn );
+    w->res = mongo_bulk_run( w->bulk, w->conn, &w->next, w->end );
+}
+
+MONGO_EXPORT int mongo_bulk_execute_parallel( mongo_bulk *bulk, mongo **conns, int count ) {
+    mongo_bulk_worker *workers;
+    mongo_saved_error io_error;
+    int i, start = bulk->next, remaining = bulk->count - bulk->next;
+    int res = MONGO_OK;
+
+    if( count < 1 )
+        return MONGO_ERROR;
+
+    /* Ordered bulks must go one operation after another. */
+    if( bulk->ordered || remaining < 1 )
+        count = 1;
+    else if( count > remaining )
+        count = remaining;
+
+    /* Each worker takes a contiguous share of the operations, so that
+     * their results land in disjoint parts of bulk->ops. */
+    workers = ( mongo_bulk_worker * )bson_malloc( count * sizeof( mongo_bulk_worker ) );
+    for( i = 0; i < count; i++ ) {
+        workers[i].bulk = bulk;
+        workers[i].conn = conns[i];
+        workers[i].next = start + ( int )( ( int64_t )remaining * i / count );
+        workers[i].end = start + ( int )( ( int64_t )remaining * ( i + 1 ) / count );
+        workers[i].thread = NULL;
+    }
+
+    for( i = 1; i < count; i++ ) {
+        if( mongo_env_thread_create( &workers[i].thread, mongo_bulk_worker_run,
+                                     &workers[i] ) != MONGO_OK )
+            workers[i].thread = NULL;
+    }
+
+    /* This thread does the first share, and any a thread was not
+     * started for. */
+    mongo_bulk_worker_run( &workers[0] );
+    for( i = 1; i < count; i++ ) {
+        if( workers[i].thread )
+            mongo_env_thread_join( workers[i].thread );
+        else
+            mongo_bulk_worker_run( &workers[i] );
+    }
+
+    /* A network error on any connection is reported on bulk->conn.
+     * bulk->next goes back to the first operation that failed share
+     * did not see through; later shares' results stay in bulk->ops,
+     * and executing again skips what they ran. */
+    bulk->next = count == 1 ? workers[0].next : bulk->count;
+    for( i = 0; i < count; i++ ) {
+        if( workers[i].res == MONGO_OK )
+            continue;
+        if( res == MONGO_OK ) {
+            mongo_save_error( workers[i].conn, &io_error );
+            mongo_restore_error( bulk->conn, &io_error );
+            res = MONGO_ERROR;
+        }
+        if( workers[i].next < bulk->next )
+            bulk->next = workers[i].next;
+    }
+    if( res == MONGO_OK )
+        mongo_clear_errors( bulk->conn );
+
+    bson_free( workers );
+
+    if( res != MONGO_OK )
+        return MONGO_ERROR;
+
+    return mongo_bulk_report( bulk, bulk->conn, start, bulk->next );
+}
+
+MONGO_EXPORT void mongo_bulk_destroy( mongo_bulk *bulk ) {
+    int i;
+
+    for( i = 0; i < bulk->count; i++ )
+        bson_free( bulk->ops[i].errmsg );
+
+    bson_free( bulk->ops );
+    bson_free( bulk->buf );
+    memset( bulk, 0, sizeof( mongo_bulk ) );
+}
+
+/* numberToReturn for the next batch: the batch size, cut short by
+ * what is left of the limit. */
+static int mongo_cursor_batch_limit( mongo_cursor *cursor ) {
+    int n = cursor->batch_size;
+
+    /* The server closes a cursor after a batch of one. */
+    if( n == 1 )
+        n = 2;
+
+    if( cursor->limit < 0 )
+        return cursor->limit;
+    if( cursor->limit > 0 && ( n == 0 || cursor->limit - cursor->seen < n ) )
+        n = cursor->limit - cursor->seen;
+
+    return n;
+}
+
+static int mongo_cursor_send_query( mongo_cursor *cursor );
+static int mongo_prepared_send( mongo *conn, mongo_prepared *prepared, int options, int limit );
+
+/* Note on the connection whether an exhaust cursor's batches are still
+ * arriving unasked. */
+static void mongo_cursor_track_stream( mongo_cursor *cursor ) {
+    if( !( cursor->options & MONGO_EXHAUST ) )
+        return;
+    if( cursor->reply->fields.cursorID )
+        cursor->conn->streaming = cursor;
+    else if( cursor->conn->streaming == cursor )
+        cursor->conn->streaming = NULL;
+}
+
+static int mongo_cursor_op_query( mongo_cursor *cursor ) {
+    int res;
+    int64_t sent;
+    mongo *server;
+    bson temp;
+    bson_iterator it;
+
+    /* Clear any errors. */
+    mongo_clear_errors( cursor->conn );
+
+    /* Set up default values for query and fields, if necessary. A
+     * prepared query carries its own. */
+    if( ! cursor->prepared ) {
+        if( ! cursor->query )
+            cursor->query = bson_shared_empty( );
+        else if( mongo_cursor_bson_valid( cursor, cursor->query ) != MONGO_OK )
+            return MONGO_ERROR;
+
+        if( ! cursor->fields )
+            cursor->fields = bson_shared_empty( );
+        else if( mongo_cursor_bson_valid( cursor, cursor->fields ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    /* Commands always go to the primary. */
+    if( cursor->read_pref != MONGO_READ_PRIMARY && ! strstr( cursor->ns, ".$cmd" ) ) {
+        if( ! ( server = mongo_read_connection( cursor->conn, cursor->read_pref ) ) )
+            return MONGO_ERROR;
+        if( server != cursor->conn ) {
+            cursor->conn = server;
+            mongo_clear_errors( server );
+        }
+        cursor->options |= MONGO_SLAVE_OK;
+    }
+
+    sent = mongo_env_time_us( );
+    if( cursor->prepared )
+        res = mongo_prepared_send( cursor->conn, cursor->prepared, cursor->options,
+                                   mongo_cursor_batch_limit( cursor ) );
+    else
+        res = mongo_cursor_send_query( cursor );
+    if( res != MONGO_OK )
+        return MONGO_ERROR;
+
+    res = mongo_read_response( cursor->conn, ( mongo_reply ** )&( cursor->reply ) );
+    if( res != MONGO_OK ) {
+        return MONGO_ERROR;
+    }
+    mongo_cursor_track_stream( cursor );
+    mongo_cursor_batch_arrived( cursor, sent );
+
+    if( cursor->reply->fields.num == 1 ) {
+        bson_init_finished_data( &temp, &cursor->reply->objs, 0 );
+        if( bson_find( &it, &temp, "$err" ) ) {
+            mongo_set_last_error( cursor->conn, &it, &temp );
+            cursor->err = MONGO_CURSOR_QUERY_FAIL;
+            return MONGO_ERROR;
+        }
+    }
+
+    cursor->seen += cursor->reply->fields.num;
+    cursor->flags |= MONGO_CURSOR_QUERY_SENT;
+    return MONGO_OK;
+}
+
+static int mongo_cursor_send_query( mongo_cursor *cursor ) {
+    int limit;
+    char *data;
+    mongo_message *mm;
+
+    mm = mongo_message_create( 16 + /* header */
+                               4 + /*  options */
+                               strlen( cursor->ns ) + 1 + /* ns */
+                               4 + 4 + /* skip,return */
+                               bson_size( cursor->query ) +
+                               bson_size( cursor->fields ) ,
+                               0 , 0 , MONGO_OP_QUERY );
+    if( mm == NULL ) {
+        return MONGO_ERROR;
+    }
+
+    data = &mm->data;
+    data = mongo_data_append32( data , &cursor->options );
+    data = mongo_data_append( data , cursor->ns , strlen( cursor->ns ) + 1 );
+    data = mongo_data_append32( data , &cursor->skip );
+    limit = mongo_cursor_batch_limit( cursor );
+    data = mongo_data_append32( data , &limit );
+    data = mongo_data_append( data , cursor->query->data , bson_size( cursor->query ) );
+    if ( cursor->fields )
+        data = mongo_data_append( data , cursor->fields->data , bson_size( cursor->fields ) );
+
+    bson_fatal_msg( ( data == ( ( char * )mm ) + mm->head.len ), "query building fail!" );
+
+    return mongo_message_send( cursor->conn , mm );
+}
+
+/* Note that the cursor's current batch is available to the consumer,
+ * who has been waiting for it since waited_since. */
+static void mongo_cursor_batch_arrived( mongo_cursor *cursor, int64_t waited_since ) {
+    int64_t now = mongo_env_time_us( );
+
+    cursor->batch_wait_us = now - waited_since;
+    cursor->batch_start_us = now;
+}
+
+/* Double the batch size, up to the cap, if the consumer gets through a
+ * batch no slower than it waits for one: round trips are then what
+ * holds it back. A slow consumer keeps the size it has. Called as the
+ * next getmore goes out, which may be before the batch is finished;
+ * the time spent so far is scaled up to the whole batch. */
+static void mongo_cursor_grow_batch( mongo_cursor *cursor ) {
+    int64_t spent;
+    int num = cursor->reply->fields.num;
+
+    if( cursor->max_batch_size <= cursor->batch_size || cursor->batch_size <= 0 )
+        return;
+
+    spent = mongo_env_time_us( ) - cursor->batch_start_us;
+    if( cursor->batch_seen > 0 && cursor->batch_seen < num )
+        spent = spent * num / cursor->batch_seen;
+    if( spent > cursor->batch_wait_us )
+        return;
+
+    cursor->batch_size = cursor->batch_size > cursor->max_batch_size / 2 ?
+                         cursor->max_batch_size : cursor->batch_size * 2;
+}
+
+/* Send a getmore for the batch after the cursor's current reply. */
+static int mongo_cursor_send_get_more( mongo_cursor *cursor ) {
+    char *data;
+    size_t sl = strlen( cursor->ns )+1;
+    int limit;
+    mongo_message *mm;
+
+    mongo_cursor_grow_batch( cursor );
+    limit = mongo_cursor_batch_limit( cursor );
+
+    mm = mongo_message_create( 16 /*header*/
+                               +4 /*ZERO*/
+                               +sl
+                               +4 /*numToReturn*/
+                               +8 /*cursorID*/
+                               , 0, 0, MONGO_OP_GET_MORE );
+    if( mm == NULL ) {
+        return MONGO_ERROR;
+    }
+
+    data = &mm->data;
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append( data, cursor->ns, sl );
+    data = mongo_data_append32( data, &limit );
+    mongo_data_append64( data, &cursor->reply->fields.cursorID );
+
+    return mongo_message_send( cursor->conn, mm );
+}
+
+/* Read the reply to a read-ahead getmore and hold it for the cursor's
+ * next batch. */
+static int mongo_cursor_land_prefetch( mongo_cursor *cursor ) {
+    mongo *conn = cursor->conn;
+    int res;
+
+    cursor->flags &= ~MONGO_CURSOR_PREFETCHING;
+    conn->prefetching = NULL;
+
+    if( ( res = mongo_read_response( conn, &cursor->prefetched ) ) != MONGO_OK ) {
+        /* The cursor's next batch went with the reply. */
+        cursor->flags |= MONGO_CURSOR_FAILED;
+        cursor->err = MONGO_CURSOR_INVALID;
+        if( res == MONGO_READ_SIZE_ERROR )
+            __mongo_set_error( conn, MONGO_READ_SIZE_ERROR, "Invalid read-ahead reply.", 0 );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/* Send the next getmore early once enough of this batch is returned.
+ * Only one read-ahead is outstanding per connection; sending this one
+ * reads the reply to any other first. */
+static void mongo_cursor_prefetch( mongo_cursor *cursor ) {
+    mongo_reply *reply = cursor->reply;
+
+    if( !( cursor->flags & MONGO_CURSOR_PREFETCH ) ||
+            ( cursor->flags & MONGO_CURSOR_PREFETCHING ) || cursor->prefetched ||
+            ( cursor->options & ( MONGO_TAILABLE | MONGO_EXHAUST ) ) || ! reply->fields.cursorID ||
+            ( cursor->limit > 0 && cursor->seen >= cursor->limit ) )
+        return;
+
+    if( ( int64_t )cursor->batch_seen * 100 < ( int64_t )cursor->prefetch * reply->fields.num )
+        return;
+
+    if( mongo_cursor_send_get_more( cursor ) == MONGO_OK ) {
+        cursor->flags |= MONGO_CURSOR_PREFETCHING;
+        cursor->conn->prefetching = cursor;
+    }
+}
+
+static int mongo_cursor_get_more( mongo_cursor *cursor ) {
+    int res;
+    int64_t waited_since = mongo_env_time_us( );
+
+    if( cursor->flags & MONGO_CURSOR_FAILED )
+        return MONGO_ERROR;
+
+    if( cursor->flags & MONGO_CURSOR_PREFETCHING ) {
+        if( mongo_cursor_land_prefetch( cursor ) != MONGO_OK )
+            return MONGO_ERROR;
+    }
+
+    if( cursor->prefetched ) {
+        mongo_reply_release( cursor->conn, cursor->reply );
+        cursor->reply = cursor->prefetched;
+        cursor->prefetched = NULL;
+        cursor->current.data = NULL;
+        cursor->batch_seen = 0;
+        cursor->seen += cursor->reply->fields.num;
+        mongo_cursor_batch_arrived( cursor, waited_since );
+        return MONGO_OK;
+    }
+
+    if( cursor->limit > 0 && cursor->seen >= cursor->limit ) {
+        cursor->err = MONGO_CURSOR_EXHAUSTED;
+        return MONGO_ERROR;
+    }
+    else if( ! cursor->reply ) {
+        cursor->err = MONGO_CURSOR_INVALID;
+        return MONGO_ERROR;
+    }
+    else if( ! cursor->reply->fields.cursorID ) {
+        cursor->err = MONGO_CURSOR_EXHAUSTED;
+        return MONGO_ERROR;
+    }
+    else {
+        mongo_reply *spare = NULL;
+
+        /* An exhaust cursor's server sends every batch unasked. */
+        if( cursor->options & MONGO_EXHAUST )
+            res = MONGO_OK;
+        else
+            res = mongo_cursor_send_get_more( cursor );
+
+        if( res == MONGO_OK && ( cursor->flags & MONGO_CURSOR_KEEP_BUFFER ) )
+            spare = cursor->reply;
+        else
+            mongo_reply_release( cursor->conn, cursor->reply );
+        cursor->reply = NULL;
+
+        if( res != MONGO_OK ) {
+            mongo_cursor_destroy( cursor );
+            return MONGO_ERROR;
+        }
+
+        cursor->reply = spare;
+        res = mongo_read_response( cursor->conn, &( cursor->reply ) );
+        if( res != MONGO_OK )
+            return MONGO_ERROR;
+        mongo_cursor_track_stream( cursor );
 
         cursor->current.data = NULL;
+        cursor->batch_seen = 0;
         cursor->seen += cursor->reply->fields.num;
+        mongo_cursor_batch_arrived( cursor, waited_since );
+
+        return MONGO_OK;
+    }
+}
+
+/* Errors from a query sent to another member belong on the client too. */
+static void mongo_cursor_copy_error( mongo_cursor *cursor, mongo *conn ) {
+    mongo_saved_error saved;
+
+    if( cursor->conn != conn ) {
+        mongo_save_error( cursor->conn, &saved );
+        mongo_restore_error( conn, &saved );
+    }
+}
+
+MONGO_EXPORT mongo_cursor *mongo_find( mongo *conn, const char *ns, const bson *query,
+                                       const bson *fields, int limit, int skip, int options ) {
+
+    mongo_cursor *cursor = mongo_cursor_alloc();
+    mongo_cursor_init( cursor, conn, ns );
+    cursor->flags |= MONGO_CURSOR_MUST_FREE;
+
+    mongo_cursor_set_query( cursor, query );
+    mongo_cursor_set_fields( cursor, fields );
+    mongo_cursor_set_limit( cursor, limit );
+    mongo_cursor_set_skip( cursor, skip );
+    mongo_cursor_set_options( cursor, options );
+
+    if( mongo_cursor_op_query( cursor ) == MONGO_OK )
+        return cursor;
+    else {
+        mongo_cursor_copy_error( cursor, conn );
+        mongo_cursor_destroy( cursor );
+        return NULL;
+    }
+}
+
+/* Point a cursor at ns without copying it; ns must outlive the cursor. */
+static void mongo_cursor_init_shared_ns( mongo_cursor *cursor, mongo *conn, const char *ns ) {
+    memset( cursor, 0, sizeof( mongo_cursor ) );
+    cursor->conn = conn;
+    cursor->read_pref = conn->read_pref;
+    cursor->ns = ns;
+    cursor->flags = MONGO_CURSOR_SHARED_NS;
+}
+
+/* Fetch the first match through an initialized stack cursor, then
+ * destroy it. */
+static int mongo_cursor_find_one( mongo_cursor *cursor, const bson *query,
+                                  const bson *fields, bson *out ) {
+    mongo *conn = cursor->conn;
+    int ret;
+
+    mongo_cursor_set_query( cursor, query );
+    mongo_cursor_set_fields( cursor, fields );
+    mongo_cursor_set_limit( cursor, 1 );
+
+    ret = mongo_cursor_next(cursor);
+    if (ret == MONGO_OK && out)
+        ret = bson_copy(out, &cursor->current);
+    if (ret != MONGO_OK && out)
+        bson_init_zero(out);
+    if (ret != MONGO_OK)
+        mongo_cursor_copy_error( cursor, conn );
+
+    mongo_cursor_destroy( cursor );
+    return ret;
+}
+
+MONGO_EXPORT int mongo_find_one( mongo *conn, const char *ns, const bson *query,
+                                 const bson *fields, bson *out ) {
+    mongo_cursor cursor[1];
+    mongo_cursor_init( cursor, conn, ns );
+    return mongo_cursor_find_one( cursor, query, fields, out );
+}
+
+/*********************************************************************
+Prepared operations
+**********************************************************************/
+
+/* Copy the two documents of a prepared operation in behind the len
+ * bytes of header and fields already in prepared->data. */
+static void mongo_prepared_finish( mongo_prepared *prepared, char *data,
+                                   const bson *first, const bson *second ) {
+    prepared->doc_offset[0] = ( int )( data - prepared->data );
+    data = mongo_data_append( data, first->data, bson_size( first ) );
+    prepared->doc_offset[1] = ( int )( data - prepared->data );
+    mongo_data_append( data, second->data, bson_size( second ) );
+}
+
+static int mongo_prepared_init( mongo *conn, mongo_prepared *prepared, const char *ns,
+                                int op, const bson *first, const bson *second, size_t fields_len ) {
+    size_t len, sl = strlen( ns ) + 1;
+
+    memset( prepared, 0, sizeof( mongo_prepared ) );
+
+    /* Checked once here, as the documents are never looked at again;
+     * binding only swaps values of the same type and length. */
+    if( mongo_bson_valid( conn, first, 0 ) != MONGO_OK ||
+            mongo_bson_valid( conn, second, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    len = 16 + 4 + sl + fields_len + bson_size( first ) + bson_size( second );
+    if( len >= INT32_MAX )
+        return MONGO_ERROR;
+
+    prepared->op = op;
+    prepared->len = ( int )len;
+    prepared->data = ( char * )bson_malloc( len );
+    prepared->ns = ( char * )bson_malloc( sl );
+    memcpy( prepared->ns, ns, sl );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepare_query( mongo *conn, mongo_prepared *prepared, const char *ns,
+                                      const bson *query, const bson *fields,
+                                      int limit, int skip, int options ) {
+    char *data;
+
+    if( ! fields )
+        fields = bson_shared_empty( );
+
+    if( mongo_prepared_init( conn, prepared, ns, MONGO_OP_QUERY, query, fields, 4 + 4 ) != MONGO_OK )
+        return MONGO_ERROR;
 
-        return MONGO_OK;
+    prepared->limit = limit;
+    prepared->skip = skip;
+    prepared->options = options;
+
+    /* The id, options and limit are filled in as it is sent. */
+    mongo_header_init( ( mongo_header * )prepared->data, prepared->len, 0, 0, MONGO_OP_QUERY );
+    data = prepared->data + 16;
+    data = mongo_data_append32( data, &options );
+    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
+    data = mongo_data_append32( data, &skip );
+    data = mongo_data_append32( data, &limit );
+    mongo_prepared_finish( prepared, data, query, fields );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepare_update( mongo *conn, mongo_prepared *prepared, const char *ns,
+                                       const bson *cond, const bson *op, int flags ) {
+    char *data;
+
+    if( mongo_prepared_init( conn, prepared, ns, MONGO_OP_UPDATE, cond, op, 4 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    mongo_header_init( ( mongo_header * )prepared->data, prepared->len, 0, 0, MONGO_OP_UPDATE );
+    data = prepared->data + 16;
+    data = mongo_data_append32( data, &ZERO );
+    data = mongo_data_append( data, ns, strlen( ns ) + 1 );
+    data = mongo_data_append32( data, &flags );
+    mongo_prepared_finish( prepared, data, cond, op );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepared_bind( mongo_prepared *prepared, int doc, const char *key ) {
+    mongo_prepared_param *param;
+    bson_iterator it[1], sub[1];
+    const char *dot;
+    size_t part_len;
+    bson_type type;
+
+    if( prepared->param_count == MONGO_PREPARED_MAX_PARAMS || doc < 0 || doc > 1 )
+        return -1;
+
+    bson_iterator_from_buffer( it, prepared->data + prepared->doc_offset[doc] );
+
+    /* Walk down one dotted component at a time. */
+    for( ;; ) {
+        dot = strchr( key, '.' );
+        part_len = dot ? ( size_t )( dot - key ) : strlen( key );
+
+        while( ( type = bson_iterator_next( it ) ) != BSON_EOO ) {
+            if( strncmp( bson_iterator_key( it ), key, part_len ) == 0 &&
+                    bson_iterator_key( it )[part_len] == '\0' )
+                break;
+        }
+        if( type == BSON_EOO )
+            return -1;
+
+        if( ! dot )
+            break;
+        if( type != BSON_OBJECT && type != BSON_ARRAY )
+            return -1;
+        bson_iterator_subiterator( it, sub );
+        *it = *sub;
+        key = dot + 1;
     }
+
+    if( type != BSON_INT && type != BSON_LONG && type != BSON_DOUBLE &&
+            type != BSON_OID && type != BSON_STRING )
+        return -1;
+
+    param = &prepared->params[prepared->param_count];
+    param->offset = ( int )( bson_iterator_value( it ) - prepared->data );
+    param->type = type;
+    param->len = type == BSON_STRING ? bson_iterator_string_len( it ) - 1 : 0;
+
+    return prepared->param_count++;
 }
 
-MONGO_EXPORT mongo_cursor *mongo_find( mongo *conn, const char *ns, const bson *query,
-                                       const bson *fields, int limit, int skip, int options ) {
+/* The parameter's value in the message, if it has the given type. */
+static char *mongo_prepared_value( mongo_prepared *prepared, int param, int type ) {
+    if( param < 0 || param >= prepared->param_count ||
+            prepared->params[param].type != type )
+        return NULL;
+    return prepared->data + prepared->params[param].offset;
+}
 
-    mongo_cursor *cursor = mongo_cursor_alloc();
-    mongo_cursor_init( cursor, conn, ns );
-    cursor->flags |= MONGO_CURSOR_MUST_FREE;
+MONGO_EXPORT int mongo_prepared_set_int( mongo_prepared *prepared, int param, int value ) {
+    char *data = mongo_prepared_value( prepared, param, BSON_INT );
 
-    mongo_cursor_set_query( cursor, query );
-    mongo_cursor_set_fields( cursor, fields );
-    mongo_cursor_set_limit( cursor, limit );
-    mongo_cursor_set_skip( cursor, skip );
-    mongo_cursor_set_options( cursor, options );
+    if( ! data )
+        return MONGO_ERROR;
+    mongo_data_append32( data, &value );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepared_set_long( mongo_prepared *prepared, int param, int64_t value ) {
+    char *data = mongo_prepared_value( prepared, param, BSON_LONG );
+
+    if( ! data )
+        return MONGO_ERROR;
+    mongo_data_append64( data, &value );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepared_set_double( mongo_prepared *prepared, int param, double value ) {
+    char *data = mongo_prepared_value( prepared, param, BSON_DOUBLE );
+
+    if( ! data )
+        return MONGO_ERROR;
+    mongo_data_append64( data, &value );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepared_set_oid( mongo_prepared *prepared, int param, const bson_oid_t *value ) {
+    char *data = mongo_prepared_value( prepared, param, BSON_OID );
+
+    if( ! data )
+        return MONGO_ERROR;
+    mongo_data_append( data, value, 12 );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_prepared_set_string( mongo_prepared *prepared, int param, const char *value ) {
+    char *data = mongo_prepared_value( prepared, param, BSON_STRING );
+
+    if( ! data || strlen( value ) != ( size_t )prepared->params[param].len )
+        return MONGO_ERROR;
+    mongo_data_append( data + 4, value, prepared->params[param].len );
+    return MONGO_OK;
+}
+
+/* Give the message a fresh request id and, for queries, the options
+ * and batch limit the cursor wants. */
+static void mongo_prepared_stamp( mongo_prepared *prepared, int options, int limit ) {
+    int id = mongo_next_request_id( );
+    size_t sl = strlen( prepared->ns ) + 1;
+
+    mongo_data_append32( prepared->data + 4, &id );
+    if( prepared->op == MONGO_OP_QUERY ) {
+        mongo_data_append32( prepared->data + 16, &options );
+        mongo_data_append32( prepared->data + 16 + 4 + sl + 4, &limit );
+    }
+}
+
+/* Send a prepared query as it lies. */
+static int mongo_prepared_send( mongo *conn, mongo_prepared *prepared, int options, int limit ) {
+    mongo_gather g[1];
+
+    mongo_prepared_stamp( prepared, options, limit );
+    mongo_gather_init( g, conn );
+    mongo_gather_add( g, prepared->data, prepared->len );
+    return mongo_gather_flush( g );
+}
+
+static int mongo_prepared_check( mongo *conn, mongo_prepared *prepared, int op ) {
+    if( prepared->op != op ) {
+        __mongo_set_error( conn, MONGO_BSON_INVALID, "Wrong kind of prepared operation.", 0 );
+        return MONGO_ERROR;
+    }
+    if( prepared->len > conn->max_msg_size ) {
+        conn->err = MONGO_BSON_TOO_LARGE;
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
+static void mongo_prepared_cursor_init( mongo_cursor *cursor, mongo *conn,
+                                        mongo_prepared *prepared ) {
+    mongo_cursor_init( cursor, conn, prepared->ns );
+    cursor->prepared = prepared;
+    mongo_cursor_set_limit( cursor, prepared->limit );
+    mongo_cursor_set_skip( cursor, prepared->skip );
+    mongo_cursor_set_options( cursor, prepared->options );
+}
+
+MONGO_EXPORT mongo_cursor *mongo_prepared_find( mongo *conn, mongo_prepared *prepared ) {
+    mongo_cursor *cursor;
+
+    if( mongo_prepared_check( conn, prepared, MONGO_OP_QUERY ) != MONGO_OK )
+        return NULL;
+
+    cursor = mongo_cursor_alloc();
+    mongo_prepared_cursor_init( cursor, conn, prepared );
+    cursor->flags |= MONGO_CURSOR_MUST_FREE;
 
     if( mongo_cursor_op_query( cursor ) == MONGO_OK )
         return cursor;
     else {
+        mongo_cursor_copy_error( cursor, conn );
         mongo_cursor_destroy( cursor );
         return NULL;
     }
 }
 
-MONGO_EXPORT int mongo_find_one( mongo *conn, const char *ns, const bson *query,
-                                 const bson *fields, bson *out ) {
+MONGO_EXPORT int mongo_prepared_find_one( mongo *conn, mongo_prepared *prepared, bson *out ) {
     int ret;
     mongo_cursor cursor[1];
-    mongo_cursor_init( cursor, conn, ns );
-    mongo_cursor_set_query( cursor, query );
-    mongo_cursor_set_fields( cursor, fields );
+
+    if( mongo_prepared_check( conn, prepared, MONGO_OP_QUERY ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    mongo_prepared_cursor_init( cursor, conn, prepared );
     mongo_cursor_set_limit( cursor, 1 );
 
-    ret = mongo_cursor_next(cursor);
-    if (ret == MONGO_OK && out)
-        ret = bson_copy(out, &cursor->current);
-    if (ret != MONGO_OK && out)
-        bson_init_zero(out);
+    ret = mongo_cursor_next( cursor );
+    if( ret == MONGO_OK && out )
+        ret = bson_copy( out, &cursor->current );
+    if( ret != MONGO_OK && out )
+        bson_init_zero( out );
+    if( ret != MONGO_OK )
+        mongo_cursor_copy_error( cursor, conn );
 
     mongo_cursor_destroy( cursor );
     return ret;
 }
 
+MONGO_EXPORT int mongo_prepared_update( mongo *conn, mongo_prepared *prepared,
+                                        mongo_write_concern *custom_write_concern ) {
+    mongo_write_concern *write_concern = NULL;
+    mongo_gather g[1];
+
+    if( mongo_prepared_check( conn, prepared, MONGO_OP_UPDATE ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_choose_write_concern( conn, custom_write_concern,
+                                    &write_concern ) == MONGO_ERROR )
+        return MONGO_ERROR;
+
+    mongo_clear_errors( conn );
+    mongo_prepared_stamp( prepared, 0, 0 );
+    mongo_gather_init( g, conn );
+    mongo_gather_add( g, prepared->data, prepared->len );
+    return mongo_gather_send_and_check_write_concern( conn, prepared->ns, g, write_concern );
+}
+
+MONGO_EXPORT void mongo_prepared_destroy( mongo_prepared *prepared ) {
+    bson_free( prepared->data );
+    bson_free( prepared->ns );
+    memset( prepared, 0, sizeof( mongo_prepared ) );
+}
+
 MONGO_EXPORT void mongo_cursor_init( mongo_cursor *cursor, mongo *conn, const char *ns ) {
     memset( cursor, 0, sizeof( mongo_cursor ) );
     cursor->conn = conn;
+    cursor->read_pref = conn->read_pref;
     cursor->ns = ( const char * )bson_malloc( strlen( ns ) + 1 );
     strncpy( ( char * )cursor->ns, ns, strlen( ns ) + 1 );
     cursor->current.data = NULL;
@@ -1348,10 +3246,44 @@ MONGO_EXPORT void mongo_cursor_set_limit( mongo_cursor *cursor, int limit ) {
     cursor->limit = limit;
 }
 
+MONGO_EXPORT int mongo_cursor_set_batch_size( mongo_cursor *cursor, int batch_size ) {
+    if( batch_size < 0 )
+        return MONGO_ERROR;
+    cursor->batch_size = batch_size;
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_cursor_set_batch_growth( mongo_cursor *cursor, int max_batch_size ) {
+    if( max_batch_size < 0 )
+        return MONGO_ERROR;
+    cursor->max_batch_size = max_batch_size;
+    return MONGO_OK;
+}
+
+MONGO_EXPORT void mongo_cursor_set_read_preference( mongo_cursor *cursor, int read_pref ) {
+    cursor->read_pref = read_pref;
+}
+
 MONGO_EXPORT void mongo_cursor_set_options( mongo_cursor *cursor, int options ) {
     cursor->options = options;
 }
 
+MONGO_EXPORT void mongo_cursor_set_keep_buffer( mongo_cursor *cursor, int keep ) {
+    if( keep )
+        cursor->flags |= MONGO_CURSOR_KEEP_BUFFER;
+    else
+        cursor->flags &= ~MONGO_CURSOR_KEEP_BUFFER;
+}
+
+MONGO_EXPORT void mongo_cursor_set_prefetch( mongo_cursor *cursor, int percent ) {
+    if( percent < 0 )
+        cursor->flags &= ~MONGO_CURSOR_PREFETCH;
+    else {
+        cursor->flags |= MONGO_CURSOR_PREFETCH;
+        cursor->prefetch = percent > 100 ? 100 : percent;
+    }
+}
+
 MONGO_EXPORT const char *mongo_cursor_data( mongo_cursor *cursor ) {
     return cursor->current.data;
 }
@@ -1367,6 +3299,11 @@ MONGO_EXPORT int mongo_cursor_next( mongo_cursor *cursor ) {
 
     if( cursor == NULL ) return MONGO_ERROR;
 
+    /* Kills that have waited long enough go out even if this call
+     * sends nothing. */
+    if( cursor->conn->kill_cursor_count )
+        mongo_kill_cursors_check( cursor->conn );
+
     if( ! already_sent )
         if( mongo_cursor_op_query( cursor ) != MONGO_OK )
             return MONGO_ERROR;
@@ -1397,62 +3334,68 @@ MONGO_EXPORT int mongo_cursor_next( mongo_cursor *cursor ) {
     /* first */
     if ( cursor->current.data == NULL ) {
         bson_init_finished_data( &cursor->current, &cursor->reply->objs, 0 );
-        return MONGO_OK;
     }
+    else {
+        next_object = cursor->current.data + bson_size( &cursor->current );
+        message_end = ( char * )cursor->reply + cursor->reply->head.len;
 
-    next_object = cursor->current.data + bson_size( &cursor->current );
-    message_end = ( char * )cursor->reply + cursor->reply->head.len;
-
-    if ( next_object >= message_end ) {
-        if( mongo_cursor_get_more( cursor ) != MONGO_OK )
-            return MONGO_ERROR;
-
-        if ( cursor->reply->fields.num == 0 ) {
-            /* Special case for tailable cursors. */
-            if ( cursor->reply->fields.cursorID ) {
-                cursor->err = MONGO_CURSOR_PENDING;
+        if ( next_object >= message_end ) {
+            if( mongo_cursor_get_more( cursor ) != MONGO_OK )
                 return MONGO_ERROR;
+
+            if ( cursor->reply->fields.num == 0 ) {
+                /* Special case for tailable cursors. */
+                if ( cursor->reply->fields.cursorID ) {
+                    cursor->err = MONGO_CURSOR_PENDING;
+                    return MONGO_ERROR;
+                }
+                else
+                    return MONGO_ERROR;
             }
-            else
-                return MONGO_ERROR;
-        }
 
-        bson_init_finished_data( &cursor->current, &cursor->reply->objs, 0 );
-    }
-    else {
-        bson_init_finished_data( &cursor->current, next_object, 0 );
+            bson_init_finished_data( &cursor->current, &cursor->reply->objs, 0 );
+        }
+        else {
+            bson_init_finished_data( &cursor->current, next_object, 0 );
+        }
     }
 
+    cursor->batch_seen++;
+    mongo_cursor_prefetch( cursor );
+
     return MONGO_OK;
 }
 
 MONGO_EXPORT int mongo_cursor_destroy( mongo_cursor *cursor ) {
     int result = MONGO_OK;
-    char *data;
 
     if ( !cursor ) return result;
 
-    /* Kill cursor if live. */
-    if ( cursor->reply && cursor->reply->fields.cursorID ) {
-        mongo *conn = cursor->conn;
-        mongo_message *mm = mongo_message_create( 16 /*header*/
-                            +4 /*ZERO*/
-                            +4 /*numCursors*/
-                            +8 /*cursorID*/
-                            , 0, 0, MONGO_OP_KILL_CURSORS );
-        if( mm == NULL ) {
-            return MONGO_ERROR;
-        }
-        data = &mm->data;
-        data = mongo_data_append32( data, &ZERO );
-        data = mongo_data_append32( data, &ONE );
-        mongo_data_append64( data, &cursor->reply->fields.cursorID );
-
-        result = mongo_message_send( conn, mm );
+    /* Take any read-ahead reply off the wire; it has the latest cursor id. */
+    if( cursor->flags & MONGO_CURSOR_PREFETCHING )
+        mongo_cursor_land_prefetch( cursor );
+    if( cursor->prefetched ) {
+        mongo_reply_release( cursor->conn, cursor->reply );
+        cursor->reply = cursor->prefetched;
+        cursor->prefetched = NULL;
     }
 
-    bson_free( cursor->reply );
-    bson_free( ( void * )cursor->ns );
+    /* An exhaust cursor stopped early still has batches on their way;
+     * closing the socket is cheaper than reading them all. */
+    if ( cursor->reply && cursor->reply->fields.cursorID &&
+            ( cursor->options & MONGO_EXHAUST ) )
+        mongo_disconnect( cursor->conn );
+    if( cursor->conn->streaming == cursor )
+        cursor->conn->streaming = NULL;
+
+    /* Kill cursor if live; the kill is batched with others. */
+    else if ( cursor->reply && cursor->reply->fields.cursorID )
+        result = mongo_kill_cursor_later( cursor->conn, cursor->reply->fields.cursorID );
+
+    if( cursor->reply )
+        mongo_reply_release( cursor->conn, cursor->reply );
+    if( ! ( cursor->flags & MONGO_CURSOR_SHARED_NS ) )
+        bson_free( ( void * )cursor->ns );
 
     if( cursor->flags & MONGO_CURSOR_MUST_FREE )
         bson_free( cursor );
@@ -1559,7 +3502,50 @@ MONGO_EXPORT int mongo_create_capped_collection( mongo *conn, const char *db,
     return result;
 }
 
-MONGO_EXPORT double mongo_count( mongo *conn, const char *db, const char *coll, const bson *query ) {
+/* Run a command against cmd_ns, a "<db>.$cmd" namespace. */
+static int mongo_run_command_ns( mongo *conn, const char *cmd_ns, const bson *command,
+                                 bson *out ) {
+    mongo_cursor cursor[1];
+    bson response[1];
+    bson_iterator it[1];
+    int res = 0;
+
+    mongo_cursor_init_shared_ns( cursor, conn, cmd_ns );
+    res = mongo_cursor_find_one( cursor, command, bson_shared_empty( ), response );
+
+    if (res == MONGO_OK && (!bson_find( it, response, "ok" ) || !bson_iterator_bool( it )) ) {
+        conn->err = MONGO_COMMAND_FAILED;
+        bson_destroy( response );
+        res = MONGO_ERROR;
+    }
+
+    if (out)
+        if (res == MONGO_OK)
+            *out = *response;
+        else
+            bson_init_zero(out);
+    else if (res == MONGO_OK)
+        bson_destroy(response);
+
+    return res;
+}
+
+MONGO_EXPORT int mongo_run_command( mongo *conn, const char *db, const bson *command,
+                                    bson *out ) {
+    size_t sl = strlen( db );
+    char *ns = (char*) bson_malloc( sl + 5 + 1 ); /* ".$cmd" + nul */
+    int res;
+
+    strcpy( ns, db );
+    strcpy( ns+sl, ".$cmd" );
+
+    res = mongo_run_command_ns( conn, ns, command, out );
+    bson_free( ns );
+    return res;
+}
+
+static double mongo_count_ns( mongo *conn, const char *cmd_ns, const char *coll,
+                              const bson *query ) {
     bson cmd[1];
     bson out[1];
     double count = MONGO_ERROR;  // -1
@@ -1570,7 +3556,7 @@ MONGO_EXPORT double mongo_count( mongo *conn, const char *db, const char *coll,
         bson_append_bson( cmd, "query", query );
     bson_finish( cmd );
 
-    if( mongo_run_command( conn, db, cmd, out ) == MONGO_OK ) {
+    if( mongo_run_command_ns( conn, cmd_ns, cmd, out ) == MONGO_OK ) {
         bson_iterator it[1];
         if( bson_find( it, out, "n" ) )
             count = bson_iterator_double( it );
@@ -1580,35 +3566,117 @@ MONGO_EXPORT double mongo_count( mongo *conn, const char *db, const char *coll,
     return count;
 }
 
-MONGO_EXPORT int mongo_run_command( mongo *conn, const char *db, const bson *command,
-                                    bson *out ) {
-    bson response[1];
-    bson_iterator it[1];
+MONGO_EXPORT double mongo_count( mongo *conn, const char *db, const char *coll, const bson *query ) {
     size_t sl = strlen( db );
     char *ns = (char*) bson_malloc( sl + 5 + 1 ); /* ".$cmd" + nul */
-    int res = 0;
+    double count;
 
     strcpy( ns, db );
     strcpy( ns+sl, ".$cmd" );
 
-    res = mongo_find_one( conn, ns, command, bson_shared_empty( ), response );
+    count = mongo_count_ns( conn, ns, coll, query );
     bson_free( ns );
+    return count;
+}
 
-    if (res == MONGO_OK && (!bson_find( it, response, "ok" ) || !bson_iterator_bool( it )) ) {
-        conn->err = MONGO_COMMAND_FAILED;
-        bson_destroy( response );
-        res = MONGO_ERROR;
+/*********************************************************************
+Collection API
+**********************************************************************/
+
+MONGO_EXPORT int mongo_collection_init( mongo_collection *coll, mongo *conn, const char *ns ) {
+    const char *dot;
+    int db_len;
+
+    memset( coll, 0, sizeof( mongo_collection ) );
+
+    if( mongo_validate_ns( conn, ns ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    /* mongo_validate_ns( ) has made sure there is a dot. */
+    dot = strchr( ns, '.' );
+    db_len = ( int )( dot - ns );
+
+    coll->conn = conn;
+    coll->ns_len = ( int )strlen( ns );
+    coll->ns = ( char * )bson_malloc( coll->ns_len + 1 );
+    memcpy( coll->ns, ns, coll->ns_len + 1 );
+    coll->name = coll->ns + db_len + 1;
+
+    coll->cmd_ns = ( char * )bson_malloc( db_len + 5 + 1 ); /* ".$cmd" + nul */
+    memcpy( coll->cmd_ns, ns, db_len );
+    strcpy( coll->cmd_ns + db_len, ".$cmd" );
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT void mongo_collection_set_write_concern( mongo_collection *coll,
+        mongo_write_concern *write_concern ) {
+    coll->write_concern = write_concern;
+}
+
+MONGO_EXPORT int mongo_collection_insert( mongo_collection *coll, const bson *data ) {
+    return mongo_insert_ns( coll->conn, coll->ns, coll->ns_len + 1, data,
+                            coll->write_concern );
+}
+
+MONGO_EXPORT int mongo_collection_insert_batch( mongo_collection *coll, const bson **data,
+        int num, int flags ) {
+    return mongo_insert_batch_ns( coll->conn, coll->ns, coll->ns_len + 1, data, num,
+                                  coll->write_concern, flags );
+}
+
+MONGO_EXPORT int mongo_collection_update( mongo_collection *coll, const bson *cond,
+        const bson *op, int flags ) {
+    return mongo_update_ns( coll->conn, coll->ns, coll->ns_len + 1, cond, op, flags,
+                            coll->write_concern );
+}
+
+MONGO_EXPORT int mongo_collection_remove( mongo_collection *coll, const bson *cond ) {
+    return mongo_remove_ns( coll->conn, coll->ns, coll->ns_len + 1, cond,
+                            coll->write_concern );
+}
+
+MONGO_EXPORT mongo_cursor *mongo_collection_find( mongo_collection *coll, const bson *query,
+        const bson *fields, int limit, int skip, int options ) {
+    mongo_cursor *cursor = mongo_cursor_alloc();
+    mongo_cursor_init_shared_ns( cursor, coll->conn, coll->ns );
+    cursor->flags |= MONGO_CURSOR_MUST_FREE;
+
+    mongo_cursor_set_query( cursor, query );
+    mongo_cursor_set_fields( cursor, fields );
+    mongo_cursor_set_limit( cursor, limit );
+    mongo_cursor_set_skip( cursor, skip );
+    mongo_cursor_set_options( cursor, options );
+
+    if( mongo_cursor_op_query( cursor ) == MONGO_OK )
+        return cursor;
+    else {
+        mongo_cursor_copy_error( cursor, coll->conn );
+        mongo_cursor_destroy( cursor );
+        return NULL;
     }
+}
 
-    if (out)
-        if (res == MONGO_OK)
-            *out = *response;
-        else
-            bson_init_zero(out);
-    else if (res == MONGO_OK)
-        bson_destroy(response);
+MONGO_EXPORT int mongo_collection_find_one( mongo_collection *coll, const bson *query,
+        const bson *fields, bson *out ) {
+    mongo_cursor cursor[1];
+    mongo_cursor_init_shared_ns( cursor, coll->conn, coll->ns );
+    return mongo_cursor_find_one( cursor, query, fields, out );
+}
 
-    return res;
+MONGO_EXPORT double mongo_collection_count( mongo_collection *coll, const bson *query ) {
+    return mongo_count_ns( coll->conn, coll->cmd_ns, coll->name, query );
+}
+
+MONGO_EXPORT int mongo_collection_run_command( mongo_collection *coll, const bson *command,
+        bson *out ) {
+    return mongo_run_command_ns( coll->conn, coll->cmd_ns, command, out );
+}
+
+MONGO_EXPORT void mongo_collection_destroy( mongo_collection *coll ) {
+    bson_free( coll->ns );
+    bson_free( coll->cmd_ns );
+    memset( coll, 0, sizeof( mongo_collection ) );
 }
 
 MONGO_EXPORT int mongo_simple_int_command( mongo *conn, const char *db,
@@ -43,8 +43,22 @@ MONGO_EXTERN_C_START
 
 #define MONGO_DEFAULT_MAX_BSON_SIZE 4 * 1024 * 1024
 
+/* Connects give up on an address after this long unless told otherwise. */
+#define MONGO_DEFAULT_CONNECT_TIMEOUT_MS 10000
+
+/* Secondary reads may go to any member this much slower than the nearest. */
+#define MONGO_DEFAULT_LOCAL_THRESHOLD_MS 15
+
+/* Cursor kills are sent together once this many wait, or the oldest has
+ * waited this long, if no other message has carried them first. */
+#define MONGO_DEFAULT_KILL_CURSORS_MAX 64
+#define MONGO_DEFAULT_KILL_CURSORS_DELAY_MS 100
+
 #define MONGO_ERR_LEN 128
 
+/* Pooled reply buffers come in power-of-two sizes from 4KB to 16MB. */
+#define MONGO_REPLY_POOL_CLASSES 13
+
 #ifndef MAXHOSTNAMELEN
     #define MAXHOSTNAMELEN 256
 #endif
@@ -67,7 +81,8 @@ typedef enum mongo_error_t {
     MONGO_BSON_INVALID,      /**< BSON not valid for the specified op. */
     MONGO_BSON_NOT_FINISHED, /**< BSON object has not been finished. */
     MONGO_BSON_TOO_LARGE,    /**< BSON object exceeds max BSON size. */
-    MONGO_WRITE_CONCERN_INVALID /**< Supplied write concern object is invalid. */
+    MONGO_WRITE_CONCERN_INVALID, /**< Supplied write concern object is invalid. */
+    MONGO_READ_NO_MEMBER     /**< No replica set member matches the read preference. */
 } mongo_error_t;
 
 typedef enum mongo_cursor_error_t {
@@ -82,7 +97,12 @@ typedef enum mongo_cursor_error_t {
 
 enum mongo_cursor_flags {
     MONGO_CURSOR_MUST_FREE = 1,      /**< mongo_cursor_destroy should free cursor. */
-    MONGO_CURSOR_QUERY_SENT = ( 1<<1 ) /**< Initial query has been sent. */
+    MONGO_CURSOR_QUERY_SENT = ( 1<<1 ), /**< Initial query has been sent. */
+    MONGO_CURSOR_KEEP_BUFFER = ( 1<<2 ), /**< Reuse one reply buffer across batches. */
+    MONGO_CURSOR_PREFETCH = ( 1<<3 ),   /**< Send getmores ahead of need. */
+    MONGO_CURSOR_PREFETCHING = ( 1<<4 ), /**< A read-ahead getmore awaits its reply. */
+    MONGO_CURSOR_SHARED_NS = ( 1<<5 ),  /**< ns belongs to a mongo_collection, not the cursor. */
+    MONGO_CURSOR_FAILED = ( 1<<6 )      /**< A read-ahead reply was lost; no more batches. */
 };
 
 enum mongo_index_opts {
@@ -111,6 +131,14 @@ enum mongo_cursor_opts {
     MONGO_PARTIAL = ( 1<<7 )          /**< Allow reads even if a shard is down. */
 };
 
+enum mongo_read_preference {
+    MONGO_READ_PRIMARY = 0,           /**< Read only from the primary. */
+    MONGO_READ_PRIMARY_PREFERRED,     /**< Read from a secondary only if the primary is down. */
+    MONGO_READ_SECONDARY,             /**< Read only from secondaries. */
+    MONGO_READ_SECONDARY_PREFERRED,   /**< Read from the primary only if no secondary is up. */
+    MONGO_READ_NEAREST                /**< Read from whichever member is nearest. */
+};
+
 enum mongo_operations {
     MONGO_OP_MSG = 1000,
     MONGO_OP_UPDATE = 2001,
@@ -169,6 +197,11 @@ typedef struct {
     mongo_host_port *hosts;        /**< List of host/ports given by the replica set */
     char *name;                    /**< Name of the replica set. */
     bson_bool_t primary_connected; /**< Primary node connection status. */
+    struct mongo_replica_set_member **members; /**< Members kept open for non-primary reads. */
+    int member_count;
+    int member_size;               /**< Allocated length of members. */
+    int64_t last_ping;             /**< When the members were last pinged. */
+    int64_t ping_deadline;         /**< When the ping round under way gives up; 0 if none is. */
 } mongo_replica_set;
 
 typedef struct mongo {
@@ -187,9 +220,42 @@ typedef struct mongo {
     char errstr[MONGO_ERR_LEN]; /**< String version of error. */
     int lasterrcode;            /**< getlasterror code from the server. */
     char lasterrstr[MONGO_ERR_LEN]; /**< getlasterror string from the server. */
+
+    char *read_buf;             /**< Bytes received but not yet parsed. */
+    int read_buf_size;          /**< Allocated size of read_buf. */
+    int read_buf_start;         /**< Offset of the first unparsed byte. */
+    int read_buf_end;           /**< Offset one past the last received byte. */
+    mongo_reply *reply_pool[MONGO_REPLY_POOL_CLASSES]; /**< Released replies by size class. */
+    struct mongo_cursor *prefetching; /**< Cursor whose read-ahead reply is unread, if any. */
+    int max_msg_size;           /**< Largest message the server accepts. */
+    int read_pref;              /**< Default mongo_read_preference for queries. */
+    int local_threshold_ms;     /**< Latency window for choosing among members. */
+    struct mongo_write_queue *write_queue; /**< Background writer, while one is running. */
+    char *kill_cursors;         /**< Pending OP_KILL_CURSORS message. */
+    int kill_cursor_count;      /**< Cursor ids waiting in kill_cursors. */
+    int kill_cursor_size;       /**< Ids kill_cursors has room for. */
+    int kill_cursors_max;       /**< See mongo_set_kill_cursors_batch( ). */
+    int kill_cursors_delay_ms;  /**< Likewise. */
+    int64_t kill_cursors_since; /**< When the oldest pending kill was queued. */
+    int batch_errors;           /**< Messages of the last mongo_insert_batch( ) that failed. */
+    int batch_error_index;      /**< First document of the first of them, or -1. */
+    void *connecting;           /**< Connect attempts still running; see env.c. */
+    struct mongo_cursor *streaming; /**< Exhaust cursor whose batches are still arriving, if any. */
+    struct mongo_replica_set_member *pinged; /**< Member whose ismaster reply on this connection is unread. */
 } mongo;
 
-typedef struct {
+typedef struct mongo_replica_set_member {
+    mongo conn;                /**< This member's own connection. */
+    char host[MAXHOSTNAMELEN];
+    int port;
+    int state;                 /**< Progress of the current ismaster round. */
+    bson_bool_t ismaster;      /**< Reported itself primary when last pinged. */
+    bson_bool_t secondary;     /**< Reported itself secondary when last pinged. */
+    int64_t sent;              /**< When the last ismaster was sent. */
+    int rtt_ms;                /**< Moving average of ismaster round trips; -1 until one is timed. */
+} mongo_replica_set_member;
+
+typedef struct mongo_cursor {
     mongo_reply *reply;  /**< reply is owned by cursor */
     mongo *conn;       /**< connection is *not* owned by cursor */
     const char *ns;    /**< owned by cursor */
@@ -202,8 +268,74 @@ typedef struct {
     int options;       /**< Bitfield containing cursor options. */
     int limit;         /**< Bitfield containing cursor options. */
     int skip;          /**< Bitfield containing cursor options. */
+    mongo_reply *prefetched; /**< Next batch, read ahead of need. */
+    int prefetch;      /**< Percent of a batch to return before reading ahead. */
+    int batch_seen;    /**< Number returned from the current batch. */
+    int batch_size;    /**< Documents to ask for per batch, or 0 for the server's default. */
+    int max_batch_size;/**< Cap for batch size growth, or 0 for a fixed batch size. */
+    int read_pref;     /**< mongo_read_preference for the query; see conn->read_pref. */
+    struct mongo_prepared *prepared; /**< Template sent in place of query and fields, if any. */
+    int64_t batch_start_us; /**< When the current batch became available. */
+    int64_t batch_wait_us;  /**< How long the consumer waited for it. */
 } mongo_cursor;
 
+#define MONGO_PREPARED_MAX_PARAMS 8
+
+/* Which document of a prepared operation a parameter is in. */
+enum mongo_prepared_doc {
+    MONGO_PREPARED_QUERY = 0,   /**< A query's selector. */
+    MONGO_PREPARED_FIELDS = 1,  /**< A query's field selector. */
+    MONGO_PREPARED_COND = 0,    /**< An update's selector. */
+    MONGO_PREPARED_OP = 1       /**< An update's modifier or replacement. */
+};
+
+typedef struct {
+    int offset;        /**< Offset of the value in the message. */
+    int type;          /**< BSON type of the value. */
+    int len;           /**< Length of a string value, excluding its NUL. */
+} mongo_prepared_param;
+
+typedef struct mongo_prepared {
+    char *data;        /**< The serialized message, ready to send. */
+    int len;
+    int op;            /**< MONGO_OP_QUERY or MONGO_OP_UPDATE. */
+    char *ns;
+    int doc_offset[2]; /**< Offsets of the message's two documents. */
+    int options;       /**< Query options; see mongo_cursor_opts. */
+    int limit;
+    int skip;
+    mongo_prepared_param params[MONGO_PREPARED_MAX_PARAMS];
+    int param_count;
+} mongo_prepared;
+
+enum mongo_bulk_op_status {
+    MONGO_BULK_UNSENT = 0,  /**< Not executed yet. */
+    MONGO_BULK_DONE,        /**< Written, and acknowledged if there is a write concern. */
+    MONGO_BULK_FAILED       /**< The server reported an error; see code and errmsg. */
+};
+
+typedef struct {
+    int opcode;        /**< MONGO_OP_INSERT, MONGO_OP_UPDATE or MONGO_OP_DELETE. */
+    int status;        /**< A mongo_bulk_op_status. */
+    int n;             /**< Documents affected, as reported by getlasterror. */
+    int code;          /**< Server error code of a failed operation. */
+    char *errmsg;      /**< Server error string of a failed operation. */
+    size_t start;      /**< Offset of the operation's messages in buf. */
+} mongo_bulk_op;
+
+typedef struct {
+    mongo *conn;       /**< connection is *not* owned by the bulk */
+    mongo_write_concern *write_concern; /**< Chosen at init; NULL for none. */
+    int ordered;       /**< Stop at the first failed operation. */
+    char *buf;         /**< Each operation's message, then its getlasterror. */
+    size_t len;
+    size_t size;
+    mongo_bulk_op *ops;
+    int count;         /**< Operations added. */
+    int ops_size;
+    int next;          /**< First operation not yet executed. */
+} mongo_bulk;
+
 /*********************************************************************
 Connection API
 **********************************************************************/
@@ -317,6 +449,14 @@ MONGO_EXPORT int mongo_validate_ns( mongo *conn, const char *ns );
  * Before passing a connection object to this function, you must already have called
  * mongo_set_replica_set and mongo_replica_set_add_seed.
  *
+ * The seeds, and any hosts learned from an earlier connection, are
+ * all contacted at once; the first member to report itself primary is
+ * used. A seed with no set name is a standalone server and is used
+ * if it answers first. Hosts reported by the members are kept for
+ * later reconnects. Gives up after conn->conn_timeout_ms if set,
+ * otherwise ten seconds. Fails with MONGO_CONN_BAD_SET_NAME if any
+ * host that answered belongs to another set.
+ *
  * @param conn a mongo object.
  *
  * @return MONGO_OK or MONGO_ERROR on failure. On failure, a constant of type
@@ -338,6 +478,30 @@ MONGO_EXPORT int mongo_replica_set_client( mongo *conn );
  */
 MONGO_EXPORT int mongo_replset_connect( mongo *conn );
 
+/**
+ * Choose where queries on a replica set connection are read from.
+ * Anything other than MONGO_READ_PRIMARY keeps a connection open to
+ * every member and pings them with ismaster every ten seconds, timing
+ * each round trip. Only the first read waits for the pings; after that
+ * each read moves the round along without blocking. Reads then go to
+ * an eligible member no more than
+ * conn->local_threshold_ms slower than the nearest one. Commands are
+ * always sent to the primary. Applies to queries started afterwards.
+ *
+ * @param conn a mongo object.
+ * @param read_pref a mongo_read_preference; MONGO_READ_PRIMARY by default.
+ */
+MONGO_EXPORT void mongo_set_read_preference( mongo *conn, int read_pref );
+
+/**
+ * Set how much slower than the nearest member another member may be
+ * and still take reads. Defaults to MONGO_DEFAULT_LOCAL_THRESHOLD_MS.
+ *
+ * @param conn a mongo object.
+ * @param millis
+ */
+MONGO_EXPORT void mongo_set_local_threshold( mongo *conn, int millis );
+
 /** Set a timeout for operations on this connection. This
  *  is a platform-specific feature, and only work on *nix
  *  system. You must also compile for linux to support this.
@@ -350,6 +514,47 @@ MONGO_EXPORT int mongo_replset_connect( mongo *conn );
  */
 MONGO_EXPORT int mongo_set_op_timeout( mongo *conn, int millis );
 
+/**
+ * Set how long a connect waits for an address to answer. A host's
+ * addresses are tried together, IPv6 and IPv4 interleaved, each
+ * starting shortly after the one before; the first to connect wins.
+ * Takes effect from the next connect, such as mongo_reconnect( ) or
+ * mongo_replica_set_client( ). mongo_client( ) starts from the
+ * default, MONGO_DEFAULT_CONNECT_TIMEOUT_MS.
+ *
+ *  @param conn a mongo object.
+ *  @param millis timeout in milliseconds, or 0 to wait as long as the
+ *      system allows.
+ */
+MONGO_EXPORT void mongo_set_connect_timeout( mongo *conn, int millis );
+
+/**
+ * Set how cursor kills are batched. Destroying a cursor the server
+ * still holds queues its id on the connection. Queued ids go out as a
+ * single OP_KILL_CURSORS in front of the connection's next message.
+ * They go out on their own once max are waiting, when the connection is
+ * closed, or once the oldest has waited millis. The wait is checked
+ * whenever a cursor on the connection is destroyed or read from, so an
+ * idle connection holds its kills until it is used or closed.
+ *
+ * @param conn a mongo object.
+ * @param max ids to queue before sending; 1 sends every kill at once.
+ *     Defaults to MONGO_DEFAULT_KILL_CURSORS_MAX.
+ * @param millis the longest a kill waits, or 0 for no limit. Defaults
+ *     to MONGO_DEFAULT_KILL_CURSORS_DELAY_MS.
+ */
+MONGO_EXPORT void mongo_set_kill_cursors_batch( mongo *conn, int max, int millis );
+
+/**
+ * Send any queued cursor kills now.
+ *
+ * @param conn a mongo object.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if they could not be sent. They are
+ *     dropped either way.
+ */
+MONGO_EXPORT int mongo_kill_cursors_flush( mongo *conn );
+
 /**
  * Ensure that this connection is healthy by performing
  * a round-trip to the server.
@@ -465,6 +670,21 @@ MONGO_EXPORT int mongo_insert( mongo *conn, const char *ns, const bson *data,
  *     may be 0 or MONGO_CONTINUE_ON_ERROR, which will cause the
  *     batch insert to continue even if a given insert in the batch fails.
  *
+ * A batch larger than the server's maximum message size is sent as
+ * several messages. Without MONGO_CONTINUE_ON_ERROR each is
+ * acknowledged before the next goes out, with a plain getlasterror if
+ * there is no write concern, and the batch stops at the first failed
+ * document: nothing after it is inserted. With it, every message and
+ * its getlasterror are written back to back and acknowledged together,
+ * and the server inserts all it can.
+ *
+ * conn->batch_errors counts the messages that failed and
+ * conn->batch_error_index gives the index in data of the first
+ * document of the first of them; the server does not say which
+ * document within a message failed. That failure is reported in
+ * conn->lasterrstr and conn->lasterrcode. Use a mongo_bulk to learn
+ * exactly which documents failed.
+ *
  * @return MONGO_OK or MONGO_ERROR.
  *
  */
@@ -533,6 +753,118 @@ MONGO_EXPORT int mongo_write_concern_finish( mongo_write_concern *write_concern
  */
 MONGO_EXPORT void mongo_write_concern_destroy( mongo_write_concern *write_concern );
 
+/*********************************************************************
+Bulk Write API
+**********************************************************************/
+
+/**
+ * Initialize a bulk write. Operations are serialized into one buffer as
+ * they are added and sent by mongo_bulk_execute( ).
+ *
+ * With a write concern, an ordered bulk is no faster than issuing its
+ * operations one by one: it waits for each acknowledgement before
+ * sending the next operation, a round trip per operation, because a
+ * legacy write sent early would run even after a failure. Only the
+ * serialization up front is saved.
+ *
+ * An unordered bulk sends up to 256 operations back to back and reads
+ * their acknowledgements afterwards, a round trip per window. Every
+ * operation still carries its own getlasterror: that is the only way
+ * the legacy protocol reports each one's outcome in bulk->ops, and a
+ * single trailing getlasterror would only describe the last failure.
+ * Without a write concern, nothing is acknowledged and everything is
+ * sent at once.
+ *
+ * @param bulk
+ * @param conn a mongo object.
+ * @param custom_write_concern a write concern object that will
+ *     override any write concern set on the conn object.
+ * @param ordered non-zero to stop at the first failed operation.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the write concern is invalid.
+ */
+MONGO_EXPORT int mongo_bulk_init( mongo_bulk *bulk, mongo *conn,
+                                  mongo_write_concern *custom_write_concern, int ordered );
+
+/**
+ * Add an insert to a bulk write.
+ *
+ * @param bulk
+ * @param ns the namespace.
+ * @param data the bson data.
+ *
+ * @return MONGO_OK or MONGO_ERROR, in which case the operation is not
+ *     added and conn->err says why.
+ */
+MONGO_EXPORT int mongo_bulk_insert( mongo_bulk *bulk, const char *ns, const bson *data );
+
+/**
+ * Add an update to a bulk write.
+ *
+ * @param bulk
+ * @param ns the namespace.
+ * @param cond the bson update query.
+ * @param op the bson update data.
+ * @param flags flags for the update.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_bulk_update( mongo_bulk *bulk, const char *ns, const bson *cond,
+                                    const bson *op, int flags );
+
+/**
+ * Add a remove to a bulk write.
+ *
+ * @param bulk
+ * @param ns the namespace.
+ * @param cond the bson query.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_bulk_remove( mongo_bulk *bulk, const char *ns, const bson *cond );
+
+/**
+ * Send every operation not yet executed. The outcome of each is left in
+ * bulk->ops. After an ordered bulk stops at a failure, calling this
+ * again carries on with the next operation.
+ *
+ * @param bulk
+ *
+ * @return MONGO_OK, or MONGO_ERROR if any operation failed, in which
+ *     case conn->lasterrstr and conn->lasterrcode describe the first
+ *     failure. On a network error conn->err is set, the connection
+ *     is closed, and bulk->next is left at the first operation whose
+ *     outcome is unknown.
+ */
+MONGO_EXPORT int mongo_bulk_execute( mongo_bulk *bulk );
+
+/**
+ * Execute an unordered bulk write over several connections at once.
+ * The operations not yet executed are split into one contiguous share
+ * per connection, each sent from its own thread. The connections must
+ * all be to the same server or replica set. Ordered bulks run on
+ * conns[0] alone.
+ *
+ * @param bulk
+ * @param conns connections to send on.
+ * @param count the number of connections, at least one.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if any operation failed, with the
+ *     first failure reported on bulk->conn as for mongo_bulk_execute( ).
+ *     After a network error on any connection, bulk->next is the first
+ *     operation that connection did not see through. Operations other
+ *     connections ran keep their results, and executing again sends
+ *     only those still MONGO_BULK_UNSENT.
+ */
+MONGO_EXPORT int mongo_bulk_execute_parallel( mongo_bulk *bulk, mongo **conns, int count );
+
+/**
+ * Free a bulk write's buffer and results.
+ *
+ * @param bulk
+ */
+MONGO_EXPORT void mongo_bulk_destroy( mongo_bulk *bulk );
+
 /*********************************************************************
 Cursor API
 **********************************************************************/
@@ -603,15 +935,82 @@ MONGO_EXPORT void mongo_cursor_set_skip( mongo_cursor *cursor, int skip );
  */
 MONGO_EXPORT void mongo_cursor_set_limit( mongo_cursor *cursor, int limit );
 
+/**
+ * Set how many documents to ask for in each batch, independent of the
+ * limit. A smaller first batch returns the first document sooner; a
+ * larger one saves round trips. Batches never run past the limit.
+ *
+ * @param cursor
+ * @param batch_size documents per batch, or 0 for the server's default.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if batch_size is negative.
+ */
+MONGO_EXPORT int mongo_cursor_set_batch_size( mongo_cursor *cursor, int batch_size );
+
+/**
+ * Let the batch size grow, up to max_batch_size, while the consumer
+ * outpaces the server. Starting from the size given to
+ * mongo_cursor_set_batch_size( ), each getmore doubles it if the
+ * consumer got through the last batch in no more time than it spent
+ * waiting for that batch to arrive. A consumer that does real work per
+ * document keeps the size it has.
+ *
+ * @param cursor
+ * @param max_batch_size the largest batch to ask for, or 0 to keep the
+ *     batch size fixed.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if max_batch_size is negative.
+ */
+MONGO_EXPORT int mongo_cursor_set_batch_growth( mongo_cursor *cursor, int max_batch_size );
+
+/**
+ * Override the connection's read preference for this cursor. When the
+ * query goes to another member, cursor->conn becomes that member's
+ * connection for the life of the cursor.
+ *
+ * @param cursor
+ * @param read_pref a mongo_read_preference.
+ */
+MONGO_EXPORT void mongo_cursor_set_read_preference( mongo_cursor *cursor, int read_pref );
+
 /**
  * Set any of the available query options (e.g., MONGO_TAILABLE).
  *
+ * With MONGO_EXHAUST the server streams every batch without waiting
+ * for getmores. Nothing else may be sent on the connection until the
+ * cursor is exhausted, and destroying it before then disconnects;
+ * call mongo_reconnect( ) to use the connection again.
+ *
  * @param cursor
  * @param options a bitfield storing query options. See
  *   mongo_cursor_bitfield_t for available constants.
  */
 MONGO_EXPORT void mongo_cursor_set_options( mongo_cursor *cursor, int options );
 
+/**
+ * Keep a single reply buffer for the life of the cursor instead of
+ * returning it to the connection's pool after every batch. The buffer
+ * only grows, so it ends up sized for the largest batch seen. Useful
+ * for long scans that fetch many large batches.
+ *
+ * @param cursor
+ * @param keep non-zero to keep the buffer.
+ */
+MONGO_EXPORT void mongo_cursor_set_keep_buffer( mongo_cursor *cursor, int keep );
+
+/**
+ * Read ahead: send the getmore for the next batch once percent of the
+ * current batch has been returned, so its round trip overlaps with
+ * processing. The reply is read when the batch runs out, or before
+ * anything else is sent on the connection. With 0 the getmore goes out
+ * as soon as a batch arrives; a negative percent turns read-ahead off.
+ * Tailable and exhaust cursors never read ahead.
+ *
+ * @param cursor
+ * @param percent
+ */
+MONGO_EXPORT void mongo_cursor_set_prefetch( mongo_cursor *cursor, int percent );
+
 /**
  * Return the current BSON object data as a const char*. This is useful
  * for creating bson iterators with bson_iterator_init.
@@ -664,6 +1063,236 @@ MONGO_EXPORT int mongo_cursor_destroy( mongo_cursor *cursor );
 MONGO_EXPORT int mongo_find_one( mongo *conn, const char *ns, const bson *query,
                                  const bson *fields, bson *out );
 
+/*********************************************************************
+Prepared operations
+**********************************************************************/
+
+/**
+ * Serialize a query once so it can be sent many times. Values marked
+ * with mongo_prepared_bind( ) can be changed between sends without
+ * building any BSON.
+ *
+ * @param conn the connection whose limits the query is checked
+ *     against; it may be sent on any connection.
+ * @param prepared the prepared query to initialize.
+ * @param ns the namespace.
+ * @param query the query, holding placeholder values of the right
+ *     types (and, for strings, lengths).
+ * @param fields a bson document of the fields to be returned, or NULL.
+ * @param limit
+ * @param skip
+ * @param options a bitfield of mongo_cursor_opts.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if query or fields is not finished,
+ *     is larger than conn->max_bson_size or is not valid UTF-8; see
+ *     conn->err.
+ */
+MONGO_EXPORT int mongo_prepare_query( mongo *conn, mongo_prepared *prepared, const char *ns,
+                                      const bson *query, const bson *fields,
+                                      int limit, int skip, int options );
+
+/**
+ * Serialize an update once so it can be sent many times.
+ *
+ * @param conn the connection whose limits the update is checked
+ *     against.
+ * @param prepared the prepared update to initialize.
+ * @param ns the namespace.
+ * @param cond the selector, holding placeholder values.
+ * @param op the modifier or replacement, holding placeholder values.
+ * @param flags a bitfield of mongo_update_opts.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if cond or op is not finished, is
+ *     larger than conn->max_bson_size or is not valid UTF-8; see
+ *     conn->err.
+ */
+MONGO_EXPORT int mongo_prepare_update( mongo *conn, mongo_prepared *prepared, const char *ns,
+                                       const bson *cond, const bson *op, int flags );
+
+/**
+ * Mark a value in a prepared operation as a parameter. Ints, longs,
+ * doubles, ObjectIds and strings can be parameters.
+ *
+ * @param prepared
+ * @param doc the mongo_prepared_doc the value is in.
+ * @param key the value's key, with dots to reach into subobjects.
+ *
+ * @return the parameter's index, or -1 if the key is not found, its
+ *     type cannot be a parameter, or MONGO_PREPARED_MAX_PARAMS are
+ *     already marked.
+ */
+MONGO_EXPORT int mongo_prepared_bind( mongo_prepared *prepared, int doc, const char *key );
+
+/**
+ * Change a parameter's value in place.
+ *
+ * @param prepared
+ * @param param an index from mongo_prepared_bind( ).
+ * @param value
+ *
+ * @return MONGO_OK, or MONGO_ERROR if param is not of that type.
+ *     mongo_prepared_set_string( ) also fails unless value is exactly
+ *     as long as the placeholder.
+ */
+MONGO_EXPORT int mongo_prepared_set_int( mongo_prepared *prepared, int param, int value );
+MONGO_EXPORT int mongo_prepared_set_long( mongo_prepared *prepared, int param, int64_t value );
+MONGO_EXPORT int mongo_prepared_set_double( mongo_prepared *prepared, int param, double value );
+MONGO_EXPORT int mongo_prepared_set_oid( mongo_prepared *prepared, int param, const bson_oid_t *value );
+MONGO_EXPORT int mongo_prepared_set_string( mongo_prepared *prepared, int param, const char *value );
+
+/**
+ * Send a prepared query with its current parameter values.
+ *
+ * @param conn a mongo object.
+ * @param prepared a query from mongo_prepare_query( ). It must not be
+ *     changed or destroyed while the cursor is in use.
+ *
+ * @return a cursor, or NULL on error; see conn->err.
+ */
+MONGO_EXPORT mongo_cursor *mongo_prepared_find( mongo *conn, mongo_prepared *prepared );
+
+/**
+ * Find a single document with a prepared query.
+ *
+ * @param conn a mongo object.
+ * @param prepared a query from mongo_prepare_query( ).
+ * @param out a bson document in which to put the result, or NULL.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if nothing matched or on error.
+ */
+MONGO_EXPORT int mongo_prepared_find_one( mongo *conn, mongo_prepared *prepared, bson *out );
+
+/**
+ * Send a prepared update with its current parameter values.
+ *
+ * @param conn a mongo object.
+ * @param prepared an update from mongo_prepare_update( ).
+ * @param custom_write_concern a write concern object that will
+ *     override any write concern set on the conn object.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_prepared_update( mongo *conn, mongo_prepared *prepared,
+                                        mongo_write_concern *custom_write_concern );
+
+/**
+ * Free a prepared operation's memory.
+ *
+ * @param prepared
+ */
+MONGO_EXPORT void mongo_prepared_destroy( mongo_prepared *prepared );
+
+/*********************************************************************
+Collection API
+**********************************************************************/
+
+/**
+ * A handle on one collection. Its namespace is validated once, when
+ * the handle is initialized, and its length and the database's
+ * command namespace are kept, so operations through the handle repeat
+ * none of that work.
+ */
+typedef struct mongo_collection {
+    mongo *conn;              /**< Connection is *not* owned. */
+    char *ns;                 /**< "<db>.<collection>". */
+    int ns_len;               /**< strlen( ns ). */
+    char *cmd_ns;             /**< "<db>.$cmd". */
+    const char *name;         /**< The collection part of ns. */
+    mongo_write_concern *write_concern; /**< For writes, or NULL for the conn's. */
+} mongo_collection;
+
+/**
+ * Initialize a collection handle.
+ *
+ * @param coll the handle to initialize.
+ * @param conn a mongo object, which must outlive the handle.
+ * @param ns the namespace.
+ *
+ * @return MONGO_OK, or MONGO_ERROR with conn->err set to
+ *     MONGO_NS_INVALID if ns is not a valid namespace.
+ */
+MONGO_EXPORT int mongo_collection_init( mongo_collection *coll, mongo *conn, const char *ns );
+
+/**
+ * Set the write concern used by writes through the handle.
+ *
+ * @param coll
+ * @param write_concern a finished write concern, or NULL to use the
+ *     connection's. It is not copied.
+ */
+MONGO_EXPORT void mongo_collection_set_write_concern( mongo_collection *coll,
+        mongo_write_concern *write_concern );
+
+/**
+ * mongo_insert( ) into the handle's collection.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_collection_insert( mongo_collection *coll, const bson *data );
+
+/**
+ * mongo_insert_batch( ) into the handle's collection.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_collection_insert_batch( mongo_collection *coll, const bson **data,
+        int num, int flags );
+
+/**
+ * mongo_update( ) in the handle's collection.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_collection_update( mongo_collection *coll, const bson *cond,
+        const bson *op, int flags );
+
+/**
+ * mongo_remove( ) from the handle's collection.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_collection_remove( mongo_collection *coll, const bson *cond );
+
+/**
+ * mongo_find( ) in the handle's collection. The cursor shares the
+ * handle's namespace, so the handle must outlive it.
+ *
+ * @return a cursor, or NULL on error.
+ */
+MONGO_EXPORT mongo_cursor *mongo_collection_find( mongo_collection *coll, const bson *query,
+        const bson *fields, int limit, int skip, int options );
+
+/**
+ * mongo_find_one( ) in the handle's collection.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if nothing matched or on error.
+ */
+MONGO_EXPORT int mongo_collection_find_one( mongo_collection *coll, const bson *query,
+        const bson *fields, bson *out );
+
+/**
+ * mongo_count( ) the handle's collection.
+ *
+ * @return the number of matching documents, or MONGO_ERROR.
+ */
+MONGO_EXPORT double mongo_collection_count( mongo_collection *coll, const bson *query );
+
+/**
+ * mongo_run_command( ) against the handle's database.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_collection_run_command( mongo_collection *coll, const bson *command,
+        bson *out );
+
+/**
+ * Free a collection handle's memory. Cursors from the handle must be
+ * destroyed first.
+ *
+ * @param coll
+ */
+MONGO_EXPORT void mongo_collection_destroy( mongo_collection *coll );
+
 
 /*********************************************************************
 Command API and Helpers
@@ -886,6 +1515,7 @@ MONGO_EXPORT void mongo_dealloc(mongo* conn);
 MONGO_EXPORT int mongo_get_err(mongo* conn);
 MONGO_EXPORT int mongo_is_connected(mongo* conn);
 MONGO_EXPORT int mongo_get_op_timeout(mongo* conn);
+MONGO_EXPORT int mongo_get_connect_timeout(mongo* conn);
 MONGO_EXPORT const char* mongo_get_primary(mongo* conn);
 MONGO_EXPORT SOCKET mongo_get_socket(mongo* conn) ;
 MONGO_EXPORT int mongo_get_host_count(mongo* conn);
@@ -907,6 +1537,81 @@ MONGO_EXPORT const char*  mongo_get_server_err_string(mongo* conn);
  */
 MONGO_EXPORT void __mongo_set_error( mongo *conn, mongo_error_t err,
                                      const char *errstr, int errorcode );
+/**
+ * Record the error reported by a getlasterror reply, or by a failed
+ * query's $err document. Mostly for internal use.
+ *
+ * @param conn a mongo connection object.
+ * @param response the reply document.
+ *
+ * @return MONGO_ERROR, with conn->err set to MONGO_WRITE_ERROR and the
+ *     server's message and code in conn->lasterrstr and conn->lasterrcode,
+ *     if the response has an "err" or "$err" string. MONGO_OK otherwise.
+ */
+MONGO_EXPORT int mongo_parse_last_error( mongo *conn, bson *response );
+
+/**
+ * As mongo_parse_last_error( ), for callers with no connection of their
+ * own to report on: the server's code and message go to lasterrcode
+ * and lasterrstr, which must hold MONGO_ERR_LEN bytes, and nothing else
+ * is touched. Mostly for internal use.
+ *
+ * @return MONGO_ERROR if the response has an "err" or "$err" string,
+ *     MONGO_OK otherwise.
+ */
+MONGO_EXPORT int mongo_parse_last_error_into( bson *response, int *lasterrcode,
+        char *lasterrstr );
+
+/**
+ * Read the next OP_REPLY from conn, through its read buffer, into a
+ * reply from its pool. Mostly for internal use.
+ *
+ * @param conn a mongo connection object.
+ * @param reply NULL, or a finished reply whose buffer may be reused.
+ *     Set to the new reply, in native byte order, or to NULL on failure.
+ *
+ * @return MONGO_OK, MONGO_READ_SIZE_ERROR for an implausible length,
+ *     or MONGO_ERROR with the error set on conn.
+ */
+MONGO_EXPORT int mongo_read_response( mongo *conn, mongo_reply **reply );
+
+/**
+ * Give back a reply from mongo_read_response( ): to conn's pool, or to
+ * the allocator if conn is NULL. Mostly for internal use.
+ */
+MONGO_EXPORT void mongo_reply_release( mongo *conn, mongo_reply *reply );
+
+/**
+ * Hand out a request id, unique across every connection in the
+ * process. Mostly for internal use.
+ *
+ * @return a positive request id.
+ */
+MONGO_EXPORT int mongo_next_request_id( void );
+
+/**
+ * Write a little-endian wire protocol header. Mostly for internal use.
+ *
+ * @param head where to write the header.
+ * @param len the length of the whole message, header included.
+ * @param id the request id, or 0 for a new one.
+ * @param responseTo
+ * @param op the opcode.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if len does not fit in the header.
+ */
+MONGO_EXPORT int mongo_header_init( mongo_header *head, size_t len, int id, int responseTo, int op );
+
+/**
+ * Copy len bytes, or a 32 or 64-bit integer in little-endian order,
+ * into a message being built. Mostly for internal use.
+ *
+ * @return the byte after the copy.
+ */
+MONGO_EXPORT char *mongo_data_append( char *start, const void *data, size_t len );
+MONGO_EXPORT char *mongo_data_append32( char *start, const void *data );
+MONGO_EXPORT char *mongo_data_append64( char *start, const void *data );
+
 /**
  * Clear all errors stored on a mongo connection object.
  *
@@ -0,0 +1,336 @@
+/* pool.c */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "pool.h"
+#include "env.h"
+
+#include <string.h>
+
+#if defined(_MSC_VER)
+  #define MONGO_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+  #define MONGO_THREAD_LOCAL __thread
+#else
+  #define MONGO_THREAD_LOCAL
+#endif
+
+#define MONGO_POOL_DEFAULT_HEALTH_CHECK_MS 5000
+#define MONGO_POOL_DEFAULT_CHECKOUT_TIMEOUT_MS 1000
+
+/* The slot this thread checked out last, tried first on its next
+ * checkout from the same pool. Only a hint; it is never trusted. */
+static MONGO_THREAD_LOCAL const mongo_pool *mongo_pool_hint_pool;
+static MONGO_THREAD_LOCAL int mongo_pool_hint_slot;
+
+static char *mongo_pool_strdup( const char *s ) {
+    char *copy = NULL;
+
+    if( s ) {
+        copy = ( char * )bson_malloc( strlen( s ) + 1 );
+        strcpy( copy, s );
+    }
+    return copy;
+}
+
+MONGO_EXPORT int mongo_pool_init( mongo_pool *pool, const char *host, int port,
+                                  int min_size, int max_size ) {
+    memset( pool, 0, sizeof( mongo_pool ) );
+
+    if( max_size < 1 || min_size < 0 || min_size > max_size )
+        return MONGO_ERROR;
+
+    strncpy( pool->host, host, MAXHOSTNAMELEN - 1 );
+    pool->port = port;
+    pool->min_size = min_size;
+    pool->max_size = max_size;
+    pool->health_check_ms = MONGO_POOL_DEFAULT_HEALTH_CHECK_MS;
+    pool->checkout_timeout_ms = MONGO_POOL_DEFAULT_CHECKOUT_TIMEOUT_MS;
+
+    pool->slots = ( mongo_pool_slot * )bson_malloc( max_size * sizeof( mongo_pool_slot ) );
+    memset( pool->slots, 0, max_size * sizeof( mongo_pool_slot ) );
+
+    /* Without threads nobody else can check a connection in, so
+     * checkout simply fails when the pool is exhausted. */
+    if( mongo_env_mutex_create( &pool->mutex ) != MONGO_OK )
+        pool->mutex = NULL;
+    else if( mongo_env_cond_create( &pool->cond ) != MONGO_OK ) {
+        mongo_env_mutex_destroy( pool->mutex );
+        pool->mutex = NULL;
+    }
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT void mongo_pool_set_auth( mongo_pool *pool, const char *db,
+                                       const char *user, const char *pass ) {
+    bson_free( pool->db );
+    bson_free( pool->user );
+    bson_free( pool->pass );
+    pool->db = mongo_pool_strdup( db );
+    pool->user = mongo_pool_strdup( user );
+    pool->pass = mongo_pool_strdup( pass );
+}
+
+MONGO_EXPORT void mongo_pool_set_health_check( mongo_pool *pool, int idle_ms ) {
+    pool->health_check_ms = idle_ms;
+}
+
+MONGO_EXPORT void mongo_pool_set_checkout_timeout( mongo_pool *pool, int millis ) {
+    pool->checkout_timeout_ms = millis;
+}
+
+/* Slot ownership: a thread owns a slot once it has moved it to
+ * MONGO_POOL_BUSY, and is then the only one touching its connection. */
+
+static mongo_pool_slot *mongo_pool_take_idle( mongo_pool *pool ) {
+    int i, start = 0;
+    mongo_pool_slot *slot;
+
+    if( mongo_pool_hint_pool == pool )
+        start = mongo_pool_hint_slot;
+
+    for( i = 0; i < pool->max_size; i++ ) {
+        slot = &pool->slots[( start + i ) % pool->max_size];
+        if( mongo_env_atomic_cas( &slot->state, MONGO_POOL_IDLE, MONGO_POOL_BUSY ) )
+            return slot;
+    }
+
+    return NULL;
+}
+
+static mongo_pool_slot *mongo_pool_take_empty( mongo_pool *pool ) {
+    int i;
+    mongo_pool_slot *slot;
+
+    for( i = 0; i < pool->max_size; i++ ) {
+        slot = &pool->slots[i];
+        if( mongo_env_atomic_cas( &slot->state, MONGO_POOL_EMPTY, MONGO_POOL_BUSY ) ) {
+            mongo_env_atomic_add( &pool->live, 1 );
+            return slot;
+        }
+    }
+
+    return NULL;
+}
+
+static void mongo_pool_close( mongo_pool_slot *slot ) {
+    mongo_destroy( &slot->conn );
+    memset( &slot->conn, 0, sizeof( mongo ) );
+}
+
+/* Wake waiting checkouts after a slot has been given back. A checkout
+ * counts itself in waiters before it looks at the slots, and sleeps
+ * only if returns has not moved since, so it either sees the slot or
+ * is woken. */
+static void mongo_pool_wake( mongo_pool *pool ) {
+    mongo_env_atomic_add( &pool->returns, 1 );
+    if( pool->mutex && mongo_env_atomic_add( &pool->waiters, 0 ) > 0 ) {
+        mongo_env_mutex_lock( pool->mutex );
+        mongo_env_cond_broadcast( pool->cond );
+        mongo_env_mutex_unlock( pool->mutex );
+    }
+}
+
+/* Close an owned slot's connection and give the slot up. */
+static void mongo_pool_release_empty( mongo_pool *pool, mongo_pool_slot *slot ) {
+    mongo_pool_close( slot );
+    mongo_env_atomic_add( &pool->live, -1 );
+    mongo_env_atomic_cas( &slot->state, MONGO_POOL_BUSY, MONGO_POOL_EMPTY );
+    mongo_pool_wake( pool );
+}
+
+static int mongo_pool_open( mongo_pool *pool, mongo_pool_slot *slot ) {
+    mongo *conn = &slot->conn;
+
+    mongo_pool_close( slot );
+
+    if( mongo_client( conn, pool->host, pool->port ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( pool->user &&
+            mongo_cmd_authenticate( conn, pool->db, pool->user, pool->pass ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    slot->last_used = mongo_env_time_ms( );
+    return MONGO_OK;
+}
+
+/* Make sure an idle connection is still usable before handing it out. */
+static int mongo_pool_ready( mongo_pool *pool, mongo_pool_slot *slot ) {
+    mongo *conn = &slot->conn;
+
+    if( ! conn->connected )
+        return mongo_pool_open( pool, slot );
+
+    if( pool->health_check_ms >= 0 &&
+            mongo_env_time_ms( ) - slot->last_used > pool->health_check_ms &&
+            mongo_check_connection( conn ) != MONGO_OK )
+        return mongo_pool_open( pool, slot );
+
+    mongo_clear_errors( conn );
+    return MONGO_OK;
+}
+
+static mongo *mongo_pool_hand_out( mongo_pool *pool, mongo_pool_slot *slot ) {
+    mongo_pool_hint_pool = pool;
+    mongo_pool_hint_slot = ( int )( slot - pool->slots );
+    return &slot->conn;
+}
+
+MONGO_EXPORT int mongo_pool_connect( mongo_pool *pool ) {
+    mongo_pool_slot *slot;
+
+    while( mongo_env_atomic_add( &pool->live, 0 ) < pool->min_size ) {
+        if( ! ( slot = mongo_pool_take_empty( pool ) ) )
+            break;
+        if( mongo_pool_open( pool, slot ) != MONGO_OK ) {
+            mongo_pool_release_empty( pool, slot );
+            return MONGO_ERROR;
+        }
+        mongo_env_atomic_cas( &slot->state, MONGO_POOL_BUSY, MONGO_POOL_IDLE );
+    }
+
+    return MONGO_OK;
+}
+
+/* Take an idle connection, or open a new one in a free slot, without
+ * waiting. Sets *failed if a new connection could not be opened. */
+static mongo *mongo_pool_try_checkout( mongo_pool *pool, int *failed ) {
+    mongo_pool_slot *slot;
+
+    *failed = 0;
+
+    while( ( slot = mongo_pool_take_idle( pool ) ) ) {
+        if( mongo_pool_ready( pool, slot ) == MONGO_OK )
+            return mongo_pool_hand_out( pool, slot );
+        mongo_pool_release_empty( pool, slot );
+    }
+
+    if( ( slot = mongo_pool_take_empty( pool ) ) ) {
+        if( mongo_pool_open( pool, slot ) == MONGO_OK )
+            return mongo_pool_hand_out( pool, slot );
+        mongo_pool_release_empty( pool, slot );
+        *failed = 1;
+    }
+
+    return NULL;
+}
+
+MONGO_EXPORT mongo *mongo_pool_checkout( mongo_pool *pool ) {
+    mongo *conn;
+    int64_t deadline, now;
+    int failed, returns;
+
+    if( ( conn = mongo_pool_try_checkout( pool, &failed ) ) || failed || ! pool->mutex )
+        return conn;
+
+    deadline = mongo_env_time_ms( ) + pool->checkout_timeout_ms;
+    mongo_env_atomic_add( &pool->waiters, 1 );
+
+    for( ;; ) {
+        returns = mongo_env_atomic_add( &pool->returns, 0 );
+        if( ( conn = mongo_pool_try_checkout( pool, &failed ) ) || failed )
+            break;
+        if( ( now = mongo_env_time_ms( ) ) >= deadline )
+            break;
+
+        /* Slots are opened and pinged with the mutex released. */
+        mongo_env_mutex_lock( pool->mutex );
+        if( mongo_env_atomic_add( &pool->returns, 0 ) == returns )
+            mongo_env_cond_timedwait( pool->cond, pool->mutex, ( int )( deadline - now ) );
+        mongo_env_mutex_unlock( pool->mutex );
+    }
+
+    mongo_env_atomic_add( &pool->waiters, -1 );
+    return conn;
+}
+
+MONGO_EXPORT void mongo_pool_checkin( mongo_pool *pool, mongo *conn ) {
+    mongo_pool_slot *slot = ( mongo_pool_slot * )conn;
+
+    if( slot < pool->slots || slot >= pool->slots + pool->max_size )
+        return;
+
+    mongo_clear_errors( conn );
+    slot->last_used = mongo_env_time_ms( );
+    mongo_env_atomic_cas( &slot->state, MONGO_POOL_BUSY, MONGO_POOL_IDLE );
+    mongo_pool_wake( pool );
+}
+
+MONGO_EXPORT int mongo_pool_bulk_execute( mongo_pool *pool, mongo_bulk *bulk, int threads ) {
+    mongo **conns;
+    int i, count = 1, failed, res;
+
+    if( threads < 1 )
+        threads = 1;
+
+    /* Only take connections that are free right now. */
+    conns = ( mongo ** )bson_malloc( threads * sizeof( mongo * ) );
+    conns[0] = bulk->conn;
+    while( count < threads && ( conns[count] = mongo_pool_try_checkout( pool, &failed ) ) )
+        count++;
+
+    res = mongo_bulk_execute_parallel( bulk, conns, count );
+
+    for( i = 1; i < count; i++ )
+        mongo_pool_checkin( pool, conns[i] );
+    bson_free( conns );
+
+    return res;
+}
+
+MONGO_EXPORT int mongo_pool_trim( mongo_pool *pool, int idle_ms ) {
+    mongo_pool_slot *slot;
+    int64_t now = mongo_env_time_ms( );
+    int i, closed = 0;
+
+    for( i = 0; i < pool->max_size &&
+            mongo_env_atomic_add( &pool->live, 0 ) > pool->min_size; i++ ) {
+        slot = &pool->slots[i];
+        if( ! mongo_env_atomic_cas( &slot->state, MONGO_POOL_IDLE, MONGO_POOL_BUSY ) )
+            continue;
+
+        /* last_used is only ours to read once we own the slot. */
+        if( now - slot->last_used > idle_ms ) {
+            mongo_pool_release_empty( pool, slot );
+            closed++;
+        }
+        else {
+            mongo_env_atomic_cas( &slot->state, MONGO_POOL_BUSY, MONGO_POOL_IDLE );
+            mongo_pool_wake( pool );
+        }
+    }
+
+    return closed;
+}
+
+MONGO_EXPORT void mongo_pool_destroy( mongo_pool *pool ) {
+    int i;
+
+    for( i = 0; i < pool->max_size; i++ )
+        mongo_pool_close( &pool->slots[i] );
+
+    if( pool->mutex ) {
+        mongo_env_cond_destroy( pool->cond );
+        mongo_env_mutex_destroy( pool->mutex );
+    }
+    bson_free( pool->slots );
+    bson_free( pool->db );
+    bson_free( pool->user );
+    bson_free( pool->pass );
+    memset( pool, 0, sizeof( mongo_pool ) );
+}
@@ -0,0 +1,172 @@
+/** @file pool.h
+ *
+ *  @brief A thread-safe pool of authenticated connections.
+ *
+ * */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "mongo.h"
+
+#ifndef MONGO_POOL_H_
+#define MONGO_POOL_H_
+
+MONGO_EXTERN_C_START
+
+enum mongo_pool_slot_state {
+    MONGO_POOL_EMPTY = 0,   /**< No connection. */
+    MONGO_POOL_IDLE,        /**< Connected and available. */
+    MONGO_POOL_BUSY         /**< Checked out, or being opened or closed. */
+};
+
+typedef struct {
+    mongo conn;             /**< Must stay first; checkin maps a conn back to its slot. */
+    volatile int state;     /**< A mongo_pool_slot_state, changed only by CAS. */
+    int64_t last_used;      /**< When the connection was last checked in. */
+} mongo_pool_slot;
+
+typedef struct {
+    char host[MAXHOSTNAMELEN];
+    int port;
+    char *db;               /**< Database to authenticate against, or NULL. */
+    char *user;
+    char *pass;
+    int min_size;           /**< Connections opened up front and never trimmed. */
+    int max_size;           /**< Number of slots. */
+    int health_check_ms;    /**< Ping connections idle longer than this; -1 never. */
+    int checkout_timeout_ms;/**< How long checkout waits when every slot is busy. */
+    volatile int live;      /**< Slots holding a connection. */
+    mongo_pool_slot *slots;
+    void *mutex;            /**< Held only to sleep on and broadcast cond. */
+    void *cond;             /**< Broadcast when a slot is given back while checkouts wait. */
+    volatile int waiters;   /**< Checkouts waiting for a slot. */
+    volatile int returns;   /**< Bumped each time a slot is given back. */
+} mongo_pool;
+
+/**
+ * Initialize a pool for a single server. No connections are opened
+ * until mongo_pool_connect( ).
+ *
+ * @param pool
+ * @param host
+ * @param port
+ * @param min_size connections to open up front and keep open.
+ * @param max_size the most connections the pool will hold.
+ *
+ * @return MONGO_OK or MONGO_ERROR if the sizes are invalid.
+ */
+MONGO_EXPORT int mongo_pool_init( mongo_pool *pool, const char *host, int port,
+                                  int min_size, int max_size );
+
+/**
+ * Authenticate every connection as it is opened, and again whenever it
+ * is reopened. Call before mongo_pool_connect( ).
+ *
+ * @param pool
+ * @param db the database to authenticate against.
+ * @param user
+ * @param pass
+ */
+MONGO_EXPORT void mongo_pool_set_auth( mongo_pool *pool, const char *db,
+                                       const char *user, const char *pass );
+
+/**
+ * Ping a connection before handing it out if it has sat idle for
+ * longer than idle_ms, reopening it if the ping fails. Defaults to
+ * 5000; -1 disables the check.
+ *
+ * @param pool
+ * @param idle_ms
+ */
+MONGO_EXPORT void mongo_pool_set_health_check( mongo_pool *pool, int idle_ms );
+
+/**
+ * How long mongo_pool_checkout( ) waits for a connection when all
+ * max_size connections are in use. Defaults to 1000.
+ *
+ * @param pool
+ * @param millis
+ */
+MONGO_EXPORT void mongo_pool_set_checkout_timeout( mongo_pool *pool, int millis );
+
+/**
+ * Open and authenticate min_size connections.
+ *
+ * @param pool
+ *
+ * @return MONGO_OK, or MONGO_ERROR if any connection failed.
+ */
+MONGO_EXPORT int mongo_pool_connect( mongo_pool *pool );
+
+/**
+ * Take a connection from the pool. A thread is handed the connection
+ * it used last when that one is idle. Safe to call from any thread;
+ * no locks are taken unless every connection is in use, in which case
+ * the caller sleeps until one is checked in or the timeout passes.
+ *
+ * @param pool
+ *
+ * @return a connected, authenticated mongo object, or NULL if none
+ *     became available before the checkout timeout or a new
+ *     connection could not be opened.
+ */
+MONGO_EXPORT mongo *mongo_pool_checkout( mongo_pool *pool );
+
+/**
+ * Return a connection to the pool. Its errors are cleared; if it has
+ * been disconnected it is reopened at its next checkout.
+ *
+ * @param pool
+ * @param conn a connection from mongo_pool_checkout( ).
+ */
+MONGO_EXPORT void mongo_pool_checkin( mongo_pool *pool, mongo *conn );
+
+/**
+ * Execute an unordered bulk write from up to threads threads, each on
+ * its own connection. bulk->conn, normally checked out from this pool,
+ * does one share; the others go to connections that are idle, or can
+ * be opened, right away. See mongo_bulk_execute_parallel( ).
+ *
+ * @param pool
+ * @param bulk
+ * @param threads the most connections to use, including bulk->conn.
+ *
+ * @return MONGO_OK or MONGO_ERROR, with errors reported on bulk->conn.
+ */
+MONGO_EXPORT int mongo_pool_bulk_execute( mongo_pool *pool, mongo_bulk *bulk, int threads );
+
+/**
+ * Close connections idle for longer than idle_ms, keeping at least
+ * min_size open.
+ *
+ * @param pool
+ * @param idle_ms
+ *
+ * @return the number of connections closed.
+ */
+MONGO_EXPORT int mongo_pool_trim( mongo_pool *pool, int idle_ms );
+
+/**
+ * Close every connection and free the pool's resources. No
+ * connections may be checked out.
+ *
+ * @param pool
+ */
+MONGO_EXPORT void mongo_pool_destroy( mongo_pool *pool );
+
+MONGO_EXTERN_C_END
+
+#endif
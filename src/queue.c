@@ -0,0 +1,403 @@
+/* queue.c */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "queue.h"
+#include "env.h"
+
+#include <string.h>
+
+/* The documents for one namespace in the current window. */
+typedef struct {
+    const char *ns;
+    const bson **docs;
+    int count;
+    int size;
+} mongo_write_queue_batch;
+
+/* Everything taken off the queue and not yet written. Owned by the
+ * writer thread. */
+typedef struct {
+    mongo_write_queue_batch *batches;
+    int batch_count;
+    int batch_size;
+    mongo_write_queue_item *items; /* Every item in the window, for freeing. */
+    mongo_write_queue_item *items_tail;
+    int count;
+    int bytes;
+    int64_t deadline;
+} mongo_write_queue_window;
+
+MONGO_EXPORT void mongo_write_queue_init( mongo_write_queue *queue,
+                                          mongo_write_concern *write_concern,
+                                          mongo_write_queue_callback cb, void *arg ) {
+    memset( queue, 0, sizeof( mongo_write_queue ) );
+    queue->write_concern = write_concern;
+    queue->cb = cb;
+    queue->arg = arg;
+    queue->flush_ms = MONGO_WRITE_QUEUE_DEFAULT_FLUSH_MS;
+    queue->max_queued = MONGO_WRITE_QUEUE_DEFAULT_MAX_QUEUED;
+}
+
+MONGO_EXPORT void mongo_write_queue_set_flush( mongo_write_queue *queue, int millis, int bytes ) {
+    queue->flush_ms = millis;
+    queue->flush_bytes = bytes;
+}
+
+/*********************************************************************
+Writer
+**********************************************************************/
+
+static mongo_write_queue_batch *mongo_write_queue_batch_for( mongo_write_queue_window *w,
+                                                             const char *ns ) {
+    mongo_write_queue_batch *batch;
+    int i;
+
+    for( i = 0; i < w->batch_count; i++ ) {
+        if( strcmp( w->batches[i].ns, ns ) == 0 )
+            return &w->batches[i];
+    }
+
+    if( w->batch_count == w->batch_size ) {
+        w->batch_size = w->batch_size ? w->batch_size * 2 : 4;
+        w->batches = ( mongo_write_queue_batch * )bson_realloc( w->batches,
+                     w->batch_size * sizeof( mongo_write_queue_batch ) );
+        memset( w->batches + w->batch_count, 0,
+                ( w->batch_size - w->batch_count ) * sizeof( mongo_write_queue_batch ) );
+    }
+
+    batch = &w->batches[w->batch_count++];
+    batch->ns = ns;
+    batch->count = 0;
+    return batch;
+}
+
+/* Move everything queued into the window, oldest first. */
+static void mongo_write_queue_take( mongo_write_queue *queue, mongo_write_queue_window *w ) {
+    mongo_write_queue_item *item, *next, *oldest = NULL;
+    mongo_write_queue_batch *batch;
+    int taken = 0;
+
+    /* The stack comes off newest first; reverse it. */
+    item = ( mongo_write_queue_item * )mongo_env_atomic_swap_ptr( &queue->head, NULL );
+    while( item ) {
+        next = item->next;
+        item->next = oldest;
+        oldest = item;
+        item = next;
+    }
+
+    if( oldest && ! w->count )
+        w->deadline = mongo_env_time_ms( ) + queue->flush_ms;
+
+    for( item = oldest; item; item = item->next ) {
+        batch = mongo_write_queue_batch_for( w, item->ns );
+        if( batch->count == batch->size ) {
+            batch->size = batch->size ? batch->size * 2 : 64;
+            batch->docs = ( const bson ** )bson_realloc( ( void * )batch->docs,
+                          batch->size * sizeof( bson * ) );
+        }
+        batch->docs[batch->count++] = &item->doc;
+        w->bytes += bson_size( &item->doc );
+        taken++;
+    }
+
+    if( oldest ) {
+        if( w->items_tail )
+            w->items_tail->next = oldest;
+        else
+            w->items = oldest;
+        for( item = oldest; item->next; item = item->next )
+            ;
+        w->items_tail = item;
+        w->count += taken;
+        mongo_env_atomic_add( &queue->queued, -taken );
+    }
+}
+
+/* Acknowledge a window with a single getlasterror, run on the database
+ * of the last namespace written. mongo_insert_batch( ) can't be asked
+ * to do it: it sends a getlasterror after every message a large batch
+ * is split into. */
+static int mongo_write_queue_ack( mongo_write_queue *queue, const char *ns ) {
+    mongo *conn = queue->conn;
+    mongo_write_concern *write_concern = queue->write_concern;
+    bson response[1];
+    char *db;
+    size_t db_len = strchr( ns, '.' ) - ns;
+    int res;
+
+    if( ! write_concern )
+        write_concern = conn->write_concern;
+    if( ! write_concern || write_concern->w < 1 )
+        return MONGO_OK;
+    if( ! write_concern->cmd ) {
+        __mongo_set_error( conn, MONGO_WRITE_CONCERN_INVALID,
+                           "Must call mongo_write_concern_finish() before using *write_concern.", 0 );
+        return MONGO_ERROR;
+    }
+
+    db = ( char * )bson_malloc( db_len + 1 );
+    memcpy( db, ns, db_len );
+    db[db_len] = '\0';
+    res = mongo_run_command( conn, db, write_concern->cmd, response );
+    bson_free( db );
+
+    if( res == MONGO_OK ) {
+        res = mongo_parse_last_error( conn, response );
+        bson_destroy( response );
+    }
+    return res;
+}
+
+/* Write the window as one unacknowledged batch insert per namespace,
+ * then acknowledge the lot with one getlasterror. */
+static void mongo_write_queue_flush( mongo_write_queue *queue, mongo_write_queue_window *w ) {
+    mongo *conn = queue->conn;
+    mongo_write_concern unacknowledged[1];
+    mongo_write_queue_item *item;
+    mongo_error_t err = MONGO_CONN_SUCCESS;
+    int errcode = 0, lasterrcode = 0, i, last = -1;
+    char errstr[MONGO_ERR_LEN], lasterrstr[MONGO_ERR_LEN];
+    int res = MONGO_OK;
+
+    if( ! w->count )
+        return;
+
+    mongo_write_concern_init( unacknowledged );
+    mongo_write_concern_set_w( unacknowledged, 0 );
+    mongo_write_concern_finish( unacknowledged );
+
+    mongo_clear_errors( conn );
+    if( ! conn->connected && mongo_reconnect( conn ) != MONGO_OK )
+        res = MONGO_ERROR;
+
+    for( i = 0; i < w->batch_count && res == MONGO_OK; i++ ) {
+        if( ! w->batches[i].count )
+            continue;
+        if( mongo_insert_batch( conn, w->batches[i].ns, w->batches[i].docs,
+                                w->batches[i].count, unacknowledged,
+                                MONGO_CONTINUE_ON_ERROR ) != MONGO_OK ) {
+            /* Keep going for the other namespaces, but report this. */
+            if( err == MONGO_CONN_SUCCESS ) {
+                err = conn->err;
+                errcode = conn->errcode;
+                lasterrcode = conn->lasterrcode;
+                memcpy( errstr, conn->errstr, MONGO_ERR_LEN );
+                memcpy( lasterrstr, conn->lasterrstr, MONGO_ERR_LEN );
+            }
+            if( ! conn->connected )
+                res = MONGO_ERROR;
+        }
+        else
+            last = i;
+        w->batches[i].count = 0;
+    }
+
+    if( res == MONGO_OK && last >= 0 &&
+            mongo_write_queue_ack( queue, w->batches[last].ns ) != MONGO_OK &&
+            err == MONGO_CONN_SUCCESS ) {
+        err = conn->err;
+        errcode = conn->errcode;
+        lasterrcode = conn->lasterrcode;
+        memcpy( errstr, conn->errstr, MONGO_ERR_LEN );
+        memcpy( lasterrstr, conn->lasterrstr, MONGO_ERR_LEN );
+    }
+
+    if( err != MONGO_CONN_SUCCESS ) {
+        res = MONGO_ERROR;
+        conn->err = err;
+        conn->errcode = errcode;
+        conn->lasterrcode = lasterrcode;
+        memcpy( conn->errstr, errstr, MONGO_ERR_LEN );
+        memcpy( conn->lasterrstr, lasterrstr, MONGO_ERR_LEN );
+    }
+
+    if( queue->cb )
+        queue->cb( conn, res, w->count, queue->arg );
+
+    while( ( item = w->items ) ) {
+        w->items = item->next;
+        bson_free( item );
+    }
+    w->items_tail = NULL;
+    w->batch_count = 0;
+    w->count = 0;
+    w->bytes = 0;
+
+    mongo_write_concern_destroy( unacknowledged );
+}
+
+/* Sleep until something is queued, the open window's deadline passes
+ * or the queue closes. Returns whether it has closed. */
+static int mongo_write_queue_wait( mongo_write_queue *queue, mongo_write_queue_window *w ) {
+    int64_t now;
+    int closed;
+
+    mongo_env_mutex_lock( queue->mutex );
+    while( ! ( closed = mongo_env_atomic_add( &queue->closed, 0 ) ) &&
+            ! mongo_env_atomic_cas_ptr( &queue->head, NULL, NULL ) ) {
+        if( ! w->count )
+            mongo_env_cond_wait( queue->cond, queue->mutex );
+        else if( ( now = mongo_env_time_ms( ) ) < w->deadline )
+            mongo_env_cond_timedwait( queue->cond, queue->mutex, ( int )( w->deadline - now ) );
+        else
+            break;
+    }
+    mongo_env_mutex_unlock( queue->mutex );
+
+    return closed;
+}
+
+static void mongo_write_queue_run( void *arg ) {
+    mongo_write_queue *queue = ( mongo_write_queue * )arg;
+    mongo_write_queue_window w[1];
+    int closed, limit;
+
+    memset( w, 0, sizeof( mongo_write_queue_window ) );
+
+    for( ;; ) {
+        /* Once closed, no new push can begin; let those already under
+         * way land so the last pass takes every accepted item. */
+        if( ( closed = mongo_write_queue_wait( queue, w ) ) ) {
+            while( mongo_env_atomic_add( &queue->pushing, 0 ) )
+                mongo_env_sleep_ms( 1 );
+        }
+        mongo_write_queue_take( queue, w );
+
+        limit = queue->flush_bytes ? queue->flush_bytes : queue->conn->max_msg_size;
+        if( w->count && ( closed || w->bytes >= limit || mongo_env_time_ms( ) >= w->deadline ) )
+            mongo_write_queue_flush( queue, w );
+
+        if( closed )
+            break;
+    }
+
+    for( ; w->batch_size; w->batch_size-- )
+        bson_free( ( void * )w->batches[w->batch_size - 1].docs );
+    bson_free( w->batches );
+}
+
+/*********************************************************************
+API
+**********************************************************************/
+
+MONGO_EXPORT int mongo_write_queue_start( mongo *conn, mongo_write_queue *queue ) {
+    if( queue->write_concern && queue->write_concern->w >= 1 &&
+            ! queue->write_concern->cmd ) {
+        __mongo_set_error( conn, MONGO_WRITE_CONCERN_INVALID,
+                           "Must call mongo_write_concern_finish() before using *write_concern.", 0 );
+        return MONGO_ERROR;
+    }
+
+    queue->conn = conn;
+    queue->max_bson_size = conn->max_bson_size;
+
+    if( mongo_env_mutex_create( &queue->mutex ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_env_cond_create( &queue->cond ) != MONGO_OK ) {
+        mongo_env_mutex_destroy( queue->mutex );
+        return MONGO_ERROR;
+    }
+
+    conn->write_queue = queue;
+
+    if( mongo_env_thread_create( &queue->writer, mongo_write_queue_run, queue ) != MONGO_OK ) {
+        conn->write_queue = NULL;
+        mongo_env_cond_destroy( queue->cond );
+        mongo_env_mutex_destroy( queue->mutex );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_enqueue_insert( mongo *conn, const char *ns, const bson *data ) {
+    mongo_write_queue *queue = conn->write_queue;
+    mongo_write_queue_item *item;
+    void *head = NULL, *seen;
+    size_t ns_size;
+    int size;
+
+    if( ! queue )
+        return MONGO_ERROR;
+
+    /* The copy below starts with err cleared, so check it here. */
+    if( ! data->finished || ( size = bson_size( data ) ) > queue->max_bson_size ||
+            ( data->err & ( BSON_NOT_UTF8 | BSON_FIELD_HAS_DOT | BSON_FIELD_INIT_DOLLAR ) ) )
+        return MONGO_ERROR;
+
+    /* Counted in before looking at closed, so the writer's last pass
+     * waits for this push if it got past the check. */
+    mongo_env_atomic_add( &queue->pushing, 1 );
+    if( mongo_env_atomic_add( &queue->closed, 0 ) ) {
+        mongo_env_atomic_add( &queue->pushing, -1 );
+        return MONGO_ERROR;
+    }
+
+    if( mongo_env_atomic_add( &queue->queued, 1 ) > queue->max_queued ) {
+        mongo_env_atomic_add( &queue->queued, -1 );
+        mongo_env_atomic_add( &queue->pushing, -1 );
+        return MONGO_ERROR;
+    }
+
+    /* One allocation holds the item, its namespace and the document. */
+    ns_size = strlen( ns ) + 1;
+    item = ( mongo_write_queue_item * )bson_malloc( sizeof( mongo_write_queue_item ) +
+            ns_size + size );
+    item->ns = ( char * )( item + 1 );
+    memcpy( ( char * )( item + 1 ), ns, ns_size );
+    memcpy( ( char * )( item + 1 ) + ns_size, data->data, size );
+    bson_init_finished_data( &item->doc, ( char * )( item + 1 ) + ns_size, 0 );
+
+    for( ;; ) {
+        item->next = ( mongo_write_queue_item * )head;
+        seen = mongo_env_atomic_cas_ptr( &queue->head, head, item );
+        if( seen == head )
+            break;
+        head = seen;
+    }
+
+    /* Only the first item into an empty queue can find the writer
+     * asleep. */
+    if( ! head ) {
+        mongo_env_mutex_lock( queue->mutex );
+        mongo_env_cond_broadcast( queue->cond );
+        mongo_env_mutex_unlock( queue->mutex );
+    }
+
+    mongo_env_atomic_add( &queue->pushing, -1 );
+    return MONGO_OK;
+}
+
+MONGO_EXPORT void mongo_write_queue_stop( mongo *conn ) {
+    mongo_write_queue *queue = conn->write_queue;
+
+    if( ! queue )
+        return;
+
+    mongo_env_mutex_lock( queue->mutex );
+    mongo_env_atomic_cas( &queue->closed, 0, 1 );
+    mongo_env_cond_broadcast( queue->cond );
+    mongo_env_mutex_unlock( queue->mutex );
+
+    mongo_env_thread_join( queue->writer );
+    mongo_env_cond_destroy( queue->cond );
+    mongo_env_mutex_destroy( queue->mutex );
+    queue->writer = NULL;
+    conn->write_queue = NULL;
+}
@@ -0,0 +1,146 @@
+/** @file queue.h
+ *
+ *  @brief Fire-and-forget inserts written by a background thread.
+ *
+ *  Any thread may queue an insert without blocking. A writer thread
+ *  owns the connection: it gathers queued documents by namespace and
+ *  sends them as batch inserts when a flush window closes, either
+ *  because the window's time is up or enough bytes are waiting. Each
+ *  window is acknowledged by a single getlasterror, and its outcome is
+ *  reported through a callback.
+ *
+ * */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "mongo.h"
+
+#ifndef MONGO_QUEUE_H_
+#define MONGO_QUEUE_H_
+
+MONGO_EXTERN_C_START
+
+#define MONGO_WRITE_QUEUE_DEFAULT_FLUSH_MS 10
+#define MONGO_WRITE_QUEUE_DEFAULT_MAX_QUEUED 100000
+
+/**
+ * Called on the writer thread once per flush window.
+ *
+ * @param conn the queue's connection. Its err, lasterrcode and
+ *     lasterrstr describe a failure; it must not be used otherwise.
+ * @param status MONGO_OK, or MONGO_ERROR if the window could not be
+ *     written or its getlasterror reported an error. The window's
+ *     documents all go out unacknowledged and a single getlasterror
+ *     follows them, which only reports the last error, so a failure
+ *     does not say which documents were not inserted.
+ * @param count the number of documents in the window.
+ * @param arg the pointer given to mongo_write_queue_init( ).
+ */
+typedef void ( *mongo_write_queue_callback )( mongo *conn, int status, int count, void *arg );
+
+typedef struct mongo_write_queue_item {
+    struct mongo_write_queue_item *next;
+    const char *ns;           /**< Points into the item's own allocation. */
+    bson doc;                 /**< Likewise. */
+} mongo_write_queue_item;
+
+typedef struct mongo_write_queue {
+    mongo *conn;              /**< Connection is *not* owned. */
+    mongo_write_concern *write_concern; /**< Acknowledges each window, or NULL for the conn's. */
+    mongo_write_queue_callback cb;
+    void *arg;
+    int flush_ms;             /**< Longest a window stays open. */
+    int flush_bytes;          /**< Close a window early once this much is waiting; 0 for
+                                   the server's maximum message size. */
+    int max_queued;           /**< Documents queued before mongo_enqueue_insert( ) fails. */
+    int max_bson_size;        /**< Snapshot of conn->max_bson_size. */
+    void *volatile head;      /**< Newest queued item; a lock-free stack. */
+    volatile int queued;      /**< Items pushed and not yet taken by the writer. */
+    volatile int pushing;     /**< mongo_enqueue_insert( ) calls past the closed check. */
+    volatile int closed;      /**< Set under mutex once stopping; no more items are taken. */
+    void *mutex;              /**< Guards the writer's sleep. */
+    void *cond;               /**< Wakes the writer when the queue stops being empty or closes. */
+    void *writer;             /**< Writer thread. */
+} mongo_write_queue;
+
+/**
+ * Initialize a write queue.
+ *
+ * @param queue
+ * @param write_concern acknowledges each flush window. NULL uses the
+ *     connection's write concern at flush time; w < 1 sends no
+ *     getlasterror at all.
+ * @param cb called once per flush window, or NULL.
+ * @param arg passed to cb.
+ */
+MONGO_EXPORT void mongo_write_queue_init( mongo_write_queue *queue,
+                                          mongo_write_concern *write_concern,
+                                          mongo_write_queue_callback cb, void *arg );
+
+/**
+ * Change when flush windows close. Call before mongo_write_queue_start( ).
+ *
+ * @param queue
+ * @param millis the longest a window stays open. Defaults to 10.
+ * @param bytes close a window as soon as this many bytes of documents
+ *     are waiting; 0, the default, uses the server's maximum message size.
+ */
+MONGO_EXPORT void mongo_write_queue_set_flush( mongo_write_queue *queue, int millis, int bytes );
+
+/**
+ * Start a writer thread for conn. Until mongo_write_queue_stop( ) the
+ * connection belongs to that thread and must only be used through
+ * mongo_enqueue_insert( ). The writer reconnects if the connection
+ * drops.
+ *
+ * @param conn a connected mongo object.
+ * @param queue an initialized queue, which must outlive the writer.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the write concern is invalid or
+ *     the thread could not be started, including on platforms without
+ *     threads.
+ */
+MONGO_EXPORT int mongo_write_queue_start( mongo *conn, mongo_write_queue *queue );
+
+/**
+ * Queue a copy of a document for insertion. Safe to call from any
+ * thread. Never blocks; the queue's lock is only taken to wake an idle
+ * writer.
+ *
+ * @param conn a connection with a started write queue.
+ * @param ns the namespace.
+ * @param data the document.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if the connection has no write
+ *     queue, the queue is stopping or full, or the document is not
+ *     finished, too large or not valid for insertion: bad UTF-8, or
+ *     a key with a '.' or a leading '$'. conn's error fields are left
+ *     alone, as they belong to the writer.
+ */
+MONGO_EXPORT int mongo_enqueue_insert( mongo *conn, const char *ns, const bson *data );
+
+/**
+ * Flush everything queued and stop the writer thread. Once this has
+ * been called mongo_enqueue_insert( ) fails; everything it accepted
+ * before is written. The connection can then be used directly again.
+ *
+ * @param conn
+ */
+MONGO_EXPORT void mongo_write_queue_stop( mongo *conn );
+
+MONGO_EXTERN_C_END
+
+#endif
@@ -0,0 +1,596 @@
+/* shared.c */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "shared.h"
+#include "env.h"
+
+#include <string.h>
+
+#define MONGO_SHARED_QUERY_FAILURE 2 /* OP_REPLY QueryFailure flag */
+
+static const int ZERO = 0;
+
+/*********************************************************************
+Errors
+**********************************************************************/
+
+/* Copy an error string, truncated to MONGO_ERR_LEN. */
+static void mongo_shared_copy_error( char *dst, const char *str ) {
+    size_t len = strlen( str );
+
+    if( len >= MONGO_ERR_LEN )
+        len = MONGO_ERR_LEN - 1;
+
+    memcpy( dst, str, len );
+    dst[len] = '\0';
+}
+
+static void mongo_shared_set_error( mongo_shared_call *call, mongo_error_t err,
+                                    const char *str, int errcode ) {
+    call->err = err;
+    call->errcode = errcode;
+    mongo_shared_copy_error( call->errstr, str );
+}
+
+/* Check the first document of the call's reply, a getlasterror
+ * response or a failed query's $err, and copy the server's error into
+ * the call. */
+static int mongo_shared_parse_last_error( mongo_shared_call *call ) {
+    bson response[1];
+
+    bson_init_finished_data( response, &call->reply->objs, 0 );
+    return mongo_parse_last_error_into( response, &call->lasterrcode, call->lasterrstr );
+}
+
+/* Fail every waiting call. Called with the mutex held. */
+static void mongo_shared_fail( mongo_shared *shared ) {
+    mongo_shared_call *call;
+
+    while( ( call = shared->waiting ) ) {
+        shared->waiting = call->next;
+        mongo_shared_set_error( call, shared->fail_err, shared->fail_errstr,
+                                shared->fail_errcode );
+        call->done = 1;
+    }
+
+    mongo_env_cond_broadcast( shared->cond );
+}
+
+/*********************************************************************
+Reader
+**********************************************************************/
+
+/* Take the call a reply answers off the waiting list. Called with the
+ * mutex held. */
+static mongo_shared_call *mongo_shared_take( mongo_shared *shared, int id ) {
+    mongo_shared_call *call, *prev = NULL;
+
+    for( call = shared->waiting; call; prev = call, call = call->next ) {
+        if( call->id == id ) {
+            if( prev )
+                prev->next = call->next;
+            else
+                shared->waiting = call->next;
+            return call;
+        }
+    }
+
+    return NULL;
+}
+
+/* Hand replies to their callers until the socket fails or is shut
+ * down. The reader has its own mongo object, with its own read buffer
+ * and reply pool, so that its errors never touch the shared one, which
+ * writers use under the write lock. A reply no call is waiting for is
+ * kept to be reused for the next. */
+static void mongo_shared_reader( void *arg ) {
+    mongo_shared *shared = ( mongo_shared * )arg;
+    mongo_shared_call *call;
+    mongo_reply *reply = NULL;
+    mongo conn[1];
+    int res;
+
+    memset( conn, 0, sizeof( mongo ) );
+    conn->sock = shared->conn->sock;
+
+    while( ( res = mongo_read_response( conn, &reply ) ) == MONGO_OK ) {
+        mongo_env_mutex_lock( shared->mutex );
+        if( ( call = mongo_shared_take( shared, reply->head.responseTo ) ) ) {
+            call->reply = reply;
+            call->done = 1;
+            reply = NULL;
+            mongo_env_cond_broadcast( shared->cond );
+        }
+        mongo_env_mutex_unlock( shared->mutex );
+    }
+
+    if( res == MONGO_READ_SIZE_ERROR )
+        __mongo_set_error( conn, MONGO_READ_SIZE_ERROR, "Invalid reply length.", 0 );
+
+    mongo_env_mutex_lock( shared->mutex );
+    if( ! shared->failed ) {
+        shared->failed = 1;
+        shared->fail_err = conn->err;
+        shared->fail_errcode = conn->errcode;
+        memcpy( shared->fail_errstr, conn->errstr, MONGO_ERR_LEN );
+    }
+    mongo_shared_fail( shared );
+    mongo_env_mutex_unlock( shared->mutex );
+
+    /* Never connected as far as conn knows: this frees its buffers and
+     * leaves the socket alone. */
+    mongo_destroy( conn );
+}
+
+/*********************************************************************
+Message building
+**********************************************************************/
+
+/* Write a message header. The new request id is stored in *id. */
+static char *mongo_shared_message( char *data, int len, int op, int *id ) {
+    *id = mongo_next_request_id( );
+    mongo_header_init( ( mongo_header * )data, len, *id, 0, op );
+    return data + sizeof( mongo_header );
+}
+
+static int mongo_shared_query_size( int ns_len, const char *suffix,
+                                    const bson *query, const bson *fields ) {
+    return 16 + 4 + ns_len + ( int )strlen( suffix ) + 1 + 4 + 4
+           + bson_size( query ) + ( fields ? bson_size( fields ) : 0 );
+}
+
+/* Write an OP_QUERY on ns_len bytes of ns followed by suffix. */
+static char *mongo_shared_query_message( char *data, const char *ns,
+                                         int ns_len, const char *suffix, int options,
+                                         int skip, int limit, const bson *query,
+                                         const bson *fields, int *id ) {
+    data = mongo_shared_message( data, mongo_shared_query_size( ns_len, suffix, query, fields ),
+                                 MONGO_OP_QUERY, id );
+    data = mongo_data_append32( data, &options );
+    data = mongo_data_append( data, ns, ns_len );
+    data = mongo_data_append( data, suffix, strlen( suffix ) + 1 );
+    data = mongo_data_append32( data, &skip );
+    data = mongo_data_append32( data, &limit );
+    data = mongo_data_append( data, query->data, bson_size( query ) );
+    if( fields )
+        data = mongo_data_append( data, fields->data, bson_size( fields ) );
+    return data;
+}
+
+static int mongo_shared_bson_valid( mongo_shared *shared, mongo_shared_call *call,
+                                    const bson *b ) {
+    if( ! b->finished ) {
+        mongo_shared_set_error( call, MONGO_BSON_NOT_FINISHED, "BSON not finished.", 0 );
+        return MONGO_ERROR;
+    }
+    if( bson_size( b ) > shared->conn->max_bson_size ) {
+        mongo_shared_set_error( call, MONGO_BSON_TOO_LARGE, "BSON too large.", 0 );
+        return MONGO_ERROR;
+    }
+    return MONGO_OK;
+}
+
+static int mongo_shared_write_concern( mongo_shared *shared, mongo_shared_call *call,
+                                       mongo_write_concern *custom_write_concern,
+                                       mongo_write_concern **write_concern ) {
+    *write_concern = custom_write_concern ? custom_write_concern : shared->conn->write_concern;
+
+    if( *write_concern && ( *write_concern )->w < 1 )
+        *write_concern = NULL;
+
+    if( *write_concern && ! ( *write_concern )->cmd ) {
+        mongo_shared_set_error( call, MONGO_WRITE_CONCERN_INVALID,
+                                "Must call mongo_write_concern_finish() before using *write_concern.", 0 );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+/*********************************************************************
+Calls
+**********************************************************************/
+
+static void mongo_shared_call_init( mongo_shared_call *call ) {
+    memset( call, 0, sizeof( mongo_shared_call ) );
+}
+
+/* Write len bytes of data, which the caller then frees, and wait for
+ * the reply to request id, if not 0. The message goes out in one
+ * piece under the write lock so requests from different threads never
+ * interleave. The mutex is never held across the write: the reader
+ * needs it to hand over replies, and the server may not read more of
+ * a long write until some of its replies have been read. */
+static int mongo_shared_send( mongo_shared *shared, mongo_shared_call *call,
+                              const char *data, int len, int id ) {
+    mongo *conn = shared->conn;
+    mongo_error_t err = MONGO_CONN_SUCCESS;
+    int errcode = 0;
+    char errstr[MONGO_ERR_LEN];
+    int res;
+
+    mongo_env_mutex_lock( shared->mutex );
+
+    if( shared->failed ) {
+        mongo_shared_set_error( call, shared->fail_err, shared->fail_errstr,
+                                shared->fail_errcode );
+        mongo_env_mutex_unlock( shared->mutex );
+        return MONGO_ERROR;
+    }
+
+    /* Registered first: the reply may arrive before the write returns. */
+    if( id ) {
+        call->id = id;
+        call->next = shared->waiting;
+        shared->waiting = call;
+    }
+
+    mongo_env_mutex_unlock( shared->mutex );
+
+    /* conn's error fields belong to the write lock; copy them out
+     * before letting go of it. */
+    mongo_env_mutex_lock( shared->write_mutex );
+    res = mongo_env_write_socket( conn, data, len );
+    if( res != MONGO_OK ) {
+        err = conn->err;
+        errcode = conn->errcode;
+        memcpy( errstr, conn->errstr, MONGO_ERR_LEN );
+    }
+    mongo_env_mutex_unlock( shared->write_mutex );
+
+    mongo_env_mutex_lock( shared->mutex );
+
+    if( res != MONGO_OK ) {
+        if( ! shared->failed ) {
+            shared->failed = 1;
+            shared->fail_err = err;
+            shared->fail_errcode = errcode;
+            memcpy( shared->fail_errstr, errstr, MONGO_ERR_LEN );
+        }
+        mongo_shared_fail( shared );
+        mongo_env_shutdown_socket( conn->sock );
+        if( ! id )
+            mongo_shared_set_error( call, err, errstr, errcode );
+    }
+    else if( id ) {
+        while( ! call->done )
+            mongo_env_cond_wait( shared->cond, shared->mutex );
+        if( ! call->reply )
+            res = MONGO_ERROR;
+    }
+
+    mongo_env_mutex_unlock( shared->mutex );
+    return res;
+}
+
+static int mongo_shared_gle_size( const char *ns, mongo_write_concern *write_concern ) {
+    if( ! write_concern )
+        return 0;
+    return mongo_shared_query_size( ( int )( strchr( ns, '.' ) - ns ), ".$cmd",
+                                    write_concern->cmd, NULL );
+}
+
+/* Space for a write of len bytes followed by its getlasterror. */
+static char *mongo_shared_write_alloc( const char *ns, int len,
+                                       mongo_write_concern *write_concern ) {
+    return ( char * )bson_malloc( len + mongo_shared_gle_size( ns, write_concern ) );
+}
+
+/* Send the len byte write in data followed by its getlasterror, if
+ * any, then free data and check the reply. */
+static int mongo_shared_write( mongo_shared *shared, mongo_shared_call *call,
+                               const char *ns, char *data, int len,
+                               mongo_write_concern *write_concern ) {
+    int res, id = 0;
+
+    if( write_concern )
+        mongo_shared_query_message( data + len, ns, ( int )( strchr( ns, '.' ) - ns ),
+                                    ".$cmd", 0, 0, 1, write_concern->cmd, NULL, &id );
+
+    res = mongo_shared_send( shared, call, data,
+                             len + mongo_shared_gle_size( ns, write_concern ), id );
+    bson_free( data );
+
+    if( res != MONGO_OK || ! write_concern )
+        return res;
+
+    if( call->reply->fields.num < 1 ) {
+        mongo_shared_set_error( call, MONGO_WRITE_ERROR, "Empty getlasterror reply.", 0 );
+        res = MONGO_ERROR;
+    }
+    else if( mongo_shared_parse_last_error( call ) != MONGO_OK ) {
+        mongo_shared_set_error( call, MONGO_WRITE_ERROR,
+                                "See call->lasterrstr for details.", 0 );
+        res = MONGO_ERROR;
+    }
+
+    mongo_shared_call_destroy( call );
+    return res;
+}
+
+/*********************************************************************
+API
+**********************************************************************/
+
+MONGO_EXPORT int mongo_shared_init( mongo_shared *shared, mongo *conn ) {
+    memset( shared, 0, sizeof( mongo_shared ) );
+    shared->conn = conn;
+
+    if( ! conn->connected ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, "Not connected.", 0 );
+        return MONGO_ERROR;
+    }
+
+    /* The reader takes the socket from here on; bytes already buffered
+     * on conn, or replies some cursor or ping is still owed, would
+     * reach no one. */
+    if( conn->read_buf_start != conn->read_buf_end || conn->prefetching ||
+            conn->streaming || conn->pinged ) {
+        __mongo_set_error( conn, MONGO_IO_ERROR, "Connection has unread replies.", 0 );
+        return MONGO_ERROR;
+    }
+
+    /* The reader waits for replies for as long as the connection is
+     * open; a receive timeout would fail it the first time the
+     * connection sat idle. Writes keep theirs. */
+    if( conn->op_timeout_ms > 0 && mongo_env_set_socket_recv_timeout( conn, 0 ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_env_mutex_create( &shared->mutex ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( mongo_env_mutex_create( &shared->write_mutex ) != MONGO_OK ) {
+        mongo_env_mutex_destroy( shared->mutex );
+        return MONGO_ERROR;
+    }
+
+    if( mongo_env_cond_create( &shared->cond ) != MONGO_OK ) {
+        mongo_env_mutex_destroy( shared->write_mutex );
+        mongo_env_mutex_destroy( shared->mutex );
+        return MONGO_ERROR;
+    }
+
+    if( mongo_env_thread_create( &shared->reader, mongo_shared_reader, shared ) != MONGO_OK ) {
+        mongo_env_cond_destroy( shared->cond );
+        mongo_env_mutex_destroy( shared->write_mutex );
+        mongo_env_mutex_destroy( shared->mutex );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_shared_query( mongo_shared *shared, mongo_shared_call *call,
+                                     const char *ns, const bson *query, const bson *fields,
+                                     int limit, int skip, int options ) {
+    char *data;
+    int len, id, res;
+
+    mongo_shared_call_init( call );
+
+    if( mongo_shared_bson_valid( shared, call, query ) != MONGO_OK ||
+            ( fields && mongo_shared_bson_valid( shared, call, fields ) != MONGO_OK ) )
+        return MONGO_ERROR;
+
+    len = mongo_shared_query_size( ( int )strlen( ns ), "", query, fields );
+    data = ( char * )bson_malloc( len );
+    mongo_shared_query_message( data, ns, ( int )strlen( ns ), "", options,
+                                skip, limit, query, fields, &id );
+
+    res = mongo_shared_send( shared, call, data, len, id );
+    bson_free( data );
+    if( res != MONGO_OK )
+        return MONGO_ERROR;
+
+    if( call->reply->fields.flag & MONGO_SHARED_QUERY_FAILURE ) {
+        mongo_shared_set_error( call, MONGO_COMMAND_FAILED,
+                                "Query failed. See call->lasterrstr for details.", 0 );
+        if( call->reply->fields.num > 0 )
+            mongo_shared_parse_last_error( call );
+        return MONGO_ERROR;
+    }
+
+    return MONGO_OK;
+}
+
+MONGO_EXPORT int mongo_shared_get_more( mongo_shared *shared, mongo_shared_call *call,
+                                        const char *ns, int64_t cursor_id, int limit ) {
+    int ns_len = ( int )strlen( ns );
+    int len = 16 + 4 + ns_len + 1 + 4 + 8;
+    int res, id;
+    char *data, *p;
+
+    mongo_shared_call_init( call );
+
+    data = ( char * )bson_malloc( len );
+    p = mongo_shared_message( data, len, MONGO_OP_GET_MORE, &id );
+    p = mongo_data_append32( p, &ZERO );
+    p = mongo_data_append( p, ns, ns_len + 1 );
+    p = mongo_data_append32( p, &limit );
+    mongo_data_append64( p, &cursor_id );
+
+    res = mongo_shared_send( shared, call, data, len, id );
+    bson_free( data );
+    return res;
+}
+
+MONGO_EXPORT int mongo_shared_find_one( mongo_shared *shared, mongo_shared_call *call,
+                                        const char *ns, const bson *query,
+                                        const bson *fields, bson *out ) {
+    bson found[1];
+    int res = MONGO_OK;
+
+    if( mongo_shared_query( shared, call, ns, query, fields, 1, 0, 0 ) != MONGO_OK ) {
+        mongo_shared_call_destroy( call );
+        return MONGO_ERROR;
+    }
+
+    if( call->reply->fields.num < 1 )
+        res = MONGO_ERROR;
+    else if( out ) {
+        bson_init_finished_data( found, &call->reply->objs, 0 );
+        bson_copy( out, found );
+    }
+
+    mongo_shared_call_destroy( call );
+    return res;
+}
+
+MONGO_EXPORT int mongo_shared_run_command( mongo_shared *shared, mongo_shared_call *call,
+                                           const char *db, const bson *command, bson *out ) {
+    bson response[1];
+    bson_iterator it[1];
+    char *ns;
+    size_t db_len = strlen( db );
+    int res;
+
+    ns = ( char * )bson_malloc( db_len + 6 );
+    strcpy( ns, db );
+    strcpy( ns + db_len, ".$cmd" );
+    res = mongo_shared_query( shared, call, ns, command, NULL, 1, 0, 0 );
+    bson_free( ns );
+
+    if( res != MONGO_OK ) {
+        mongo_shared_call_destroy( call );
+        return MONGO_ERROR;
+    }
+
+    if( call->reply->fields.num < 1 ) {
+        mongo_shared_set_error( call, MONGO_COMMAND_FAILED, "Empty command reply.", 0 );
+        mongo_shared_call_destroy( call );
+        return MONGO_ERROR;
+    }
+
+    bson_init_finished_data( response, &call->reply->objs, 0 );
+    if( ! bson_find( it, response, "ok" ) || ! bson_iterator_bool( it ) ) {
+        mongo_shared_set_error( call, MONGO_COMMAND_FAILED, "Command failed.", 0 );
+        if( bson_find( it, response, "errmsg" ) == BSON_STRING )
+            mongo_shared_copy_error( call->lasterrstr, bson_iterator_string( it ) );
+        if( bson_find( it, response, "code" ) != BSON_EOO )
+            call->lasterrcode = bson_iterator_int( it );
+        res = MONGO_ERROR;
+    }
+    else if( out )
+        bson_copy( out, response );
+
+    mongo_shared_call_destroy( call );
+    return res;
+}
+
+MONGO_EXPORT int mongo_shared_insert( mongo_shared *shared, mongo_shared_call *call,
+                                      const char *ns, const bson *data,
+                                      mongo_write_concern *custom_write_concern ) {
+    mongo_write_concern *write_concern;
+    int ns_len = ( int )strlen( ns );
+    int len = 16 + 4 + ns_len + 1 + bson_size( data );
+    int id;
+    char *msg, *p;
+
+    mongo_shared_call_init( call );
+
+    if( mongo_shared_bson_valid( shared, call, data ) != MONGO_OK ||
+            mongo_shared_write_concern( shared, call, custom_write_concern,
+                                        &write_concern ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    msg = mongo_shared_write_alloc( ns, len, write_concern );
+    p = mongo_shared_message( msg, len, MONGO_OP_INSERT, &id );
+    p = mongo_data_append32( p, &ZERO );
+    p = mongo_data_append( p, ns, ns_len + 1 );
+    mongo_data_append( p, data->data, bson_size( data ) );
+
+    return mongo_shared_write( shared, call, ns, msg, len, write_concern );
+}
+
+MONGO_EXPORT int mongo_shared_update( mongo_shared *shared, mongo_shared_call *call,
+                                      const char *ns, const bson *cond, const bson *op,
+                                      int flags, mongo_write_concern *custom_write_concern ) {
+    mongo_write_concern *write_concern;
+    int ns_len = ( int )strlen( ns );
+    int len, id;
+    char *msg, *p;
+
+    mongo_shared_call_init( call );
+
+    if( mongo_shared_bson_valid( shared, call, cond ) != MONGO_OK ||
+            mongo_shared_bson_valid( shared, call, op ) != MONGO_OK ||
+            mongo_shared_write_concern( shared, call, custom_write_concern,
+                                        &write_concern ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    len = 16 + 4 + ns_len + 1 + 4 + bson_size( cond ) + bson_size( op );
+    msg = mongo_shared_write_alloc( ns, len, write_concern );
+    p = mongo_shared_message( msg, len, MONGO_OP_UPDATE, &id );
+    p = mongo_data_append32( p, &ZERO );
+    p = mongo_data_append( p, ns, ns_len + 1 );
+    p = mongo_data_append32( p, &flags );
+    p = mongo_data_append( p, cond->data, bson_size( cond ) );
+    mongo_data_append( p, op->data, bson_size( op ) );
+
+    return mongo_shared_write( shared, call, ns, msg, len, write_concern );
+}
+
+MONGO_EXPORT int mongo_shared_remove( mongo_shared *shared, mongo_shared_call *call,
+                                      const char *ns, const bson *cond,
+                                      mongo_write_concern *custom_write_concern ) {
+    mongo_write_concern *write_concern;
+    int ns_len = ( int )strlen( ns );
+    int len, id;
+    char *msg, *p;
+
+    mongo_shared_call_init( call );
+
+    if( mongo_shared_bson_valid( shared, call, cond ) != MONGO_OK ||
+            mongo_shared_write_concern( shared, call, custom_write_concern,
+                                        &write_concern ) != MONGO_OK )
+        return MONGO_ERROR;
+
+    len = 16 + 4 + ns_len + 1 + 4 + bson_size( cond );
+    msg = mongo_shared_write_alloc( ns, len, write_concern );
+    p = mongo_shared_message( msg, len, MONGO_OP_DELETE, &id );
+    p = mongo_data_append32( p, &ZERO );
+    p = mongo_data_append( p, ns, ns_len + 1 );
+    p = mongo_data_append32( p, &ZERO );
+    mongo_data_append( p, cond->data, bson_size( cond ) );
+
+    return mongo_shared_write( shared, call, ns, msg, len, write_concern );
+}
+
+MONGO_EXPORT void mongo_shared_call_destroy( mongo_shared_call *call ) {
+    /* The reader's pool is its own; the reply goes back to the allocator. */
+    mongo_reply_release( NULL, call->reply );
+    call->reply = NULL;
+}
+
+MONGO_EXPORT void mongo_shared_destroy( mongo_shared *shared ) {
+    mongo_env_mutex_lock( shared->mutex );
+    if( ! shared->failed ) {
+        shared->failed = 1;
+        shared->fail_err = MONGO_IO_ERROR;
+        strcpy( shared->fail_errstr, "Connection closed." );
+    }
+    mongo_env_shutdown_socket( shared->conn->sock );
+    mongo_env_mutex_unlock( shared->mutex );
+
+    mongo_env_thread_join( shared->reader );
+    mongo_env_cond_destroy( shared->cond );
+    mongo_env_mutex_destroy( shared->write_mutex );
+    mongo_env_mutex_destroy( shared->mutex );
+
+    mongo_disconnect( shared->conn );
+    memset( shared, 0, sizeof( mongo_shared ) );
+}
@@ -0,0 +1,217 @@
+/** @file shared.h
+ *
+ *  @brief One connection shared by many threads.
+ *
+ *  Any number of threads may have requests outstanding on a shared
+ *  connection at once. Requests are written whole under a lock, and a
+ *  reader thread hands each OP_REPLY to the caller whose request it
+ *  answers, matched by responseTo. Errors are reported on the
+ *  caller's mongo_shared_call rather than on the connection.
+ *
+ * */
+
+/*    Copyright 2009-2012 10gen Inc.
+ *
+ *    Licensed under the Apache License, Version 2.0 (the "License");
+ *    you may not use this file except in compliance with the License.
+ *    You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *    Unless required by applicable law or agreed to in writing, software
+ *    distributed under the License is distributed on an "AS IS" BASIS,
+ *    WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *    See the License for the specific language governing permissions and
+ *    limitations under the License.
+ */
+
+#include "mongo.h"
+
+#ifndef MONGO_SHARED_H_
+#define MONGO_SHARED_H_
+
+MONGO_EXTERN_C_START
+
+/**
+ * One request and its outcome. Calls normally live on the caller's
+ * stack; every operation initializes the call it is given.
+ */
+typedef struct mongo_shared_call {
+    int id;                     /**< Request id the reply must answer. */
+    int done;                   /**< Set once the reply, or a failure, is in. */
+    mongo_reply *reply;         /**< The reply in native byte order; owned by the call. */
+
+    mongo_error_t err;          /**< Driver error code for this call. */
+    int errcode;                /**< errno or WSAGetLastError() for this call. */
+    char errstr[MONGO_ERR_LEN]; /**< String version of err. */
+    int lasterrcode;            /**< Server error code for this call. */
+    char lasterrstr[MONGO_ERR_LEN]; /**< Server error string for this call. */
+
+    struct mongo_shared_call *next;
+} mongo_shared_call;
+
+typedef struct mongo_shared {
+    mongo *conn;                /**< Connection is *not* owned. */
+    void *mutex;                /**< Guards the fields below. */
+    void *write_mutex;          /**< Held while writing to conn, and nowhere else. */
+    void *cond;                 /**< Broadcast whenever a call completes. */
+    void *reader;               /**< Thread reading replies. */
+    int failed;                 /**< Set once the socket has failed or is closing. */
+    mongo_error_t fail_err;     /**< Why the socket failed. */
+    int fail_errcode;
+    char fail_errstr[MONGO_ERR_LEN];
+    mongo_shared_call *waiting; /**< Calls awaiting a reply. */
+} mongo_shared;
+
+/**
+ * Share a connected mongo object between threads. From now on it
+ * must only be used through the mongo_shared_* functions. Replies are
+ * waited for without a time limit: an operation timeout set with
+ * mongo_set_op_timeout( ) still applies to writes, but no longer to
+ * reads.
+ *
+ * @param shared
+ * @param conn a connected, authenticated connection.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if conn is not connected, still
+ *     has replies to read for a cursor or ping, or the reader thread
+ *     could not be started, including on platforms without threads.
+ */
+MONGO_EXPORT int mongo_shared_init( mongo_shared *shared, mongo *conn );
+
+/**
+ * Send a query and wait for the first batch. A reply with the
+ * QueryFailure flag set fails the call with MONGO_COMMAND_FAILED and
+ * the server's $err in call->lasterrstr.
+ *
+ * @param shared
+ * @param call receives the reply and any error. Release it with
+ *     mongo_shared_call_destroy( ).
+ * @param ns
+ * @param query
+ * @param fields fields to return, or NULL for all.
+ * @param limit
+ * @param skip
+ * @param options a bitfield of mongo_cursor_opts.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_shared_query( mongo_shared *shared, mongo_shared_call *call,
+                                     const char *ns, const bson *query, const bson *fields,
+                                     int limit, int skip, int options );
+
+/**
+ * Fetch the next batch of a cursor opened with mongo_shared_query( ).
+ *
+ * @param shared
+ * @param call receives the reply and any error.
+ * @param ns
+ * @param cursor_id call->reply->fields.cursorID from the previous batch.
+ * @param limit
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_shared_get_more( mongo_shared *shared, mongo_shared_call *call,
+                                        const char *ns, int64_t cursor_id, int limit );
+
+/**
+ * Find a single document.
+ *
+ * @param shared
+ * @param call receives any error.
+ * @param ns
+ * @param query
+ * @param fields fields to return, or NULL for all.
+ * @param out a bson document to hold a copy of the result, or NULL.
+ *
+ * @return MONGO_OK, or MONGO_ERROR if nothing matched or the call
+ *     failed.
+ */
+MONGO_EXPORT int mongo_shared_find_one( mongo_shared *shared, mongo_shared_call *call,
+                                        const char *ns, const bson *query,
+                                        const bson *fields, bson *out );
+
+/**
+ * Run a command.
+ *
+ * @param shared
+ * @param call receives any error.
+ * @param db
+ * @param command
+ * @param out a bson document to hold a copy of the response, or NULL.
+ *
+ * @return MONGO_OK, or MONGO_ERROR with MONGO_COMMAND_FAILED if the
+ *     command did not return ok.
+ */
+MONGO_EXPORT int mongo_shared_run_command( mongo_shared *shared, mongo_shared_call *call,
+                                           const char *db, const bson *command, bson *out );
+
+/**
+ * Insert a document. With a write concern the getlasterror goes out
+ * in the same write and the call waits for its reply.
+ *
+ * @param shared
+ * @param call receives any error.
+ * @param ns
+ * @param data
+ * @param custom_write_concern a write concern, or NULL for the
+ *     connection's default.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_shared_insert( mongo_shared *shared, mongo_shared_call *call,
+                                      const char *ns, const bson *data,
+                                      mongo_write_concern *custom_write_concern );
+
+/**
+ * Update documents, as mongo_update( ) does.
+ *
+ * @param shared
+ * @param call receives any error.
+ * @param ns
+ * @param cond
+ * @param op
+ * @param flags a bitfield of mongo_update_opts.
+ * @param custom_write_concern a write concern, or NULL for the
+ *     connection's default.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_shared_update( mongo_shared *shared, mongo_shared_call *call,
+                                      const char *ns, const bson *cond, const bson *op,
+                                      int flags, mongo_write_concern *custom_write_concern );
+
+/**
+ * Remove documents, as mongo_remove( ) does.
+ *
+ * @param shared
+ * @param call receives any error.
+ * @param ns
+ * @param cond
+ * @param custom_write_concern a write concern, or NULL for the
+ *     connection's default.
+ *
+ * @return MONGO_OK or MONGO_ERROR.
+ */
+MONGO_EXPORT int mongo_shared_remove( mongo_shared *shared, mongo_shared_call *call,
+                                      const char *ns, const bson *cond,
+                                      mongo_write_concern *custom_write_concern );
+
+/**
+ * Free the reply held by a call, if any.
+ *
+ * @param call
+ */
+MONGO_EXPORT void mongo_shared_call_destroy( mongo_shared_call *call );
+
+/**
+ * Stop the reader thread and disconnect the connection. No calls may
+ * be in progress. The caller still destroys the mongo object.
+ *
+ * @param shared
+ */
+MONGO_EXPORT void mongo_shared_destroy( mongo_shared *shared );
+
+MONGO_EXTERN_C_END
+
+#endif
@@ -0,0 +1,337 @@
+/* async_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "async.h"
+#include "mock_server.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+/* An in-process wire protocol server on the far end of a socketpair.
+ * It answers every request in a batch in reverse order, so replies
+ * only reach the right callbacks if they are matched by responseTo. */
+
+#define MOCK_BUF_SIZE ( 1024 * 1024 )
+#define MOCK_CURSOR_ID 77
+
+typedef struct {
+    mock_conn conn[1];
+    bson *replies[256];
+    int reply_to[256];
+    int64_t reply_cursor[256];
+    int reply_flags[256];
+    int replies_len;
+    int inserts;
+    const char *last_error;
+} mock_server;
+
+/* Hold a reply, and take ownership of doc, until mock_flush( ). */
+static void mock_defer( mock_server *m, int response_to, bson *doc, int64_t cursor_id, int flags ) {
+    ASSERT( m->replies_len < 256 );
+    m->replies[m->replies_len] = doc;
+    m->reply_to[m->replies_len] = response_to;
+    m->reply_cursor[m->replies_len] = cursor_id;
+    m->reply_flags[m->replies_len] = flags;
+    m->replies_len++;
+}
+
+static bson *mock_doc_int( const char *key, int value ) {
+    bson *b = bson_alloc( );
+    bson_init( b );
+    bson_append_int( b, key, value );
+    bson_finish( b );
+    return b;
+}
+
+static void mock_flush( mock_server *m ) {
+    int i;
+
+    /* Newest first. */
+    for( i = m->replies_len - 1; i >= 0; i-- ) {
+        mock_reply( m->conn->fd, m->reply_to[i], m->reply_flags[i], m->reply_cursor[i],
+                    m->replies[i], 1 );
+        if( m->replies[i] ) {
+            bson_destroy( m->replies[i] );
+            bson_dealloc( m->replies[i] );
+        }
+    }
+    m->replies_len = 0;
+}
+
+static void mock_query( mock_server *m, int id, const char *ns, const char *query ) {
+    bson q[1];
+    bson_iterator it[1];
+    bson *doc;
+    const char *key;
+    size_t ns_len = strlen( ns );
+
+    bson_init_finished_data( q, ( char * )query, 0 );
+
+    if( ns_len < 5 || strcmp( ns + ns_len - 5, ".$cmd" ) != 0 ) {
+        mock_defer( m, id, mock_doc_int( "n", 0 ), MOCK_CURSOR_ID, 0 );
+        return;
+    }
+
+    bson_iterator_init( it, q );
+    bson_iterator_next( it );
+    key = bson_iterator_key( it );
+
+    doc = bson_alloc( );
+    bson_init( doc );
+    if( strcmp( key, "getlasterror" ) == 0 ) {
+        bson_append_int( doc, "ok", 1 );
+        if( m->last_error ) {
+            bson_append_string( doc, "err", m->last_error );
+            bson_append_int( doc, "code", 11000 );
+        }
+        else
+            bson_append_null( doc, "err" );
+        m->last_error = NULL;
+    }
+    else if( strcmp( key, "echo" ) == 0 ) {
+        bson_append_int( doc, "ok", 1 );
+        bson_append_int( doc, "echo", bson_iterator_int( it ) );
+    }
+    else if( strcmp( key, "bad" ) == 0 ) {
+        bson_append_int( doc, "ok", 0 );
+        bson_append_string( doc, "errmsg", "no such cmd" );
+    }
+    else {
+        bson_append_string( doc, "$err", "unknown" );
+        bson_finish( doc );
+        mock_defer( m, id, doc, 0, MOCK_QUERY_FAILURE );
+        return;
+    }
+    bson_finish( doc );
+    mock_defer( m, id, doc, 0, 0 );
+}
+
+static void mock_handle( void *arg, mock_conn *c, const mock_request *req ) {
+    mock_server *m = ( mock_server * )arg;
+    bson doc[1];
+    bson_iterator it[1];
+
+    if( req->op == MONGO_OP_INSERT ) {
+        bson_init_finished_data( doc, ( char * )req->doc, 0 );
+        if( bson_find( it, doc, "fail" ) )
+            m->last_error = "E11000 duplicate key error";
+        m->inserts++;
+    }
+    else if( req->op == MONGO_OP_QUERY )
+        mock_query( m, req->id, req->ns, req->doc );
+    else if( req->op == MONGO_OP_GET_MORE )
+        mock_defer( m, req->id, mock_doc_int( "n", 1 ), 0, 0 );
+}
+
+/* Read everything the client has sent and answer it. */
+static void mock_service( mock_server *m ) {
+    while( mock_conn_read( m->conn ) > 0 )
+        ;
+    mock_conn_dispatch( m->conn, mock_handle, m );
+    mock_flush( m );
+}
+
+static mock_server server[1];
+
+static void run( mongo_async *loop ) {
+    int spins = 0;
+    while( mongo_async_pending( loop ) ) {
+        ASSERT( mongo_async_poll( loop, 10 ) != MONGO_ERROR );
+        mock_service( server );
+        ASSERT( ++spins < 1000 );
+    }
+}
+
+typedef struct {
+    int calls;
+    int status;
+    int has_reply;
+    int64_t cursor_id;
+    int value;
+} result;
+
+static void record( mongo *conn, int status, const mongo_reply *reply, void *arg ) {
+    result *r = ( result * )arg;
+    bson doc[1];
+    bson_iterator it[1];
+
+    r->calls++;
+    r->status = status;
+    r->has_reply = reply != NULL;
+    if( reply ) {
+        r->cursor_id = reply->fields.cursorID;
+        if( reply->fields.num > 0 ) {
+            bson_init_finished_data( doc, ( char * )&reply->objs, 0 );
+            if( bson_find( it, doc, "echo" ) || bson_find( it, doc, "n" ) )
+                r->value = bson_iterator_int( it );
+        }
+    }
+}
+
+static void test_unacknowledged_insert( mongo_async *loop, mongo_async_conn *ac ) {
+    mongo_write_concern wc[1];
+    result r[1];
+    bson *b = mock_doc_int( "a", 1 );
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 0 );
+    mongo_write_concern_finish( wc );
+
+    memset( r, 0, sizeof( r ) );
+    ASSERT( mongo_async_insert( ac, "test.async", b, wc, record, r ) == MONGO_OK );
+    run( loop );
+
+    ASSERT( r->calls == 1 );
+    ASSERT( r->status == MONGO_OK );
+    ASSERT( ! r->has_reply );
+    ASSERT( server->inserts == 1 );
+
+    bson_destroy( b );
+    bson_dealloc( b );
+    mongo_write_concern_destroy( wc );
+}
+
+static void test_acknowledged_insert( mongo_async *loop, mongo_async_conn *ac, mongo *conn ) {
+    result ok[1], dup[1];
+    bson *good = mock_doc_int( "a", 1 );
+    bson *bad = mock_doc_int( "fail", 1 );
+
+    memset( ok, 0, sizeof( ok ) );
+    memset( dup, 0, sizeof( dup ) );
+    ASSERT( mongo_async_insert( ac, "test.async", good, NULL, record, ok ) == MONGO_OK );
+    ASSERT( mongo_async_insert( ac, "test.async", bad, NULL, record, dup ) == MONGO_OK );
+    ASSERT( mongo_async_pending( loop ) == 2 );
+    run( loop );
+
+    ASSERT( ok->calls == 1 && ok->status == MONGO_OK && ok->has_reply );
+    ASSERT( dup->calls == 1 && dup->status == MONGO_ERROR && dup->has_reply );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT_EQUAL_STRINGS( conn->lasterrstr, "E11000" );
+
+    bson_destroy( good );
+    bson_dealloc( good );
+    bson_destroy( bad );
+    bson_dealloc( bad );
+}
+
+static void test_find_and_get_more( mongo_async *loop, mongo_async_conn *ac ) {
+    result first[1], more[1];
+
+    memset( first, 0, sizeof( first ) );
+    memset( more, 0, sizeof( more ) );
+    ASSERT( mongo_async_find( ac, "test.async", NULL, NULL, 0, 0, 0, record, first ) == MONGO_OK );
+    run( loop );
+
+    ASSERT( first->calls == 1 && first->status == MONGO_OK );
+    ASSERT( first->cursor_id == MOCK_CURSOR_ID );
+    ASSERT( first->value == 0 );
+
+    ASSERT( mongo_async_get_more( ac, "test.async", first->cursor_id, 0, record, more ) == MONGO_OK );
+    run( loop );
+
+    ASSERT( more->calls == 1 && more->status == MONGO_OK );
+    ASSERT( more->cursor_id == 0 );
+    ASSERT( more->value == 1 );
+}
+
+static void test_commands( mongo_async *loop, mongo_async_conn *ac, mongo *conn ) {
+    result r[100], bad[1], unknown[1];
+    bson *cmd[100];
+    bson *b;
+    int i;
+
+    memset( r, 0, sizeof( r ) );
+    for( i = 0; i < 100; i++ ) {
+        cmd[i] = mock_doc_int( "echo", i );
+        ASSERT( mongo_async_command( ac, "test", cmd[i], record, &r[i] ) == MONGO_OK );
+    }
+
+    memset( bad, 0, sizeof( bad ) );
+    b = mock_doc_int( "bad", 1 );
+    ASSERT( mongo_async_command( ac, "test", b, record, bad ) == MONGO_OK );
+    bson_destroy( b );
+    bson_dealloc( b );
+
+    memset( unknown, 0, sizeof( unknown ) );
+    b = mock_doc_int( "unknown", 1 );
+    ASSERT( mongo_async_command( ac, "test", b, record, unknown ) == MONGO_OK );
+    bson_destroy( b );
+    bson_dealloc( b );
+
+    run( loop );
+
+    for( i = 0; i < 100; i++ ) {
+        ASSERT( r[i].calls == 1 );
+        ASSERT( r[i].status == MONGO_OK );
+        ASSERT( r[i].value == i );
+        bson_destroy( cmd[i] );
+        bson_dealloc( cmd[i] );
+    }
+    ASSERT( bad->calls == 1 && bad->status == MONGO_ERROR && bad->has_reply );
+    ASSERT( unknown->calls == 1 && unknown->status == MONGO_ERROR && unknown->has_reply );
+
+    /* The QueryFailure reply came last, so its error is the one left on conn. */
+    ASSERT( conn->err == MONGO_COMMAND_FAILED );
+    ASSERT_EQUAL_STRINGS( conn->lasterrstr, "unknown" );
+}
+
+static void test_connection_lost( mongo_async *loop, mongo_async_conn *ac, mongo *conn ) {
+    result r[1], after[1];
+    bson *b = mock_doc_int( "echo", 1 );
+
+    memset( r, 0, sizeof( r ) );
+    ASSERT( mongo_async_command( ac, "test", b, record, r ) == MONGO_OK );
+    ASSERT( mongo_async_poll( loop, 0 ) == 0 );
+
+    mock_conn_close( server->conn );
+    while( mongo_async_pending( loop ) )
+        ASSERT( mongo_async_poll( loop, 100 ) != MONGO_ERROR );
+
+    ASSERT( r->calls == 1 );
+    ASSERT( r->status == MONGO_ERROR );
+    ASSERT( ! r->has_reply );
+    ASSERT( conn->err == MONGO_IO_ERROR );
+
+    memset( after, 0, sizeof( after ) );
+    ASSERT( mongo_async_command( ac, "test", b, record, after ) == MONGO_ERROR );
+    ASSERT( after->calls == 0 );
+
+    bson_destroy( b );
+    bson_dealloc( b );
+}
+
+int main() {
+    mongo conn[1];
+    mongo_async loop[1];
+    mongo_async_conn *ac;
+    int sv[2];
+
+    ASSERT( socketpair( AF_UNIX, SOCK_STREAM, 0, sv ) == 0 );
+    mock_conn_open( server->conn, sv[1], MOCK_BUF_SIZE );
+    fcntl( sv[1], F_SETFL, fcntl( sv[1], F_GETFL, 0 ) | O_NONBLOCK );
+
+    mongo_init( conn );
+    conn->sock = sv[0];
+    conn->connected = 1;
+
+    ASSERT( mongo_async_init( loop ) == MONGO_OK );
+    ac = mongo_async_attach( loop, conn );
+    ASSERT( ac != NULL );
+
+    test_unacknowledged_insert( loop, ac );
+    test_acknowledged_insert( loop, ac, conn );
+    test_find_and_get_more( loop, ac );
+    test_commands( loop, ac, conn );
+    test_connection_lost( loop, ac, conn );
+
+    mongo_async_destroy( loop );
+    mongo_destroy( conn );
+
+    return 0;
+}
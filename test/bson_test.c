@@ -294,6 +294,240 @@ int test_bson_iterator( void ) {
     return 0;
 }
 
+int test_bson_index( void ) {
+    bson b[1];
+    bson_index index[1];
+    bson_iterator it[1], scan[1];
+    char key[16];
+    int i;
+
+    bson_init( b );
+    ASSERT( bson_index_init( index, b ) == BSON_ERROR );
+    ASSERT( bson_index_find( it, index, "field0" ) == BSON_EOO );
+    ASSERT( bson_iterator_next( it ) == BSON_EOO );
+    for( i = 0; i < 200; i++ ) {
+        sprintf( key, "field%d", i );
+        bson_append_int( b, key, i );
+    }
+    bson_append_string( b, "field7", "repeated" );
+    bson_append_null( b, "" );
+    bson_finish( b );
+
+    ASSERT( bson_index_init( index, b ) == BSON_OK );
+    ASSERT( index->count == 201 );
+
+    for( i = 0; i < 200; i++ ) {
+        sprintf( key, "field%d", i );
+        ASSERT( bson_index_find( it, index, key ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == i );
+        ASSERT( bson_find( scan, b, key ) == BSON_INT );
+        ASSERT( it->cur == scan->cur );
+    }
+
+    /* The first of a repeated key, and the iterator carries on from there. */
+    ASSERT( bson_index_find( it, index, "field7" ) == BSON_INT );
+    ASSERT( bson_iterator_next( it ) == BSON_INT );
+    ASSERT( strcmp( bson_iterator_key( it ), "field8" ) == 0 );
+
+    ASSERT( bson_index_find( it, index, "" ) == BSON_NULL );
+    ASSERT( bson_index_find( it, index, "field200" ) == BSON_EOO );
+    ASSERT( bson_find( scan, b, "field200" ) == BSON_EOO );
+    ASSERT( it->cur == scan->cur );
+    ASSERT( bson_iterator_next( it ) == BSON_EOO );
+
+    bson_index_destroy( index );
+    ASSERT( bson_index_find( it, index, "field0" ) == BSON_EOO );
+    bson_destroy( b );
+
+    ASSERT( bson_index_init( index, bson_shared_empty( ) ) == BSON_OK );
+    ASSERT( bson_index_find( it, index, "foo" ) == BSON_EOO );
+    bson_index_destroy( index );
+
+    return 0;
+}
+
+int test_bson_find_many( void ) {
+    const char *keys[] = { "c", "missing", "a", "c", "" };
+    const char *wide[40];
+    char names[40][8];
+    bson b[1];
+    bson_matcher matcher[1];
+    bson_iterator out[40], scan[1];
+    int i;
+
+    bson_init( b );
+    bson_append_int( b, "a", 1 );
+    bson_append_string( b, "b", "two" );
+    bson_append_int( b, "c", 3 );
+    bson_append_int( b, "a", 4 );
+    bson_append_null( b, "" );
+    for( i = 0; i < 40; i++ ) {
+        sprintf( names[i], "k%d", i );
+        bson_append_int( b, names[i], i );
+        wide[i] = names[i];
+    }
+    bson_finish( b );
+
+    ASSERT( bson_find_many( b, keys, 5, out ) == 4 );
+    ASSERT( bson_iterator_int( &out[0] ) == 3 );
+    ASSERT( bson_iterator_type( &out[1] ) == BSON_EOO );
+    ASSERT( bson_find( scan, b, "missing" ) == BSON_EOO );
+    ASSERT( out[1].cur == scan->cur );
+    ASSERT( bson_iterator_int( &out[2] ) == 1 );
+    ASSERT( out[3].cur == out[0].cur );
+    ASSERT( bson_iterator_type( &out[4] ) == BSON_NULL );
+
+    /* Iteration carries on from a found field. */
+    ASSERT( bson_iterator_next( &out[2] ) == BSON_STRING );
+    ASSERT( strcmp( bson_iterator_string( &out[2] ), "two" ) == 0 );
+
+    /* More keys than fit on the stack, and a reused matcher. */
+    ASSERT( bson_find_many( b, wide, 40, out ) == 40 );
+    bson_matcher_init( matcher, wide, 40 );
+    for( i = 0; i < 3; i++ ) {
+        ASSERT( bson_matcher_find( matcher, b, out ) == 40 );
+        ASSERT( bson_iterator_int( &out[39] ) == 39 );
+    }
+    ASSERT( bson_matcher_find( matcher, bson_shared_empty( ), out ) == 0 );
+    ASSERT( bson_iterator_type( &out[0] ) == BSON_EOO );
+    bson_matcher_destroy( matcher );
+
+    bson_destroy( b );
+    return 0;
+}
+
+int test_bson_find_path( void ) {
+    bson b[1];
+    bson_path path[1];
+    bson_iterator it[1];
+
+    bson_init( b );
+    bson_append_int( b, "x", 0 );
+    bson_append_start_object( b, "a" );
+    bson_append_string( b, "s", "leaf" );
+    bson_append_start_object( b, "b" );
+    bson_append_int( b, "c", 42 );
+    bson_append_int( b, "d", 43 );
+    bson_append_finish_object( b );
+    bson_append_finish_object( b );
+    bson_append_start_array( b, "items" );
+    bson_append_start_object( b, "0" );
+    bson_append_double( b, "price", 1.5 );
+    bson_append_finish_object( b );
+    bson_append_start_object( b, "1" );
+    bson_append_double( b, "price", 2.5 );
+    bson_append_finish_object( b );
+    bson_append_finish_array( b );
+    bson_append_int( b, "a.b", 7 );
+    bson_finish( b );
+
+    ASSERT( bson_find_path( it, b, "a.b.c" ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 42 );
+    ASSERT( bson_iterator_next( it ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 43 );
+
+    ASSERT( bson_find_path( it, b, "x" ) == BSON_INT );
+    ASSERT( bson_find_path( it, b, "a.b" ) == BSON_OBJECT );
+    ASSERT( bson_find_path( it, b, "items.1.price" ) == BSON_DOUBLE );
+    ASSERT( bson_iterator_double( it ) == 2.5 );
+    ASSERT( bson_find_path( it, b, "items.1" ) == BSON_OBJECT );
+
+    ASSERT( bson_find_path( it, b, "items.2.price" ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "items.01" ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "a.s.c" ) == BSON_EOO );
+    ASSERT( bson_iterator_next( it ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "a.z" ) == BSON_EOO );
+    ASSERT( bson_find_path( it, b, "missing" ) == BSON_EOO );
+
+    bson_path_init( path, "items.0.price" );
+    ASSERT( path->count == 3 );
+    ASSERT( bson_path_find( it, b, path ) == BSON_DOUBLE );
+    ASSERT( bson_iterator_double( it ) == 1.5 );
+    bson_path_destroy( path );
+
+    bson_path_init( path, "a.b.c.d" );
+    ASSERT( bson_path_find( it, b, path ) == BSON_EOO );
+    bson_path_destroy( path );
+
+    bson_destroy( b );
+    return 0;
+}
+
+static const bson_key ts_key = BSON_KEY_LITERAL( "ts" );
+
+int test_bson_key( void ) {
+    bson_key id, dotted, dollar, bad;
+    bson a[1], b[1];
+    bson_oid_t oid;
+    char not_utf8[] = { ( char )0xC0, ( char )0xC0, 0 };
+
+    ASSERT( bson_key_init( &id, "_id" ) == BSON_OK );
+    ASSERT( id.len == 3 && id.err == 0 );
+    ASSERT( bson_key_init( &dotted, "a.b" ) == BSON_OK );
+    ASSERT( dotted.err == BSON_FIELD_HAS_DOT );
+    ASSERT( bson_key_init( &dollar, "$set" ) == BSON_OK );
+    ASSERT( dollar.err == BSON_FIELD_INIT_DOLLAR );
+    ASSERT( bson_key_init( &bad, not_utf8 ) == BSON_ERROR );
+    ASSERT( bad.err & BSON_NOT_UTF8 );
+
+    /* Keyed appends build the same bytes as named ones. */
+    bson_oid_gen( &oid );
+    bson_init( a );
+    bson_append_oid( a, "_id", &oid );
+    bson_append_int( a, "ts", 1 );
+    bson_append_start_object( a, "ts" );
+    bson_append_string( a, "ts", "x" );
+    bson_append_finish_object( a );
+    bson_finish( a );
+
+    bson_init( b );
+    bson_append_oid_key( b, &id, &oid );
+    bson_append_int_key( b, &ts_key, 1 );
+    bson_append_start_object_key( b, &ts_key );
+    bson_append_string_key( b, &ts_key, "x" );
+    bson_append_finish_object( b );
+    bson_finish( b );
+
+    ASSERT( bson_size( a ) == bson_size( b ) );
+    ASSERT( memcmp( a->data, b->data, bson_size( a ) ) == 0 );
+    ASSERT( b->err == 0 );
+    bson_destroy( a );
+    bson_destroy( b );
+
+    /* A key's flags land on the object as if its name were checked. */
+    bson_init( b );
+    ASSERT( bson_append_null_key( b, &dotted ) == BSON_OK );
+    ASSERT( bson_append_long_key( b, &dollar, 1 ) == BSON_OK );
+    ASSERT( b->err == ( BSON_FIELD_HAS_DOT | BSON_FIELD_INIT_DOLLAR ) );
+    ASSERT( bson_append_double_key( b, &bad, 1.0 ) == BSON_ERROR );
+    ASSERT( b->err & BSON_NOT_UTF8 );
+    bson_destroy( b );
+
+    /* Trusted keys are not checked at all. */
+    bson_init( b );
+    bson_set_trusted_keys( b, 1 );
+    ASSERT( bson_append_int( b, "a.b", 1 ) == BSON_OK );
+    ASSERT( b->err == 0 );
+    bson_set_trusted_keys( b, 0 );
+    ASSERT( bson_append_int( b, "a.b", 1 ) == BSON_OK );
+    ASSERT( b->err == BSON_FIELD_HAS_DOT );
+    bson_destroy( b );
+
+    /* Every way of reinitializing an object forgets the setting. */
+    bson_set_trusted_keys( b, 1 );
+    bson_init_zero( b );
+    ASSERT( ! b->trustKeys );
+    bson_set_trusted_keys( b, 1 );
+    bson_init_finished_data( b, ( char * )bson_shared_empty( )->data, 0 );
+    ASSERT( ! b->trustKeys );
+    bson_set_trusted_keys( b, 1 );
+    bson_init( b );
+    ASSERT( ! b->trustKeys );
+    bson_destroy( b );
+
+    return 0;
+}
+
 int test_bson_size( void ) {
     bson bsmall[1];
 
@@ -349,6 +583,10 @@ int main() {
 
   test_bson_generic();
   test_bson_iterator();
+  test_bson_index();
+  test_bson_find_many();
+  test_bson_find_path();
+  test_bson_key();
   test_bson_size();
   test_bson_deep_nesting();
   test_bson_oid_generated_time();
@@ -0,0 +1,238 @@
+/* bulk_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const char *db = "test";
+static const char *ns = "test.bulk";
+static const char *other_ns = "test.bulk_other";
+
+static void make_doc( bson *b, const char *key, int value ) {
+    bson_init( b );
+    bson_append_int( b, key, value );
+    bson_finish( b );
+}
+
+static void reset( mongo *conn ) {
+    mongo_cmd_drop_collection( conn, db, "bulk", NULL );
+    mongo_cmd_drop_collection( conn, db, "bulk_other", NULL );
+    mongo_create_simple_index( conn, ns, "n", MONGO_INDEX_UNIQUE, NULL );
+}
+
+int test_unordered( mongo *conn, mongo_write_concern *wc ) {
+    mongo_bulk bulk[1];
+    bson doc[1], cond[1], op[1];
+    int i;
+
+    reset( conn );
+    ASSERT( mongo_bulk_init( bulk, conn, wc, 0 ) == MONGO_OK );
+
+    /* Enough inserts to span several acknowledgement windows, one of
+     * them a duplicate, across two collections. */
+    for( i = 0; i < 600; i++ ) {
+        make_doc( doc, "n", i == 300 ? 298 : i );
+        ASSERT( mongo_bulk_insert( bulk, i % 2 ? other_ns : ns, doc ) == MONGO_OK );
+        bson_destroy( doc );
+    }
+
+    make_doc( cond, "n", 10 );
+    bson_init( op );
+    bson_append_start_object( op, "$set" );
+    bson_append_int( op, "m", 1 );
+    bson_append_finish_object( op );
+    bson_finish( op );
+    ASSERT( mongo_bulk_update( bulk, ns, cond, op, 0 ) == MONGO_OK );
+    bson_destroy( cond );
+    bson_destroy( op );
+
+    make_doc( cond, "n", 20 );
+    ASSERT( mongo_bulk_remove( bulk, ns, cond ) == MONGO_OK );
+    bson_destroy( cond );
+
+    ASSERT( bulk->count == 602 );
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+
+    for( i = 0; i < 602; i++ ) {
+        if( i == 300 ) {
+            ASSERT( bulk->ops[i].status == MONGO_BULK_FAILED );
+            ASSERT( bulk->ops[i].code == 11000 );
+            ASSERT( bulk->ops[i].errmsg != NULL );
+        }
+        else {
+            ASSERT( bulk->ops[i].status == MONGO_BULK_DONE );
+            ASSERT( bulk->ops[i].errmsg == NULL );
+        }
+    }
+    ASSERT( bulk->ops[600].opcode == MONGO_OP_UPDATE );
+    ASSERT( bulk->ops[600].n == 1 );
+    ASSERT( bulk->ops[601].opcode == MONGO_OP_DELETE );
+    ASSERT( bulk->ops[601].n == 1 );
+
+    ASSERT( mongo_count( conn, db, "bulk", NULL ) == 298 );
+    ASSERT( mongo_count( conn, db, "bulk_other", NULL ) == 300 );
+
+    /* Nothing is left to send. */
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_OK );
+
+    mongo_bulk_destroy( bulk );
+    return 0;
+}
+
+int test_ordered( mongo *conn, mongo_write_concern *wc ) {
+    mongo_bulk bulk[1];
+    bson doc[1];
+    int i;
+
+    reset( conn );
+    ASSERT( mongo_bulk_init( bulk, conn, wc, 1 ) == MONGO_OK );
+
+    for( i = 0; i < 10; i++ ) {
+        make_doc( doc, "n", i == 5 ? 4 : i );
+        ASSERT( mongo_bulk_insert( bulk, ns, doc ) == MONGO_OK );
+        bson_destroy( doc );
+    }
+
+    /* Stops at the duplicate ... */
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( bulk->ops[4].status == MONGO_BULK_DONE );
+    ASSERT( bulk->ops[5].status == MONGO_BULK_FAILED );
+    ASSERT( bulk->ops[6].status == MONGO_BULK_UNSENT );
+    ASSERT( mongo_count( conn, db, "bulk", NULL ) == 5 );
+
+    /* ... and carries on after it when asked. */
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_OK );
+    ASSERT( bulk->ops[9].status == MONGO_BULK_DONE );
+    ASSERT( mongo_count( conn, db, "bulk", NULL ) == 9 );
+
+    mongo_bulk_destroy( bulk );
+    return 0;
+}
+
+int test_unacknowledged( mongo *conn ) {
+    mongo_write_concern wc0[1];
+    mongo_bulk bulk[1];
+    bson doc[1];
+    int i;
+
+    mongo_write_concern_init( wc0 );
+    mongo_write_concern_set_w( wc0, 0 );
+    mongo_write_concern_finish( wc0 );
+
+    reset( conn );
+    ASSERT( mongo_bulk_init( bulk, conn, wc0, 0 ) == MONGO_OK );
+    ASSERT( bulk->write_concern == NULL );
+
+    for( i = 0; i < 1000; i++ ) {
+        make_doc( doc, "n", i );
+        ASSERT( mongo_bulk_insert( bulk, ns, doc ) == MONGO_OK );
+        bson_destroy( doc );
+    }
+
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_OK );
+    ASSERT( bulk->ops[999].status == MONGO_BULK_DONE );
+    ASSERT( mongo_count( conn, db, "bulk", NULL ) == 1000 );
+
+    mongo_bulk_destroy( bulk );
+    mongo_write_concern_destroy( wc0 );
+    return 0;
+}
+
+int test_invalid( mongo *conn ) {
+    mongo_bulk bulk[1];
+    mongo_write_concern wc[1];
+
+    /* An unfinished write concern is refused up front. */
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    ASSERT( mongo_bulk_init( bulk, conn, wc, 0 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_CONCERN_INVALID );
+    mongo_bulk_destroy( bulk );
+
+    mongo_clear_errors( conn );
+    ASSERT( mongo_bulk_init( bulk, conn, NULL, 0 ) == MONGO_OK );
+    ASSERT( mongo_bulk_insert( bulk, "test.$bad", bson_shared_empty( ) ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_NS_INVALID );
+    ASSERT( bulk->count == 0 );
+    mongo_bulk_destroy( bulk );
+
+    /* Updates and removes check the namespace too, write concern or not. */
+    mongo_clear_errors( conn );
+    mongo_write_concern_finish( wc );
+    ASSERT( mongo_bulk_init( bulk, conn, wc, 1 ) == MONGO_OK );
+    ASSERT( mongo_bulk_update( bulk, "nodot", bson_shared_empty( ),
+                               bson_shared_empty( ), 0 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_NS_INVALID );
+    mongo_clear_errors( conn );
+    ASSERT( mongo_bulk_remove( bulk, "nodot", bson_shared_empty( ) ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_NS_INVALID );
+    ASSERT( bulk->count == 0 );
+    mongo_bulk_destroy( bulk );
+    mongo_write_concern_destroy( wc );
+
+    return 0;
+}
+
+int test_parallel_lost_connection( mongo *conn, mongo_write_concern *wc ) {
+    mongo_bulk bulk[1];
+    mongo dead[1];
+    mongo *conns[2];
+    bson b[1];
+    int i;
+
+    reset( conn );
+    ASSERT( mongo_bulk_init( bulk, conn, wc, 0 ) == MONGO_OK );
+    for( i = 0; i < 100; i++ ) {
+        make_doc( b, "n", i );
+        ASSERT( mongo_bulk_insert( bulk, ns, b ) == MONGO_OK );
+        bson_destroy( b );
+    }
+
+    /* The second share's connection is gone: its operations are left
+     * unsent and execution resumes at the first of them. */
+    mongo_init( dead );
+    conns[0] = conn;
+    conns[1] = dead;
+    ASSERT( mongo_bulk_execute_parallel( bulk, conns, 2 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_IO_ERROR );
+    ASSERT( bulk->next == 50 );
+    for( i = 0; i < 100; i++ )
+        ASSERT( bulk->ops[i].status == ( i < 50 ? MONGO_BULK_DONE : MONGO_BULK_UNSENT ) );
+    ASSERT( mongo_count( conn, db, "bulk", NULL ) == 50 );
+
+    ASSERT( mongo_bulk_execute( bulk ) == MONGO_OK );
+    ASSERT( bulk->next == 100 );
+    ASSERT( mongo_count( conn, db, "bulk", NULL ) == 100 );
+
+    mongo_bulk_destroy( bulk );
+    mongo_destroy( dead );
+    return 0;
+}
+
+int main() {
+    mongo conn[1];
+    mongo_write_concern wc1[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+    CONN_CLIENT_TEST;
+
+    mongo_write_concern_init( wc1 );
+    mongo_write_concern_set_w( wc1, 1 );
+    mongo_write_concern_finish( wc1 );
+
+    test_unordered( conn, wc1 );
+    test_ordered( conn, wc1 );
+    test_unacknowledged( conn );
+    test_invalid( conn );
+    test_parallel_lost_connection( conn, wc1 );
+
+    mongo_write_concern_destroy( wc1 );
+    mongo_cmd_drop_db( conn, db );
+    mongo_destroy( conn );
+    return 0;
+}
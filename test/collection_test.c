@@ -0,0 +1,121 @@
+/* collection_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const char *db = "test";
+static const char *ns = "test.collection";
+
+int test_invalid( mongo *conn ) {
+    mongo_collection coll[1];
+
+    mongo_clear_errors( conn );
+    ASSERT( mongo_collection_init( coll, conn, "test" ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_NS_INVALID );
+    ASSERT( mongo_collection_init( coll, conn, ".test" ) == MONGO_ERROR );
+    ASSERT( mongo_collection_init( coll, conn, "test." ) == MONGO_ERROR );
+    mongo_clear_errors( conn );
+    return 0;
+}
+
+int test_crud( mongo *conn ) {
+    mongo_collection coll[1];
+    mongo_write_concern wc[1];
+    mongo_cursor *cursor;
+    bson doc[1], op[1], out[1];
+    const bson *docs[10];
+    bson batch[10];
+    bson_iterator it[1];
+    int i, count;
+
+    mongo_cmd_drop_collection( conn, db, "collection", NULL );
+    ASSERT( mongo_collection_init( coll, conn, ns ) == MONGO_OK );
+    ASSERT( coll->ns_len == ( int )strlen( ns ) );
+    ASSERT( strcmp( coll->name, "collection" ) == 0 );
+    ASSERT( strcmp( coll->cmd_ns, "test.$cmd" ) == 0 );
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    mongo_write_concern_finish( wc );
+    mongo_collection_set_write_concern( coll, wc );
+
+    bson_init( doc );
+    bson_append_int( doc, "_id", 0 );
+    bson_append_int( doc, "n", 0 );
+    bson_finish( doc );
+    ASSERT( mongo_collection_insert( coll, doc ) == MONGO_OK );
+
+    /* The handle's write concern reports the duplicate. */
+    ASSERT( mongo_collection_insert( coll, doc ) == MONGO_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    bson_destroy( doc );
+
+    for( i = 0; i < 10; i++ ) {
+        bson_init( &batch[i] );
+        bson_append_int( &batch[i], "_id", i + 1 );
+        bson_append_int( &batch[i], "n", i + 1 );
+        bson_finish( &batch[i] );
+        docs[i] = &batch[i];
+    }
+    ASSERT( mongo_collection_insert_batch( coll, docs, 10, 0 ) == MONGO_OK );
+    for( i = 0; i < 10; i++ )
+        bson_destroy( &batch[i] );
+
+    ASSERT( mongo_collection_count( coll, NULL ) == 11 );
+
+    bson_init( doc );
+    bson_append_int( doc, "_id", 5 );
+    bson_finish( doc );
+    bson_init( op );
+    bson_append_start_object( op, "$set" );
+    bson_append_int( op, "n", 50 );
+    bson_append_finish_object( op );
+    bson_finish( op );
+    ASSERT( mongo_collection_update( coll, doc, op, 0 ) == MONGO_OK );
+    ASSERT( mongo_collection_find_one( coll, doc, NULL, out ) == MONGO_OK );
+    ASSERT( bson_find( it, out, "n" ) == BSON_INT );
+    ASSERT( bson_iterator_int( it ) == 50 );
+    bson_destroy( out );
+
+    ASSERT( mongo_collection_remove( coll, doc ) == MONGO_OK );
+    ASSERT( mongo_collection_find_one( coll, doc, NULL, NULL ) == MONGO_ERROR );
+    ASSERT( mongo_collection_count( coll, NULL ) == 10 );
+    bson_destroy( op );
+    bson_destroy( doc );
+
+    /* Cursors share the handle's namespace across getmores. */
+    ASSERT( ( cursor = mongo_collection_find( coll, bson_shared_empty( ), NULL, 0, 0, 0 ) ) != NULL );
+    ASSERT( cursor->ns == coll->ns );
+    mongo_cursor_set_batch_size( cursor, 3 );
+    for( count = 0; mongo_cursor_next( cursor ) == MONGO_OK; count++ )
+        ;
+    mongo_cursor_destroy( cursor );
+    ASSERT( count == 10 );
+
+    bson_init( doc );
+    bson_append_int( doc, "ping", 1 );
+    bson_finish( doc );
+    ASSERT( mongo_collection_run_command( coll, doc, NULL ) == MONGO_OK );
+    bson_destroy( doc );
+
+    mongo_write_concern_destroy( wc );
+    mongo_collection_destroy( coll );
+    return 0;
+}
+
+int main() {
+    mongo conn[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+    CONN_CLIENT_TEST;
+
+    test_invalid( conn );
+    test_crud( conn );
+
+    mongo_cmd_drop_db( conn, db );
+    mongo_destroy( conn );
+    return 0;
+}
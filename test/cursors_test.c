@@ -2,11 +2,14 @@
 
 #include "test.h"
 #include "mongo.h"
+#include "env.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <time.h>
 
+#define REPLY_CURSOR_NOT_FOUND 1 /* OP_REPLY CursorNotFound flag */
+
 void create_capped_collection( mongo *conn ) {
     bson b;
 
@@ -181,6 +184,342 @@ int test_copy_cursor_data( mongo *conn ) {
     return 0;
 }
 
+int test_interleaved_queries( mongo *conn ) {
+    mongo_cursor *cursor;
+    bson_iterator it[1];
+    bson query[1], out[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 500 );
+
+    cursor = mongo_find( conn, "test.cursors", bson_shared_empty( ), bson_shared_empty( ), 0, 0, 0 );
+
+    /* Each find_one reads its own reply on the same connection while
+     * the cursor still holds its current batch. */
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+
+        bson_init( query );
+        bson_append_int( query, "a", count );
+        bson_finish( query );
+        ASSERT( mongo_find_one( conn, "test.cursors", query, bson_shared_empty( ), out ) == MONGO_OK );
+        ASSERT( bson_find( it, out, "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+        bson_destroy( out );
+        bson_destroy( query );
+
+        ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+        count++;
+    }
+
+    ASSERT( count == 500 );
+    mongo_cursor_destroy( cursor );
+    remove_sample_data( conn );
+
+    return 0;
+}
+
+int test_keep_buffer( mongo *conn ) {
+    mongo_cursor cursor[1];
+    mongo_reply *first = NULL;
+    bson_iterator it[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 10000 );
+
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_keep_buffer( cursor, 1 );
+    /* Equal batches of equal documents: every getmore fits the first
+     * batch's buffer. */
+    mongo_cursor_set_batch_size( cursor, 100 );
+
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+        if( count == 0 )
+            first = cursor->reply;
+        else if( count % 100 == 0 )
+            ASSERT( cursor->reply == first );
+        count++;
+    }
+
+    ASSERT( count == 10000 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+
+    mongo_cursor_destroy( cursor );
+    remove_sample_data( conn );
+
+    return 0;
+}
+
+int test_prefetch( mongo *conn ) {
+    mongo_cursor cursor[1], other[1];
+    bson_iterator it[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 1000 );
+
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_prefetch( cursor, 50 );
+
+    /* A second read-ahead cursor and plain queries share the connection;
+     * each outstanding reply is read before the next request goes out. */
+    mongo_cursor_init( other, conn, "test.cursors" );
+    mongo_cursor_set_prefetch( other, 0 );
+
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+
+        ASSERT( mongo_cursor_next( other ) == MONGO_OK );
+        ASSERT( bson_find( it, mongo_cursor_bson( other ), "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+
+        if( count % 150 == 0 )
+            ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 1000 );
+        count++;
+    }
+
+    ASSERT( count == 1000 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    ASSERT( mongo_cursor_next( other ) == MONGO_ERROR );
+    mongo_cursor_destroy( cursor );
+    mongo_cursor_destroy( other );
+
+    /* Destroying a cursor with a getmore in flight leaves the
+     * connection usable. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_prefetch( cursor, 0 );
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( cursor->flags & MONGO_CURSOR_PREFETCHING );
+    mongo_cursor_destroy( cursor );
+    ASSERT( conn->prefetching == NULL );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 1000 );
+
+    remove_sample_data( conn );
+
+    return 0;
+}
+
+int test_exhaust( mongo *conn ) {
+    mongo_cursor cursor[1];
+    bson_iterator it[1];
+    int count;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 1000 );
+
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_options( cursor, MONGO_EXHAUST );
+
+    count = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "a" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == count );
+        count++;
+    }
+
+    ASSERT( count == 1000 );
+    ASSERT( cursor->err == MONGO_CURSOR_EXHAUSTED );
+    mongo_cursor_destroy( cursor );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 1000 );
+
+    /* Stopping early drops the connection rather than reading the rest. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    mongo_cursor_set_options( cursor, MONGO_EXHAUST );
+    for( count = 0; count < 10; count++ )
+        ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    mongo_cursor_destroy( cursor );
+
+    ASSERT( ! mongo_is_connected( conn ) );
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    ASSERT( mongo_count( conn, "test", "cursors", NULL ) == 1000 );
+
+    remove_sample_data( conn );
+
+    return 0;
+}
+
+int test_batch_size( mongo *conn ) {
+    mongo_cursor cursor[1];
+    int count, batches;
+    int grown[] = { 10, 20, 40, 80, 160, 160, 160, 160, 160, 50 };
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 1000 );
+
+    /* Batches of ten, cut short by the limit. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    ASSERT( mongo_cursor_set_batch_size( cursor, -1 ) == MONGO_ERROR );
+    ASSERT( mongo_cursor_set_batch_growth( cursor, -1 ) == MONGO_ERROR );
+    ASSERT( cursor->batch_size == 0 && cursor->max_batch_size == 0 );
+    mongo_cursor_set_batch_size( cursor, 10 );
+    mongo_cursor_set_limit( cursor, 25 );
+
+    count = batches = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        if( cursor->batch_seen == 1 ) {
+            ASSERT( cursor->reply->fields.num == ( batches < 2 ? 10 : 5 ) );
+            batches++;
+        }
+        count++;
+    }
+    ASSERT( count == 25 );
+    ASSERT( batches == 3 );
+    mongo_cursor_destroy( cursor );
+
+    /* A fast consumer doubles from ten up to 160, with no limit. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    ASSERT( mongo_cursor_set_batch_size( cursor, 10 ) == MONGO_OK );
+    ASSERT( mongo_cursor_set_batch_growth( cursor, 160 ) == MONGO_OK );
+
+    count = batches = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        if( cursor->batch_seen == 1 ) {
+            ASSERT( batches < 10 );
+            ASSERT( cursor->reply->fields.num == grown[batches] );
+            batches++;
+        }
+        count++;
+    }
+    ASSERT( count == 1000 );
+    ASSERT( batches == 10 );
+    mongo_cursor_destroy( cursor );
+
+    /* A consumer slower than the round trips gets no bigger batches. */
+    mongo_cursor_init( cursor, conn, "test.cursors" );
+    ASSERT( mongo_cursor_set_batch_size( cursor, 10 ) == MONGO_OK );
+    ASSERT( mongo_cursor_set_batch_growth( cursor, 160 ) == MONGO_OK );
+    mongo_cursor_set_limit( cursor, 40 );
+
+    count = batches = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        if( cursor->batch_seen == 1 ) {
+            ASSERT( cursor->reply->fields.num == 10 );
+            batches++;
+        }
+        mongo_env_sleep_ms( 5 );
+        count++;
+    }
+    ASSERT( count == 40 );
+    ASSERT( batches == 4 );
+    ASSERT( cursor->batch_size == 10 );
+    mongo_cursor_destroy( cursor );
+
+    remove_sample_data( conn );
+
+    return 0;
+}
+
+static mongo_cursor *open_cursor( mongo *conn ) {
+    mongo_cursor *cursor;
+
+    cursor = mongo_find( conn, "test.cursors", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    mongo_cursor_set_batch_size( cursor, 2 );
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( cursor->reply->fields.cursorID );
+    return cursor;
+}
+
+int test_kill_cursors( mongo *conn ) {
+    mongo_cursor *cursors[10];
+    int64_t killed;
+    int i;
+
+    remove_sample_data( conn );
+    create_capped_collection( conn );
+    insert_sample_data( conn, 500 );
+
+    /* Kills wait for the next message and go out in front of it. */
+    mongo_set_kill_cursors_batch( conn, 10, 0 );
+    for( i = 0; i < 5; i++ )
+        cursors[i] = open_cursor( conn );
+    for( i = 0; i < 5; i++ )
+        mongo_cursor_destroy( cursors[i] );
+    ASSERT( conn->kill_cursor_count == 5 );
+    cursors[0] = open_cursor( conn );
+    ASSERT( conn->kill_cursor_count == 0 );
+    mongo_cursor_destroy( cursors[0] );
+    ASSERT( conn->kill_cursor_count == 1 );
+    ASSERT( mongo_find_one( conn, "test.cursors", bson_shared_empty( ), NULL, NULL ) == MONGO_OK );
+    ASSERT( conn->kill_cursor_count == 0 );
+
+    /* A full batch goes out on its own. */
+    for( i = 0; i < 10; i++ )
+        cursors[i] = open_cursor( conn );
+    for( i = 0; i < 10; i++ )
+        mongo_cursor_destroy( cursors[i] );
+    ASSERT( conn->kill_cursor_count == 0 );
+
+    /* A flushed kill reaches the server: a getmore on the killed id,
+     * sent once a live cursor's first batch runs out, comes back
+     * CursorNotFound. */
+    cursors[0] = open_cursor( conn );
+    cursors[1] = open_cursor( conn );
+    killed = cursors[0]->reply->fields.cursorID;
+    mongo_cursor_destroy( cursors[0] );
+    ASSERT( conn->kill_cursor_count == 1 );
+    ASSERT( mongo_kill_cursors_flush( conn ) == MONGO_OK );
+    ASSERT( conn->kill_cursor_count == 0 );
+    cursors[1]->reply->fields.cursorID = killed;
+    while( mongo_cursor_next( cursors[1] ) == MONGO_OK )
+        ;
+    ASSERT( cursors[1]->reply->fields.flag & REPLY_CURSOR_NOT_FOUND );
+    mongo_cursor_destroy( cursors[1] );
+
+    /* A kill that has waited past its deadline goes out on the next
+     * read, even one served from the buffer. */
+    mongo_set_kill_cursors_batch( conn, 10, 20 );
+    cursors[0] = open_cursor( conn );
+    cursors[1] = open_cursor( conn );
+    mongo_cursor_destroy( cursors[0] );
+    ASSERT( conn->kill_cursor_count == 1 );
+    mongo_env_sleep_ms( 40 );
+    ASSERT( mongo_cursor_next( cursors[1] ) == MONGO_OK );
+    ASSERT( conn->kill_cursor_count == 0 );
+    mongo_cursor_destroy( cursors[1] );
+    ASSERT( mongo_kill_cursors_flush( conn ) == MONGO_OK );
+
+    /* Kills queued before a reconnect are sent, not dropped. */
+    mongo_set_kill_cursors_batch( conn, 10, 0 );
+    cursors[0] = open_cursor( conn );
+    cursors[1] = open_cursor( conn );
+    killed = cursors[0]->reply->fields.cursorID;
+    mongo_cursor_destroy( cursors[0] );
+    ASSERT( conn->kill_cursor_count == 1 );
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    ASSERT( conn->kill_cursor_count == 0 );
+    cursors[1]->reply->fields.cursorID = killed;
+    while( mongo_cursor_next( cursors[1] ) == MONGO_OK )
+        ;
+    ASSERT( cursors[1]->reply->fields.flag & REPLY_CURSOR_NOT_FOUND );
+    mongo_cursor_destroy( cursors[1] );
+
+    /* One at a time, as before. */
+    mongo_set_kill_cursors_batch( conn, 1, 0 );
+    mongo_cursor_destroy( open_cursor( conn ) );
+    ASSERT( conn->kill_cursor_count == 0 );
+
+    mongo_set_kill_cursors_batch( conn, MONGO_DEFAULT_KILL_CURSORS_MAX,
+                                  MONGO_DEFAULT_KILL_CURSORS_DELAY_MS );
+    remove_sample_data( conn );
+    return 0;
+}
+
 int main() {
 
     mongo conn[1];
@@ -193,6 +532,12 @@ int main() {
     test_builder_api( conn );
     test_bad_query( conn );
     test_copy_cursor_data( conn );
+    test_interleaved_queries( conn );
+    test_keep_buffer( conn );
+    test_prefetch( conn );
+    test_exhaust( conn );
+    test_batch_size( conn );
+    test_kill_cursors( conn );
 
     mongo_destroy( conn );
     return 0;
@@ -0,0 +1,351 @@
+/* discovery_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "env.h"
+#include "mock_server.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* In-process members of a replica set, each listening on a port of
+ * its own and answering ismaster as configured. Any other query is
+ * answered with a document naming the member's port; one on
+ * MOCK_STREAM_NS gets two such documents and a cursor with two more. */
+
+#define MOCK_MAX_CLIENTS 16
+#define MOCK_BUF_SIZE ( 64 * 1024 )
+#define MOCK_STREAM_NS "test.stream"
+#define MOCK_CURSOR_ID 5
+
+typedef struct {
+    int listen_fd;
+    int port;
+    const char *set_name;   /* NULL for a standalone server. */
+    int ismaster;
+    int secondary;
+    volatile int reply_delay_ms; /* Held back from every ismaster reply. */
+    const char *hosts[4];   /* The set's members as "host:port". */
+    char host_buf[4][32];
+    volatile int stop;
+    volatile int queries;   /* Queries other than commands. */
+    volatile int pings;     /* ismaster commands. */
+    void *thread;
+    mock_conn clients[MOCK_MAX_CLIENTS];
+} mock_member;
+
+static void mock_reply_port( mock_member *m, int fd, int response_to, int count, int64_t cursor ) {
+    bson doc[1];
+
+    bson_init( doc );
+    bson_append_int( doc, "port", m->port );
+    bson_finish( doc );
+    mock_reply( fd, response_to, 0, cursor, doc, count );
+    bson_destroy( doc );
+}
+
+static void mock_query( mock_member *m, int fd, int id, const char *ns, const char *query ) {
+    bson q[1], doc[1];
+    bson_iterator it[1];
+    size_t ns_len = strlen( ns );
+    int i, delay;
+
+    bson_init_finished_data( q, ( char * )query, 0 );
+    bson_iterator_init( it, q );
+    bson_iterator_next( it );
+
+    if( ns_len < 5 || strcmp( ns + ns_len - 5, ".$cmd" ) != 0 ) {
+        mongo_env_atomic_add( &m->queries, 1 );
+        if( strcmp( ns, MOCK_STREAM_NS ) == 0 )
+            mock_reply_port( m, fd, id, 2, MOCK_CURSOR_ID );
+        else
+            mock_reply_port( m, fd, id, 1, 0 );
+        return;
+    }
+
+    bson_init( doc );
+    if( strcmp( bson_iterator_key( it ), "ismaster" ) == 0 ) {
+        mongo_env_atomic_add( &m->pings, 1 );
+        if( ( delay = mongo_env_atomic_add( &m->reply_delay_ms, 0 ) ) )
+            mongo_env_sleep_ms( delay );
+        bson_append_bool( doc, "ismaster", m->ismaster );
+        bson_append_bool( doc, "secondary", m->secondary );
+        if( m->set_name ) {
+            bson_append_string( doc, "setName", m->set_name );
+            bson_append_start_array( doc, "hosts" );
+            for( i = 0; i < 4 && m->hosts[i]; i++ )
+                bson_append_string( doc, m->host_buf[i], m->hosts[i] );
+            bson_append_finish_array( doc );
+        }
+        bson_append_int( doc, "maxBsonObjectSize", 16 * 1024 * 1024 );
+        bson_append_int( doc, "ok", 1 );
+    }
+    else
+        bson_append_int( doc, "ok", 1 );
+    bson_finish( doc );
+    mock_reply( fd, id, 0, 0, doc, 1 );
+    bson_destroy( doc );
+}
+
+static void mock_handle( void *arg, mock_conn *c, const mock_request *req ) {
+    mock_member *m = ( mock_member * )arg;
+
+    if( req->op == MONGO_OP_QUERY )
+        mock_query( m, c->fd, req->id, req->ns, req->doc );
+    else if( req->op == MONGO_OP_GET_MORE )
+        mock_reply_port( m, c->fd, req->id, 2, 0 );
+}
+
+static void mock_run( void *arg ) {
+    mock_member *m = ( mock_member * )arg;
+    struct pollfd fds[MOCK_MAX_CLIENTS + 1];
+    int i;
+
+    while( ! mongo_env_atomic_add( &m->stop, 0 ) ) {
+        fds[0].fd = m->listen_fd;
+        fds[0].events = POLLIN;
+        for( i = 0; i < MOCK_MAX_CLIENTS; i++ ) {
+            fds[i + 1].fd = m->clients[i].fd;
+            fds[i + 1].events = POLLIN;
+            fds[i + 1].revents = 0;
+        }
+        fds[0].revents = 0;
+        if( poll( fds, MOCK_MAX_CLIENTS + 1, 20 ) <= 0 )
+            continue;
+
+        for( i = 0; i < MOCK_MAX_CLIENTS; i++ ) {
+            if( fds[i + 1].fd < 0 || ! fds[i + 1].revents )
+                continue;
+            if( mock_conn_read( &m->clients[i] ) <= 0 )
+                mock_conn_close( &m->clients[i] );
+            else
+                mock_conn_dispatch( &m->clients[i], mock_handle, m );
+        }
+
+        if( fds[0].revents ) {
+            for( i = 0; i < MOCK_MAX_CLIENTS && m->clients[i].fd >= 0; i++ )
+                ;
+            ASSERT( i < MOCK_MAX_CLIENTS );
+            mock_conn_open( &m->clients[i], accept( m->listen_fd, NULL, NULL ), MOCK_BUF_SIZE );
+        }
+    }
+}
+
+static void mock_start( mock_member *m, const char *set_name, int ismaster, int secondary ) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof( sa );
+    int i;
+
+    memset( m, 0, sizeof( mock_member ) );
+    m->set_name = set_name;
+    m->ismaster = ismaster;
+    m->secondary = secondary;
+    for( i = 0; i < MOCK_MAX_CLIENTS; i++ )
+        m->clients[i].fd = -1;
+    for( i = 0; i < 4; i++ )
+        sprintf( m->host_buf[i], "%d", i );
+
+    memset( &sa, 0, sizeof( sa ) );
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = inet_addr( "127.0.0.1" );
+    m->listen_fd = socket( AF_INET, SOCK_STREAM, 0 );
+    ASSERT( bind( m->listen_fd, ( struct sockaddr * )&sa, sizeof( sa ) ) == 0 );
+    ASSERT( listen( m->listen_fd, 16 ) == 0 );
+    ASSERT( getsockname( m->listen_fd, ( struct sockaddr * )&sa, &len ) == 0 );
+    m->port = ntohs( sa.sin_port );
+
+    ASSERT( mongo_env_thread_create( &m->thread, mock_run, m ) == MONGO_OK );
+}
+
+/* Make every member name all of them as the set's hosts. */
+static void mock_set_hosts( mock_member **members, int count ) {
+    static char hosts[4][32];
+    int i, j;
+
+    for( i = 0; i < count; i++ )
+        sprintf( hosts[i], "127.0.0.1:%d", members[i]->port );
+    for( i = 0; i < count; i++ )
+        for( j = 0; j < count; j++ )
+            members[i]->hosts[j] = hosts[j];
+}
+
+static void mock_stop( mock_member *m ) {
+    int i;
+
+    mongo_env_atomic_add( &m->stop, 1 );
+    mongo_env_thread_join( m->thread );
+    for( i = 0; i < MOCK_MAX_CLIENTS; i++ )
+        mock_conn_close( &m->clients[i] );
+    close( m->listen_fd );
+}
+
+/* A seed without a set name is a standalone server, not a primary. */
+int test_standalone_seed( void ) {
+    mongo conn[1];
+    mock_member standalone[1];
+
+    mock_start( standalone, NULL, 1, 0 );
+
+    mongo_replica_set_init( conn, "rs" );
+    mongo_replica_set_add_seed( conn, "127.0.0.1", standalone->port );
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_CONN_NO_PRIMARY );
+    ASSERT( ! conn->connected );
+    mongo_destroy( conn );
+
+    mock_stop( standalone );
+    return 0;
+}
+
+/* A seed from another set fails the connect even though this set's
+ * primary answers too. The primary is slow to answer so the other
+ * seed is heard first; one heard after the primary is not checked. */
+int test_bad_set_name( void ) {
+    mongo conn[1];
+    mock_member primary[1], other[1];
+
+    mock_start( primary, "rs", 1, 0 );
+    mongo_env_atomic_add( &primary->reply_delay_ms, 100 );
+    mock_start( other, "other", 1, 0 );
+
+    mongo_replica_set_init( conn, "rs" );
+    mongo_replica_set_add_seed( conn, "127.0.0.1", primary->port );
+    mongo_replica_set_add_seed( conn, "127.0.0.1", other->port );
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_CONN_BAD_SET_NAME );
+    ASSERT( ! conn->connected );
+    mongo_destroy( conn );
+
+    /* Without the stray seed the primary is found. */
+    mongo_replica_set_init( conn, "rs" );
+    mongo_replica_set_add_seed( conn, "127.0.0.1", primary->port );
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_OK );
+    ASSERT( conn->primary->port == primary->port );
+    mongo_destroy( conn );
+
+    mock_stop( primary );
+    mock_stop( other );
+    return 0;
+}
+
+static mongo_replica_set_member *find_member( mongo *conn, mongo *member_conn ) {
+    int i;
+
+    for( i = 0; i < conn->replica_set->member_count; i++ )
+        if( &conn->replica_set->members[i]->conn == member_conn )
+            return conn->replica_set->members[i];
+    return NULL;
+}
+
+static int read_port( mongo_cursor *cursor ) {
+    bson_iterator it[1];
+
+    ASSERT( mongo_cursor_next( cursor ) == MONGO_OK );
+    ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "port" ) == BSON_INT );
+    return bson_iterator_int( it );
+}
+
+int test_read_preference( void ) {
+    mongo conn[1];
+    mongo_cursor *cursor;
+    mongo_cursor stream[1];
+    mongo_replica_set_member *member;
+    mock_member primary[1], secondary[1];
+    mock_member *members[2];
+    int64_t start;
+    int pings;
+
+    mock_start( primary, "rs", 1, 0 );
+    mock_start( secondary, "rs", 0, 1 );
+    members[0] = primary;
+    members[1] = secondary;
+    mock_set_hosts( members, 2 );
+
+    mongo_replica_set_init( conn, "rs" );
+    mongo_replica_set_add_seed( conn, "127.0.0.1", primary->port );
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_OK );
+    ASSERT( conn->primary->port == primary->port );
+
+    /* Primary reads stay on the client's own connection. */
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor && cursor->conn == conn );
+    ASSERT( read_port( cursor ) == primary->port );
+    ASSERT( conn->replica_set->member_count == 0 );
+    mongo_cursor_destroy( cursor );
+
+    mongo_set_read_preference( conn, MONGO_READ_SECONDARY );
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor && cursor->conn != conn );
+    ASSERT( cursor->options & MONGO_SLAVE_OK );
+    ASSERT( read_port( cursor ) == secondary->port );
+    ASSERT( conn->replica_set->member_count == 2 );
+    ASSERT( ( member = find_member( conn, cursor->conn ) ) != NULL );
+    ASSERT( member->secondary && member->rtt_ms >= 0 );
+    mongo_cursor_destroy( cursor );
+
+    /* Commands still go to the primary. */
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    /* A due ping does not hold reads up while a member is slow to
+     * answer it; later reads finish the round. */
+    mongo_env_atomic_add( &primary->reply_delay_ms, 300 );
+    conn->replica_set->last_ping = 0;
+    start = mongo_env_time_ms( );
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor && read_port( cursor ) == secondary->port );
+    ASSERT( mongo_env_time_ms( ) - start < 200 );
+    ASSERT( conn->replica_set->ping_deadline != 0 );
+    mongo_cursor_destroy( cursor );
+
+    while( conn->replica_set->ping_deadline ) {
+        ASSERT( mongo_env_time_ms( ) - start < 5000 );
+        mongo_env_sleep_ms( 50 );
+        cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+        ASSERT( cursor && read_port( cursor ) == secondary->port );
+        mongo_cursor_destroy( cursor );
+    }
+    ASSERT( conn->replica_set->last_ping > 0 );
+    mongo_env_atomic_add( &primary->reply_delay_ms, -300 );
+
+    /* A member with a read-ahead reply outstanding sits the round out,
+     * and its cursor still gets every batch. */
+    mongo_cursor_init( stream, conn, MOCK_STREAM_NS );
+    mongo_cursor_set_read_preference( stream, MONGO_READ_SECONDARY );
+    mongo_cursor_set_prefetch( stream, 50 );
+    ASSERT( read_port( stream ) == secondary->port );
+    ASSERT( stream->conn->prefetching == stream );
+
+    pings = mongo_env_atomic_add( &secondary->pings, 0 );
+    conn->replica_set->last_ping = 0;
+    mongo_set_read_preference( conn, MONGO_READ_SECONDARY_PREFERRED );
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor && read_port( cursor ) == secondary->port );
+    mongo_cursor_destroy( cursor );
+    ASSERT( mongo_env_atomic_add( &secondary->pings, 0 ) == pings );
+
+    ASSERT( read_port( stream ) == secondary->port );
+    ASSERT( read_port( stream ) == secondary->port );
+    ASSERT( read_port( stream ) == secondary->port );
+    ASSERT( mongo_cursor_next( stream ) == MONGO_ERROR );
+    mongo_cursor_destroy( stream );
+
+    mongo_destroy( conn );
+    mock_stop( primary );
+    mock_stop( secondary );
+    return 0;
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    test_standalone_seed();
+    test_bad_set_name();
+    test_read_preference();
+
+    return 0;
+}
@@ -4,10 +4,18 @@
 
 #include "test.h"
 #include "mongo.h"
+#include "env.h"
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
 
 /* Test read timeout by causing the
  * server to sleep for 10s on a query.
@@ -72,6 +80,135 @@ int test_getaddrinfo( void ) {
     return 0;
 }
 
+/* Nothing answers at a blackholed address; the connect gives up when
+ * the connect timeout passes rather than the kernel's. */
+int test_connect_timeout( void ) {
+    mongo conn[1];
+    time_t start;
+
+    CONN_CLIENT_TEST;
+
+    ASSERT( mongo_get_connect_timeout( conn ) == MONGO_DEFAULT_CONNECT_TIMEOUT_MS );
+    mongo_set_connect_timeout( conn, 200 );
+    strcpy( conn->primary->host, "10.255.255.1" );
+
+    start = time( NULL );
+    ASSERT( mongo_reconnect( conn ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_CONN_FAIL );
+    ASSERT( time( NULL ) - start <= 2 );
+
+    mongo_destroy( conn );
+
+    return 0;
+}
+
+static void set_port( struct addrinfo *addr, int port ) {
+    if( addr->ai_family == AF_INET6 )
+        ( ( struct sockaddr_in6 * )addr->ai_addr )->sin6_port = htons( port );
+    else
+        ( ( struct sockaddr_in * )addr->ai_addr )->sin_port = htons( port );
+}
+
+/* Listen on addr at port, or any port if port is 0. Returns the port
+ * and leaves it set in addr. */
+static int listen_on( struct addrinfo *addr, int port, int backlog, int *fd ) {
+    struct sockaddr_storage sa;
+    socklen_t len = sizeof( sa );
+    int one = 1;
+
+    *fd = socket( addr->ai_family, SOCK_STREAM, 0 );
+    if( addr->ai_family == AF_INET6 )
+        setsockopt( *fd, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof( one ) );
+
+    set_port( addr, port );
+    ASSERT( bind( *fd, addr->ai_addr, addr->ai_addrlen ) == 0 );
+    ASSERT( listen( *fd, backlog ) == 0 );
+    ASSERT( getsockname( *fd, ( struct sockaddr * )&sa, &len ) == 0 );
+
+    port = ntohs( sa.ss_family == AF_INET6 ? ( ( struct sockaddr_in6 * )&sa )->sin6_port :
+                  ( ( struct sockaddr_in * )&sa )->sin_port );
+    set_port( addr, port );
+    return port;
+}
+
+/* localhost's first address hangs, with its accept queue full, while
+ * another answers. Both the blocking connect and the one replica set
+ * discovery drives connect to the other address, long before the
+ * first gives up. Needs localhost to resolve to both IPv4 and IPv6. */
+int test_connect_fallback( void ) {
+    struct addrinfo hints, *list, *first, *other;
+    struct pollfd pfd;
+    mongo conn[1];
+    mongo *conns[1];
+    int hung, good, fillers[3], port, ready, i;
+    int64_t start;
+
+    memset( &hints, 0, sizeof( hints ) );
+#ifdef AI_ADDRCONFIG
+    hints.ai_flags = AI_ADDRCONFIG;
+#endif
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    ASSERT( getaddrinfo( "localhost", "0", &hints, &list ) == 0 );
+
+    first = list;
+    for( other = list->ai_next; other != NULL; other = other->ai_next )
+        if( other->ai_family != first->ai_family )
+            break;
+    if( ! other ) {
+        printf( "localhost has one address family; skipping test_connect_fallback\n" );
+        freeaddrinfo( list );
+        return 0;
+    }
+
+    port = listen_on( other, 0, 16, &good );
+    listen_on( first, port, 0, &hung );
+
+    /* Fill the accept queue so further SYNs are dropped. */
+    for( i = 0; i < 3; i++ ) {
+        fillers[i] = socket( first->ai_family, SOCK_STREAM, 0 );
+        fcntl( fillers[i], F_SETFL, O_NONBLOCK );
+        connect( fillers[i], first->ai_addr, first->ai_addrlen );
+    }
+    mongo_env_sleep_ms( 100 );
+
+    mongo_init( conn );
+    mongo_set_connect_timeout( conn, 5000 );
+
+    start = mongo_env_time_ms( );
+    ASSERT( mongo_env_socket_connect( conn, "localhost", port ) == MONGO_OK );
+    ASSERT( mongo_env_time_ms( ) - start < 1000 );
+    pfd.fd = good;
+    pfd.events = POLLIN;
+    ASSERT( poll( &pfd, 1, 1000 ) == 1 );
+    close( accept( good, NULL, NULL ) );
+    mongo_env_close_socket( conn->sock );
+    conn->sock = 0;
+    conn->connected = 0;
+
+    /* The same through start, poll and finish. */
+    start = mongo_env_time_ms( );
+    ASSERT( mongo_env_socket_connect_start( conn, "localhost", port ) == MONGO_OK );
+    conns[0] = conn;
+    while( ! conn->connected ) {
+        ASSERT( mongo_env_time_ms( ) - start < 1000 );
+        if( mongo_env_poll_sockets( conns, &ready, 1, 1000 ) > 0 && ready )
+            ASSERT( mongo_env_socket_connect_finish( conn ) == MONGO_OK );
+    }
+    ASSERT( conn->connecting == NULL );
+    ASSERT( poll( &pfd, 1, 1000 ) == 1 );
+    close( accept( good, NULL, NULL ) );
+
+    mongo_destroy( conn );
+    for( i = 0; i < 3; i++ )
+        close( fillers[i] );
+    close( hung );
+    close( good );
+    freeaddrinfo( list );
+
+    return 0;
+}
+
 int test_error_messages( void ) {
     mongo conn[1];
     bson b[1];
@@ -105,6 +242,8 @@ int main() {
         test_read_timeout();
     }
     test_getaddrinfo();
+    test_connect_timeout();
+    test_connect_fallback();
     test_error_messages();
 
     return 0;
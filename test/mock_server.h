@@ -0,0 +1,122 @@
+/* mock_server.h */
+
+/* The wire protocol end of an in-process mock server, for tests that
+ * need replies a real server can't be made to give on cue. Each test
+ * owns its sockets and decides what to answer: a mock_conn buffers one
+ * client's requests, mock_conn_dispatch( ) hands each whole one to the
+ * test's handler, and the handler answers with mock_reply( ).
+ *
+ * Include after test.h. */
+
+#ifndef MOCK_SERVER_H_
+#define MOCK_SERVER_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MOCK_OP_REPLY 1
+#define MOCK_QUERY_FAILURE 2 /* OP_REPLY QueryFailure flag */
+
+typedef struct {
+    int fd;        /* -1 when closed. */
+    char *in;      /* Bytes read but not yet dispatched. */
+    int len;
+    int size;
+} mock_conn;
+
+/* One whole request. OP_QUERY, OP_GET_MORE and OP_INSERT all have ns
+ * at the same offset. */
+typedef struct {
+    int id;
+    int op;
+    const char *ns;
+    const char *doc;   /* The query, or the first document inserted; else NULL. */
+} mock_request;
+
+typedef void ( *mock_handler )( void *arg, mock_conn *c, const mock_request *req );
+
+static void mock_conn_open( mock_conn *c, int fd, int size ) {
+    c->fd = fd;
+    c->in = ( char * )malloc( size );
+    c->len = 0;
+    c->size = size;
+}
+
+static void mock_conn_close( mock_conn *c ) {
+    if( c->fd >= 0 )
+        close( c->fd );
+    free( c->in );
+    c->fd = -1;
+    c->in = NULL;
+    c->len = 0;
+}
+
+/* Read once from the client. Returns what read( ) did. */
+static int mock_conn_read( mock_conn *c ) {
+    int got;
+
+    ASSERT( c->len < c->size );
+    got = ( int )read( c->fd, c->in + c->len, c->size - c->len );
+    if( got > 0 )
+        c->len += got;
+    return got;
+}
+
+/* Hand every whole request read so far to handler, keeping the start
+ * of any partial one for next time. */
+static void mock_conn_dispatch( mock_conn *c, mock_handler handler, void *arg ) {
+    mock_request req;
+    char *p = c->in;
+    int len;
+
+    while( c->in + c->len - p >= 16 ) {
+        bson_little_endian32( &len, p );
+        if( c->in + c->len - p < len )
+            break;
+        bson_little_endian32( &req.id, p + 4 );
+        bson_little_endian32( &req.op, p + 12 );
+        req.ns = p + 20;
+        if( req.op == MONGO_OP_QUERY )
+            req.doc = req.ns + strlen( req.ns ) + 1 + 8;
+        else if( req.op == MONGO_OP_INSERT )
+            req.doc = req.ns + strlen( req.ns ) + 1;
+        else
+            req.doc = NULL;
+        handler( arg, c, &req );
+        p += len;
+    }
+
+    memmove( c->in, p, c->in + c->len - p );
+    c->len -= ( int )( p - c->in );
+}
+
+/* Send an OP_REPLY holding count copies of doc, which is NULL for an
+ * empty reply. */
+static void mock_reply( int fd, int response_to, int flags, int64_t cursor,
+                        const bson *doc, int count ) {
+    int len, zero = 0, op = MOCK_OP_REPLY, id = 1000, i;
+    int size = doc ? bson_size( doc ) : 0;
+    char *msg, *p;
+
+    if( ! doc )
+        count = 0;
+    len = 36 + count * size;
+    msg = p = ( char * )malloc( len );
+
+    bson_little_endian32( p, &len ); p += 4;
+    bson_little_endian32( p, &id ); p += 4;
+    bson_little_endian32( p, &response_to ); p += 4;
+    bson_little_endian32( p, &op ); p += 4;
+    bson_little_endian32( p, &flags ); p += 4;
+    bson_little_endian64( p, &cursor ); p += 8;
+    bson_little_endian32( p, &zero ); p += 4;
+    bson_little_endian32( p, &count ); p += 4;
+    for( i = 0; i < count; i++, p += size )
+        memcpy( p, doc->data, size );
+
+    ASSERT( write( fd, msg, len ) == len );
+    free( msg );
+}
+
+#endif
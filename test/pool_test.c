@@ -0,0 +1,208 @@
+/* pool_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "pool.h"
+#include "env.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const char *db = "test";
+
+void test_checkout_checkin( void ) {
+    mongo_pool pool[1];
+    mongo *a, *b, *c;
+
+    ASSERT( mongo_pool_init( pool, TEST_SERVER, 27017, 2, 3 ) == MONGO_OK );
+    mongo_pool_set_checkout_timeout( pool, 50 );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_OK );
+    ASSERT( pool->live == 2 );
+
+    a = mongo_pool_checkout( pool );
+    b = mongo_pool_checkout( pool );
+    c = mongo_pool_checkout( pool );
+    ASSERT( a && b && c );
+    ASSERT( a != b && b != c && a != c );
+    ASSERT( pool->live == 3 );
+
+    /* Every slot is busy. */
+    ASSERT( mongo_pool_checkout( pool ) == NULL );
+
+    ASSERT( mongo_simple_int_command( b, "admin", "ping", 1, NULL ) == MONGO_OK );
+    mongo_pool_checkin( pool, b );
+    mongo_pool_checkin( pool, a );
+    mongo_pool_checkin( pool, c );
+
+    /* The thread is handed the connection it checked out last. */
+    ASSERT( mongo_pool_checkout( pool ) == c );
+    mongo_pool_checkin( pool, c );
+
+    ASSERT( mongo_pool_trim( pool, -1 ) == 1 );
+    ASSERT( pool->live == 2 );
+
+    mongo_pool_destroy( pool );
+}
+
+#define THREADS 8
+#define ROUNDS 100
+
+typedef struct {
+    mongo_pool *pool;
+    volatile int *in_use;
+    volatile int *most_in_use;
+    int failures;
+} worker;
+
+static void work( void *arg ) {
+    worker *w = ( worker * )arg;
+    mongo *conn;
+    int i, n, most;
+
+    for( i = 0; i < ROUNDS; i++ ) {
+        if( ! ( conn = mongo_pool_checkout( w->pool ) ) ) {
+            w->failures++;
+            continue;
+        }
+
+        n = mongo_env_atomic_add( w->in_use, 1 );
+        while( ( most = *w->most_in_use ) < n &&
+                ! mongo_env_atomic_cas( w->most_in_use, most, n ) )
+            ;
+        if( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) != MONGO_OK )
+            w->failures++;
+        mongo_env_atomic_add( w->in_use, -1 );
+
+        mongo_pool_checkin( w->pool, conn );
+    }
+}
+
+void test_threads( void ) {
+    mongo_pool pool[1];
+    void *threads[THREADS];
+    worker workers[THREADS];
+    volatile int in_use = 0, most_in_use = 0;
+    int i;
+
+    /* Many more threads than connections: checkouts wait for checkins. */
+    ASSERT( mongo_pool_init( pool, TEST_SERVER, 27017, 1, 2 ) == MONGO_OK );
+    mongo_pool_set_checkout_timeout( pool, 10000 );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_OK );
+
+    for( i = 0; i < THREADS; i++ ) {
+        workers[i].pool = pool;
+        workers[i].in_use = &in_use;
+        workers[i].most_in_use = &most_in_use;
+        workers[i].failures = 0;
+        ASSERT( mongo_env_thread_create( &threads[i], work, &workers[i] ) == MONGO_OK );
+    }
+    for( i = 0; i < THREADS; i++ ) {
+        mongo_env_thread_join( threads[i] );
+        ASSERT( workers[i].failures == 0 );
+    }
+
+    ASSERT( most_in_use >= 1 && most_in_use <= 2 );
+    ASSERT( pool->live <= 2 );
+    ASSERT( pool->waiters == 0 );
+
+    mongo_pool_destroy( pool );
+}
+
+void test_reconnect_and_auth( void ) {
+    mongo conn[1];
+    mongo_pool pool[1];
+    mongo *a;
+
+    CONN_CLIENT_TEST;
+    mongo_cmd_drop_db( conn, db );
+    mongo_cmd_add_user( conn, db, "user", "password" );
+
+    ASSERT( mongo_pool_init( pool, TEST_SERVER, 27017, 1, 1 ) == MONGO_OK );
+    mongo_pool_set_auth( pool, db, "user", "wrong" );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_ERROR );
+    ASSERT( pool->live == 0 );
+
+    mongo_pool_set_auth( pool, db, "user", "password" );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_OK );
+
+    /* A connection that was dropped is reopened, and authenticated
+     * again, at its next checkout. */
+    a = mongo_pool_checkout( pool );
+    ASSERT( a );
+    mongo_disconnect( a );
+    mongo_pool_checkin( pool, a );
+
+    a = mongo_pool_checkout( pool );
+    ASSERT( a && mongo_is_connected( a ) );
+    ASSERT( mongo_simple_int_command( a, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    /* Health check on every checkout. */
+    mongo_pool_set_health_check( pool, 0 );
+    mongo_pool_checkin( pool, a );
+    a = mongo_pool_checkout( pool );
+    ASSERT( a && mongo_is_connected( a ) );
+    mongo_pool_checkin( pool, a );
+
+    mongo_pool_destroy( pool );
+
+    mongo_cmd_drop_db( conn, db );
+    mongo_destroy( conn );
+}
+
+void test_bulk( void ) {
+    mongo_pool pool[1];
+    mongo_bulk bulk[1];
+    mongo_write_concern wc[1];
+    mongo *conn;
+    bson b[1];
+    int i;
+
+    ASSERT( mongo_pool_init( pool, TEST_SERVER, 27017, 1, 4 ) == MONGO_OK );
+    ASSERT( mongo_pool_connect( pool ) == MONGO_OK );
+    conn = mongo_pool_checkout( pool );
+    ASSERT( conn );
+
+    mongo_cmd_drop_collection( conn, db, "pool_bulk", NULL );
+    mongo_create_simple_index( conn, "test.pool_bulk", "n", MONGO_INDEX_UNIQUE, NULL );
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    mongo_write_concern_finish( wc );
+
+    ASSERT( mongo_bulk_init( bulk, conn, wc, 0 ) == MONGO_OK );
+    for( i = 0; i < 2000; i++ ) {
+        bson_init( b );
+        bson_append_int( b, "n", i == 1501 ? 1500 : i );
+        bson_finish( b );
+        ASSERT( mongo_bulk_insert( bulk, "test.pool_bulk", b ) == MONGO_OK );
+        bson_destroy( b );
+    }
+
+    /* Three more connections are opened for the other shares. */
+    ASSERT( mongo_pool_bulk_execute( pool, bulk, 4 ) == MONGO_ERROR );
+    ASSERT( pool->live == 4 );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( bulk->next == 2000 );
+
+    for( i = 0; i < 2000; i++ )
+        ASSERT( bulk->ops[i].status == ( i == 1501 ? MONGO_BULK_FAILED : MONGO_BULK_DONE ) );
+    ASSERT( mongo_count( conn, db, "pool_bulk", NULL ) == 1999 );
+
+    mongo_bulk_destroy( bulk );
+    mongo_write_concern_destroy( wc );
+    mongo_cmd_drop_collection( conn, db, "pool_bulk", NULL );
+    mongo_pool_checkin( pool, conn );
+    mongo_pool_destroy( pool );
+}
+
+int main() {
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    test_checkout_checkin( );
+    test_threads( );
+    test_reconnect_and_auth( );
+    test_bulk( );
+
+    return 0;
+}
@@ -0,0 +1,185 @@
+/* prepared_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+static const char *db = "test";
+static const char *ns = "test.prepared";
+
+static void fill( mongo *conn ) {
+    bson doc[1];
+    char name[16];
+    int i;
+
+    mongo_cmd_drop_collection( conn, db, "prepared", NULL );
+    for( i = 0; i < 20; i++ ) {
+        sprintf( name, "user%03d", i );
+        bson_init( doc );
+        bson_append_int( doc, "_id", i );
+        bson_append_string( doc, "name", name );
+        bson_append_long( doc, "n", 0 );
+        bson_finish( doc );
+        mongo_insert( conn, ns, doc, NULL );
+        bson_destroy( doc );
+    }
+}
+
+int test_find_one( mongo *conn ) {
+    mongo_prepared prepared[1];
+    bson query[1], out[1];
+    bson_iterator it[1];
+    char name[16];
+    int id, i;
+
+    bson_init( query );
+    bson_append_int( query, "_id", 0 );
+    bson_finish( query );
+    ASSERT( mongo_prepare_query( conn, prepared, ns, query, NULL, 0, 0, 0 ) == MONGO_OK );
+    bson_destroy( query );
+
+    ASSERT( ( id = mongo_prepared_bind( prepared, MONGO_PREPARED_QUERY, "_id" ) ) == 0 );
+    ASSERT( mongo_prepared_bind( prepared, MONGO_PREPARED_QUERY, "missing" ) == -1 );
+
+    for( i = 0; i < 20; i++ ) {
+        ASSERT( mongo_prepared_set_int( prepared, id, i ) == MONGO_OK );
+        ASSERT( mongo_prepared_find_one( conn, prepared, out ) == MONGO_OK );
+        sprintf( name, "user%03d", i );
+        ASSERT( bson_find( it, out, "name" ) == BSON_STRING );
+        ASSERT( strcmp( bson_iterator_string( it ), name ) == 0 );
+        bson_destroy( out );
+    }
+
+    ASSERT( mongo_prepared_set_int( prepared, id, 99 ) == MONGO_OK );
+    ASSERT( mongo_prepared_find_one( conn, prepared, NULL ) == MONGO_ERROR );
+
+    /* Only a value of the parameter's type fits. */
+    ASSERT( mongo_prepared_set_long( prepared, id, 1 ) == MONGO_ERROR );
+    ASSERT( mongo_prepared_set_int( prepared, 1, 1 ) == MONGO_ERROR );
+
+    /* Updates cannot be sent as queries, nor the reverse. */
+    ASSERT( mongo_prepared_update( conn, prepared, NULL ) == MONGO_ERROR );
+
+    mongo_prepared_destroy( prepared );
+    return 0;
+}
+
+int test_invalid( mongo *conn ) {
+    mongo_prepared prepared[1];
+    bson query[1];
+    int max_bson_size = conn->max_bson_size;
+
+    /* Documents are checked when prepared, not on every send. */
+    bson_init( query );
+    bson_append_int( query, "_id", 0 );
+    ASSERT( mongo_prepare_query( conn, prepared, ns, query, NULL, 0, 0, 0 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_BSON_NOT_FINISHED );
+    bson_finish( query );
+
+    conn->max_bson_size = bson_size( query ) - 1;
+    ASSERT( mongo_prepare_query( conn, prepared, ns, query, NULL, 0, 0, 0 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_BSON_TOO_LARGE );
+    ASSERT( mongo_prepare_update( conn, prepared, ns, query, query, 0 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_BSON_TOO_LARGE );
+    conn->max_bson_size = max_bson_size;
+
+    bson_destroy( query );
+    mongo_clear_errors( conn );
+    return 0;
+}
+
+int test_find( mongo *conn ) {
+    mongo_prepared prepared[1];
+    mongo_cursor *cursor;
+    bson query[1];
+    int gt, name, count;
+
+    bson_init( query );
+    bson_append_start_object( query, "_id" );
+    bson_append_int( query, "$gt", 0 );
+    bson_append_finish_object( query );
+    bson_append_string( query, "name", "user000" );
+    bson_finish( query );
+    ASSERT( mongo_prepare_query( conn, prepared, ns, query, NULL, 0, 0, 0 ) == MONGO_OK );
+    bson_destroy( query );
+
+    ASSERT( ( gt = mongo_prepared_bind( prepared, MONGO_PREPARED_QUERY, "_id.$gt" ) ) >= 0 );
+    ASSERT( ( name = mongo_prepared_bind( prepared, MONGO_PREPARED_QUERY, "name" ) ) >= 0 );
+
+    ASSERT( mongo_prepared_set_string( prepared, name, "user1" ) == MONGO_ERROR );
+    ASSERT( mongo_prepared_set_string( prepared, name, "user015" ) == MONGO_OK );
+
+    ASSERT( mongo_prepared_set_int( prepared, gt, 10 ) == MONGO_OK );
+    ASSERT( ( cursor = mongo_prepared_find( conn, prepared ) ) != NULL );
+    for( count = 0; mongo_cursor_next( cursor ) == MONGO_OK; count++ )
+        ;
+    mongo_cursor_destroy( cursor );
+    ASSERT( count == 1 );
+
+    ASSERT( mongo_prepared_set_int( prepared, gt, 15 ) == MONGO_OK );
+    ASSERT( ( cursor = mongo_prepared_find( conn, prepared ) ) != NULL );
+    ASSERT( mongo_cursor_next( cursor ) != MONGO_OK );
+    mongo_cursor_destroy( cursor );
+
+    mongo_prepared_destroy( prepared );
+    return 0;
+}
+
+int test_update( mongo *conn ) {
+    mongo_prepared prepared[1];
+    bson cond[1], op[1], out[1];
+    bson_iterator it[1];
+    int id, n, i;
+
+    bson_init( cond );
+    bson_append_int( cond, "_id", 0 );
+    bson_finish( cond );
+    bson_init( op );
+    bson_append_start_object( op, "$set" );
+    bson_append_long( op, "n", 0 );
+    bson_append_finish_object( op );
+    bson_finish( op );
+    ASSERT( mongo_prepare_update( conn, prepared, ns, cond, op, 0 ) == MONGO_OK );
+
+    ASSERT( ( id = mongo_prepared_bind( prepared, MONGO_PREPARED_COND, "_id" ) ) >= 0 );
+    ASSERT( ( n = mongo_prepared_bind( prepared, MONGO_PREPARED_OP, "$set.n" ) ) >= 0 );
+
+    for( i = 0; i < 20; i++ ) {
+        ASSERT( mongo_prepared_set_int( prepared, id, i ) == MONGO_OK );
+        ASSERT( mongo_prepared_set_long( prepared, n, ( int64_t )i * 100 ) == MONGO_OK );
+        ASSERT( mongo_prepared_update( conn, prepared, NULL ) == MONGO_OK );
+    }
+
+    bson_destroy( cond );
+    bson_init( cond );
+    bson_append_int( cond, "_id", 7 );
+    bson_finish( cond );
+    ASSERT( mongo_find_one( conn, ns, cond, NULL, out ) == MONGO_OK );
+    ASSERT( bson_find( it, out, "n" ) == BSON_LONG );
+    ASSERT( bson_iterator_long( it ) == 700 );
+    bson_destroy( out );
+
+    bson_destroy( cond );
+    bson_destroy( op );
+    mongo_prepared_destroy( prepared );
+    return 0;
+}
+
+int main() {
+    mongo conn[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+    CONN_CLIENT_TEST;
+
+    fill( conn );
+    test_find_one( conn );
+    test_invalid( conn );
+    test_find( conn );
+    test_update( conn );
+
+    mongo_cmd_drop_db( conn, db );
+    mongo_destroy( conn );
+    return 0;
+}
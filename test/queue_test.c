@@ -0,0 +1,180 @@
+/* queue_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "queue.h"
+#include "env.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define THREADS 8
+#define DOCS_PER_THREAD 500
+
+static const char *db = "test";
+static const char *ns = "test.queue";
+static const char *other_ns = "test.queue_other";
+
+typedef struct {
+    int windows;
+    int docs;
+    int failures;
+    int lasterrcode;
+    volatile int hold;   /* Keep the writer in the callback while set. */
+    volatile int held;   /* Set once the writer is being held. */
+} totals;
+
+static void on_flush( mongo *conn, int status, int count, void *arg ) {
+    totals *t = ( totals * )arg;
+
+    t->windows++;
+    t->docs += count;
+    if( status != MONGO_OK ) {
+        t->failures++;
+        t->lasterrcode = conn->lasterrcode;
+    }
+
+    if( mongo_env_atomic_add( &t->hold, 0 ) ) {
+        mongo_env_atomic_add( &t->held, 1 );
+        while( mongo_env_atomic_add( &t->hold, 0 ) )
+            mongo_env_sleep_ms( 1 );
+    }
+}
+
+typedef struct {
+    mongo *conn;
+    int base;
+    int failures;
+} producer;
+
+static void produce( void *arg ) {
+    producer *p = ( producer * )arg;
+    bson doc[1];
+    int i;
+
+    for( i = 0; i < DOCS_PER_THREAD; i++ ) {
+        bson_init( doc );
+        bson_append_int( doc, "n", p->base + i );
+        bson_finish( doc );
+        if( mongo_enqueue_insert( p->conn, i % 2 ? other_ns : ns, doc ) != MONGO_OK )
+            p->failures++;
+        bson_destroy( doc );
+    }
+}
+
+int test_producers( mongo *conn, mongo_write_concern *wc ) {
+    mongo_write_queue queue[1];
+    producer producers[THREADS];
+    void *threads[THREADS];
+    totals t[1];
+    int i;
+
+    mongo_cmd_drop_collection( conn, db, "queue", NULL );
+    mongo_cmd_drop_collection( conn, db, "queue_other", NULL );
+
+    memset( t, 0, sizeof( totals ) );
+    mongo_write_queue_init( queue, wc, on_flush, t );
+    mongo_write_queue_set_flush( queue, 5, 16 * 1024 );
+    ASSERT( mongo_write_queue_start( conn, queue ) == MONGO_OK );
+
+    for( i = 0; i < THREADS; i++ ) {
+        producers[i].conn = conn;
+        producers[i].base = i * DOCS_PER_THREAD;
+        producers[i].failures = 0;
+        ASSERT( mongo_env_thread_create( &threads[i], produce, &producers[i] ) == MONGO_OK );
+    }
+    for( i = 0; i < THREADS; i++ ) {
+        mongo_env_thread_join( threads[i] );
+        ASSERT( producers[i].failures == 0 );
+    }
+
+    mongo_write_queue_stop( conn );
+    ASSERT( conn->write_queue == NULL );
+
+    /* Everything queued was written, in far fewer round trips. */
+    ASSERT( t->failures == 0 );
+    ASSERT( t->docs == THREADS * DOCS_PER_THREAD );
+    ASSERT( t->windows < t->docs );
+    ASSERT( mongo_count( conn, db, "queue", NULL ) == THREADS * DOCS_PER_THREAD / 2 );
+    ASSERT( mongo_count( conn, db, "queue_other", NULL ) == THREADS * DOCS_PER_THREAD / 2 );
+
+    /* Stopped: nothing more is accepted. */
+    ASSERT( mongo_enqueue_insert( conn, ns, bson_shared_empty( ) ) == MONGO_ERROR );
+    return 0;
+}
+
+int test_failures( mongo *conn, mongo_write_concern *wc ) {
+    mongo_write_queue queue[1];
+    totals t[1];
+    bson doc[1], unfinished[1], dotted[1];
+
+    mongo_cmd_drop_collection( conn, db, "queue", NULL );
+    mongo_create_simple_index( conn, ns, "n", MONGO_INDEX_UNIQUE, NULL );
+
+    memset( t, 0, sizeof( totals ) );
+    mongo_write_queue_init( queue, wc, on_flush, t );
+    queue->max_queued = 2;
+    ASSERT( mongo_write_queue_start( conn, queue ) == MONGO_OK );
+
+    bson_init( unfinished );
+    ASSERT( mongo_enqueue_insert( conn, ns, unfinished ) == MONGO_ERROR );
+    bson_destroy( unfinished );
+
+    /* Keys the server would refuse are refused up front. */
+    bson_init( dotted );
+    bson_append_int( dotted, "a.b", 1 );
+    bson_finish( dotted );
+    ASSERT( mongo_enqueue_insert( conn, ns, dotted ) == MONGO_ERROR );
+    bson_destroy( dotted );
+
+    /* Hold the writer in the first window's callback, so nothing is
+     * taken off the queue until it fills. */
+    mongo_env_atomic_add( &t->hold, 1 );
+    bson_init( doc );
+    bson_append_int( doc, "n", 0 );
+    bson_finish( doc );
+    ASSERT( mongo_enqueue_insert( conn, ns, doc ) == MONGO_OK );
+    bson_destroy( doc );
+    while( ! mongo_env_atomic_add( &t->held, 0 ) )
+        mongo_env_sleep_ms( 1 );
+
+    /* A duplicate key fails its window through the callback. */
+    bson_init( doc );
+    bson_append_int( doc, "n", 1 );
+    bson_finish( doc );
+    ASSERT( mongo_enqueue_insert( conn, ns, doc ) == MONGO_OK );
+    ASSERT( mongo_enqueue_insert( conn, ns, doc ) == MONGO_OK );
+    ASSERT( mongo_enqueue_insert( conn, ns, doc ) == MONGO_ERROR );
+    bson_destroy( doc );
+    mongo_env_atomic_add( &t->hold, -1 );
+
+    mongo_write_queue_stop( conn );
+    ASSERT( t->docs == 3 );
+    ASSERT( t->failures == 1 );
+    ASSERT( t->lasterrcode == 11000 );
+    ASSERT( mongo_count( conn, db, "queue", NULL ) == 2 );
+
+    /* Nothing was queued without a writer. */
+    ASSERT( mongo_enqueue_insert( conn, ns, bson_shared_empty( ) ) == MONGO_ERROR );
+    return 0;
+}
+
+int main() {
+    mongo conn[1];
+    mongo_write_concern wc[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+    CONN_CLIENT_TEST;
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    mongo_write_concern_finish( wc );
+
+    test_producers( conn, wc );
+    test_failures( conn, wc );
+
+    mongo_write_concern_destroy( wc );
+    mongo_cmd_drop_db( conn, db );
+    mongo_destroy( conn );
+    return 0;
+}
@@ -71,6 +71,93 @@ int test_connect( const char *set_name ) {
     return res;
 }
 
+int test_discovery( const char *set_name ) {
+
+    mongo conn[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    mongo_replica_set_init( conn, set_name );
+    /* Nothing listens on the first seed. */
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT + 9 );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_OK );
+    ASSERT( conn->replica_set->primary_connected );
+    ASSERT( conn->replica_set->hosts != NULL );
+    ASSERT( mongo_check_connection( conn ) == MONGO_OK );
+
+    /* With only the dead seed left, the hosts learned above are
+     * enough to find the primary again. */
+    bson_free( conn->replica_set->seeds->next );
+    conn->replica_set->seeds->next = NULL;
+
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    ASSERT( conn->replica_set->primary_connected );
+    ASSERT( mongo_check_connection( conn ) == MONGO_OK );
+
+    mongo_destroy( conn );
+    return 0;
+}
+
+/* Needs at least one secondary. */
+int test_read_preference( const char *set_name ) {
+
+    mongo conn[1];
+    mongo_cursor *cursor;
+    mongo_cursor primary_cursor[1];
+    mongo_replica_set_member *member = NULL;
+    int i;
+
+    INIT_SOCKETS_FOR_WINDOWS;
+
+    mongo_replica_set_init( conn, set_name );
+    mongo_replica_set_add_seed( conn, TEST_SERVER, SEED_START_PORT );
+    ASSERT( mongo_replica_set_client( conn ) == MONGO_OK );
+
+    /* Primary reads stay on the client's own connection. */
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    ASSERT( cursor->conn == conn );
+    ASSERT( conn->replica_set->member_count == 0 );
+    mongo_cursor_destroy( cursor );
+
+    mongo_set_read_preference( conn, MONGO_READ_SECONDARY );
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    ASSERT( cursor->conn != conn );
+    ASSERT( cursor->options & MONGO_SLAVE_OK );
+
+    ASSERT( conn->replica_set->member_count >= 2 );
+    for( i = 0; i < conn->replica_set->member_count; i++ ) {
+        if( &conn->replica_set->members[i]->conn == cursor->conn )
+            member = conn->replica_set->members[i];
+    }
+    ASSERT( member );
+    ASSERT( member->secondary );
+    ASSERT( member->rtt_ms >= 0 );
+    mongo_cursor_destroy( cursor );
+
+    /* Commands still go to the primary. */
+    ASSERT( mongo_simple_int_command( conn, "admin", "ping", 1, NULL ) == MONGO_OK );
+
+    /* A cursor can ask for the primary regardless. */
+    mongo_cursor_init( primary_cursor, conn, "test.foo" );
+    mongo_cursor_set_read_preference( primary_cursor, MONGO_READ_PRIMARY );
+    mongo_cursor_next( primary_cursor );
+    ASSERT( primary_cursor->conn == conn );
+    mongo_cursor_destroy( primary_cursor );
+
+    mongo_set_read_preference( conn, MONGO_READ_NEAREST );
+    cursor = mongo_find( conn, "test.foo", bson_shared_empty( ), NULL, 0, 0, 0 );
+    ASSERT( cursor );
+    ASSERT( cursor->conn != conn );
+    mongo_cursor_destroy( cursor );
+
+    mongo_destroy( conn );
+    return 0;
+}
+
 int test_reconnect( const char *set_name ) {
 
     mongo conn[1];
@@ -174,6 +261,8 @@ int main() {
     ASSERT( test_connect_deprecated( REPLICA_SET_NAME ) == MONGO_OK );
     ASSERT( test_connect( REPLICA_SET_NAME ) == MONGO_OK );
     ASSERT( test_connect( "test-foobar" ) == MONGO_CONN_BAD_SET_NAME );
+    ASSERT( test_discovery( REPLICA_SET_NAME ) == 0 );
+    ASSERT( test_read_preference( REPLICA_SET_NAME ) == 0 );
     ASSERT( test_insert_limits( REPLICA_SET_NAME ) == MONGO_OK );
 
     /*
@@ -0,0 +1,158 @@
+/* shared_test.c */
+
+#include "test.h"
+#include "mongo.h"
+#include "shared.h"
+#include "env.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define THREADS 16
+#define DOCS_PER_THREAD 50
+
+static const char *db = "test";
+static const char *ns = "test.shared";
+
+typedef struct {
+    mongo_shared *shared;
+    mongo_write_concern *wc;
+    int base;
+    int failures;
+} worker;
+
+static void work( void *arg ) {
+    worker *w = ( worker * )arg;
+    mongo_shared_call call[1];
+    bson doc[1], out[1];
+    bson_iterator it[1];
+    int i;
+
+    for( i = 0; i < DOCS_PER_THREAD; i++ ) {
+        bson_init( doc );
+        bson_append_int( doc, "n", w->base + i );
+        bson_finish( doc );
+
+        if( mongo_shared_insert( w->shared, call, ns, doc, w->wc ) != MONGO_OK )
+            w->failures++;
+
+        /* Each thread must get back its own document. */
+        if( mongo_shared_find_one( w->shared, call, ns, doc, NULL, out ) != MONGO_OK )
+            w->failures++;
+        else {
+            if( bson_find( it, out, "n" ) != BSON_INT || bson_iterator_int( it ) != w->base + i )
+                w->failures++;
+            bson_destroy( out );
+        }
+
+        bson_destroy( doc );
+    }
+}
+
+int test_threads( mongo *conn, mongo_write_concern *wc ) {
+    mongo_shared shared[1];
+    worker workers[THREADS];
+    void *threads[THREADS];
+    int i;
+
+    mongo_cmd_drop_collection( conn, db, "shared", NULL );
+    ASSERT( mongo_shared_init( shared, conn ) == MONGO_OK );
+
+    for( i = 0; i < THREADS; i++ ) {
+        workers[i].shared = shared;
+        workers[i].wc = wc;
+        workers[i].base = i * 1000;
+        workers[i].failures = 0;
+        ASSERT( mongo_env_thread_create( &threads[i], work, &workers[i] ) == MONGO_OK );
+    }
+    for( i = 0; i < THREADS; i++ ) {
+        mongo_env_thread_join( threads[i] );
+        ASSERT( workers[i].failures == 0 );
+    }
+    ASSERT( shared->waiting == NULL );
+
+    mongo_shared_destroy( shared );
+    ASSERT( ! conn->connected );
+    return 0;
+}
+
+int test_call_errors( mongo *conn ) {
+    mongo_shared shared[1];
+    mongo_shared_call call[1];
+    bson cmd[1], out[1];
+    bson_iterator it[1];
+
+    mongo_clear_errors( conn );
+    ASSERT( mongo_shared_init( shared, conn ) == MONGO_OK );
+
+    /* A failed command is reported on its call, not the connection. */
+    bson_init( cmd );
+    bson_append_int( cmd, "fakeerror", 1 );
+    bson_finish( cmd );
+    ASSERT( mongo_shared_run_command( shared, call, db, cmd, NULL ) == MONGO_ERROR );
+    ASSERT( call->err == MONGO_COMMAND_FAILED );
+    ASSERT( call->lasterrstr[0] != '\0' );
+    ASSERT( call->lasterrcode != 0 || call->err != MONGO_CONN_SUCCESS );
+    ASSERT( conn->err == MONGO_CONN_SUCCESS );
+    bson_destroy( cmd );
+
+    bson_init( cmd );
+    bson_append_int( cmd, "ping", 1 );
+    bson_finish( cmd );
+    ASSERT( mongo_shared_run_command( shared, call, "admin", cmd, out ) == MONGO_OK );
+    ASSERT( call->err == MONGO_CONN_SUCCESS );
+    ASSERT( bson_find( it, out, "ok" ) && bson_iterator_bool( it ) );
+    bson_destroy( out );
+    bson_destroy( cmd );
+
+    ASSERT( mongo_shared_find_one( shared, call, ns, bson_shared_empty( ), NULL, NULL ) == MONGO_OK );
+
+    mongo_shared_destroy( shared );
+
+    /* Only connected connections can be shared. */
+    ASSERT( mongo_shared_init( shared, conn ) == MONGO_ERROR );
+    return 0;
+}
+
+/* An operation timeout must not fail the reader of an idle connection. */
+int test_idle( mongo *conn ) {
+    mongo_shared shared[1];
+    mongo_shared_call call[1];
+
+    ASSERT( mongo_set_op_timeout( conn, 50 ) == MONGO_OK );
+    ASSERT( mongo_shared_init( shared, conn ) == MONGO_OK );
+
+    mongo_env_sleep_ms( 200 );
+    ASSERT( mongo_shared_find_one( shared, call, ns, bson_shared_empty( ), NULL, NULL ) == MONGO_OK );
+    ASSERT( call->err == MONGO_CONN_SUCCESS );
+
+    mongo_shared_destroy( shared );
+    mongo_set_op_timeout( conn, 0 );
+    return 0;
+}
+
+int main() {
+    mongo conn[1];
+    mongo_write_concern wc[1];
+
+    INIT_SOCKETS_FOR_WINDOWS;
+    CONN_CLIENT_TEST;
+
+    mongo_write_concern_init( wc );
+    mongo_write_concern_set_w( wc, 1 );
+    mongo_write_concern_finish( wc );
+
+    test_threads( conn, wc );
+
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    test_call_errors( conn );
+
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    test_idle( conn );
+
+    ASSERT( mongo_reconnect( conn ) == MONGO_OK );
+    mongo_cmd_drop_db( conn, db );
+    mongo_write_concern_destroy( wc );
+    mongo_destroy( conn );
+    return 0;
+}
@@ -114,6 +114,20 @@ int main() {
     ASSERT( result == BSON_ERROR );
     ASSERT( b.err & BSON_NOT_UTF8 );
 
+    /* Long keys and strings are checked in blocks while they are ASCII. */
+    b.err = 0;
+    result = bson_append_string( &b , "a_long_field_name_with_a.dot_past_the_first_block" ,
+                                 "caf\xc3\xa9 and then a long run of plain ASCII text \xe2\x82\xac" );
+    ASSERT( result == BSON_OK );
+    ASSERT( b.err == BSON_FIELD_HAS_DOT );
+
+    b.err = 0;
+    result = bson_append_string( &b , "a_long_field_name_without_dots" ,
+                                 "plain ASCII text for a block \xc0\xc0 then more" );
+    ASSERT( result == BSON_ERROR );
+    ASSERT( b.err == BSON_NOT_UTF8 );
+    b.err = 0;
+
     for ( j=0; j < BATCH_SIZE; j++ )
         bp[j] = &bs[j];
 
@@ -118,6 +118,43 @@ void test_batch_insert_with_continue( mongo *conn ) {
     }
 }
 
+/* More documents than fit in one scatter/gather vector. */
+void test_batch_insert_many( mongo *conn ) {
+    bson *objs[200];
+    mongo_cursor cursor[1];
+    int i;
+
+    mongo_cmd_drop_collection( conn, TEST_DB, TEST_COL, NULL );
+
+    for( i=0; i<200; i++ ) {
+        objs[i] = bson_alloc();
+        bson_init( objs[i] );
+        bson_append_int( objs[i], "n", i );
+        bson_finish( objs[i] );
+    }
+
+    ASSERT( mongo_insert_batch( conn, TEST_NS, (const bson **)objs, 200,
+        NULL, 0 ) == MONGO_OK );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 200 );
+
+    mongo_cursor_init( cursor, conn, TEST_NS );
+    i = 0;
+    while( mongo_cursor_next( cursor ) == MONGO_OK ) {
+        bson_iterator it[1];
+        ASSERT( bson_find( it, mongo_cursor_bson( cursor ), "n" ) == BSON_INT );
+        ASSERT( bson_iterator_int( it ) == i );
+        i++;
+    }
+    ASSERT( i == 200 );
+    mongo_cursor_destroy( cursor );
+
+    for( i=0; i<200; i++ ) {
+        bson_destroy( objs[i] );
+        bson_dealloc( objs[i] );
+    }
+}
+
 /* We can test write concern for update
  * and remove by doing operations on a capped collection. */
 void test_update_and_remove( mongo *conn ) {
@@ -346,6 +383,94 @@ void test_write_concern_api( void ){
   mongo_write_concern_destroy( &wc );
 }
 
+/* A batch larger than the server's message size is split. */
+void test_batch_insert_split( mongo *conn ) {
+    mongo_write_concern wc1[1];
+    bson *objs[200];
+    const bson *mixed[40];
+    int max_msg_size = conn->max_msg_size;
+    int i;
+
+    mongo_write_concern_init( wc1 );
+    mongo_write_concern_set_w( wc1, 1 );
+    mongo_write_concern_finish( wc1 );
+
+    mongo_cmd_drop_collection( conn, TEST_DB, TEST_COL, NULL );
+    mongo_create_simple_index( conn, TEST_NS, "n", MONGO_INDEX_UNIQUE, NULL );
+
+    for( i=0; i<200; i++ ) {
+        objs[i] = bson_alloc();
+        bson_init( objs[i] );
+        bson_append_int( objs[i], "n", i );
+        bson_finish( objs[i] );
+    }
+
+    /* Room for ten documents per message. */
+    conn->max_msg_size = 16 + 4 + ( int )strlen( TEST_NS ) + 1 + 10 * bson_size( objs[0] );
+
+    ASSERT( mongo_insert_batch( conn, TEST_NS, (const bson **)objs, 100,
+        wc1, 0 ) == MONGO_OK );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 100 );
+
+    /* Documents 50 to 99 are duplicates. The first message fails at
+     * its first document and nothing after it goes in. */
+    ASSERT( mongo_insert_batch( conn, TEST_NS, (const bson **)objs + 50, 60,
+        wc1, 0 ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( conn->batch_errors == 1 );
+    ASSERT( conn->batch_error_index == 0 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 100 );
+
+    /* The same holds for a failure in a later message, with or without
+     * a write concern: 100 to 119 go in, 0 to 9 fail, 120 to 129 are
+     * never sent. */
+    for( i=0; i<40; i++ )
+        mixed[i] = objs[i < 20 ? 100 + i : i < 30 ? i - 20 : i + 90];
+    ASSERT( mongo_insert_batch( conn, TEST_NS, mixed, 40, wc1, 0 ) == MONGO_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( conn->batch_errors == 1 );
+    ASSERT( conn->batch_error_index == 20 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 120 );
+
+    ASSERT( mongo_insert_batch( conn, TEST_NS, mixed + 10, 30, NULL, 0 ) == MONGO_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( conn->batch_error_index == 0 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 120 );
+
+    /* Continuing inserts the rest and reports every failed message:
+     * here 130 to 139 and 140 to 159 go in around 0 to 9. */
+    for( i=0; i<40; i++ )
+        mixed[i] = objs[i < 10 ? 130 + i : i < 20 ? i - 10 : i + 120];
+    ASSERT( mongo_insert_batch( conn, TEST_NS, mixed, 40,
+        wc1, MONGO_CONTINUE_ON_ERROR ) == MONGO_ERROR );
+    ASSERT( conn->err == MONGO_WRITE_ERROR );
+    ASSERT( conn->lasterrcode == 11000 );
+    ASSERT( conn->batch_errors == 1 );
+    ASSERT( conn->batch_error_index == 10 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 150 );
+
+    ASSERT( mongo_insert_batch( conn, TEST_NS, (const bson **)objs + 50, 150,
+        wc1, MONGO_CONTINUE_ON_ERROR ) == MONGO_ERROR );
+    ASSERT( conn->batch_errors == 10 );
+    ASSERT( conn->batch_error_index == 0 );
+    ASSERT( mongo_count( conn, TEST_DB, TEST_COL,
+          bson_shared_empty( ) ) == 200 );
+
+    conn->max_msg_size = max_msg_size;
+    mongo_write_concern_destroy( wc1 );
+
+    for( i=0; i<200; i++ ) {
+        bson_destroy( objs[i] );
+        bson_dealloc( objs[i] );
+    }
+}
+
 int main() {
     mongo conn[1];
     char version[10];
@@ -359,10 +484,12 @@ int main() {
     ASSERT( conn->write_concern != (void*)0 );
 
     test_insert( conn );
+    test_batch_insert_many( conn );
     if( mongo_get_server_version( version ) != -1 && version[0] != '1' ) {
         test_write_concern_input( conn );
         test_update_and_remove( conn );
         test_batch_insert_with_continue( conn );
+        test_batch_insert_split( conn );
     }
 
     mongo_destroy( conn );